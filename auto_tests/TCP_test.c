@@ -520,6 +520,100 @@ START_TEST(test_client_invalid)
 }
 END_TEST
 
+/* Put the packet encrypted with shared_key and nonce, which is incremented,
+ * framed with its length in frame.
+ *
+ * return length of the frame.
+ */
+static uint16_t make_frame(const uint8_t *shared_key, uint8_t *nonce, const uint8_t *data, uint16_t length,
+                           uint8_t *frame)
+{
+    uint16_t c_length = htons(length + crypto_box_MACBYTES);
+    memcpy(frame, &c_length, sizeof(uint16_t));
+    int len = encrypt_data_symmetric(shared_key, nonce, data, length, frame + sizeof(uint16_t));
+    ck_assert_msg(len == length + crypto_box_MACBYTES, "Encrypt failed.");
+    increment_nonce(nonce);
+    return sizeof(uint16_t) + len;
+}
+
+#define FRAMING_REQUESTS 3
+
+/* Put a routing request for a new key from con in frame.
+ *
+ * return length of the frame.
+ */
+static uint16_t make_routing_request_frame(struct sec_TCP_con *con, uint8_t *frame)
+{
+    uint8_t requ_p[1 + crypto_box_PUBLICKEYBYTES];
+    requ_p[0] = 0;
+    randombytes(requ_p + 1, crypto_box_PUBLICKEYBYTES);
+    return make_frame(con->shared_key, con->sent_nonce, requ_p, sizeof(requ_p), frame);
+}
+
+static void check_routing_responses(struct sec_TCP_con *con, uint32_t num)
+{
+    uint32_t i;
+
+    for (i = 0; i < num; ++i) {
+        uint8_t data[2048];
+        int len = read_packet_sec_TCP(con, data, 2 + 1 + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_MACBYTES);
+        ck_assert_msg(len == 1 + 1 + crypto_box_PUBLICKEYBYTES, "wrong len %u", len);
+        ck_assert_msg(data[0] == 1, "wrong packet id %u", data[0]);
+    }
+}
+
+START_TEST(test_server_framing)
+{
+    uint8_t self_public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t self_secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(1, NUM_PORTS, ports, self_secret_key, NULL);
+    ck_assert_msg(tcp_s != NULL, "Failed to create TCP relay server");
+
+    struct sec_TCP_con *con = new_TCP_con(tcp_s);
+    uint8_t frames[FRAMING_REQUESTS * 128];
+    uint16_t length = 0;
+    uint32_t i;
+
+    /* Several packets in one send(). */
+    for (i = 0; i < FRAMING_REQUESTS; ++i) {
+        length += make_routing_request_frame(con, frames + length);
+    }
+
+    ck_assert_msg(send(con->sock, frames, length, 0) == length, "send failed");
+    c_sleep(50);
+    do_TCP_server(tcp_s);
+    c_sleep(50);
+    check_routing_responses(con, FRAMING_REQUESTS);
+
+    /* A packet split across reads, inside its length then inside its data. */
+    length = make_routing_request_frame(con, frames);
+    ck_assert_msg(send(con->sock, frames, 1, 0) == 1, "send failed");
+    c_sleep(50);
+    do_TCP_server(tcp_s);
+    ck_assert_msg(send(con->sock, frames + 1, 10, 0) == 10, "send failed");
+    c_sleep(50);
+    do_TCP_server(tcp_s);
+    ck_assert_msg(send(con->sock, frames + 11, length - 11, 0) == length - 11, "send failed");
+    c_sleep(50);
+    do_TCP_server(tcp_s);
+    c_sleep(50);
+    check_routing_responses(con, 1);
+
+    /* A length longer than any packet kills the connection. */
+    uint16_t bad_length = htons(MAX_PACKET_SIZE + 1);
+    ck_assert_msg(send(con->sock, &bad_length, sizeof(bad_length), 0) == sizeof(bad_length), "send failed");
+    c_sleep(50);
+    do_TCP_server(tcp_s);
+    c_sleep(50);
+    ck_assert_msg(tcp_s->num_accepted_connections == 0, "Connection sending a bad length wasn't killed");
+    ck_assert_msg(recv(con->sock, frames, sizeof(frames), 0) == 0, "Connection sending a bad length wasn't closed");
+
+    kill_TCP_con(con);
+    kill_TCP_server(tcp_s);
+}
+END_TEST
+
 #include "../toxcore/TCP_connection.h"
 
 _Bool tcp_data_callback_called;
@@ -731,6 +825,647 @@ START_TEST(test_tcp_connection2)
 }
 END_TEST
 
+#define NUM_THREADED_PAIRS 8
+
+typedef struct {
+    TCP_Client_Connection *conn;
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+    uint8_t status;
+    uint8_t connection_id;
+    uint32_t received;
+    uint32_t oob_received;
+    _Bool first; /* Gets the OOB packet and the disconnect notification of its pair. */
+    _Bool requested; /* Sent its routing request (test_reconnect). */
+} Threaded_Client;
+
+static int threaded_status_callback(void *object, uint32_t number, uint8_t connection_id, uint8_t status)
+{
+    Threaded_Client *client = object;
+    client->status = status;
+    client->connection_id = connection_id;
+    return 0;
+}
+
+static int threaded_data_callback(void *object, uint32_t number, uint8_t connection_id, const uint8_t *data,
+                                  uint16_t length, void *userdata)
+{
+    Threaded_Client *client = object;
+
+    if (length == 5 && data[0] == 1 && data[4] == 5 && connection_id == client->connection_id) {
+        ++client->received;
+    }
+
+    return 0;
+}
+
+static int threaded_oob_callback(void *object, const uint8_t *public_key, const uint8_t *data, uint16_t length,
+                                 void *userdata)
+{
+    Threaded_Client *client = object;
+
+    if (length == 5 && data[0] == 1 && data[4] == 5) {
+        ++client->oob_received;
+    }
+
+    return 0;
+}
+
+/* Run the clients until done returns 1 for all of them, for at most 5 seconds.
+ *
+ * return 1 if it did.
+ */
+static _Bool run_threaded_clients(Threaded_Client *clients, _Bool (*done)(const Threaded_Client *client))
+{
+    uint32_t i, j;
+
+    for (i = 0; i < 500; ++i) {
+        unix_time_update();
+        _Bool all_done = 1;
+
+        for (j = 0; j < NUM_THREADED_PAIRS * 2; ++j) {
+            do_TCP_connection(clients[j].conn, NULL);
+
+            if (!done(&clients[j])) {
+                all_done = 0;
+            }
+        }
+
+        if (all_done) {
+            return 1;
+        }
+
+        c_sleep(10);
+    }
+
+    return 0;
+}
+
+static _Bool threaded_confirmed(const Threaded_Client *client)
+{
+    return client->conn->status == TCP_CLIENT_CONFIRMED;
+}
+
+static _Bool threaded_linked(const Threaded_Client *client)
+{
+    return client->status == 2;
+}
+
+static _Bool threaded_received(const Threaded_Client *client)
+{
+    return client->received != 0 && (client->oob_received != 0 || !client->first);
+}
+
+static _Bool threaded_unlinked(const Threaded_Client *client)
+{
+    return client->status == 1 || !client->first;
+}
+
+START_TEST(test_threads)
+{
+    unix_time_update();
+    uint8_t self_public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t self_secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server_threaded(1, NUM_PORTS, ports, self_secret_key, NULL, 4);
+    ck_assert_msg(tcp_s != NULL, "Failed to create threaded TCP relay server");
+    ck_assert_msg(public_key_cmp(tcp_s->public_key, self_public_key) == 0, "Wrong public key");
+
+    Threaded_Client clients[NUM_THREADED_PAIRS * 2];
+    memset(clients, 0, sizeof(clients));
+    IP_Port ip_port_tcp_s;
+    ip_port_tcp_s.ip.family = AF_INET6;
+    ip_port_tcp_s.ip.ip6.in6_addr = in6addr_loopback;
+    uint32_t i;
+
+    for (i = 0; i < NUM_THREADED_PAIRS * 2; ++i) {
+        crypto_box_keypair(clients[i].public_key, clients[i].secret_key);
+        clients[i].first = (i % 2 == 0);
+        ip_port_tcp_s.port = htons(ports[rand() % NUM_PORTS]);
+        clients[i].conn = new_TCP_connection(ip_port_tcp_s, self_public_key, clients[i].public_key, clients[i].secret_key,
+                                             0);
+        ck_assert_msg(clients[i].conn != NULL, "Failed to create TCP client");
+        routing_status_handler(clients[i].conn, threaded_status_callback, &clients[i]);
+        routing_data_handler(clients[i].conn, threaded_data_callback, &clients[i]);
+        oob_data_handler(clients[i].conn, threaded_oob_callback, &clients[i]);
+    }
+
+    ck_assert_msg(run_threaded_clients(clients, threaded_confirmed), "Clients failed to connect");
+
+    uint8_t data[5] = {1, 2, 3, 4, 5};
+
+    /* With 16 clients spread over 4 threads most pairs end up on different ones. */
+    for (i = 0; i < NUM_THREADED_PAIRS; ++i) {
+        ck_assert_msg(send_routing_request(clients[i * 2].conn, clients[i * 2 + 1].public_key) == 1, "Routing request failed");
+        ck_assert_msg(send_routing_request(clients[i * 2 + 1].conn, clients[i * 2].public_key) == 1, "Routing request failed");
+    }
+
+    ck_assert_msg(run_threaded_clients(clients, threaded_linked), "Clients failed to get linked");
+
+    for (i = 0; i < NUM_THREADED_PAIRS * 2; ++i) {
+        ck_assert_msg(send_data(clients[i].conn, clients[i].connection_id, data, sizeof(data)) == 1, "Send data failed");
+
+        if (!clients[i].first) {
+            ck_assert_msg(send_oob_packet(clients[i].conn, clients[i - 1].public_key, data, sizeof(data)) == 1, "OOB send failed");
+        }
+    }
+
+    ck_assert_msg(run_threaded_clients(clients, threaded_received), "Data or OOB packets weren't relayed");
+
+    for (i = 0; i < NUM_THREADED_PAIRS; ++i) {
+        send_disconnect_request(clients[i * 2 + 1].conn, clients[i * 2 + 1].connection_id);
+    }
+
+    ck_assert_msg(run_threaded_clients(clients, threaded_unlinked), "Disconnects weren't relayed");
+
+    kill_TCP_server(tcp_s);
+
+    for (i = 0; i < NUM_THREADED_PAIRS * 2; ++i) {
+        kill_TCP_connection(clients[i].conn);
+    }
+}
+END_TEST
+
+#define NUM_RECONNECT_CLIENTS 32
+
+/* Run tcp_s and the clients, each asking to be routed to its pair once
+ * confirmed, until all of them are linked, for at most 5 seconds.
+ *
+ * return 1 if they were.
+ */
+static _Bool run_reconnect_clients(TCP_Server *tcp_s, Threaded_Client *clients)
+{
+    uint32_t i, j;
+
+    for (i = 0; i < 500; ++i) {
+        unix_time_update();
+        do_TCP_server(tcp_s);
+        _Bool all_done = 1;
+
+        for (j = 0; j < NUM_RECONNECT_CLIENTS; ++j) {
+            do_TCP_connection(clients[j].conn, NULL);
+
+            if (clients[j].conn->status == TCP_CLIENT_CONFIRMED && !clients[j].requested) {
+                clients[j].requested = send_routing_request(clients[j].conn, clients[j ^ 1].public_key) == 1;
+            }
+
+            if (clients[j].status != 2) {
+                all_done = 0;
+            }
+        }
+
+        if (all_done) {
+            return 1;
+        }
+
+        c_sleep(5);
+    }
+
+    return 0;
+}
+
+START_TEST(test_reconnect)
+{
+    unix_time_update();
+    uint8_t self_public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t self_secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(1, NUM_PORTS, ports, self_secret_key, NULL);
+    ck_assert_msg(tcp_s != NULL, "Failed to create TCP relay server");
+    /* The clients reconnect much faster than TCP_HANDSHAKE_RATE. */
+    TCP_server_set_handshake_limit(tcp_s, 0, 0);
+
+    Threaded_Client clients[NUM_RECONNECT_CLIENTS];
+    memset(clients, 0, sizeof(clients));
+    IP_Port ip_port_tcp_s;
+    ip_port_tcp_s.ip.family = AF_INET6;
+    ip_port_tcp_s.ip.ip6.in6_addr = in6addr_loopback;
+    uint32_t i, round;
+
+    for (i = 0; i < NUM_RECONNECT_CLIENTS; ++i) {
+        crypto_box_keypair(clients[i].public_key, clients[i].secret_key);
+    }
+
+    /* All connect, then the first of each pair reconnects with the same key:
+     * the server replaces its old connection. */
+    for (round = 0; round < 4; ++round) {
+        for (i = 0; i < NUM_RECONNECT_CLIENTS; ++i) {
+            if (round != 0 && i % 2 != 0) {
+                continue;
+            }
+
+            kill_TCP_connection(clients[i].conn);
+            ip_port_tcp_s.port = htons(ports[rand() % NUM_PORTS]);
+            clients[i].conn = new_TCP_connection(ip_port_tcp_s, self_public_key, clients[i].public_key,
+                                                 clients[i].secret_key, 0);
+            ck_assert_msg(clients[i].conn != NULL, "Failed to create TCP client");
+            routing_status_handler(clients[i].conn, threaded_status_callback, &clients[i]);
+            clients[i].status = 0;
+            clients[i].requested = 0;
+        }
+
+        ck_assert_msg(run_reconnect_clients(tcp_s, clients), "Clients failed to get linked in round %u", round);
+        ck_assert_msg(tcp_s->num_accepted_connections == NUM_RECONNECT_CLIENTS, "%u accepted connections instead of %u",
+                      tcp_s->num_accepted_connections, NUM_RECONNECT_CLIENTS);
+        ck_assert_msg(tcp_s->accepted_key_index.count == NUM_RECONNECT_CLIENTS, "%u keys in the index instead of %u",
+                      tcp_s->accepted_key_index.count, NUM_RECONNECT_CLIENTS);
+        ck_assert_msg(tcp_s->num_accepted_connections + tcp_s->num_free_accepted == tcp_s->size_accepted_connections,
+                      "Lost track of free connection slots");
+        ck_assert_msg(tcp_s->num_incoming_connections == 0, "%u connections still doing their handshake",
+                      tcp_s->num_incoming_connections);
+    }
+
+    /* Slots of the replaced connections were reused. */
+    ck_assert_msg(tcp_s->size_accepted_connections < NUM_RECONNECT_CLIENTS * 2, "Connection array grew to %u",
+                  tcp_s->size_accepted_connections);
+
+    kill_TCP_server(tcp_s);
+
+    for (i = 0; i < NUM_RECONNECT_CLIENTS; ++i) {
+        kill_TCP_connection(clients[i].conn);
+    }
+}
+END_TEST
+
+/* More than the 256 handshakes the server used to keep. */
+#define NUM_IDLE_SOCKETS 300
+#define NUM_LIMITED_SOCKETS 8
+
+/* Connect a socket to the server that never sends its handshake. */
+static sock_t connect_idle_socket(void)
+{
+    sock_t sock = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_in6 addr6_loopback = {0};
+    addr6_loopback.sin6_family = AF_INET6;
+    addr6_loopback.sin6_port = htons(ports[rand() % NUM_PORTS]);
+    addr6_loopback.sin6_addr = in6addr_loopback;
+
+    ck_assert_msg(connect(sock, (struct sockaddr *)&addr6_loopback, sizeof(addr6_loopback)) == 0,
+                  "Failed to connect to TCP relay server");
+    return sock;
+}
+
+START_TEST(test_handshakes)
+{
+    unix_time_update();
+    uint8_t self_public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t self_secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(self_public_key, self_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(1, NUM_PORTS, ports, self_secret_key, NULL);
+    ck_assert_msg(tcp_s != NULL, "Failed to create TCP relay server");
+    TCP_server_set_handshake_limit(tcp_s, 0, 0);
+
+    sock_t socks[NUM_IDLE_SOCKETS + NUM_LIMITED_SOCKETS];
+    uint32_t i;
+
+    for (i = 0; i < NUM_IDLE_SOCKETS; ++i) {
+        socks[i] = connect_idle_socket();
+    }
+
+    c_sleep(50);
+    do_TCP_server(tcp_s);
+    ck_assert_msg(tcp_s->num_incoming_connections == NUM_IDLE_SOCKETS, "%u connections doing their handshake",
+                  tcp_s->num_incoming_connections);
+
+    /* Past its burst a source only gets one connection per second. */
+    TCP_server_set_handshake_limit(tcp_s, 1, NUM_LIMITED_SOCKETS / 2);
+
+    for (i = NUM_IDLE_SOCKETS; i < NUM_IDLE_SOCKETS + NUM_LIMITED_SOCKETS; ++i) {
+        socks[i] = connect_idle_socket();
+    }
+
+    c_sleep(50);
+    do_TCP_server(tcp_s);
+    TCP_Handshake_Stats stats;
+    ck_assert_msg(TCP_server_handshake_stats(tcp_s, &stats) == 0, "Failed to get handshake stats");
+    ck_assert_msg(stats.accepted == NUM_IDLE_SOCKETS + NUM_LIMITED_SOCKETS / 2
+                  && stats.rate_limited == NUM_LIMITED_SOCKETS / 2, "%u accepted, %u rate limited",
+                  (unsigned int)stats.accepted, (unsigned int)stats.rate_limited);
+
+    /* None of them sends its handshake in time. */
+    for (i = 0; i < (TCP_HANDSHAKE_TIMEOUT + 2) * 20 && tcp_s->num_incoming_connections != 0; ++i) {
+        c_sleep(50);
+        do_TCP_server(tcp_s);
+    }
+
+    ck_assert_msg(TCP_server_handshake_stats(tcp_s, &stats) == 0, "Failed to get handshake stats");
+    ck_assert_msg(stats.timed_out == stats.accepted && stats.confirmed == 0 && stats.evicted == 0,
+                  "%u of %u connections timed out", (unsigned int)stats.timed_out, (unsigned int)stats.accepted);
+    ck_assert_msg(tcp_s->size_incoming_connections == 0, "Incoming connections weren't freed");
+
+    kill_TCP_server(tcp_s);
+
+    for (i = 0; i < NUM_IDLE_SOCKETS + NUM_LIMITED_SOCKETS; ++i) {
+        kill_sock(socks[i]);
+    }
+}
+END_TEST
+
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
+#include <sys/socket.h>
+
+#define OUTPUT_RING_ROUNDS 200
+
+/* Byte number i of the stream written in test_output_ring. */
+static uint8_t output_ring_byte(uint32_t i)
+{
+    return i % 251;
+}
+
+START_TEST(test_output_ring)
+{
+    int fds[2];
+    ck_assert_msg(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "socketpair failed");
+    ck_assert_msg(set_socket_nonblock(fds[0]) && set_socket_nonblock(fds[1]), "Failed to make the sockets nonblocking");
+
+    /* Small buffers so the writes below keep filling them. */
+    int size = 4096;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    TCP_Output_Ring output;
+    memset(&output, 0, sizeof(output));
+    uint8_t packet[MAX_PACKET_SIZE];
+    uint8_t received[8192];
+    uint32_t written = 0, read = 0, max_size = 0, i, j;
+
+    /* Write packets of all sizes while reading the other end a bit slower than
+     * it is written to or a bit faster, so data keeps waiting in the ring and
+     * wrapping around in it. */
+    for (i = 0; i < OUTPUT_RING_ROUNDS * 2; ++i) {
+        if (i < OUTPUT_RING_ROUNDS) {
+            for (j = 0; j < 7; ++j) {
+                uint16_t length = 1 + ((i * 7 + j) * 379) % (MAX_PACKET_SIZE - 1);
+                uint16_t k;
+
+                for (k = 0; k < length; ++k) {
+                    packet[k] = output_ring_byte(written + k);
+                }
+
+                ck_assert_msg(TCP_output_write(&output, fds[0], packet, length) == 1, "Write failed");
+                written += length;
+            }
+        }
+
+        int len = recv(fds[1], received, 1 + (i * 1237) % sizeof(received), 0);
+
+        for (j = 0; len > 0 && j < (uint32_t)len; ++j, ++read) {
+            ck_assert_msg(received[j] == output_ring_byte(read), "Wrong byte %u", read);
+        }
+
+        if (output.size > max_size) {
+            max_size = output.size;
+        }
+
+        TCP_output_flush(&output, fds[0]);
+    }
+
+    ck_assert_msg(read == written, "Only %u of %u bytes read", read, written);
+    ck_assert_msg(output.length == 0, "Data still waiting");
+    ck_assert_msg(max_size > TCP_OUTPUT_MIN_SIZE, "The ring never grew, the test doesn't test shrinking it");
+    ck_assert_msg(output.size <= TCP_OUTPUT_MIN_SIZE, "The ring kept its size of %u once emptied", output.size);
+    ck_assert_msg(output.bytes_queued != 0, "Nothing ever waited, the test doesn't test anything");
+    ck_assert_msg(output.flushes != 0 && output.flushes <= OUTPUT_RING_ROUNDS * 2, "Wrong number of flushes: %llu",
+                  (unsigned long long)output.flushes);
+
+    TCP_output_free(&output);
+    close(fds[0]);
+    close(fds[1]);
+}
+END_TEST
+
+#define INPUT_FRAMES 3
+
+/* Check that input has the packet made by input_frame() with number num next,
+ * and only that. */
+static void check_input_packet(int sock, TCP_Input_Buffer *input, const uint8_t *shared_key, uint8_t *recv_nonce,
+                               uint32_t num, uint16_t length)
+{
+    uint8_t packet[MAX_PACKET_SIZE];
+    int len = read_packet_TCP_secure_connection(sock, input, shared_key, recv_nonce, packet, sizeof(packet));
+    ck_assert_msg(len == length, "Packet %u has length %i instead of %u", num, len, length);
+    ck_assert_msg(packet[0] == num % 256 && packet[length - 1] == num % 256, "Packet %u has the wrong data", num);
+}
+
+static uint16_t input_frame(const uint8_t *shared_key, uint8_t *nonce, uint32_t num, uint16_t length, uint8_t *frame)
+{
+    uint8_t packet[MAX_PACKET_SIZE];
+    memset(packet, num % 256, length);
+    return make_frame(shared_key, nonce, packet, length, frame);
+}
+
+START_TEST(test_input_buffer)
+{
+    int fds[2];
+    ck_assert_msg(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "socketpair failed");
+    ck_assert_msg(set_socket_nonblock(fds[1]), "Failed to make the socket nonblocking");
+
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    uint8_t sent_nonce[crypto_box_NONCEBYTES], recv_nonce[crypto_box_NONCEBYTES];
+    new_symmetric_key(shared_key);
+    random_nonce(sent_nonce);
+    memcpy(recv_nonce, sent_nonce, crypto_box_NONCEBYTES);
+
+    TCP_Input_Buffer input;
+    memset(&input, 0, sizeof(input));
+    uint8_t packet[MAX_PACKET_SIZE];
+    uint8_t frames[INPUT_FRAMES * (sizeof(uint16_t) + MAX_PACKET_SIZE)];
+    uint16_t lengths[INPUT_FRAMES] = {1, MAX_PACKET_SIZE - crypto_box_MACBYTES, 100};
+    uint32_t num = 0, length = 0, i;
+
+    ck_assert_msg(read_packet_TCP_secure_connection(fds[1], &input, shared_key, recv_nonce, packet,
+                  sizeof(packet)) == 0, "Read a packet before any was sent");
+
+    /* Several packets, up to the biggest, in one send(). */
+    for (i = 0; i < INPUT_FRAMES; ++i) {
+        length += input_frame(shared_key, sent_nonce, num + i, lengths[i], frames + length);
+    }
+
+    ck_assert_msg(send(fds[0], frames, length, 0) == length, "send failed");
+
+    for (i = 0; i < INPUT_FRAMES; ++i) {
+        check_input_packet(fds[1], &input, shared_key, recv_nonce, num + i, lengths[i]);
+    }
+
+    num += INPUT_FRAMES;
+    ck_assert_msg(read_packet_TCP_secure_connection(fds[1], &input, shared_key, recv_nonce, packet,
+                  sizeof(packet)) == 0, "Read a packet that wasn't sent");
+
+    /* A packet split across reads at every byte, the first one inside its
+     * length, with the start of the next one read along with its end. The
+     * lengths differ so that what is left of one isn't taken for another. */
+    uint16_t frame_length = input_frame(shared_key, sent_nonce, num, 50 + num % 7, frames);
+
+    for (i = 1; i < frame_length; ++i) {
+        uint16_t next_length = input_frame(shared_key, sent_nonce, num + 1, 50 + (num + 1) % 7, frames + frame_length);
+        uint16_t rest = frame_length - i + i % 3;
+        ck_assert_msg(send(fds[0], frames, i, 0) == i, "send failed");
+        ck_assert_msg(read_packet_TCP_secure_connection(fds[1], &input, shared_key, recv_nonce, packet,
+                      sizeof(packet)) == 0, "Read packet %u with %u of its bytes", num, i);
+        ck_assert_msg(send(fds[0], frames + i, rest, 0) == rest, "send failed");
+        check_input_packet(fds[1], &input, shared_key, recv_nonce, num, 50 + num % 7);
+        ++num;
+
+        ck_assert_msg(send(fds[0], frames + frame_length + i % 3, next_length - i % 3, 0) == next_length - i % 3,
+                      "send failed");
+        check_input_packet(fds[1], &input, shared_key, recv_nonce, num, 50 + num % 7);
+        ++num;
+        frame_length = input_frame(shared_key, sent_nonce, num, 50 + num % 7, frames);
+    }
+
+    ck_assert_msg(input.length == 0, "%u bytes left in the buffer", input.length);
+    TCP_input_free(&input);
+
+    /* Lengths that no packet has. */
+    uint16_t bad_lengths[] = {0, MAX_PACKET_SIZE + 1, 0xFFFF};
+
+    for (i = 0; i < sizeof(bad_lengths) / sizeof(bad_lengths[0]); ++i) {
+        uint16_t bad_length = htons(bad_lengths[i]);
+        ck_assert_msg(send(fds[0], &bad_length, sizeof(bad_length), 0) == sizeof(bad_length), "send failed");
+        ck_assert_msg(read_packet_TCP_secure_connection(fds[1], &input, shared_key, recv_nonce, packet,
+                      sizeof(packet)) == -1, "Length %u wasn't refused", bad_lengths[i]);
+        TCP_input_free(&input);
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+}
+END_TEST
+
+static uint32_t framing_oob_received;
+static int framing_oob_callback(void *object, const uint8_t *public_key, const uint8_t *data, uint16_t length,
+                                void *userdata)
+{
+    if (length == 1 && data[0] == framing_oob_received % 256) {
+        ++framing_oob_received;
+    }
+
+    return 0;
+}
+
+/* Frame an OOB packet from a random key with data num for the client. */
+static uint16_t oob_recv_frame(const uint8_t *shared_key, uint8_t *nonce, uint32_t num, uint8_t *frame)
+{
+    uint8_t packet[1 + crypto_box_PUBLICKEYBYTES + 1];
+    packet[0] = TCP_PACKET_OOB_RECV;
+    randombytes(packet + 1, crypto_box_PUBLICKEYBYTES);
+    packet[1 + crypto_box_PUBLICKEYBYTES] = num % 256;
+    return make_frame(shared_key, nonce, packet, sizeof(packet), frame);
+}
+
+static void run_framing_client(TCP_Client_Connection *conn)
+{
+    c_sleep(50);
+    do_TCP_connection(conn, NULL);
+}
+
+START_TEST(test_client_framing)
+{
+    unix_time_update();
+    uint8_t self_public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t self_secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(self_public_key, self_secret_key);
+
+    /* A server made by hand, that sends its packets in whatever pieces. */
+    sock_t listen_sock = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_in6 addr6_loopback = {0};
+    socklen_t addrlen = sizeof(addr6_loopback);
+    addr6_loopback.sin6_family = AF_INET6;
+    addr6_loopback.sin6_addr = in6addr_loopback;
+    ck_assert_msg(bind(listen_sock, (struct sockaddr *)&addr6_loopback, sizeof(addr6_loopback)) == 0, "bind failed");
+    ck_assert_msg(listen(listen_sock, 1) == 0, "listen failed");
+    ck_assert_msg(getsockname(listen_sock, (struct sockaddr *)&addr6_loopback, &addrlen) == 0, "getsockname failed");
+
+    uint8_t f_public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t f_secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(f_public_key, f_secret_key);
+    IP_Port ip_port_tcp_s;
+    ip_port_tcp_s.port = addr6_loopback.sin6_port;
+    ip_port_tcp_s.ip.family = AF_INET6;
+    ip_port_tcp_s.ip.ip6.in6_addr = in6addr_loopback;
+    TCP_Client_Connection *conn = new_TCP_connection(ip_port_tcp_s, self_public_key, f_public_key, f_secret_key, 0);
+    ck_assert_msg(conn != NULL, "Failed to create TCP client");
+    oob_data_handler(conn, framing_oob_callback, NULL);
+
+    sock_t sock = accept(listen_sock, NULL, NULL);
+    ck_assert_msg(sock_valid(sock), "accept failed");
+    uint32_t i;
+
+    for (i = 0; i < 20 && conn->status != TCP_CLIENT_UNCONFIRMED; ++i) {
+        run_framing_client(conn);
+    }
+
+    uint8_t handshake[TCP_CLIENT_HANDSHAKE_SIZE];
+    uint8_t handshake_plain[TCP_HANDSHAKE_PLAIN_SIZE];
+    ck_assert_msg(recv(sock, handshake, sizeof(handshake), MSG_WAITALL) == sizeof(handshake), "recv failed");
+    ck_assert_msg(decrypt_data(f_public_key, self_secret_key, handshake + crypto_box_PUBLICKEYBYTES,
+                               handshake + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES,
+                               sizeof(handshake) - (crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES),
+                               handshake_plain) == TCP_HANDSHAKE_PLAIN_SIZE, "Decrypt failed.");
+
+    uint8_t sent_nonce[crypto_box_NONCEBYTES];
+    uint8_t t_secret_key[crypto_box_SECRETKEYBYTES];
+    uint8_t response_plain[TCP_HANDSHAKE_PLAIN_SIZE];
+    uint8_t response[TCP_SERVER_HANDSHAKE_SIZE];
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    crypto_box_keypair(response_plain, t_secret_key);
+    random_nonce(sent_nonce);
+    memcpy(response_plain + crypto_box_PUBLICKEYBYTES, sent_nonce, crypto_box_NONCEBYTES);
+    new_nonce(response);
+    ck_assert_msg(encrypt_data(f_public_key, self_secret_key, response, response_plain, sizeof(response_plain),
+                               response + crypto_box_NONCEBYTES) == sizeof(response) - crypto_box_NONCEBYTES,
+                  "Encrypt failed.");
+    encrypt_precompute(handshake_plain, t_secret_key, shared_key);
+    ck_assert_msg(send(sock, response, sizeof(response), 0) == sizeof(response), "send failed");
+
+    for (i = 0; i < 20 && conn->status != TCP_CLIENT_CONFIRMED; ++i) {
+        run_framing_client(conn);
+    }
+
+    ck_assert_msg(conn->status == TCP_CLIENT_CONFIRMED, "Wrong status. Expected: %u, is: %u", TCP_CLIENT_CONFIRMED,
+                  conn->status);
+
+    /* Several packets in one send(). */
+    uint8_t frames[INPUT_FRAMES * 128];
+    uint32_t num = 0, length = 0;
+
+    for (i = 0; i < INPUT_FRAMES; ++i) {
+        length += oob_recv_frame(shared_key, sent_nonce, num + i, frames + length);
+    }
+
+    ck_assert_msg(send(sock, frames, length, 0) == length, "send failed");
+    run_framing_client(conn);
+    num += INPUT_FRAMES;
+    ck_assert_msg(framing_oob_received == num, "%u of %u packets received", framing_oob_received, num);
+
+    /* A packet split across reads, inside its length then inside its data. */
+    length = oob_recv_frame(shared_key, sent_nonce, num, frames);
+    ck_assert_msg(send(sock, frames, 1, 0) == 1, "send failed");
+    run_framing_client(conn);
+    ck_assert_msg(send(sock, frames + 1, 10, 0) == 10, "send failed");
+    run_framing_client(conn);
+    ck_assert_msg(framing_oob_received == num, "Packet received before all of it was sent");
+    ck_assert_msg(send(sock, frames + 11, length - 11, 0) == length - 11, "send failed");
+    run_framing_client(conn);
+    ++num;
+    ck_assert_msg(framing_oob_received == num, "%u of %u packets received", framing_oob_received, num);
+    ck_assert_msg(conn->status == TCP_CLIENT_CONFIRMED, "Wrong status. Expected: %u, is: %u", TCP_CLIENT_CONFIRMED,
+                  conn->status);
+
+    /* A length longer than any packet disconnects. */
+    uint16_t bad_length = htons(MAX_PACKET_SIZE + 1);
+    ck_assert_msg(send(sock, &bad_length, sizeof(bad_length), 0) == sizeof(bad_length), "send failed");
+    run_framing_client(conn);
+    ck_assert_msg(conn->status == TCP_CLIENT_DISCONNECTED, "Wrong status. Expected: %u, is: %u",
+                  TCP_CLIENT_DISCONNECTED, conn->status);
+
+    kill_TCP_connection(conn);
+    kill_sock(sock);
+    kill_sock(listen_sock);
+}
+END_TEST
+#endif
+
 static Suite *TCP_suite(void)
 {
     Suite *s = suite_create("TCP");
@@ -739,8 +1474,17 @@ static Suite *TCP_suite(void)
     DEFTESTCASE_SLOW(some, 10);
     DEFTESTCASE_SLOW(client, 10);
     DEFTESTCASE_SLOW(client_invalid, 15);
+    DEFTESTCASE_SLOW(server_framing, 10);
     DEFTESTCASE_SLOW(tcp_connection, 20);
     DEFTESTCASE_SLOW(tcp_connection2, 20);
+    DEFTESTCASE_SLOW(threads, 30);
+    DEFTESTCASE_SLOW(reconnect, 20);
+    DEFTESTCASE_SLOW(handshakes, 30);
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
+    DEFTESTCASE(output_ring);
+    DEFTESTCASE(input_buffer);
+    DEFTESTCASE_SLOW(client_framing, 10);
+#endif
     return s;
 }
 
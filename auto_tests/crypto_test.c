@@ -271,6 +271,89 @@ START_TEST(test_large_data_symmetric)
 }
 END_TEST
 
+START_TEST(test_inplace_symmetric)
+{
+    unsigned char k[crypto_box_KEYBYTES];
+    unsigned char n[crypto_box_NONCEBYTES];
+
+    unsigned char m1[1000];
+    unsigned char c1[sizeof(m1) + crypto_box_MACBYTES];
+    unsigned char buffer[sizeof(m1) + crypto_box_MACBYTES];
+    unsigned char mac[crypto_box_MACBYTES];
+    unsigned char detached[sizeof(m1)];
+
+    rand_bytes(m1, sizeof(m1));
+    rand_bytes(n, crypto_box_NONCEBYTES);
+    new_symmetric_key(k);
+
+    ck_assert_msg(encrypt_data_symmetric(k, n, m1, sizeof(m1), c1) == sizeof(c1), "could not encrypt data");
+
+    /* Same output as encrypt_data_symmetric(), MAC first. */
+    memcpy(buffer + crypto_box_MACBYTES, m1, sizeof(m1));
+    ck_assert_msg(encrypt_data_symmetric_inplace(k, n, buffer, sizeof(m1)) == sizeof(c1), "could not encrypt in place");
+    ck_assert_msg(memcmp(buffer, c1, sizeof(c1)) == 0, "in place encryption differs");
+
+    ck_assert_msg(encrypt_data_symmetric_detached(k, n, m1, sizeof(m1), detached, mac) == sizeof(m1),
+                  "could not encrypt with detached MAC");
+    ck_assert_msg(memcmp(mac, c1, crypto_box_MACBYTES) == 0, "detached MAC differs");
+    ck_assert_msg(memcmp(detached, c1 + crypto_box_MACBYTES, sizeof(m1)) == 0, "detached encryption differs");
+
+    ck_assert_msg(decrypt_data_symmetric_detached(k, n, detached, sizeof(m1), mac, detached) == sizeof(m1),
+                  "could not decrypt with detached MAC");
+    ck_assert_msg(memcmp(detached, m1, sizeof(m1)) == 0, "detached decryption differs");
+
+    ck_assert_msg(decrypt_data_symmetric_inplace(k, n, buffer, sizeof(buffer)) == sizeof(m1), "could not decrypt in place");
+    ck_assert_msg(memcmp(buffer + crypto_box_MACBYTES, m1, sizeof(m1)) == 0, "in place decryption differs");
+
+    /* Tampered packets are rejected. */
+    c1[crypto_box_MACBYTES + 10] ^= 1;
+    ck_assert_msg(decrypt_data_symmetric_inplace(k, n, c1, sizeof(c1)) == -1, "tampered data decrypted");
+    mac[0] ^= 1;
+    ck_assert_msg(decrypt_data_symmetric_detached(k, n, c1 + crypto_box_MACBYTES, sizeof(m1), mac, detached) == -1,
+                  "tampered MAC accepted");
+    ck_assert_msg(decrypt_data_symmetric_inplace(k, n, c1, crypto_box_MACBYTES) == -1, "empty message decrypted");
+}
+END_TEST
+
+#define NUM_BATCH_KEYS 50
+
+START_TEST(test_precompute_batch)
+{
+    static uint8_t public_keys[NUM_BATCH_KEYS][crypto_box_PUBLICKEYBYTES];
+    static uint8_t expected[NUM_BATCH_KEYS][crypto_box_BEFORENMBYTES];
+    static uint8_t enc_keys[NUM_BATCH_KEYS][crypto_box_BEFORENMBYTES];
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+    unsigned int i, num, threads;
+
+    crypto_box_keypair(public_key, secret_key);
+
+    for (i = 0; i < NUM_BATCH_KEYS; ++i) {
+        uint8_t other_secret_key[crypto_box_SECRETKEYBYTES];
+        crypto_box_keypair(public_keys[i], other_secret_key);
+        encrypt_precompute(public_keys[i], secret_key, expected[i]);
+    }
+
+    /* Batches too small to split, split unevenly and capped threads. */
+    const unsigned int nums[] = {0, 1, PRECOMPUTE_KEYS_PER_THREAD * 2 - 1, 13, NUM_BATCH_KEYS};
+
+    for (num = 0; num < sizeof(nums) / sizeof(nums[0]); ++num) {
+        for (threads = 0; threads <= MAX_PRECOMPUTE_THREADS + 1; threads += 3) {
+            memset(enc_keys, 0, sizeof(enc_keys));
+            ck_assert_msg(encrypt_precompute_batch(public_keys[0], secret_key, enc_keys[0], nums[num], threads) == 0,
+                          "batch of %u keys with %u threads failed", nums[num], threads);
+            ck_assert_msg(memcmp(enc_keys, expected, nums[num] * crypto_box_BEFORENMBYTES) == 0,
+                          "batch of %u keys with %u threads: wrong shared keys", nums[num], threads);
+
+            for (i = nums[num]; i < NUM_BATCH_KEYS; ++i) {
+                ck_assert_msg(enc_keys[i][0] == 0 && memcmp(enc_keys[i], enc_keys[i] + 1, crypto_box_BEFORENMBYTES - 1) == 0,
+                              "batch of %u keys wrote past its end", nums[num]);
+            }
+        }
+    }
+}
+END_TEST
+
 static void increment_nonce_number_cmp(uint8_t *nonce, uint32_t num)
 {
     uint32_t num1, num2;
@@ -332,6 +415,8 @@ static Suite *crypto_suite(void)
     DEFTESTCASE_SLOW(endtoend, 15); /* waiting up to 15 seconds */
     DEFTESTCASE(large_data);
     DEFTESTCASE(large_data_symmetric);
+    DEFTESTCASE(inplace_symmetric);
+    DEFTESTCASE(precompute_batch);
     DEFTESTCASE_SLOW(increment_nonce, 20);
 
     return s;
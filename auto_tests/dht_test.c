@@ -648,6 +648,336 @@ loop_top:
 }
 END_TEST
 
+/* A key sharing a prefix of exactly length bits with public_key. */
+static void prefix_key(const uint8_t *public_key, unsigned int length, uint8_t *key)
+{
+    randombytes(key, crypto_box_PUBLICKEYBYTES);
+    memcpy(key, public_key, length / 8);
+
+    uint8_t mask = 0xFF << (8 - length % 8);
+    uint8_t bit = 0x80 >> (length % 8);
+    uint8_t self = public_key[length / 8];
+    key[length / 8] = (self & mask) | (~self & bit) | (key[length / 8] & ~(mask | bit));
+}
+
+static int same_nodes(const Node_format *nodes1, const Node_format *nodes2, uint32_t num)
+{
+    uint32_t i;
+
+    for (i = 0; i < num; ++i) {
+        if (!client_in_nodelist(nodes2, num, nodes1[i].public_key)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+START_TEST(test_close_list)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    Networking_Core *net = new_networking(NULL, ip, TOX_PORT_DEFAULT);
+    ck_assert_msg(net != NULL, "Failed to create Networking_Core");
+    DHT *dht = new_DHT(NULL, net);
+    ck_assert_msg(dht != NULL, "Failed to create DHT");
+
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    unsigned int i;
+
+    for (i = 0; i < 4000; ++i) {
+        if (i % 2) {
+            randombytes(public_key, sizeof(public_key));
+        } else {
+            prefix_key(dht->self_public_key, rand() % 64, public_key);
+        }
+
+        ip_port.ip.ip4.uint32 = rand();
+        ip_port.port = i + 1;
+        addto_lists(dht, ip_port, public_key);
+    }
+
+    uint32_t num_close = 0;
+
+    for (i = 0; i < LCLIENT_LIST; ++i) {
+        const Client_data *client = &dht->close_clientlist[i];
+
+        if (client->assoc4.timestamp != 0) {
+            ck_assert_msg(close_list_bucket(dht, client->public_key) == i - i % LCLIENT_NODES, "node in wrong bucket");
+            ck_assert_msg(close_list_index(dht, client->public_key) == i, "node not found in its bucket");
+            ++num_close;
+        }
+    }
+
+    ck_assert_msg(num_close > LCLIENT_NODES * 16, "only %u nodes in close list", num_close);
+
+    /* Looking at the closest buckets only finds the same nodes as looking at all of them. */
+    for (i = 0; i < 2000; ++i) {
+        Node_format nodes1[MAX_SENT_NODES], nodes2[MAX_SENT_NODES];
+        uint32_t num1 = 0, num2 = 0;
+
+        if (i % 2) {
+            randombytes(public_key, sizeof(public_key));
+        } else {
+            prefix_key(dht->self_public_key, rand() % 64, public_key);
+        }
+
+        memset(nodes1, 0, sizeof(nodes1));
+        memset(nodes2, 0, sizeof(nodes2));
+        get_close_nodes_close_list(dht, public_key, nodes1, AF_INET, &num1, 1, 0);
+        get_close_nodes_inner(public_key, nodes2, AF_INET, dht->close_clientlist, LCLIENT_LIST, &num2, 1, 0);
+        ck_assert_msg(num1 == MAX_SENT_NODES && num2 == MAX_SENT_NODES, "not enough close nodes found");
+        ck_assert_msg(same_nodes(nodes1, nodes2, MAX_SENT_NODES), "different close nodes found");
+    }
+
+    /* A node that changed its key is removed from the bucket of its old one. */
+    for (i = 0; i < LCLIENT_LIST; ++i) {
+        if (dht->close_clientlist[i].assoc4.timestamp != 0) {
+            break;
+        }
+    }
+
+    uint8_t old_key[crypto_box_PUBLICKEYBYTES];
+    memcpy(old_key, dht->close_clientlist[i].public_key, sizeof(old_key));
+    ip_port = dht->close_clientlist[i].assoc4.ip_port;
+    prefix_key(dht->self_public_key, (i / LCLIENT_NODES + 1) % LCLIENT_LENGTH, public_key);
+    addto_lists(dht, ip_port, public_key);
+    ck_assert_msg(close_list_index(dht, old_key) == -1, "old key still in close list");
+
+    kill_DHT(dht);
+    kill_networking(net);
+}
+END_TEST
+
+#define NUM_TIMERS 2000
+
+typedef struct {
+    uint64_t deadlines[NUM_TIMERS];
+    uint32_t fired[NUM_TIMERS];
+    uint64_t last_now, now;
+    Timer_Wheel *wheel;
+} Timer_Test;
+
+static void timer_test_fired(void *object, uint32_t id, uint64_t deadline)
+{
+    Timer_Test *test = object;
+
+    ck_assert_msg(id < NUM_TIMERS, "bad timer id %u", id);
+    ck_assert_msg(deadline == test->deadlines[id], "timer %u fired with deadline %llu instead of %llu", id,
+                  (unsigned long long)deadline, (unsigned long long)test->deadlines[id]);
+    ck_assert_msg(deadline <= test->now && deadline > test->last_now, "timer %u fired at the wrong time", id);
+    ++test->fired[id];
+
+    /* Timers with odd ids keep rescheduling themselves. */
+    if (id % 2 == 1 && test->fired[id] < 4) {
+        test->deadlines[id] = timer_wheel_add(test->wheel, deadline + (rand() % 5000), id);
+        ck_assert_msg(test->deadlines[id] > deadline, "rescheduled timer would fire again on the same tick");
+    }
+}
+
+START_TEST(test_timer_wheel)
+{
+    static Timer_Test test;
+    uint64_t start = 1000000;
+    uint32_t i;
+
+    memset(&test, 0, sizeof(test));
+    test.wheel = timer_wheel_new(start);
+    ck_assert_msg(test.wheel != NULL, "Failed to create timer wheel");
+    test.last_now = start - 1;
+
+    for (i = 0; i < NUM_TIMERS; ++i) {
+        uint64_t delta;
+
+        switch (i % 4) {
+            case 0:
+                delta = rand() % 64;
+                break;
+
+            case 1:
+                delta = rand() % 5000;
+                break;
+
+            case 2:
+                delta = rand() % 300000;
+                break;
+
+            default:
+                /* Beyond what the top level covers. */
+                delta = (1ULL << 24) + rand() % 100000;
+                break;
+        }
+
+        test.deadlines[i] = timer_wheel_add(test.wheel, start + delta, i);
+        ck_assert_msg(test.deadlines[i] == start + delta, "timer added with the wrong deadline");
+    }
+
+    ck_assert_msg(timer_wheel_count(test.wheel) == NUM_TIMERS, "wrong number of timers");
+
+    while (timer_wheel_count(test.wheel) != 0) {
+        test.now = test.last_now + 1 + (rand() % 3 == 0 ? rand() % 100000 : rand() % 50);
+        timer_wheel_run(test.wheel, test.now, &timer_test_fired, &test);
+        test.last_now = test.now;
+    }
+
+    for (i = 0; i < NUM_TIMERS; ++i) {
+        ck_assert_msg(test.fired[i] == (i % 2 == 1 ? 4 : 1), "timer %u fired %u times", i, test.fired[i]);
+    }
+
+    /* Deadlines that already passed fire on the next tick that is run. */
+    ck_assert_msg(timer_wheel_add(test.wheel, 0, 0) == test.now + 1, "timer in the past not moved to the next tick");
+    timer_wheel_kill(test.wheel);
+}
+END_TEST
+
+#define NUM_SHARED_KEYS 64
+#define NUM_SHARED_KEYS_THREADS 4
+
+typedef struct {
+    Shared_Keys *shared_keys;
+    uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+    uint8_t public_keys[NUM_SHARED_KEYS][crypto_box_PUBLICKEYBYTES];
+    uint8_t expected[NUM_SHARED_KEYS][crypto_box_BEFORENMBYTES];
+    unsigned int errors[NUM_SHARED_KEYS_THREADS];
+} Shared_Keys_Test;
+
+static void *shared_keys_thread(void *arg)
+{
+    Shared_Keys_Test *test = ((void **)arg)[0];
+    unsigned int num = *(unsigned int *)((void **)arg)[1];
+    unsigned int i;
+
+    for (i = 0; i < 2000; ++i) {
+        unsigned int k = (i * 7 + num * 13) % NUM_SHARED_KEYS;
+        uint8_t shared_key[crypto_box_BEFORENMBYTES];
+        get_shared_key(test->shared_keys, shared_key, test->secret_key, test->public_keys[k]);
+
+        if (memcmp(shared_key, test->expected[k], crypto_box_BEFORENMBYTES) != 0) {
+            ++test->errors[num];
+        }
+    }
+
+    return NULL;
+}
+
+START_TEST(test_shared_keys)
+{
+    static Shared_Keys_Test test;
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    Shared_Keys_Stats stats;
+    unsigned int i;
+
+    crypto_box_keypair(public_key, test.secret_key);
+
+    for (i = 0; i < NUM_SHARED_KEYS; ++i) {
+        uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+        crypto_box_keypair(test.public_keys[i], secret_key);
+        encrypt_precompute(test.public_keys[i], test.secret_key, test.expected[i]);
+    }
+
+    /* A single set: SHARED_KEYS_WAYS keys fit, the next one evicts one. */
+    Shared_Keys *shared_keys = new_shared_keys(1);
+    ck_assert_msg(shared_keys != NULL, "Failed to create shared keys");
+
+    unsigned int round;
+
+    for (round = 0; round < 2; ++round) {
+        for (i = 0; i < SHARED_KEYS_WAYS; ++i) {
+            get_shared_key(shared_keys, shared_key, test.secret_key, test.public_keys[i]);
+            ck_assert_msg(memcmp(shared_key, test.expected[i], sizeof(shared_key)) == 0, "wrong shared key");
+        }
+    }
+
+    shared_keys_get_stats(shared_keys, &stats);
+    ck_assert_msg(stats.misses == SHARED_KEYS_WAYS && stats.hits == SHARED_KEYS_WAYS && stats.evictions == 0,
+                  "wrong stats: %llu hits, %llu misses, %llu evictions", (unsigned long long)stats.hits,
+                  (unsigned long long)stats.misses, (unsigned long long)stats.evictions);
+
+    /* Every key was used, so the first one goes. */
+    get_shared_key(shared_keys, shared_key, test.secret_key, test.public_keys[SHARED_KEYS_WAYS]);
+
+    for (i = 1; i < SHARED_KEYS_WAYS; ++i) {
+        get_shared_key(shared_keys, shared_key, test.secret_key, test.public_keys[i]);
+    }
+
+    /* A key that was never used again goes before the ones that were. */
+    get_shared_key(shared_keys, shared_key, test.secret_key, test.public_keys[SHARED_KEYS_WAYS + 1]);
+    ck_assert_msg(memcmp(shared_key, test.expected[SHARED_KEYS_WAYS + 1], sizeof(shared_key)) == 0, "wrong shared key");
+
+    for (i = 1; i < SHARED_KEYS_WAYS; ++i) {
+        get_shared_key(shared_keys, shared_key, test.secret_key, test.public_keys[i]);
+    }
+
+    shared_keys_get_stats(shared_keys, &stats);
+    ck_assert_msg(stats.misses == SHARED_KEYS_WAYS + 2 && stats.evictions == 2, "wrong stats after evictions");
+    kill_shared_keys(shared_keys);
+
+    /* Prefilled keys are found, and only computed once. */
+    shared_keys = new_shared_keys(1024);
+    ck_assert_msg(shared_keys != NULL, "Failed to create shared keys");
+    shared_keys_prefill(shared_keys, test.secret_key, test.public_keys[0], 10);
+    shared_keys_prefill(shared_keys, test.secret_key, test.public_keys[5], 10);
+
+    for (i = 0; i < 15; ++i) {
+        get_shared_key(shared_keys, shared_key, test.secret_key, test.public_keys[i]);
+        ck_assert_msg(memcmp(shared_key, test.expected[i], sizeof(shared_key)) == 0, "wrong prefilled shared key");
+    }
+
+    shared_keys_get_stats(shared_keys, &stats);
+    ck_assert_msg(stats.hits == 15 && stats.misses == 0, "prefilled keys not found");
+    kill_shared_keys(shared_keys);
+
+    /* Threads sharing a cache too small for all keys. */
+    test.shared_keys = new_shared_keys(NUM_SHARED_KEYS / 2);
+    ck_assert_msg(test.shared_keys != NULL, "Failed to create shared keys");
+
+    pthread_t threads[NUM_SHARED_KEYS_THREADS];
+    unsigned int nums[NUM_SHARED_KEYS_THREADS];
+    void *args[NUM_SHARED_KEYS_THREADS][2];
+
+    for (i = 0; i < NUM_SHARED_KEYS_THREADS; ++i) {
+        nums[i] = i;
+        args[i][0] = &test;
+        args[i][1] = &nums[i];
+        ck_assert_msg(pthread_create(&threads[i], NULL, &shared_keys_thread, args[i]) == 0, "Failed to start thread");
+    }
+
+    for (i = 0; i < NUM_SHARED_KEYS_THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+        ck_assert_msg(test.errors[i] == 0, "thread %u got %u wrong shared keys", i, test.errors[i]);
+    }
+
+    shared_keys_get_stats(test.shared_keys, &stats);
+    ck_assert_msg(stats.hits + stats.misses == NUM_SHARED_KEYS_THREADS * 2000, "lookups not counted");
+    kill_shared_keys(test.shared_keys);
+
+    /* A DHT with single set caches evicts once they are full. */
+    IP ip;
+    ip_init(&ip, 1);
+    Networking_Core *net = new_networking(NULL, ip, DHT_DEFAULT_PORT);
+    DHT *dht = new_DHT(NULL, net);
+    ck_assert_msg(dht != NULL, "Failed to create DHT");
+    ck_assert_msg(DHT_set_shared_keys_size(dht, 1) == 0, "Failed to resize shared keys");
+
+    for (i = 0; i <= SHARED_KEYS_WAYS; ++i) {
+        uint8_t expected[crypto_box_BEFORENMBYTES];
+        encrypt_precompute(test.public_keys[i], dht->self_secret_key, expected);
+        DHT_get_shared_key_recv(dht, shared_key, test.public_keys[i]);
+        ck_assert_msg(memcmp(shared_key, expected, sizeof(shared_key)) == 0, "wrong shared key");
+    }
+
+    shared_keys_get_stats(dht->shared_keys_recv, &stats);
+    ck_assert_msg(stats.misses == SHARED_KEYS_WAYS + 1 && stats.evictions == 1, "cache size not changed");
+    kill_DHT(dht);
+    kill_networking(net);
+}
+END_TEST
+
 static Suite *dht_suite(void)
 {
     Suite *s = suite_create("DHT");
@@ -656,6 +986,9 @@ static Suite *dht_suite(void)
     DEFTESTCASE(addto_lists_ipv4);
     DEFTESTCASE(addto_lists_ipv6);
 #endif
+    DEFTESTCASE(timer_wheel);
+    DEFTESTCASE(shared_keys);
+    DEFTESTCASE(close_list);
     DEFTESTCASE_SLOW(list, 20);
     DEFTESTCASE_SLOW(DHT_test, 50);
     return s;
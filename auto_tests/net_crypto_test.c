@@ -0,0 +1,975 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <check.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../toxcore/net_crypto.h"
+#include "../toxcore/util.h"
+
+#include "helpers.h"
+
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+#define c_sleep(x) Sleep(1*x)
+#else
+#include <unistd.h>
+#define c_sleep(x) usleep(1000*x)
+#endif
+
+#define NUM_ITEMS 2000
+
+START_TEST(test_packet_pool)
+{
+    Packet_Pool *pool = new_packet_pool(sizeof(Packet_Data));
+    ck_assert_msg(pool != NULL, "Failed to create packet pool");
+
+    static Packet_Data *items[NUM_ITEMS];
+    Packet_Pool_Stats stats;
+    unsigned int i, j;
+
+    for (i = 0; i < NUM_ITEMS; ++i) {
+        items[i] = packet_pool_alloc(pool);
+        ck_assert_msg(items[i] != NULL, "Failed to allocate item %u", i);
+        ck_assert_msg(((uintptr_t)items[i] & 15) == 0, "Item %u is not aligned", i);
+        memset(items[i], i & 0xFF, sizeof(Packet_Data));
+    }
+
+    for (i = 0; i < NUM_ITEMS; ++i) {
+        for (j = 0; j < sizeof(Packet_Data); ++j) {
+            ck_assert_msg(((uint8_t *)items[i])[j] == (i & 0xFF), "Item %u was overwritten", i);
+        }
+    }
+
+    packet_pool_get_stats(pool, &stats);
+    ck_assert_msg(stats.items_used == NUM_ITEMS && stats.items_peak == NUM_ITEMS, "Bad item counts");
+    ck_assert_msg(stats.allocations == NUM_ITEMS, "Bad allocation count");
+    ck_assert_msg(stats.slabs > 1 && stats.slab_allocations == stats.slabs, "Bad slab count");
+    ck_assert_msg(stats.items_free < PACKET_POOL_SLAB_SIZE / sizeof(Packet_Data), "Too many free items");
+
+    /* Freeing every other item keeps all slabs partly used. */
+    uint32_t slabs = stats.slabs;
+
+    for (i = 0; i < NUM_ITEMS; i += 2) {
+        packet_pool_free(pool, items[i]);
+        items[i] = NULL;
+    }
+
+    packet_pool_get_stats(pool, &stats);
+    ck_assert_msg(stats.slabs == slabs && stats.items_used == NUM_ITEMS / 2, "Bad counts after freeing half");
+
+    /* The freed items are reused before any new slab is made. */
+    for (i = 0; i < NUM_ITEMS; i += 2) {
+        items[i] = packet_pool_alloc(pool);
+        ck_assert_msg(items[i] != NULL, "Failed to allocate item %u", i);
+    }
+
+    packet_pool_get_stats(pool, &stats);
+    ck_assert_msg(stats.slabs == slabs && stats.slab_allocations == slabs, "Freed items were not reused");
+
+    /* All but one of the slabs go back to the system once empty. */
+    for (i = 0; i < NUM_ITEMS; ++i) {
+        packet_pool_free(pool, items[i]);
+    }
+
+    packet_pool_get_stats(pool, &stats);
+    ck_assert_msg(stats.items_used == 0, "Items still in use");
+    ck_assert_msg(stats.slabs == 1, "%u slabs kept, should be 1", stats.slabs);
+
+    packet_pool_free(pool, NULL);
+    kill_packet_pool(pool);
+}
+END_TEST
+
+#define PACKET_ID_TEST 160
+
+typedef struct {
+    Networking_Core *net;
+    DHT *dht;
+    Net_Crypto *c;
+    int connection_id;
+    uint32_t received;
+    _Bool out_of_order;
+} Test_Peer;
+
+static int handle_test_data(void *object, int id, const uint8_t *data, uint16_t length, void *userdata)
+{
+    Test_Peer *peer = object;
+    uint32_t number;
+
+    if (length != 1 + sizeof(number) || data[0] != PACKET_ID_TEST) {
+        peer->out_of_order = 1;
+        return 0;
+    }
+
+    memcpy(&number, data + 1, sizeof(number));
+
+    if (number != peer->received) {
+        peer->out_of_order = 1;
+    }
+
+    ++peer->received;
+    return 0;
+}
+
+static int handle_test_connection(void *object, New_Connection *n_c)
+{
+    Test_Peer *peer = object;
+    peer->connection_id = accept_crypto_connection(peer->c, n_c);
+
+    if (peer->connection_id == -1) {
+        return -1;
+    }
+
+    connection_data_handler(peer->c, peer->connection_id, &handle_test_data, peer, peer->connection_id);
+    return 0;
+}
+
+static void init_test_peer(Test_Peer *peer)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    TCP_Proxy_Info proxy_info;
+    memset(&proxy_info, 0, sizeof(proxy_info));
+
+    memset(peer, 0, sizeof(Test_Peer));
+    peer->connection_id = -1;
+    peer->net = new_networking(NULL, ip, TOX_PORTRANGE_FROM);
+    ck_assert_msg(peer->net != NULL, "Failed to create networking");
+    peer->dht = new_DHT(NULL, peer->net);
+    ck_assert_msg(peer->dht != NULL, "Failed to create DHT");
+    peer->c = new_net_crypto(NULL, peer->dht, &proxy_info);
+    ck_assert_msg(peer->c != NULL, "Failed to create net_crypto");
+    new_connection_handler(peer->c, &handle_test_connection, peer);
+}
+
+static void kill_test_peer(Test_Peer *peer)
+{
+    kill_net_crypto(peer->c);
+    kill_DHT(peer->dht);
+    kill_networking(peer->net);
+}
+
+static void do_test_peers(Test_Peer *peer1, Test_Peer *peer2)
+{
+    do_net_crypto(peer1->c, NULL);
+    networking_poll(peer1->net, NULL);
+    do_net_crypto(peer2->c, NULL);
+    networking_poll(peer2->net, NULL);
+    c_sleep(1);
+}
+
+/* Connect peer1 to peer2 over loopback, return the connection id of peer1. */
+static int connect_test_peers(Test_Peer *peer1, Test_Peer *peer2)
+{
+    IP_Port ip_port;
+    memset(&ip_port, 0, sizeof(ip_port));
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint32 = htonl(0x7F000001);
+    ip_port.port = peer2->net->port;
+
+    int id = new_crypto_connection(peer1->c, peer2->c->self_public_key, peer2->dht->self_public_key);
+    ck_assert_msg(id != -1, "Failed to create connection");
+    ck_assert_msg(set_direct_ip_port(peer1->c, id, ip_port, 1) == 0, "Failed to set ip_port");
+
+    uint64_t start = unix_time();
+
+    while (crypto_connection_status(peer1->c, id, NULL, NULL) != CRYPTO_CONN_ESTABLISHED || peer2->connection_id == -1
+            || crypto_connection_status(peer2->c, peer2->connection_id, NULL, NULL) != CRYPTO_CONN_ESTABLISHED) {
+        ck_assert_msg(!is_timeout(start, 10), "Failed to connect");
+        do_test_peers(peer1, peer2);
+    }
+
+    return id;
+}
+
+#define NUM_TEST_PACKETS 300
+
+START_TEST(test_packets_array)
+{
+    Test_Peer peer1, peer2;
+    init_test_peer(&peer1);
+    init_test_peer(&peer2);
+
+    int id = connect_test_peers(&peer1, &peer2);
+    Crypto_Connection *conn1 = &peer1.c->crypto_connections[id];
+    Crypto_Connection *conn2 = &peer2.c->crypto_connections[peer2.connection_id];
+
+    ck_assert_msg(conn1->send_array.capacity <= CRYPTO_MIN_PACKET_BUFFER_SIZE, "Send array too big after connecting");
+    ck_assert_msg(conn2->recv_array.capacity <= CRYPTO_MIN_PACKET_BUFFER_SIZE, "Recv array too big after connecting");
+
+    uint32_t i;
+
+    for (i = 0; i < NUM_TEST_PACKETS; ++i) {
+        uint8_t packet[1 + sizeof(i)];
+        packet[0] = PACKET_ID_TEST;
+        memcpy(packet + 1, &i, sizeof(i));
+        ck_assert_msg(write_cryptpacket(peer1.c, id, packet, sizeof(packet), 0) == i, "Failed to queue packet %u", i);
+    }
+
+    ck_assert_msg(conn1->send_array.capacity >= NUM_TEST_PACKETS, "Send array did not grow");
+    ck_assert_msg(conn1->send_array.capacity < 2 * NUM_TEST_PACKETS, "Send array grew too much");
+
+    uint64_t start = unix_time();
+
+    while (peer2.received != NUM_TEST_PACKETS || conn1->send_array.buffer_end != conn1->send_array.buffer_start) {
+        ck_assert_msg(!is_timeout(start, 20), "Only %u packets received", peer2.received);
+        do_test_peers(&peer1, &peer2);
+    }
+
+    ck_assert_msg(!peer2.out_of_order, "Packets were received out of order");
+
+    for (i = 0; i < 10; ++i) {
+        do_test_peers(&peer1, &peer2);
+    }
+
+    ck_assert_msg(conn1->send_array.capacity == CRYPTO_MIN_PACKET_BUFFER_SIZE, "Send array did not shrink back, %u",
+                  conn1->send_array.capacity);
+    ck_assert_msg(conn2->recv_array.capacity <= CRYPTO_MIN_PACKET_BUFFER_SIZE, "Recv array did not shrink back");
+
+    kill_test_peer(&peer1);
+    kill_test_peer(&peer2);
+}
+END_TEST
+
+#define NUM_INDEX_CONNECTIONS 1000
+
+START_TEST(test_connection_index)
+{
+    Test_Peer peer;
+    init_test_peer(&peer);
+
+    static uint8_t keys[NUM_INDEX_CONNECTIONS][crypto_box_PUBLICKEYBYTES];
+    static IP_Port ip_ports[NUM_INDEX_CONNECTIONS];
+    static int ids[NUM_INDEX_CONNECTIONS];
+    uint32_t i;
+
+    for (i = 0; i < NUM_INDEX_CONNECTIONS; ++i) {
+        randombytes(keys[i], crypto_box_PUBLICKEYBYTES);
+        ids[i] = new_crypto_connection(peer.c, keys[i], keys[i]);
+        ck_assert_msg(ids[i] != -1, "Failed to create connection %u", i);
+
+        memset(&ip_ports[i], 0, sizeof(IP_Port));
+        ip_init(&ip_ports[i].ip, 0);
+        ip_ports[i].ip.ip4.uint32 = htonl(0x01000000 + i);
+        ip_ports[i].port = htons(33445);
+        ck_assert_msg(set_direct_ip_port(peer.c, ids[i], ip_ports[i], 0) == 0, "Failed to set ip_port %u", i);
+    }
+
+    for (i = 0; i < NUM_INDEX_CONNECTIONS; ++i) {
+        ck_assert_msg(new_crypto_connection(peer.c, keys[i], keys[i]) == ids[i], "Connection %u not found by key", i);
+    }
+
+    /* An ip_port can only belong to one connection. */
+    ck_assert_msg(set_direct_ip_port(peer.c, ids[0], ip_ports[1], 0) == -1, "Same ip_port set on two connections");
+
+    for (i = 0; i < NUM_INDEX_CONNECTIONS; i += 2) {
+        ck_assert_msg(crypto_kill(peer.c, ids[i]) == 0, "Failed to kill connection %u", i);
+    }
+
+    for (i = 1; i < NUM_INDEX_CONNECTIONS; i += 2) {
+        ck_assert_msg(new_crypto_connection(peer.c, keys[i], keys[i]) == ids[i], "Connection %u lost", i);
+        ck_assert_msg(set_direct_ip_port(peer.c, ids[i], ip_ports[i - 1], 0) == 0, "ip_port of killed connection %u kept",
+                      i - 1);
+    }
+
+    for (i = 0; i < NUM_INDEX_CONNECTIONS; i += 2) {
+        int id = new_crypto_connection(peer.c, keys[i], keys[i]);
+        ck_assert_msg(id != -1, "Failed to create connection %u again", i);
+        ck_assert_msg(set_direct_ip_port(peer.c, id, ip_ports[i + 1], 0) == 0, "Old ip_port of connection %u kept", i + 1);
+    }
+
+    kill_test_peer(&peer);
+}
+END_TEST
+
+#define NUM_CC_TEST_PACKETS 2000
+
+START_TEST(test_congestion_control)
+{
+    Test_Peer peer1, peer2;
+    init_test_peer(&peer1);
+    init_test_peer(&peer2);
+
+    ck_assert_msg(net_crypto_congestion_control(peer1.c, CRYPTO_CONGESTION_NUM) == -1, "Set unknown controller");
+    ck_assert_msg(net_crypto_congestion_control(peer1.c, CRYPTO_CONGESTION_BBR) == 0, "Failed to set controller");
+    ck_assert_msg(net_crypto_congestion_control(peer2.c, CRYPTO_CONGESTION_BBR) == 0, "Failed to set controller");
+
+    int id = connect_test_peers(&peer1, &peer2);
+    Crypto_Connection *conn1 = &peer1.c->crypto_connections[id];
+    ck_assert_msg(conn1->congestion_controller == CRYPTO_CONGESTION_BBR, "Connection did not get the controller");
+
+    uint32_t i = 0;
+    uint64_t start = unix_time();
+
+    while (peer2.received != NUM_CC_TEST_PACKETS || conn1->send_array.num_stored != 0) {
+        ck_assert_msg(!is_timeout(start, 30), "Only %u packets received", peer2.received);
+
+        for (; i < NUM_CC_TEST_PACKETS; ++i) {
+            uint8_t packet[1 + sizeof(i)];
+            packet[0] = PACKET_ID_TEST;
+            memcpy(packet + 1, &i, sizeof(i));
+
+            if (write_cryptpacket(peer1.c, id, packet, sizeof(packet), 1) == -1) {
+                break;
+            }
+        }
+
+        do_test_peers(&peer1, &peer2);
+    }
+
+    ck_assert_msg(!peer2.out_of_order, "Packets were received out of order");
+    ck_assert_msg(conn1->bbr.max_bw > 0, "No bandwidth was measured");
+    ck_assert_msg(conn1->congestion_window != 0, "No send window was set");
+
+    kill_test_peer(&peer1);
+    kill_test_peer(&peer2);
+}
+END_TEST
+
+#define NUM_SACK_TEST_PACKETS 1000
+#define SACK_TEST_DROP_INTERVAL 10
+
+/* Counts the data packets and drops every drop_interval'th one before
+ * net_crypto sees it. */
+typedef struct {
+    Packet_Handles handle;
+    uint32_t count;
+    uint32_t drop_interval;
+} Lossy_Handler;
+
+static int handle_lossy_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    Lossy_Handler *lossy = object;
+
+    if (++lossy->count % lossy->drop_interval == 0) {
+        return 1;
+    }
+
+    return lossy->handle.function(lossy->handle.object, source, packet, length, userdata);
+}
+
+START_TEST(test_sack)
+{
+    /* First with both peers speaking version 1, then with peer1 never
+     * telling its version so peer2 keeps sending it request packets. */
+    unsigned int mode;
+
+    for (mode = 0; mode < 2; ++mode) {
+        Test_Peer peer1, peer2;
+        init_test_peer(&peer1);
+        init_test_peer(&peer2);
+        net_crypto_congestion_control(peer1.c, CRYPTO_CONGESTION_BBR);
+        net_crypto_congestion_control(peer2.c, CRYPTO_CONGESTION_BBR);
+
+        int id = connect_test_peers(&peer1, &peer2);
+        Crypto_Connection *conn1 = &peer1.c->crypto_connections[id];
+        Crypto_Connection *conn2 = &peer2.c->crypto_connections[peer2.connection_id];
+
+        if (mode == 1) {
+            conn1->version_packets_sent = MAX_NUM_SENDPACKET_TRIES;
+            conn1->version_acked = 1;
+            conn2->peer_version = 0;
+        }
+
+        Lossy_Handler lossy;
+        memset(&lossy, 0, sizeof(lossy));
+        lossy.drop_interval = SACK_TEST_DROP_INTERVAL;
+        lossy.handle = peer2.net->packethandlers[NET_PACKET_CRYPTO_DATA];
+        networking_registerhandler(peer2.net, NET_PACKET_CRYPTO_DATA, &handle_lossy_packet, &lossy);
+
+        uint32_t i = 0;
+        uint64_t start = unix_time();
+
+        while (peer2.received != NUM_SACK_TEST_PACKETS || conn1->send_array.num_stored != 0) {
+            ck_assert_msg(!is_timeout(start, 30), "Only %u packets received in mode %u", peer2.received, mode);
+
+            for (; i < NUM_SACK_TEST_PACKETS; ++i) {
+                uint8_t packet[1 + sizeof(i)];
+                packet[0] = PACKET_ID_TEST;
+                memcpy(packet + 1, &i, sizeof(i));
+
+                if (write_cryptpacket(peer1.c, id, packet, sizeof(packet), 1) == -1) {
+                    break;
+                }
+            }
+
+            do_test_peers(&peer1, &peer2);
+        }
+
+        ck_assert_msg(!peer2.out_of_order, "Packets were received out of order in mode %u", mode);
+
+        if (mode == 0) {
+            ck_assert_msg(conn1->srtt != 0 && conn1->rto >= CRYPTO_MIN_RTO, "No retransmission timeout was set");
+            ck_assert_msg(conn1->peer_version == CRYPTO_PROTOCOL_VERSION, "peer1 did not learn the version of peer2");
+            ck_assert_msg(conn2->peer_version == CRYPTO_PROTOCOL_VERSION, "peer2 did not learn the version of peer1");
+            ck_assert_msg(conn1->version_acked && conn2->version_acked, "Peers did not get SACK packets");
+        } else {
+            ck_assert_msg(conn2->peer_version == 0, "peer2 learned the version of peer1");
+        }
+
+        kill_test_peer(&peer1);
+        kill_test_peer(&peer2);
+    }
+}
+END_TEST
+
+#define NUM_STATS_TEST_PACKETS 500
+
+START_TEST(test_connection_stats)
+{
+    Test_Peer peer1, peer2;
+    init_test_peer(&peer1);
+    init_test_peer(&peer2);
+    net_crypto_congestion_control(peer1.c, CRYPTO_CONGESTION_BBR);
+    net_crypto_congestion_control(peer2.c, CRYPTO_CONGESTION_BBR);
+
+    int id = connect_test_peers(&peer1, &peer2);
+    Crypto_Connection *conn1 = &peer1.c->crypto_connections[id];
+    Crypto_Connection_Stats stats1, stats2;
+    ck_assert_msg(crypto_connection_stats(peer1.c, id + 1, &stats1) == -1, "Got stats of a missing connection");
+
+    Lossy_Handler lossy;
+    memset(&lossy, 0, sizeof(lossy));
+    lossy.drop_interval = SACK_TEST_DROP_INTERVAL;
+    lossy.handle = peer2.net->packethandlers[NET_PACKET_CRYPTO_DATA];
+    networking_registerhandler(peer2.net, NET_PACKET_CRYPTO_DATA, &handle_lossy_packet, &lossy);
+
+    uint32_t i = 0;
+    uint64_t start = unix_time();
+
+    while (peer2.received != NUM_STATS_TEST_PACKETS || conn1->send_array.num_stored != 0) {
+        ck_assert_msg(!is_timeout(start, 30), "Only %u packets received", peer2.received);
+
+        for (; i < NUM_STATS_TEST_PACKETS; ++i) {
+            uint8_t packet[1 + sizeof(i)];
+            packet[0] = PACKET_ID_TEST;
+            memcpy(packet + 1, &i, sizeof(i));
+
+            if (write_cryptpacket(peer1.c, id, packet, sizeof(packet), 1) == -1) {
+                break;
+            }
+        }
+
+        do_test_peers(&peer1, &peer2);
+    }
+
+    ck_assert_msg(crypto_connection_stats(peer1.c, id, &stats1) == 0, "Failed to get stats of peer1");
+    ck_assert_msg(crypto_connection_stats(peer2.c, peer2.connection_id, &stats2) == 0, "Failed to get stats of peer2");
+
+    ck_assert_msg(stats1.packets_sent >= NUM_STATS_TEST_PACKETS, "%llu packets sent",
+                  (unsigned long long)stats1.packets_sent);
+    ck_assert_msg(stats1.packets_resent != 0, "No packets resent");
+    ck_assert_msg(stats2.packets_received >= NUM_STATS_TEST_PACKETS, "%llu packets received",
+                  (unsigned long long)stats2.packets_received);
+    ck_assert_msg(stats2.packets_received <= stats1.packets_sent, "More packets received than sent");
+    ck_assert_msg(stats1.send_queue_size == 0 && stats2.recv_queue_size == 0, "Queues not empty");
+    ck_assert_msg(stats1.rtt != 0 && stats1.rto != 0, "No rtt");
+    ck_assert_msg(stats1.direct_connected && stats2.direct_connected, "Peers not directly connected");
+
+    kill_test_peer(&peer1);
+    kill_test_peer(&peer2);
+}
+END_TEST
+
+#define NUM_COALESCE_TEST_PACKETS 1000
+
+START_TEST(test_coalesce)
+{
+    Test_Peer peer1, peer2;
+    init_test_peer(&peer1);
+    init_test_peer(&peer2);
+    net_crypto_coalesce_packets(peer1.c, 1);
+
+    int id = connect_test_peers(&peer1, &peer2);
+    Crypto_Connection *conn1 = &peer1.c->crypto_connections[id];
+    ck_assert_msg(conn1->coalesce, "Connection does not coalesce packets");
+
+    uint64_t start = unix_time();
+
+    while (conn1->peer_version < 2) {
+        ck_assert_msg(!is_timeout(start, 10), "peer1 did not learn the version of peer2");
+        do_test_peers(&peer1, &peer2);
+    }
+
+    Lossy_Handler counter;
+    memset(&counter, 0, sizeof(counter));
+    counter.drop_interval = ~0;
+    counter.handle = peer2.net->packethandlers[NET_PACKET_CRYPTO_DATA];
+    networking_registerhandler(peer2.net, NET_PACKET_CRYPTO_DATA, &handle_lossy_packet, &counter);
+
+    uint32_t i = 0;
+    int64_t last_number = -1;
+    start = unix_time();
+
+    while (peer2.received != NUM_COALESCE_TEST_PACKETS) {
+        ck_assert_msg(!is_timeout(start, 20), "Only %u packets received", peer2.received);
+
+        /* Bursts of 20 packets, all but the first of each coalesced. */
+        uint32_t burst_end = i + 20;
+
+        for (; i < NUM_COALESCE_TEST_PACKETS && i < burst_end; ++i) {
+            uint8_t packet[1 + sizeof(i)];
+            packet[0] = PACKET_ID_TEST;
+            memcpy(packet + 1, &i, sizeof(i));
+            int64_t number = write_cryptpacket(peer1.c, id, packet, sizeof(packet), 0);
+            ck_assert_msg(number != -1, "Failed to write packet %u", i);
+            ck_assert_msg(number >= last_number, "Packet numbers went backwards");
+            last_number = number;
+        }
+
+        do_test_peers(&peer1, &peer2);
+    }
+
+    ck_assert_msg(!peer2.out_of_order, "Packets were received out of order");
+    ck_assert_msg(counter.count < NUM_COALESCE_TEST_PACKETS / 4, "%u data packets for %u packets", counter.count,
+                  NUM_COALESCE_TEST_PACKETS);
+
+    while (conn1->send_array.num_stored != 0) {
+        ck_assert_msg(!is_timeout(start, 20), "Packets were not acked");
+        do_test_peers(&peer1, &peer2);
+    }
+
+    ck_assert_msg(cryptpacket_received(peer1.c, id, last_number) == 0, "Last packet not acked");
+
+    kill_test_peer(&peer1);
+    kill_test_peer(&peer2);
+}
+END_TEST
+
+#define NUM_RECEIPT_TEST_PACKETS 5000
+
+typedef struct {
+    Test_Peer *sender, *receiver;
+    int connection_id;
+
+    /* The numbers write_cryptpacket() gave each writer's packets and the ones
+     * they arrived in. */
+    int64_t written[2][NUM_RECEIPT_TEST_PACKETS];
+    int64_t arrived[2][NUM_RECEIPT_TEST_PACKETS];
+    uint32_t received;
+} Receipt_Test;
+
+static int handle_receipt_test_data(void *object, int id, const uint8_t *data, uint16_t length, void *userdata)
+{
+    Receipt_Test *test = object;
+    uint32_t number;
+
+    if (length < 2 + sizeof(number) || data[0] != PACKET_ID_TEST || data[1] > 1) {
+        return 0;
+    }
+
+    memcpy(&number, data + 2, sizeof(number));
+
+    if (number < NUM_RECEIPT_TEST_PACKETS) {
+        /* The one being handled was the last taken out of the receive array. */
+        const Crypto_Connection *conn = &test->receiver->c->crypto_connections[id];
+        test->arrived[data[1]][number] = conn->recv_array.buffer_start - 1;
+        ++test->received;
+    }
+
+    return 0;
+}
+
+static void *receipt_test_writer(void *arg)
+{
+    void **args = arg;
+    Receipt_Test *test = args[0];
+    uint8_t writer = *(uint8_t *)args[1];
+    uint8_t packet[CRYPTO_COALESCE_MAX_LENGTH + 1];
+    uint32_t i;
+
+    /* Writer 0 writes small packets, which are coalesced, and writer 1 ones
+     * too long for it, which send the coalesced packet first. */
+    uint16_t length = writer == 0 ? 2 + sizeof(i) : sizeof(packet);
+    memset(packet, 0, sizeof(packet));
+    packet[0] = PACKET_ID_TEST;
+    packet[1] = writer;
+
+    for (i = 0; i < NUM_RECEIPT_TEST_PACKETS; ++i) {
+        memcpy(packet + 2, &i, sizeof(i));
+
+        int64_t number;
+
+        while ((number = write_cryptpacket(test->sender->c, test->connection_id, packet, length, 0)) == -1) {
+            /* Send array full, try again. */
+            c_sleep(1);
+        }
+
+        test->written[writer][i] = number;
+    }
+
+    return NULL;
+}
+
+START_TEST(test_coalesce_receipts)
+{
+    Test_Peer peer1, peer2;
+    init_test_peer(&peer1);
+    init_test_peer(&peer2);
+    net_crypto_coalesce_packets(peer1.c, 1);
+
+    static Receipt_Test test;
+    memset(&test, 0, sizeof(test));
+    test.sender = &peer1;
+    test.receiver = &peer2;
+    test.connection_id = connect_test_peers(&peer1, &peer2);
+    uint64_t start = unix_time();
+
+    while (peer1.c->crypto_connections[test.connection_id].peer_version < 2) {
+        ck_assert_msg(!is_timeout(start, 10), "peer1 did not learn the version of peer2");
+        do_test_peers(&peer1, &peer2);
+    }
+
+    connection_data_handler(peer2.c, peer2.connection_id, &handle_receipt_test_data, &test, peer2.connection_id);
+
+    /* Two threads writing while the connection is run. */
+    pthread_t threads[2];
+    uint8_t writers[2] = {0, 1};
+    void *args[2][2];
+    unsigned int i, j;
+
+    for (i = 0; i < 2; ++i) {
+        args[i][0] = &test;
+        args[i][1] = &writers[i];
+        ck_assert_msg(pthread_create(&threads[i], NULL, &receipt_test_writer, args[i]) == 0, "Failed to start thread");
+    }
+
+    start = unix_time();
+
+    while (test.received != 2 * NUM_RECEIPT_TEST_PACKETS) {
+        ck_assert_msg(!is_timeout(start, 30), "Only %u packets received", test.received);
+        do_test_peers(&peer1, &peer2);
+    }
+
+    for (i = 0; i < 2; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (i = 0; i < 2; ++i) {
+        for (j = 0; j < NUM_RECEIPT_TEST_PACKETS; ++j) {
+            ck_assert_msg(test.written[i][j] == test.arrived[i][j],
+                          "Packet %u of writer %u written as %lld arrived in %lld", j, i,
+                          (long long)test.written[i][j], (long long)test.arrived[i][j]);
+        }
+    }
+
+    kill_test_peer(&peer1);
+    kill_test_peer(&peer2);
+}
+END_TEST
+
+#define NUM_SEND_QUEUE_THREADS 4
+#define NUM_SEND_QUEUE_PACKETS 20000
+#define NUM_LOSSY_TEST_PACKETS 200
+#define PACKET_ID_LOSSY_TEST 200
+
+typedef struct {
+    Send_Queue *queue;
+    Net_Crypto *c;
+    int connection_id;
+    unsigned int num;
+
+    uint8_t sending;
+    _Bool concurrent, out_of_order;
+    uint32_t received;
+    uint32_t next[NUM_SEND_QUEUE_THREADS];
+} Send_Queue_Test;
+
+/* Packets are the number of the thread that sent it followed by a counter. */
+static void check_send_queue_packet(Send_Queue_Test *test, const uint8_t *data, uint16_t length)
+{
+    uint32_t number;
+
+    if (length != 2 + sizeof(number) || data[1] >= NUM_SEND_QUEUE_THREADS) {
+        test->out_of_order = 1;
+        return;
+    }
+
+    memcpy(&number, data + 2, sizeof(number));
+
+    if (number != test->next[data[1]]) {
+        test->out_of_order = 1;
+    }
+
+    test->next[data[1]] = number + 1;
+    ++test->received;
+}
+
+static void send_queue_test_cb(void *object, const uint8_t *data, uint16_t length)
+{
+    Send_Queue_Test *test = object;
+
+    if (__atomic_exchange_n(&test->sending, 1, __ATOMIC_ACQUIRE)) {
+        test->concurrent = 1;
+    }
+
+    check_send_queue_packet(test, data, length);
+    __atomic_store_n(&test->sending, 0, __ATOMIC_RELEASE);
+}
+
+static int handle_lossy_test_data(void *object, int id, const uint8_t *data, uint16_t length)
+{
+    check_send_queue_packet(object, data, length);
+    return 0;
+}
+
+static void *send_queue_thread(void *arg)
+{
+    void **args = arg;
+    Send_Queue_Test *test = args[0];
+    unsigned int num = *(unsigned int *)args[1];
+    uint8_t packet[2 + sizeof(uint32_t)];
+    uint32_t i;
+
+    packet[0] = PACKET_ID_LOSSY_TEST;
+    packet[1] = num;
+
+    for (i = 0; i < (test->queue ? NUM_SEND_QUEUE_PACKETS : NUM_LOSSY_TEST_PACKETS); ++i) {
+        memcpy(packet + 2, &i, sizeof(i));
+
+        if (test->queue) {
+            while (send_queue_add(test->queue, packet, sizeof(packet), &send_queue_test_cb, test) == -1) {
+                /* Full, try again. */
+            }
+        } else {
+            ck_assert_msg(send_lossy_cryptpacket(test->c, test->connection_id, packet, sizeof(packet)) == 0,
+                          "Failed to send lossy packet");
+            c_sleep(1);
+        }
+    }
+
+    return NULL;
+}
+
+static void run_send_queue_threads(Send_Queue_Test *test, pthread_t *threads, void *args[][2], unsigned int *nums)
+{
+    unsigned int i;
+
+    for (i = 0; i < NUM_SEND_QUEUE_THREADS; ++i) {
+        nums[i] = i;
+        args[i][0] = test;
+        args[i][1] = &nums[i];
+        ck_assert_msg(pthread_create(&threads[i], NULL, &send_queue_thread, args[i]) == 0, "Failed to start thread");
+    }
+}
+
+START_TEST(test_send_queue)
+{
+    pthread_t threads[NUM_SEND_QUEUE_THREADS];
+    unsigned int nums[NUM_SEND_QUEUE_THREADS];
+    void *args[NUM_SEND_QUEUE_THREADS][2];
+    Send_Queue_Test test;
+    unsigned int i;
+
+    /* Threads sharing a small queue. */
+    memset(&test, 0, sizeof(test));
+    test.queue = new_send_queue(16);
+    ck_assert_msg(test.queue != NULL, "Failed to create send queue");
+    run_send_queue_threads(&test, threads, args, nums);
+
+    for (i = 0; i < NUM_SEND_QUEUE_THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    ck_assert_msg(!test.concurrent, "Packets were sent by two threads at the same time");
+    ck_assert_msg(!test.out_of_order, "Packets of a thread were sent out of order");
+    ck_assert_msg(test.received == NUM_SEND_QUEUE_THREADS * NUM_SEND_QUEUE_PACKETS, "Only %u packets sent",
+                  test.received);
+    ck_assert_msg(send_queue_size(test.queue) == 0, "Packets left in the queue");
+    kill_send_queue(test.queue);
+
+    /* Threads sending lossy packets on a connection while it is being run. */
+    Test_Peer peer1, peer2;
+    init_test_peer(&peer1);
+    init_test_peer(&peer2);
+
+    memset(&test, 0, sizeof(test));
+    test.c = peer1.c;
+    test.connection_id = connect_test_peers(&peer1, &peer2);
+    connection_lossy_data_handler(peer2.c, peer2.connection_id, &handle_lossy_test_data, &test, peer2.connection_id);
+    run_send_queue_threads(&test, threads, args, nums);
+
+    uint64_t start = unix_time();
+
+    while (test.received != NUM_SEND_QUEUE_THREADS * NUM_LOSSY_TEST_PACKETS) {
+        ck_assert_msg(!is_timeout(start, 20), "Only %u lossy packets received", test.received);
+        do_test_peers(&peer1, &peer2);
+    }
+
+    for (i = 0; i < NUM_SEND_QUEUE_THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    ck_assert_msg(!test.out_of_order, "Lossy packets of a thread were received out of order");
+    ck_assert_msg(send_queue_size(peer1.c->crypto_connections[test.connection_id].lossy_queue) == 0,
+                  "Lossy packets left in the queue");
+
+    kill_test_peer(&peer1);
+    kill_test_peer(&peer2);
+}
+END_TEST
+
+#define NUM_FLOOD_SOCKETS 16
+#define TEST_COOKIE_REQUEST_LENGTH (1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES * 2 \
+                                    + sizeof(uint64_t) + crypto_box_MACBYTES)
+
+/* Send num garbage cookie requests to peer from each flooder. */
+static void flood_cookie_requests(Networking_Core **flooders, unsigned int num_flooders, const Test_Peer *peer,
+                                  unsigned int num)
+{
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint32 = htonl(0x7F000001);
+    ip_port.port = peer->net->port;
+
+    uint8_t packet[TEST_COOKIE_REQUEST_LENGTH];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = NET_PACKET_COOKIE_REQUEST;
+    unsigned int i, j;
+
+    for (i = 0; i < num_flooders; ++i) {
+        for (j = 0; j < num; ++j) {
+            ck_assert_msg(sendpacket(flooders[i], ip_port, packet, sizeof(packet)) == sizeof(packet), "sendpacket failed");
+        }
+    }
+}
+
+START_TEST(test_handshake_flood)
+{
+    Test_Peer peer1, peer2;
+    init_test_peer(&peer1);
+    init_test_peer(&peer2);
+
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+    Networking_Core *flooders[NUM_FLOOD_SOCKETS];
+    unsigned int i;
+
+    /* Sources are IPs, so each flooder gets an address of its own. */
+    IP flooder_ip = ip;
+
+    for (i = 0; i < NUM_FLOOD_SOCKETS; ++i) {
+        flooder_ip.ip4.uint32 = htonl(0x7F000002 + i);
+        flooders[i] = new_networking(NULL, flooder_ip, TOX_PORTRANGE_FROM);
+        ck_assert_msg(flooders[i] != NULL, "Failed to create networking");
+    }
+
+    /* One source gets CRYPTO_HANDSHAKE_BURST of them through. */
+    Crypto_Handshake_Stats stats;
+    flood_cookie_requests(flooders, 1, &peer2, 100);
+    c_sleep(10);
+    networking_poll(peer2.net, NULL);
+    net_crypto_get_handshake_stats(peer2.c, &stats);
+    ck_assert_msg(stats.queued == CRYPTO_HANDSHAKE_BURST && stats.rate_limited == 100 - CRYPTO_HANDSHAKE_BURST,
+                  "%u queued, %u rate limited", (unsigned int)stats.queued, (unsigned int)stats.rate_limited);
+
+    /* Other ports of its IP get none through. */
+    flooder_ip.ip4.uint32 = htonl(0x7F000002);
+    Networking_Core *other_port = new_networking(NULL, flooder_ip, TOX_PORTRANGE_FROM);
+    ck_assert_msg(other_port != NULL, "Failed to create networking");
+    flood_cookie_requests(&other_port, 1, &peer2, 10);
+    kill_networking(other_port);
+    c_sleep(10);
+    networking_poll(peer2.net, NULL);
+    net_crypto_get_handshake_stats(peer2.c, &stats);
+    ck_assert_msg(stats.queued == CRYPTO_HANDSHAKE_BURST && stats.rate_limited == 110 - CRYPTO_HANDSHAKE_BURST,
+                  "Another port of the source got %u through", (unsigned int)stats.queued - CRYPTO_HANDSHAKE_BURST);
+
+    /* Handshakes with a cookie that isn't ours never get queued. */
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.port = peer2.net->port;
+    uint8_t handshake[1 + 2 * (crypto_box_NONCEBYTES + sizeof(uint64_t) + 2 * crypto_box_PUBLICKEYBYTES
+                               + crypto_box_MACBYTES) + 2 * crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES
+                      + crypto_hash_sha512_BYTES + crypto_box_MACBYTES];
+    memset(handshake, 0, sizeof(handshake));
+    handshake[0] = NET_PACKET_CRYPTO_HS;
+
+    for (i = 0; i < 4; ++i) {
+        sendpacket(flooders[1], ip_port, handshake, sizeof(handshake));
+    }
+
+    c_sleep(10);
+    networking_poll(peer2.net, NULL);
+    net_crypto_get_handshake_stats(peer2.c, &stats);
+    ck_assert_msg(stats.invalid == 4 && stats.queued == CRYPTO_HANDSHAKE_BURST, "Forged handshakes were queued");
+
+    /* The queue doesn't grow past CRYPTO_HANDSHAKE_QUEUE_SIZE. */
+    flood_cookie_requests(flooders + 2, NUM_FLOOD_SOCKETS - 2, &peer2, CRYPTO_HANDSHAKE_BURST);
+    c_sleep(10);
+    networking_poll(peer2.net, NULL);
+    net_crypto_get_handshake_stats(peer2.c, &stats);
+    ck_assert_msg(stats.queued == CRYPTO_HANDSHAKE_QUEUE_SIZE, "%u queued", (unsigned int)stats.queued);
+    ck_assert_msg(stats.dropped == (NUM_FLOOD_SOCKETS - 1) * CRYPTO_HANDSHAKE_BURST - CRYPTO_HANDSHAKE_QUEUE_SIZE,
+                  "%u dropped", (unsigned int)stats.dropped);
+
+    do_net_crypto(peer2.c, NULL);
+    net_crypto_get_handshake_stats(peer2.c, &stats);
+    ck_assert_msg(stats.handled == CRYPTO_HANDSHAKE_QUEUE_SIZE, "%u handled", (unsigned int)stats.handled);
+
+    /* Connecting while the flood goes on. */
+    int id = new_crypto_connection(peer1.c, peer2.c->self_public_key, peer2.dht->self_public_key);
+    ck_assert_msg(id != -1, "Failed to create connection");
+    ck_assert_msg(set_direct_ip_port(peer1.c, id, ip_port, 1) == 0, "Failed to set ip_port");
+
+    uint64_t start = unix_time();
+
+    while (crypto_connection_status(peer1.c, id, NULL, NULL) != CRYPTO_CONN_ESTABLISHED) {
+        ck_assert_msg(!is_timeout(start, 10), "Failed to connect during the flood");
+        flood_cookie_requests(flooders, NUM_FLOOD_SOCKETS, &peer2, 4);
+        do_test_peers(&peer1, &peer2);
+    }
+
+    net_crypto_get_handshake_stats(peer2.c, &stats);
+    ck_assert_msg(stats.rate_limited + stats.dropped > stats.handled, "The flood was not limited");
+
+    for (i = 0; i < NUM_FLOOD_SOCKETS; ++i) {
+        kill_networking(flooders[i]);
+    }
+
+    kill_test_peer(&peer1);
+    kill_test_peer(&peer2);
+}
+END_TEST
+
+static Suite *net_crypto_suite(void)
+{
+    Suite *s = suite_create("Net_crypto");
+
+    DEFTESTCASE(packet_pool);
+    DEFTESTCASE_SLOW(packets_array, 40);
+    DEFTESTCASE(connection_index);
+    DEFTESTCASE_SLOW(congestion_control, 40);
+    DEFTESTCASE_SLOW(sack, 80);
+    DEFTESTCASE_SLOW(connection_stats, 40);
+    DEFTESTCASE_SLOW(coalesce, 40);
+    DEFTESTCASE_SLOW(coalesce_receipts, 40);
+    DEFTESTCASE_SLOW(send_queue, 40);
+    DEFTESTCASE_SLOW(handshake_flood, 40);
+
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    srand((unsigned int) time(NULL));
+
+    Suite *net_crypto = net_crypto_suite();
+    SRunner *test_runner = srunner_create(net_crypto);
+    int number_failed = 0;
+
+    srunner_run_all(test_runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
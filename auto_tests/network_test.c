@@ -9,6 +9,8 @@
 #include <sys/types.h>
 #include <time.h>
 
+#include "../toxcore/crypto_core.h"
+#include "../toxcore/key_index.h"
 #include "../toxcore/network.h"
 
 #include "helpers.h"
@@ -134,12 +136,405 @@ START_TEST(test_ip_equal)
 }
 END_TEST
 
+static uint32_t batch_packets_received;
+
+static int handle_batch_test_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
+                                    void *userdata)
+{
+    if (length == 100 && packet[1] == (uint8_t)batch_packets_received) {
+        ++batch_packets_received;
+    }
+
+    return 0;
+}
+
+START_TEST(test_recv_batch)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    Networking_Core *net1 = new_networking(NULL, ip, TOX_PORTRANGE_FROM);
+    Networking_Core *net2 = new_networking(NULL, ip, TOX_PORTRANGE_FROM);
+    ck_assert_msg(net1 && net2, "Failed to create networking");
+
+    ck_assert_msg(networking_set_recv_batch(net2, MAX_RECV_BATCH_SIZE + 1) == -1, "Oversized batch accepted");
+    ck_assert_msg(networking_set_recv_batch(net2, 8) == 0, "Failed to enable batched receive");
+
+    networking_registerhandler(net2, 200, &handle_batch_test_packet, NULL);
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.port = net2->port;
+
+    uint8_t packet[100] = {200};
+    uint32_t i;
+
+    /* More than two batches worth, so that networking_poll() has to refill the ring. */
+    for (i = 0; i < 20; ++i) {
+        packet[1] = i;
+        ck_assert_msg(sendpacket(net1, ip_port, packet, sizeof(packet)) == sizeof(packet), "sendpacket failed");
+    }
+
+    batch_packets_received = 0;
+    networking_poll(net2, NULL);
+    ck_assert_msg(batch_packets_received == 20, "Expected 20 packets in order, got %u", batch_packets_received);
+
+    ck_assert_msg(networking_set_recv_batch(net2, 0) == 0, "Failed to disable batched receive");
+
+    packet[1] = 20;
+    sendpacket(net1, ip_port, packet, sizeof(packet));
+    networking_poll(net2, NULL);
+    ck_assert_msg(batch_packets_received == 21, "Unbatched receive failed after disabling batching");
+
+    kill_networking(net1);
+    kill_networking(net2);
+}
+END_TEST
+
+START_TEST(test_send_batch)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    Networking_Core *net1 = new_networking(NULL, ip, TOX_PORTRANGE_FROM);
+    Networking_Core *net2 = new_networking(NULL, ip, TOX_PORTRANGE_FROM);
+    ck_assert_msg(net1 && net2, "Failed to create networking");
+
+    ck_assert_msg(networking_set_send_batch(net1, MAX_SEND_BATCH_SIZE + 1) == -1, "Oversized queue accepted");
+    ck_assert_msg(networking_set_send_batch(net1, 16) == 0, "Failed to enable transmit queue");
+
+    networking_registerhandler(net2, 200, &handle_batch_test_packet, NULL);
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.port = net2->port;
+
+    uint8_t packet[100] = {200};
+    uint32_t i;
+
+    for (i = 0; i < 40; ++i) {
+        packet[1] = i;
+        ck_assert_msg(sendpacket(net1, ip_port, packet, sizeof(packet)) == sizeof(packet), "sendpacket failed");
+    }
+
+    /* Two full queues went out on their own, the rest waits for a flush. */
+    ck_assert_msg(net1->send_stats.packets == 32, "Expected 32 packets flushed, got %llu",
+                  (unsigned long long)net1->send_stats.packets);
+    ck_assert_msg(net1->send_stats.syscalls < net1->send_stats.packets, "Queue didn't save any syscalls");
+
+    batch_packets_received = 0;
+    networking_poll(net2, NULL);
+    ck_assert_msg(batch_packets_received == 32, "Expected 32 packets in order, got %u", batch_packets_received);
+
+    networking_flush(net1);
+    ck_assert_msg(net1->send_stats.packets == 40, "Flush didn't send the remaining packets");
+    ck_assert_msg(net1->send_stats.last_flush_packets == 8, "Wrong last flush packet count");
+
+    networking_poll(net2, NULL);
+    ck_assert_msg(batch_packets_received == 40, "Expected 40 packets in order, got %u", batch_packets_received);
+
+    kill_networking(net1);
+    kill_networking(net2);
+}
+END_TEST
+
+#define CRYPTO_TEST_SENDERS 3
+#define CRYPTO_TEST_PACKETS 300
+
+static uint32_t crypto_packets_received[CRYPTO_TEST_SENDERS];
+static uint32_t crypto_packets_out_of_order;
+
+/* "Decrypts" by flipping bits, rejecting packets with the 4th byte set. */
+static int decrypt_crypto_test_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
+                                      uint8_t *plain)
+{
+    if (length != 100 || packet[3] != 0) {
+        return -1;
+    }
+
+    uint16_t i;
+
+    for (i = 1; i < length; ++i) {
+        plain[i - 1] = packet[i] ^ 0x55;
+    }
+
+    return length - 1;
+}
+
+static int handle_crypto_test_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
+                                     const uint8_t *plain, uint16_t plain_length, void *userdata)
+{
+    uint8_t sender = plain[0] ^ 0x55;
+    uint8_t number = plain[1] ^ 0x55;
+
+    if (plain_length != 99 || sender >= CRYPTO_TEST_SENDERS || packet[1] != sender) {
+        return 1;
+    }
+
+    /* Every 10th packet is rejected by the decrypt callback. */
+    if (number != (uint8_t)(crypto_packets_received[sender] + crypto_packets_received[sender] / 9)) {
+        ++crypto_packets_out_of_order;
+    }
+
+    ++crypto_packets_received[sender];
+    return 0;
+}
+
+START_TEST(test_crypto_workers)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    Networking_Core *senders[CRYPTO_TEST_SENDERS];
+    Networking_Core *net = new_networking(NULL, ip, TOX_PORTRANGE_FROM);
+    ck_assert_msg(net != NULL, "Failed to create networking");
+
+    uint32_t i, j;
+
+    for (i = 0; i < CRYPTO_TEST_SENDERS; ++i) {
+        senders[i] = new_networking(NULL, ip, TOX_PORTRANGE_FROM);
+        ck_assert_msg(senders[i] != NULL, "Failed to create networking");
+    }
+
+    ck_assert_msg(networking_set_crypto_workers(net, MAX_CRYPTO_WORKERS + 1) == -1, "Too many workers accepted");
+    ck_assert_msg(networking_set_crypto_workers(net, 4) == 0, "Failed to start crypto workers");
+
+    networking_registerhandler_decrypt(net, 200, &decrypt_crypto_test_packet, &handle_crypto_test_packet, NULL);
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.port = net->port;
+
+    /* Interleaved, and more than a worker's queue holds. */
+    for (j = 0; j < CRYPTO_TEST_PACKETS; ++j) {
+        for (i = 0; i < CRYPTO_TEST_SENDERS; ++i) {
+            uint8_t packet[100] = {200, i, (uint8_t)j, j % 10 == 9};
+            ck_assert_msg(sendpacket(senders[i], ip_port, packet, sizeof(packet)) == sizeof(packet), "sendpacket failed");
+        }
+    }
+
+    memset(crypto_packets_received, 0, sizeof(crypto_packets_received));
+    crypto_packets_out_of_order = 0;
+    networking_poll(net, NULL);
+
+    for (i = 0; i < CRYPTO_TEST_SENDERS; ++i) {
+        ck_assert_msg(crypto_packets_received[i] == CRYPTO_TEST_PACKETS * 9 / 10, "sender %u: %u packets handled", i,
+                      crypto_packets_received[i]);
+    }
+
+    ck_assert_msg(crypto_packets_out_of_order == 0, "%u packets handled out of order", crypto_packets_out_of_order);
+
+    /* Without workers the same handlers run inline. */
+    ck_assert_msg(networking_set_crypto_workers(net, 0) == 0, "Failed to stop crypto workers");
+    uint8_t packet[100] = {200, 0, (uint8_t)CRYPTO_TEST_PACKETS};
+    sendpacket(senders[0], ip_port, packet, sizeof(packet));
+    networking_poll(net, NULL);
+    ck_assert_msg(crypto_packets_received[0] == CRYPTO_TEST_PACKETS * 9 / 10 + 1, "Inline decrypt failed");
+    ck_assert_msg(crypto_packets_out_of_order == 0, "Inline packet handled out of order");
+
+    for (i = 0; i < CRYPTO_TEST_SENDERS; ++i) {
+        kill_networking(senders[i]);
+    }
+
+    kill_networking(net);
+}
+END_TEST
+
+START_TEST(test_reuseport)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    ck_assert_msg(new_networking_reuseport(NULL, ip, 0, NULL) == NULL, "Port 0 accepted");
+
+    Networking_Core *net1 = new_networking_reuseport(NULL, ip, TOX_PORTRANGE_TO, NULL);
+    ck_assert_msg(net1 != NULL, "Failed to create networking");
+
+    Networking_Core *net2 = new_networking_reuseport(NULL, ip, TOX_PORTRANGE_TO, NULL);
+    ck_assert_msg(net2 != NULL, "Failed to share port with SO_REUSEPORT");
+    ck_assert_msg(net1->port == net2->port, "Sockets bound to different ports");
+
+    /* A packet handed over from another socket reaches the same handler. */
+    networking_registerhandler(net1, 200, &handle_batch_test_packet, NULL);
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.port = net2->port;
+
+    uint8_t packet[100] = {200};
+    batch_packets_received = 0;
+    networking_dispatch(net1, ip_port, packet, sizeof(packet), NULL);
+    ck_assert_msg(batch_packets_received == 1, "Dispatched packet not handled");
+
+    kill_networking(net1);
+    kill_networking(net2);
+}
+END_TEST
+
+START_TEST(test_networking_wait)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    Networking_Core *net1 = new_networking(NULL, ip, TOX_PORTRANGE_FROM);
+    Networking_Core *net2 = new_networking(NULL, ip, TOX_PORTRANGE_FROM);
+    ck_assert_msg(net1 && net2, "Failed to create networking");
+
+    sock_t socks[2] = {net1->sock, net2->sock};
+
+    uint64_t start = current_time_monotonic();
+    ck_assert_msg(networking_wait(NULL, socks, 2, 100) == 0, "Woke up without a packet");
+    ck_assert_msg(current_time_monotonic() - start >= 90, "Didn't wait for the timeout");
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.port = net2->port;
+
+    uint8_t packet[100] = {200};
+    sendpacket(net1, ip_port, packet, sizeof(packet));
+
+    start = current_time_monotonic();
+    ck_assert_msg(networking_wait(net1, socks, 2, 10000) == 1, "Didn't wake up for a packet");
+    ck_assert_msg(current_time_monotonic() - start < 5000, "Waited for the timeout despite a packet");
+
+    kill_networking(net1);
+    kill_networking(net2);
+}
+END_TEST
+
+#define NUM_INDEX_KEYS 1000
+
+static _Bool key_match(const void *object, uint32_t index, const void *key)
+{
+    const uint8_t (*keys)[32] = object;
+    return memcmp(keys[index], key, sizeof(keys[index])) == 0;
+}
+
+START_TEST(test_key_index)
+{
+    static uint8_t keys[NUM_INDEX_KEYS][32];
+    static uint32_t hashes[NUM_INDEX_KEYS];
+    Key_Index key_index;
+    memset(&key_index, 0, sizeof(key_index));
+    uint64_t seed = random_64b();
+    uint32_t i, j;
+
+    /* Keys only differing in their last bytes still get different hashes. */
+    for (i = 0; i < NUM_INDEX_KEYS; ++i) {
+        keys[i][30] = i >> 8;
+        keys[i][31] = i;
+        hashes[i] = key_index_hash(seed, keys[i], sizeof(keys[i]));
+        ck_assert_msg(key_index_add(&key_index, hashes[i], i) == 0, "Failed to add key %u", i);
+    }
+
+    uint32_t collisions = 0;
+
+    for (i = 0; i < NUM_INDEX_KEYS; ++i) {
+        for (j = i + 1; j < NUM_INDEX_KEYS; ++j) {
+            collisions += hashes[i] == hashes[j];
+        }
+    }
+
+    ck_assert_msg(collisions < 3, "%u hash collisions", collisions);
+
+    for (i = 0; i < NUM_INDEX_KEYS; ++i) {
+        ck_assert_msg(key_index_find(&key_index, hashes[i], &key_match, keys, keys[i]) == (int32_t)i,
+                      "Key %u not found", i);
+    }
+
+    for (i = 0; i < NUM_INDEX_KEYS; i += 2) {
+        ck_assert_msg(key_index_remove(&key_index, hashes[i], i) == 0, "Failed to remove key %u", i);
+    }
+
+    ck_assert_msg(key_index_remove(&key_index, hashes[0], 0) == -1, "Removed key 0 twice");
+
+    for (i = 0; i < NUM_INDEX_KEYS; ++i) {
+        int32_t expected = (i % 2) ? (int32_t)i : -1;
+        ck_assert_msg(key_index_find(&key_index, hashes[i], &key_match, keys, keys[i]) == expected,
+                      "Wrong lookup of key %u", i);
+    }
+
+    IP_Port ip_port1, ip_port2;
+    memset(&ip_port1, 0, sizeof(ip_port1));
+    ip_port1.ip.family = AF_INET;
+    ip_port1.ip.ip4.uint32 = htonl(0x7F000001);
+    ip_port1.port = htons(33445);
+    ip_port2 = ip_port1;
+    ip_port2.ip.ip4.uint32 = htonl(0x7F000002);
+    ck_assert_msg(key_index_hash_ip_port(seed, &ip_port1) != key_index_hash_ip_port(seed, &ip_port2),
+                  "ip_ports hashed the same");
+
+    key_index_free(&key_index);
+    ck_assert_msg(key_index.size == 0 && key_index.slots == NULL, "Key index not freed");
+}
+END_TEST
+
+#define SKETCH_BURST 4
+#define SKETCH_INTERVAL 1000
+
+START_TEST(test_key_index_sketch)
+{
+    uint64_t seed = random_64b();
+    IP ip1, ip2, ip3;
+    ip_reset(&ip1);
+    ip1.family = AF_INET6;
+    ip1.ip6.uint32[0] = htonl(0x20010DB8);
+    ip1.ip6.uint32[3] = htonl(1);
+    ip2 = ip1;
+    ip2.ip6.uint32[3] = htonl(2);
+    ip3 = ip1;
+    ip3.ip6.uint32[1] = htonl(1);
+    uint32_t hash1 = key_index_hash_source(seed, &ip1);
+    uint32_t hash3 = key_index_hash_source(seed, &ip3);
+    ck_assert_msg(hash1 == key_index_hash_source(seed, &ip2), "Addresses in one /64 are different sources");
+    ck_assert_msg(hash1 != hash3, "Addresses in different /64s are the same source");
+
+    Key_Index_Sketch *sketch = calloc(1, sizeof(Key_Index_Sketch));
+    ck_assert_msg(sketch != NULL, "Failed to allocate sketch");
+    uint64_t now = 1000000;
+    uint32_t i;
+
+    for (i = 0; i < SKETCH_BURST; ++i) {
+        ck_assert_msg(key_index_sketch_take(sketch, hash1, now, SKETCH_INTERVAL, SKETCH_BURST),
+                      "Token %u of the burst refused", i);
+    }
+
+    ck_assert_msg(!key_index_sketch_take(sketch, hash1, now, SKETCH_INTERVAL, SKETCH_BURST), "Burst exceeded");
+
+    /* Unless both of its buckets are shared with the first one, which they
+     * are one time in KEY_INDEX_SKETCH_WIDTH^2. */
+    if (((hash1 ^ hash3) & 0xFFFF) % KEY_INDEX_SKETCH_WIDTH != 0
+            || ((hash1 ^ hash3) >> 16) % KEY_INDEX_SKETCH_WIDTH != 0) {
+        ck_assert_msg(key_index_sketch_take(sketch, hash3, now, SKETCH_INTERVAL, SKETCH_BURST),
+                      "Another source was limited");
+    }
+
+    ck_assert_msg(key_index_sketch_take(sketch, hash1, now + SKETCH_INTERVAL, SKETCH_INTERVAL, SKETCH_BURST),
+                  "No token after the interval");
+    ck_assert_msg(!key_index_sketch_take(sketch, hash1, now + SKETCH_INTERVAL, SKETCH_INTERVAL, SKETCH_BURST),
+                  "More than one token after the interval");
+    free(sketch);
+}
+END_TEST
+
 static Suite *network_suite(void)
 {
     Suite *s = suite_create("Network");
 
     DEFTESTCASE(addr_resolv_localhost);
     DEFTESTCASE(ip_equal);
+    DEFTESTCASE(recv_batch);
+    DEFTESTCASE(send_batch);
+    DEFTESTCASE(crypto_workers);
+    DEFTESTCASE(reuseport);
+    DEFTESTCASE(networking_wait);
+    DEFTESTCASE(key_index);
+    DEFTESTCASE(key_index_sketch);
 
     return s;
 }
@@ -429,13 +429,14 @@ START_TEST(test_one)
 }
 END_TEST
 
-START_TEST(test_few_clients)
+/* tox2 sends the messages and files, made with options2 (the defaults if NULL). */
+static void few_clients(const struct Tox_Options *options2)
 {
     long long unsigned int con_time, cur_time = time(NULL);
     TOX_ERR_NEW t_n_error;
     Tox *tox1 = tox_new(0, &t_n_error);
     ck_assert_msg(t_n_error == TOX_ERR_NEW_OK, "wrong error");
-    Tox *tox2 = tox_new(0, &t_n_error);
+    Tox *tox2 = tox_new(options2, &t_n_error);
     ck_assert_msg(t_n_error == TOX_ERR_NEW_OK, "wrong error");
     Tox *tox3 = tox_new(0, &t_n_error);
     ck_assert_msg(t_n_error == TOX_ERR_NEW_OK, "wrong error");
@@ -520,6 +521,17 @@ START_TEST(test_few_clients)
 
     printf("tox clients messaging succeeded\n");
 
+    TOX_ERR_FRIEND_QUERY err_q;
+    Tox_Connection_Stats *stats = tox_connection_stats_new(0);
+    ck_assert_msg(stats != NULL, "tox_connection_stats_new failed");
+    ck_assert_msg(tox_friend_get_connection_stats(tox2, 0, stats, &err_q) && err_q == TOX_ERR_FRIEND_QUERY_OK,
+                  "tox_friend_get_connection_stats failed because %u\n", err_q);
+    ck_assert_msg(tox_connection_stats_get_connection(stats) == TOX_CONNECTION_UDP, "Wrong connection in stats");
+    ck_assert_msg(tox_connection_stats_get_packets_sent(stats) != 0, "No packets sent in stats");
+    tox_friend_get_connection_stats(tox2, 1, stats, &err_q);
+    ck_assert_msg(err_q == TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND, "Got stats of a missing friend");
+    tox_connection_stats_free(stats);
+
     unsigned int save_size1 = tox_get_savedata_size(tox2);
     ck_assert_msg(save_size1 != 0 && save_size1 < 4096, "save is invalid size %u", save_size1);
     printf("%u\n", save_size1);
@@ -528,7 +540,13 @@ START_TEST(test_few_clients)
     tox_kill(tox2);
 
     struct Tox_Options options;
-    tox_options_default(&options);
+
+    if (options2) {
+        options = *options2;
+    } else {
+        tox_options_default(&options);
+    }
+
     options.savedata_type = TOX_SAVEDATA_TYPE_TOX_SAVE;
     options.savedata_data = save1;
     options.savedata_length = save_size1;
@@ -834,12 +852,35 @@ START_TEST(test_few_clients)
         c_sleep(MIN(tox1_interval, MIN(tox2_interval, tox3_interval)));
     }
 
-    printf("test_few_clients succeeded, took %llu seconds\n", time(NULL) - cur_time);
+    printf("few_clients succeeded, took %llu seconds\n", time(NULL) - cur_time);
 
     tox_kill(tox1);
     tox_kill(tox2);
     tox_kill(tox3);
 }
+
+START_TEST(test_few_clients)
+{
+    few_clients(0);
+}
+END_TEST
+
+START_TEST(test_few_clients_bbr)
+{
+    struct Tox_Options options2;
+    tox_options_default(&options2);
+    tox_options_set_congestion_control(&options2, TOX_CONGESTION_CONTROL_BBR);
+    few_clients(&options2);
+}
+END_TEST
+
+START_TEST(test_few_clients_coalescing)
+{
+    struct Tox_Options options2;
+    tox_options_default(&options2);
+    tox_options_set_coalescing_enabled(&options2, 1);
+    few_clients(&options2);
+}
 END_TEST
 
 #define NUM_TOXES 90
@@ -1369,6 +1410,8 @@ static Suite *tox_suite(void)
 
     DEFTESTCASE(one);
     DEFTESTCASE_SLOW(few_clients, 8 * timeout_mux);
+    DEFTESTCASE_SLOW(few_clients_bbr, 8 * timeout_mux);
+    DEFTESTCASE_SLOW(few_clients_coalescing, 8 * timeout_mux);
     DEFTESTCASE_SLOW(many_clients, 8 * timeout_mux);
 
     /* Each tox connects to a single tox TCP    */
@@ -57,6 +57,11 @@
 
 #define PORT 33445
 
+/* Sockets the main loop waits on and, if the TCP relay has more sockets than
+ * fit, how long it waits at most (milliseconds). */
+#define MAX_WAIT_SOCKETS 1024
+#define MAX_WAIT_MILLISECONDS 30
+
 
 static void manage_keys(DHT *dht)
 {
@@ -102,8 +107,8 @@ static void manage_keys(DHT *dht)
 int main(int argc, char *argv[])
 {
     if (argc == 2 && !strncasecmp(argv[1], "-h", 3)) {
-        printf("Usage (connected)  : %s [--ipv4|--ipv6] IP PORT KEY\n", argv[0]);
-        printf("Usage (unconnected): %s [--ipv4|--ipv6]\n", argv[0]);
+        printf("Usage (connected)  : %s [--ipv4|--ipv6] [--shared-keys=N] [--crypto-workers=N] IP PORT KEY\n", argv[0]);
+        printf("Usage (unconnected): %s [--ipv4|--ipv6] [--shared-keys=N] [--crypto-workers=N]\n", argv[0]);
         exit(0);
     }
 
@@ -115,6 +120,25 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    uint32_t shared_keys_size = SHARED_KEYS_DEFAULT_SIZE;
+    int crypto_workers = 0;
+
+    while (argvoffset + 1 < argc && !strncmp(argv[argvoffset + 1], "--", 2)) {
+        const char *arg = argv[argvoffset + 1];
+
+        if (!strncmp(arg, "--shared-keys=", 14) && atoi(arg + 14) > 0) {
+            shared_keys_size = atoi(arg + 14);
+        } else if (!strncmp(arg, "--crypto-workers=", 17) && atoi(arg + 17) >= 0
+                   && atoi(arg + 17) <= MAX_CRYPTO_WORKERS) {
+            crypto_workers = atoi(arg + 17);
+        } else {
+            printf("Invalid argument: %s.\n", arg);
+            exit(1);
+        }
+
+        ++argvoffset;
+    }
+
     /* Initialize networking -
        Bind to ip 0.0.0.0 / [::] : PORT */
     IP ip;
@@ -133,6 +157,20 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    if (DHT_set_shared_keys_size(dht, shared_keys_size) == -1 || onion_set_shared_keys_size(onion, shared_keys_size) == -1
+            || onion_announce_set_shared_keys_size(onion_a, shared_keys_size) == -1) {
+        printf("Failed to allocate shared key caches of %u keys.\n", shared_keys_size);
+        exit(1);
+    }
+
+    networking_set_recv_batch(dht->net, MAX_RECV_BATCH_SIZE);
+    networking_set_send_batch(dht->net, MAX_SEND_BATCH_SIZE);
+
+    if (networking_set_crypto_workers(dht->net, crypto_workers) == -1) {
+        printf("Failed to start %d crypto workers.\n", crypto_workers);
+        exit(1);
+    }
+
     perror("Initialization");
 
     manage_keys(dht);
@@ -183,6 +221,8 @@ int main(int argc, char *argv[])
     uint64_t last_LANdiscovery = 0;
     LANdiscovery_init(dht);
 
+    sock_t socks[MAX_WAIT_SOCKETS];
+
     while (1) {
         if (is_waiting_for_dht_connection && DHT_isconnected(dht)) {
             printf("Connected to other bootstrap node successfully.\n");
@@ -201,7 +241,21 @@ int main(int argc, char *argv[])
 #endif
         networking_poll(dht->net, NULL);
 
-        c_sleep(1);
+        uint32_t num_socks = 1;
+        uint32_t interval = DHT_run_interval(dht);
+        interval = MIN(interval, timeout_remaining_ms(last_LANdiscovery,
+                       is_waiting_for_dht_connection ? 5 : LAN_DISCOVERY_INTERVAL));
+        socks[0] = dht->net->sock;
+#ifdef TCP_RELAY_ENABLED
+        num_socks += TCP_server_get_socks(tcp_s, socks + 1, MAX_WAIT_SOCKETS - 1);
+        interval = MIN(interval, TCP_server_run_interval(tcp_s));
+
+        if (num_socks == MAX_WAIT_SOCKETS) {
+            interval = MIN(interval, MAX_WAIT_MILLISECONDS);
+        }
+
+#endif
+        networking_wait(dht->net, socks, num_socks, interval);
     }
 
     return 0;
@@ -375,6 +375,21 @@ enum class SAVEDATA_TYPE {
   SECRET_KEY,
 }
 
+/**
+ * Congestion controller used to pace the data sent to friends.
+ */
+enum class CONGESTION_CONTROL {
+  /**
+   * Based on the size of the send queue.
+   */
+  CLASSIC,
+  /**
+   * Based on the bottleneck bandwidth and round trip time of the path (BBR).
+   * Only changes how fast we send, so friends don't need to support it.
+   */
+  BBR,
+}
+
 
 static class options {
   /**
@@ -491,6 +506,27 @@ static class options {
        */
       size_t length;
     }
+
+    /**
+     * The congestion controller of the connections to friends.
+     */
+    CONGESTION_CONTROL congestion_control;
+
+    /**
+     * Send small lossless packets (messages, file control) written while
+     * others wait to be acknowledged together in one packet, waiting up to
+     * 10 ms for more of them. Fewer packets are sent at the cost of some
+     * latency. Only done with friends whose client can unpack them.
+     */
+    bool coalescing_enabled;
+
+    /**
+     * Try to back the buffers of packets waiting to be sent or delivered
+     * with huge pages, which take fewer TLB entries with many busy
+     * connections. Falls back to normal memory where the system has no huge
+     * pages to give.
+     */
+    bool hugepages_enabled;
   }
 
 
@@ -812,6 +848,31 @@ const uint32_t iteration_interval();
 void iterate(any user_data);
 
 
+int32_t[size] fds {
+  /**
+   * Return the number of sockets $iterate() reads from.
+   *
+   * This function can be used to determine how much memory to allocate for
+   * $get. The number changes as TCP connections come and go, so call it again
+   * after every $iterate().
+   */
+  size();
+
+  /**
+   * Copy the sockets (file descriptors) $iterate() reads from into an array.
+   *
+   * Instead of sleeping for $iteration_interval() milliseconds between calls
+   * to $iterate(), a client can block on these sockets (e.g. with poll(),
+   * select() or epoll) for up to that time, and call $iterate() as soon as one
+   * of them is readable.
+   *
+   * @param fds A memory region with enough space to hold $size elements. If
+   *   this parameter is NULL, this function has no effect.
+   */
+  get();
+}
+
+
 /*******************************************************************************
  *
  * :: Internal client information (Tox address/id)
@@ -1408,6 +1469,180 @@ namespace friend {
 }
 
 
+/*******************************************************************************
+ *
+ * :: Friend connection statistics
+ *
+ ******************************************************************************/
+
+
+/**
+ * Transport statistics of the connection to a friend, for diagnosing slow or
+ * unreliable connections. Filled by ${friend.connection_stats.get} or passed
+ * to the `${event friend.connection_stats}` callback, and read with the
+ * accessor functions below.
+ */
+static class connection_stats {
+  struct this;
+
+  /**
+   * The smoothed round trip time to the friend in milliseconds.
+   */
+  uint64_t rtt {
+    get();
+  }
+
+  /**
+   * The time in milliseconds after which a packet not acknowledged by the
+   * friend is sent again, 0 before the first round trip time measurement.
+   */
+  uint64_t rto {
+    get();
+  }
+
+  /**
+   * The number of packets per second the connection is allowed to send.
+   */
+  uint32_t send_rate {
+    get();
+  }
+
+  /**
+   * The number of packets per second received from the friend.
+   */
+  uint32_t recv_rate {
+    get();
+  }
+
+  /**
+   * The number of lossless packets sent to the friend, not counting the
+   * packets sent again.
+   */
+  uint64_t packets_sent {
+    get();
+  }
+
+  /**
+   * The number of lossless packets sent again because they were lost.
+   */
+  uint64_t packets_resent {
+    get();
+  }
+
+  /**
+   * The number of lossless packets received from the friend.
+   */
+  uint64_t packets_received {
+    get();
+  }
+
+  /**
+   * The number of lossless packets sent but not acknowledged by the friend yet.
+   */
+  uint32_t send_queue_size {
+    get();
+  }
+
+  /**
+   * The number of lossless packets received that wait for an earlier lost
+   * packet to be delivered.
+   */
+  uint32_t recv_queue_size {
+    get();
+  }
+
+  /**
+   * The number of lossy packets waiting to be sent.
+   */
+  uint32_t lossy_queue_size {
+    get();
+  }
+
+  /**
+   * The time in milliseconds since the connection last had to slow down
+   * because packets were lost, UINT64_MAX if it never had to.
+   */
+  uint64_t time_since_congestion {
+    get();
+  }
+
+  /**
+   * Whether packets go directly to the friend over UDP or through TCP relays.
+   * $NONE if the friend is offline.
+   */
+  CONNECTION connection {
+    get();
+  }
+
+  /**
+   * The number of TCP relays the friend can be reached through.
+   */
+  uint32_t tcp_relays {
+    get();
+  }
+
+
+  /**
+   * Allocates a new $this object to pass to ${friend.connection_stats.get}.
+   *
+   * Objects returned from this function must be freed using the $free
+   * function.
+   *
+   * @return A new $this object or NULL on failure.
+   */
+  static this new() {
+    /**
+     * The function failed to allocate enough memory for the stats struct.
+     */
+    MALLOC,
+  }
+
+
+  /**
+   * Releases all resources associated with a stats object.
+   *
+   * Passing a pointer that was not returned by $new results in
+   * undefined behaviour.
+   */
+  void free();
+}
+
+
+namespace friend {
+
+  bool connection_stats {
+    /**
+     * Fill stats with the current transport statistics of the connection to a
+     * friend. All of them are 0 if the friend is offline.
+     *
+     * @param friend_number The friend number for which to query the statistics.
+     * @param stats An object returned by ${connection_stats.new}.
+     *
+     * @return true on success.
+     */
+    get(uint32_t friend_number, connection_stats_t *stats)
+        with error for query;
+  }
+
+
+  /**
+   * This event is triggered about once per second for each online friend, so
+   * clients can keep track of the connections without polling them. Nothing is
+   * gathered while no callback is set.
+   */
+  event connection_stats {
+    /**
+     * @param friend_number The friend number of the friend the statistics are
+     *   for.
+     * @param stats The result of calling ${connection_stats.get} on the passed
+     *   friend_number. Only valid during the callback.
+     */
+    typedef void(uint32_t friend_number, const connection_stats_t *stats);
+  }
+
+}
+
+
 /*******************************************************************************
  *
  * :: Sending private messages
@@ -143,7 +143,9 @@ static void parse_tcp_relay_ports_config(config_t *cfg, uint16_t **tcp_relay_por
 
 int get_general_config(const char *cfg_file_path, char **pid_file_path, char **keys_file_path, int *port,
                        int *enable_ipv6, int *enable_ipv4_fallback, int *enable_lan_discovery, int *enable_tcp_relay,
-                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *enable_motd, char **motd)
+                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *enable_motd, char **motd,
+                       int *udp_worker_threads, int *tcp_relay_threads, int *crypto_worker_threads,
+                       int *shared_keys_cache_size)
 {
     config_t cfg;
 
@@ -156,6 +158,10 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
     const char *NAME_ENABLE_TCP_RELAY     = "enable_tcp_relay";
     const char *NAME_ENABLE_MOTD          = "enable_motd";
     const char *NAME_MOTD                 = "motd";
+    const char *NAME_UDP_WORKER_THREADS   = "udp_worker_threads";
+    const char *NAME_TCP_RELAY_THREADS    = "tcp_relay_threads";
+    const char *NAME_CRYPTO_WORKER_THREADS = "crypto_worker_threads";
+    const char *NAME_SHARED_KEYS_CACHE_SIZE = "shared_keys_cache_size";
 
     config_init(&cfg);
 
@@ -259,6 +265,36 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
         (*motd)[motd_length - 1] = '\0';
     }
 
+    // Get number of UDP worker threads
+    if (config_lookup_int(&cfg, NAME_UDP_WORKER_THREADS, udp_worker_threads) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_UDP_WORKER_THREADS);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_UDP_WORKER_THREADS, DEFAULT_UDP_WORKER_THREADS);
+        *udp_worker_threads = DEFAULT_UDP_WORKER_THREADS;
+    }
+
+    // Get number of TCP relay threads
+    if (config_lookup_int(&cfg, NAME_TCP_RELAY_THREADS, tcp_relay_threads) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_TCP_RELAY_THREADS);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_TCP_RELAY_THREADS, DEFAULT_TCP_RELAY_THREADS);
+        *tcp_relay_threads = DEFAULT_TCP_RELAY_THREADS;
+    }
+
+    // Get number of crypto worker threads
+    if (config_lookup_int(&cfg, NAME_CRYPTO_WORKER_THREADS, crypto_worker_threads) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_CRYPTO_WORKER_THREADS);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_CRYPTO_WORKER_THREADS,
+                  DEFAULT_CRYPTO_WORKER_THREADS);
+        *crypto_worker_threads = DEFAULT_CRYPTO_WORKER_THREADS;
+    }
+
+    // Get size of the shared key caches
+    if (config_lookup_int(&cfg, NAME_SHARED_KEYS_CACHE_SIZE, shared_keys_cache_size) == CONFIG_FALSE) {
+        write_log(LOG_LEVEL_WARNING, "No '%s' setting in configuration file.\n", NAME_SHARED_KEYS_CACHE_SIZE);
+        write_log(LOG_LEVEL_WARNING, "Using default '%s': %d\n", NAME_SHARED_KEYS_CACHE_SIZE,
+                  DEFAULT_SHARED_KEYS_CACHE_SIZE);
+        *shared_keys_cache_size = DEFAULT_SHARED_KEYS_CACHE_SIZE;
+    }
+
     config_destroy(&cfg);
 
     write_log(LOG_LEVEL_INFO, "Successfully read:\n");
@@ -291,6 +327,11 @@ int get_general_config(const char *cfg_file_path, char **pid_file_path, char **k
         write_log(LOG_LEVEL_INFO, "'%s': %s\n", NAME_MOTD, *motd);
     }
 
+    write_log(LOG_LEVEL_INFO, "'%s': %d\n", NAME_UDP_WORKER_THREADS,   *udp_worker_threads);
+    write_log(LOG_LEVEL_INFO, "'%s': %d\n", NAME_TCP_RELAY_THREADS,    *tcp_relay_threads);
+    write_log(LOG_LEVEL_INFO, "'%s': %d\n", NAME_CRYPTO_WORKER_THREADS, *crypto_worker_threads);
+    write_log(LOG_LEVEL_INFO, "'%s': %d\n", NAME_SHARED_KEYS_CACHE_SIZE, *shared_keys_cache_size);
+
     return 1;
 }
 
@@ -39,7 +39,9 @@
  */
 int get_general_config(const char *cfg_file_path, char **pid_file_path, char **keys_file_path, int *port,
                        int *enable_ipv6, int *enable_ipv4_fallback, int *enable_lan_discovery, int *enable_tcp_relay,
-                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *enable_motd, char **motd);
+                       uint16_t **tcp_relay_ports, int *tcp_relay_port_count, int *enable_motd, char **motd,
+                       int *udp_worker_threads, int *tcp_relay_threads, int *crypto_worker_threads,
+                       int *shared_keys_cache_size);
 
 /**
  * Bootstraps off nodes listed in the config file.
@@ -38,5 +38,9 @@
 #define DEFAULT_TCP_RELAY_PORTS_COUNT 3
 #define DEFAULT_ENABLE_MOTD           1 // 1 - true, 0 - false
 #define DEFAULT_MOTD                  DAEMON_NAME
+#define DEFAULT_UDP_WORKER_THREADS    0 // 0 - handle all UDP packets on the main thread
+#define DEFAULT_TCP_RELAY_THREADS     0 // 0 - run the TCP relay on the main thread
+#define DEFAULT_CRYPTO_WORKER_THREADS 0 // 0 - decrypt UDP packets on the thread that received them
+#define DEFAULT_SHARED_KEYS_CACHE_SIZE 2048 // same as toxcore's SHARED_KEYS_DEFAULT_SIZE
 
 #endif // CONFIG_DEFAULTS_H
@@ -31,4 +31,11 @@
 #define MIN_ALLOWED_PORT 1
 #define MAX_ALLOWED_PORT 65535
 
+#define UDP_RECV_BATCH_SIZE 32  // datagrams read per syscall by networking_poll()
+#define UDP_SEND_BATCH_SIZE 128 // datagrams gathered per flush of the transmit queue
+
+#define MAX_UDP_WORKER_THREADS 64
+#define MAX_TCP_RELAY_THREADS 64
+#define MAX_SHARED_KEYS_CACHE_SIZE 1048576 // 64 MiB per cache, the DHT and onion use six
+
 #endif // GLOBAL_H
@@ -0,0 +1,435 @@
+/* shards.c
+ *
+ * Tox DHT bootstrap daemon.
+ * Worker threads sharing the DHT's UDP port through SO_REUSEPORT.
+ *
+ *  Copyright (C) 2014-2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "shards.h"
+
+#include "../../../toxcore/ping.h"
+#include "../../../toxcore/util.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Packets a worker can hand to the main loop between two do_shards() calls
+#define SHARD_QUEUE_SIZE 512
+
+// How often the workers' copy of the DHT's nodes is refreshed, in seconds
+#define NODES_SNAPSHOT_INTERVAL 1
+
+// How long a worker waits for packets before checking whether it should stop, in milliseconds
+#define WORKER_POLL_TIMEOUT 100
+
+enum {
+    FORWARD_PACKET,    // dispatch data to the DHT's handlers
+    FORWARD_SEEN_NODE, // pass the public key in data and source on to add_to_ping()
+};
+
+typedef struct {
+    uint8_t  type;
+    IP_Port  source;
+    uint16_t length;
+    uint8_t  data[MAX_UDP_PACKET_SIZE];
+} Forward_Entry;
+
+typedef struct {
+    Shards *shards;
+    Networking_Core *net;
+
+    pthread_t thread;
+    uint8_t thread_started;
+
+    /* The worker fills queue; do_shards() swaps it with spare and empties
+     * that, so the lock is never held while the DHT handles packets. */
+    pthread_mutex_t queue_mutex;
+    Forward_Entry *queue;
+    Forward_Entry *spare;
+    uint32_t queue_count;
+    Shard_Stats stats;
+} Shard;
+
+struct Shards {
+    DHT *dht;
+
+    pthread_rwlock_t nodes_lock;
+    Client_data *nodes;
+    uint32_t num_nodes;
+    uint32_t nodes_capacity;
+    Client_data *spare_nodes;
+    uint32_t spare_capacity;
+    uint64_t last_snapshot;
+
+    volatile uint8_t stop;
+
+    /* Workers write a byte to wakeup[1] when their queue stops being empty. */
+    int wakeup[2];
+
+    Shard *workers;
+    unsigned int num_workers;
+};
+
+/* Queue an entry for the main loop, dropping it if the main loop fell behind.
+ *
+ * return 0 on success.
+ * return -1 if the queue is full.
+ */
+static int forward(Shard *shard, uint8_t type, IP_Port source, const uint8_t *data, uint16_t length)
+{
+    pthread_mutex_lock(&shard->queue_mutex);
+
+    if (type == FORWARD_SEEN_NODE) {
+        ++shard->stats.packets_answered;
+    }
+
+    if (shard->queue_count == SHARD_QUEUE_SIZE) {
+        ++shard->stats.packets_dropped;
+        pthread_mutex_unlock(&shard->queue_mutex);
+        return -1;
+    }
+
+    if (shard->queue_count == 0) {
+        uint8_t byte = 0;
+
+        if (write(shard->shards->wakeup[1], &byte, 1) != 1) {
+            // The pipe being full means the main loop is awake anyway.
+        }
+    }
+
+    Forward_Entry *entry = &shard->queue[shard->queue_count];
+    entry->type = type;
+    entry->source = source;
+    entry->length = length;
+    memcpy(entry->data, data, length);
+    ++shard->queue_count;
+
+    if (type == FORWARD_PACKET) {
+        ++shard->stats.packets_forwarded;
+    }
+
+    pthread_mutex_unlock(&shard->queue_mutex);
+    return 0;
+}
+
+static int handle_forward(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    forward(object, FORWARD_PACKET, source, packet, length);
+    return 0;
+}
+
+static int handle_getnodes(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    Shard *shard = object;
+    Shards *shards = shard->shards;
+
+    pthread_rwlock_rdlock(&shards->nodes_lock);
+    int ret = DHT_answer_getnodes(shards->dht, shard->net, shards->dht->shared_keys_recv, shards->nodes,
+                                  shards->num_nodes, source, packet, length);
+    pthread_rwlock_unlock(&shards->nodes_lock);
+
+    if (ret == -1) {
+        return 1;
+    }
+
+    forward(shard, FORWARD_SEEN_NODE, source, packet + 1, crypto_box_PUBLICKEYBYTES);
+    return 0;
+}
+
+static int handle_ping_request(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    Shard *shard = object;
+    DHT *dht = shard->shards->dht;
+
+    if (ping_answer_request(dht, shard->net, dht->shared_keys_recv, source, packet, length) == -1) {
+        return 1;
+    }
+
+    forward(shard, FORWARD_SEEN_NODE, source, packet + 1, crypto_box_PUBLICKEYBYTES);
+    return 0;
+}
+
+static void *worker_thread(void *arg)
+{
+    Shard *shard = arg;
+
+    while (!shard->shards->stop) {
+        struct pollfd fd;
+        fd.fd = shard->net->sock;
+        fd.events = POLLIN;
+        fd.revents = 0;
+
+        if (poll(&fd, 1, WORKER_POLL_TIMEOUT) > 0) {
+            networking_poll(shard->net, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+/* Copy the DHT's nodes into the spare list and swap it in for the workers.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int refresh_nodes(Shards *shards)
+{
+    const DHT *dht = shards->dht;
+    uint32_t needed = LCLIENT_LIST + dht->num_friends * MAX_FRIEND_CLIENTS;
+
+    if (shards->spare_capacity < needed) {
+        Client_data *temp = realloc(shards->spare_nodes, needed * sizeof(Client_data));
+
+        if (temp == NULL) {
+            return -1;
+        }
+
+        shards->spare_nodes = temp;
+        shards->spare_capacity = needed;
+    }
+
+    uint32_t num = DHT_copy_nodes(dht, shards->spare_nodes, shards->spare_capacity);
+
+    pthread_rwlock_wrlock(&shards->nodes_lock);
+    Client_data *old = shards->nodes;
+    uint32_t old_capacity = shards->nodes_capacity;
+    shards->nodes = shards->spare_nodes;
+    shards->nodes_capacity = shards->spare_capacity;
+    shards->num_nodes = num;
+    pthread_rwlock_unlock(&shards->nodes_lock);
+
+    shards->spare_nodes = old;
+    shards->spare_capacity = old_capacity;
+    return 0;
+}
+
+static void empty_queue(Shards *shards, Shard *shard)
+{
+    pthread_mutex_lock(&shard->queue_mutex);
+    Forward_Entry *entries = shard->queue;
+    uint32_t count = shard->queue_count;
+    shard->queue = shard->spare;
+    shard->spare = entries;
+    shard->queue_count = 0;
+    pthread_mutex_unlock(&shard->queue_mutex);
+
+    uint32_t i;
+
+    for (i = 0; i < count; ++i) {
+        const Forward_Entry *entry = &entries[i];
+
+        if (entry->type == FORWARD_PACKET) {
+            networking_dispatch(shards->dht->net, entry->source, entry->data, entry->length, NULL);
+        } else {
+            add_to_ping(shards->dht->ping, entry->data, entry->source);
+        }
+    }
+}
+
+void do_shards(Shards *shards)
+{
+    uint8_t buf[64];
+
+    while (read(shards->wakeup[0], buf, sizeof(buf)) > 0) {
+        // Drain the pipe, the queues are checked below anyway.
+    }
+
+    if (is_timeout(shards->last_snapshot, NODES_SNAPSHOT_INTERVAL)) {
+        if (refresh_nodes(shards) == 0) {
+            shards->last_snapshot = unix_time();
+        }
+    }
+
+    unsigned int i;
+
+    for (i = 0; i < shards->num_workers; ++i) {
+        empty_queue(shards, &shards->workers[i]);
+    }
+
+    networking_flush(shards->dht->net);
+}
+
+int shards_get_fd(const Shards *shards)
+{
+    return shards->wakeup[0];
+}
+
+void shards_get_stats(Shards *shards, Shard_Stats *stats)
+{
+    memset(stats, 0, sizeof(Shard_Stats));
+
+    unsigned int i;
+
+    for (i = 0; i < shards->num_workers; ++i) {
+        Shard *shard = &shards->workers[i];
+
+        pthread_mutex_lock(&shard->queue_mutex);
+        stats->packets_answered += shard->stats.packets_answered;
+        stats->packets_forwarded += shard->stats.packets_forwarded;
+        stats->packets_dropped += shard->stats.packets_dropped;
+        pthread_mutex_unlock(&shard->queue_mutex);
+    }
+}
+
+/* return 0 on success.
+ * return -1 on failure.
+ */
+static int init_shard(Shards *shards, Shard *shard, IP ip)
+{
+    if (pthread_mutex_init(&shard->queue_mutex, NULL) != 0) {
+        return -1;
+    }
+
+    shard->shards = shards;
+
+    shard->queue = calloc(SHARD_QUEUE_SIZE, sizeof(Forward_Entry));
+    shard->spare = calloc(SHARD_QUEUE_SIZE, sizeof(Forward_Entry));
+
+    if (shard->queue == NULL || shard->spare == NULL) {
+        return -1;
+    }
+
+    shard->net = new_networking_reuseport(NULL, ip, ntohs(shards->dht->net->port), NULL);
+
+    if (shard->net == NULL) {
+        return -1;
+    }
+
+    unsigned int i;
+
+    for (i = 0; i < 256; ++i) {
+        networking_registerhandler(shard->net, i, &handle_forward, shard);
+    }
+
+    networking_registerhandler(shard->net, NET_PACKET_GET_NODES, &handle_getnodes, shard);
+    networking_registerhandler(shard->net, NET_PACKET_PING_REQUEST, &handle_ping_request, shard);
+    networking_set_recv_batch(shard->net, MAX_RECV_BATCH_SIZE);
+    return 0;
+}
+
+Shards *new_shards(DHT *dht, IP ip, unsigned int num_workers)
+{
+    if (num_workers == 0) {
+        return NULL;
+    }
+
+    Shards *shards = calloc(1, sizeof(Shards));
+
+    if (shards == NULL) {
+        return NULL;
+    }
+
+    shards->dht = dht;
+
+    if (pipe(shards->wakeup) != 0) {
+        free(shards);
+        return NULL;
+    }
+
+    if (pthread_rwlock_init(&shards->nodes_lock, NULL) != 0) {
+        close(shards->wakeup[0]);
+        close(shards->wakeup[1]);
+        free(shards);
+        return NULL;
+    }
+
+    fcntl(shards->wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(shards->wakeup[1], F_SETFL, O_NONBLOCK);
+
+    shards->workers = calloc(num_workers, sizeof(Shard));
+
+    if (shards->workers == NULL) {
+        pthread_rwlock_destroy(&shards->nodes_lock);
+        close(shards->wakeup[0]);
+        close(shards->wakeup[1]);
+        free(shards);
+        return NULL;
+    }
+
+    shards->num_workers = num_workers;
+
+    if (refresh_nodes(shards) == -1) {
+        kill_shards(shards);
+        return NULL;
+    }
+
+    shards->last_snapshot = unix_time();
+
+    unsigned int i;
+
+    for (i = 0; i < num_workers; ++i) {
+        if (init_shard(shards, &shards->workers[i], ip) == -1) {
+            kill_shards(shards);
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < num_workers; ++i) {
+        Shard *shard = &shards->workers[i];
+
+        if (pthread_create(&shard->thread, NULL, &worker_thread, shard) != 0) {
+            kill_shards(shards);
+            return NULL;
+        }
+
+        shard->thread_started = 1;
+    }
+
+    return shards;
+}
+
+void kill_shards(Shards *shards)
+{
+    if (shards == NULL) {
+        return;
+    }
+
+    shards->stop = 1;
+
+    unsigned int i;
+
+    for (i = 0; i < shards->num_workers; ++i) {
+        Shard *shard = &shards->workers[i];
+
+        if (shard->thread_started) {
+            pthread_join(shard->thread, NULL);
+        }
+
+        if (shard->shards != NULL) {
+            kill_networking(shard->net);
+            pthread_mutex_destroy(&shard->queue_mutex);
+        }
+
+        free(shard->queue);
+        free(shard->spare);
+    }
+
+    free(shards->workers);
+    free(shards->nodes);
+    free(shards->spare_nodes);
+    pthread_rwlock_destroy(&shards->nodes_lock);
+    close(shards->wakeup[0]);
+    close(shards->wakeup[1]);
+    free(shards);
+}
@@ -0,0 +1,84 @@
+/* shards.h
+ *
+ * Tox DHT bootstrap daemon.
+ * Worker threads sharing the DHT's UDP port through SO_REUSEPORT.
+ *
+ *  Copyright (C) 2014-2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SHARDS_H
+#define SHARDS_H
+
+#include "../../../toxcore/DHT.h"
+
+/*
+ * The DHT itself stays single threaded: its Networking_Core must have been
+ * created with new_networking_reuseport() and is polled by the main loop as
+ * usual. Each worker owns one more socket bound to the same port, so the
+ * kernel spreads incoming datagrams over the main loop and the workers by
+ * source address.
+ *
+ * Workers answer getnodes and ping requests themselves, which only needs the
+ * DHT's keys, a read-mostly copy of the DHT's nodes (refreshed by
+ * do_shards()) and the DHT's shared key cache, which is thread safe. Every
+ * other packet is handed to the main loop and dispatched to the DHT's own
+ * handlers there.
+ */
+
+typedef struct Shards Shards;
+
+typedef struct {
+    uint64_t packets_answered;  // getnodes and ping requests answered by the worker
+    uint64_t packets_forwarded; // packets handed to the main loop
+    uint64_t packets_dropped;   // packets (or seen nodes) not handed over because the main loop fell behind
+} Shard_Stats;
+
+/**
+ * Starts num_workers worker threads sharing dht's port.
+ *
+ * @param dht DHT whose Networking_Core was created with new_networking_reuseport().
+ * @param ip IP the DHT's socket is bound to.
+ * @param num_workers Number of worker threads to start.
+ * @return Shards on success, NULL on failure.
+ */
+Shards *new_shards(DHT *dht, IP ip, unsigned int num_workers);
+
+/**
+ * Refreshes the workers' copy of the DHT's nodes and dispatches the packets
+ * they handed over. Call this from the main loop, next to do_DHT().
+ */
+void do_shards(Shards *shards);
+
+/**
+ * Gets a file descriptor that becomes readable when the workers handed over
+ * packets, for the main loop to wait on next to the DHT's socket.
+ */
+int shards_get_fd(const Shards *shards);
+
+/**
+ * Sums up the counters of all workers.
+ */
+void shards_get_stats(Shards *shards, Shard_Stats *stats);
+
+/**
+ * Stops the worker threads and releases all resources.
+ */
+void kill_shards(Shards *shards);
+
+#endif // SHARDS_H
@@ -44,9 +44,14 @@
 #include "config.h"
 #include "global.h"
 #include "log.h"
+#include "shards.h"
 
 
-#define SLEEP_MILLISECONDS(MS) usleep(1000*MS)
+// Sockets the main loop waits on: the UDP socket, the UDP worker threads' wakeup fd and the TCP relay's sockets
+#define MAX_WAIT_SOCKETS 1024
+
+// If not all of the TCP relay's sockets fit (it's built without epoll and very busy), don't wait any longer than this
+#define MAX_WAIT_MILLISECONDS 30
 
 // Uses the already existing key or creates one if it didn't exist
 //
@@ -112,6 +117,17 @@ static void print_public_key(const uint8_t *public_key)
     write_log(LOG_LEVEL_INFO, "Public Key: %s\n", buffer);
 }
 
+// Creates the UDP socket, letting UDP worker threads share its port if there are any
+
+static Networking_Core *new_daemon_networking(IP ip, int port, int udp_worker_threads)
+{
+    if (udp_worker_threads > 0) {
+        return new_networking_reuseport(NULL, ip, port, NULL);
+    }
+
+    return new_networking(NULL, ip, port);
+}
+
 // Demonizes the process, appending PID to the PID file and closing file descriptors based on log backend
 // Terminates the application if the daemonization fails.
 
@@ -200,9 +216,15 @@ int main(int argc, char *argv[])
     int tcp_relay_port_count;
     int enable_motd;
     char *motd;
+    int udp_worker_threads;
+    int tcp_relay_threads;
+    int crypto_worker_threads;
+    int shared_keys_cache_size;
 
     if (get_general_config(cfg_file_path, &pid_file_path, &keys_file_path, &port, &enable_ipv6, &enable_ipv4_fallback,
-                           &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count, &enable_motd, &motd)) {
+                           &enable_lan_discovery, &enable_tcp_relay, &tcp_relay_ports, &tcp_relay_port_count, &enable_motd, &motd,
+                           &udp_worker_threads, &tcp_relay_threads, &crypto_worker_threads,
+                           &shared_keys_cache_size)) {
         write_log(LOG_LEVEL_INFO, "General config read successfully\n");
     } else {
         write_log(LOG_LEVEL_ERROR, "Couldn't read config file: %s. Exiting.\n", cfg_file_path);
@@ -215,6 +237,30 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (udp_worker_threads < 0 || udp_worker_threads > MAX_UDP_WORKER_THREADS) {
+        write_log(LOG_LEVEL_ERROR, "Invalid number of UDP worker threads: %d, should be in [0, %d]. Exiting.\n",
+                  udp_worker_threads, MAX_UDP_WORKER_THREADS);
+        return 1;
+    }
+
+    if (tcp_relay_threads < 0 || tcp_relay_threads > MAX_TCP_RELAY_THREADS) {
+        write_log(LOG_LEVEL_ERROR, "Invalid number of TCP relay threads: %d, should be in [0, %d]. Exiting.\n",
+                  tcp_relay_threads, MAX_TCP_RELAY_THREADS);
+        return 1;
+    }
+
+    if (crypto_worker_threads < 0 || crypto_worker_threads > MAX_CRYPTO_WORKERS) {
+        write_log(LOG_LEVEL_ERROR, "Invalid number of crypto worker threads: %d, should be in [0, %d]. Exiting.\n",
+                  crypto_worker_threads, MAX_CRYPTO_WORKERS);
+        return 1;
+    }
+
+    if (shared_keys_cache_size < 1 || shared_keys_cache_size > MAX_SHARED_KEYS_CACHE_SIZE) {
+        write_log(LOG_LEVEL_ERROR, "Invalid shared key cache size: %d, should be in [1, %d]. Exiting.\n",
+                  shared_keys_cache_size, MAX_SHARED_KEYS_CACHE_SIZE);
+        return 1;
+    }
+
     if (!run_in_foreground) {
         daemonize(log_backend, pid_file_path);
     }
@@ -224,14 +270,14 @@ int main(int argc, char *argv[])
     IP ip;
     ip_init(&ip, enable_ipv6);
 
-    Networking_Core *net = new_networking(NULL, ip, port);
+    Networking_Core *net = new_daemon_networking(ip, port, udp_worker_threads);
 
     if (net == NULL) {
         if (enable_ipv6 && enable_ipv4_fallback) {
             write_log(LOG_LEVEL_WARNING, "Couldn't initialize IPv6 networking. Falling back to using IPv4.\n");
             enable_ipv6 = 0;
             ip_init(&ip, enable_ipv6);
-            net = new_networking(NULL, ip, port);
+            net = new_daemon_networking(ip, port, udp_worker_threads);
 
             if (net == NULL) {
                 write_log(LOG_LEVEL_ERROR, "Couldn't fallback to IPv4. Exiting.\n");
@@ -243,6 +289,18 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (networking_set_recv_batch(net, UDP_RECV_BATCH_SIZE) == -1) {
+        write_log(LOG_LEVEL_WARNING, "Couldn't enable batched UDP receive.\n");
+    }
+
+    if (networking_set_send_batch(net, UDP_SEND_BATCH_SIZE) == -1) {
+        write_log(LOG_LEVEL_WARNING, "Couldn't enable batched UDP send.\n");
+    }
+
+    if (crypto_worker_threads > 0 && networking_set_crypto_workers(net, crypto_worker_threads) == -1) {
+        write_log(LOG_LEVEL_WARNING, "Couldn't start %d crypto worker threads.\n", crypto_worker_threads);
+    }
+
     DHT *dht = new_DHT(NULL, net);
 
     if (dht == NULL) {
@@ -258,6 +316,13 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (DHT_set_shared_keys_size(dht, shared_keys_cache_size) == -1
+            || onion_set_shared_keys_size(onion, shared_keys_cache_size) == -1
+            || onion_announce_set_shared_keys_size(onion_a, shared_keys_cache_size) == -1) {
+        write_log(LOG_LEVEL_ERROR, "Couldn't allocate shared key caches of %d keys. Exiting.\n", shared_keys_cache_size);
+        return 1;
+    }
+
     if (enable_motd) {
         if (bootstrap_set_callbacks(dht->net, DAEMON_VERSION_NUMBER, (uint8_t *)motd, strlen(motd) + 1) == 0) {
             write_log(LOG_LEVEL_INFO, "Set MOTD successfully.\n");
@@ -286,7 +351,12 @@ int main(int argc, char *argv[])
             return 1;
         }
 
-        tcp_server = new_TCP_server(enable_ipv6, tcp_relay_port_count, tcp_relay_ports, dht->self_secret_key, onion);
+        if (tcp_relay_threads > 0) {
+            tcp_server = new_TCP_server_threaded(enable_ipv6, tcp_relay_port_count, tcp_relay_ports, dht->self_secret_key,
+                                                 onion, tcp_relay_threads);
+        } else {
+            tcp_server = new_TCP_server(enable_ipv6, tcp_relay_port_count, tcp_relay_ports, dht->self_secret_key, onion);
+        }
 
         // tcp_relay_port_count != 0 at this point
         free(tcp_relay_ports);
@@ -306,6 +376,19 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    Shards *shards = NULL;
+
+    if (udp_worker_threads > 0) {
+        shards = new_shards(dht, ip, udp_worker_threads);
+
+        if (shards != NULL) {
+            write_log(LOG_LEVEL_INFO, "Started %d UDP worker threads successfully.\n", udp_worker_threads);
+        } else {
+            write_log(LOG_LEVEL_ERROR, "Couldn't start UDP worker threads. Exiting.\n");
+            return 1;
+        }
+    }
+
     print_public_key(dht->self_public_key);
 
     uint64_t last_LANdiscovery = 0;
@@ -318,6 +401,8 @@ int main(int argc, char *argv[])
         write_log(LOG_LEVEL_INFO, "Initialized LAN discovery successfully.\n");
     }
 
+    sock_t socks[MAX_WAIT_SOCKETS];
+
     while (1) {
         do_DHT(dht);
 
@@ -332,12 +417,39 @@ int main(int argc, char *argv[])
 
         networking_poll(dht->net, NULL);
 
+        if (shards != NULL) {
+            do_shards(shards);
+        }
+
         if (waiting_for_dht_connection && DHT_isconnected(dht)) {
             write_log(LOG_LEVEL_INFO, "Connected to another bootstrap node successfully.\n");
             waiting_for_dht_connection = 0;
         }
 
-        SLEEP_MILLISECONDS(30);
+        // Block until a socket is readable or something is due
+        uint32_t num_socks = 0;
+        uint32_t interval = DHT_run_interval(dht);
+
+        socks[num_socks++] = dht->net->sock;
+
+        if (shards != NULL) {
+            socks[num_socks++] = shards_get_fd(shards);
+        }
+
+        if (enable_lan_discovery) {
+            interval = MIN(interval, timeout_remaining_ms(last_LANdiscovery, LAN_DISCOVERY_INTERVAL));
+        }
+
+        if (enable_tcp_relay) {
+            num_socks += TCP_server_get_socks(tcp_server, socks + num_socks, MAX_WAIT_SOCKETS - num_socks);
+            interval = MIN(interval, TCP_server_run_interval(tcp_server));
+        }
+
+        if (num_socks == MAX_WAIT_SOCKETS) {
+            interval = MIN(interval, MAX_WAIT_MILLISECONDS);
+        }
+
+        networking_wait(dht->net, socks, num_socks, interval);
     }
 
     return 1;
@@ -0,0 +1,588 @@
+/* bench_tools.c
+ *
+ * Clocks, peers and load generators shared by the benchmarks.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "bench_tools.h"
+
+#include <poll.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+/* Packets written by a relay client in a row before going to the next one. */
+#define MAX_RELAY_BURST 16
+
+uint64_t bench_clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+double bench_time_seconds(void)
+{
+    return bench_clock_ns(CLOCK_MONOTONIC) / 1e9;
+}
+
+uint64_t bench_time_us(void)
+{
+    return bench_clock_ns(CLOCK_MONOTONIC) / 1000;
+}
+
+double bench_cpu_seconds(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+uint64_t bench_resident_size(void)
+{
+    FILE *file = fopen("/proc/self/statm", "r");
+
+    if (file == NULL) {
+        return 0;
+    }
+
+    unsigned long size, resident;
+    int ret = fscanf(file, "%lu %lu", &size, &resident);
+    fclose(file);
+
+    if (ret != 2) {
+        return 0;
+    }
+
+    return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+IP_Port bench_random_ip_port(_Bool loopback)
+{
+    IP_Port ip_port;
+    memset(&ip_port, 0, sizeof(ip_port));
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint32 = loopback ? htonl(0x7F000001) : random_int();
+    ip_port.port = htons(1024 + random_int() % 60000);
+    return ip_port;
+}
+
+void bench_close_key(const DHT *dht, unsigned int index, uint8_t *public_key)
+{
+    randombytes(public_key, crypto_box_PUBLICKEYBYTES);
+    memcpy(public_key, dht->self_public_key, index / 8);
+
+    uint8_t mask = 0xFF << (8 - index % 8);
+    uint8_t bit = 0x80 >> (index % 8);
+    uint8_t self = dht->self_public_key[index / 8];
+    public_key[index / 8] = (self & mask) | (~self & bit) | (public_key[index / 8] & ~(mask | bit));
+}
+
+void bench_fill_close_list(DHT *dht, _Bool loopback)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < LCLIENT_LENGTH; ++i) {
+        for (j = 0; j < LCLIENT_NODES; ++j) {
+            uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+            bench_close_key(dht, i, public_key);
+            addto_lists(dht, bench_random_ip_port(loopback), public_key);
+        }
+    }
+}
+
+static int handle_peer_data(void *object, int id, const uint8_t *data, uint16_t length, void *userdata)
+{
+    Bench_Peer *peer = object;
+    ++peer->received;
+    peer->received_bytes += length;
+
+    if (peer->data_handler != NULL) {
+        return peer->data_handler(peer->handler_object, id, data, length, userdata);
+    }
+
+    return 0;
+}
+
+static int handle_peer_lossy_data(void *object, int id, const uint8_t *data, uint16_t length)
+{
+    Bench_Peer *peer = object;
+    ++peer->received;
+    peer->received_bytes += length;
+
+    if (peer->lossy_data_handler != NULL) {
+        return peer->lossy_data_handler(peer->handler_object, id, data, length);
+    }
+
+    return 0;
+}
+
+static int handle_peer_new_connection(void *object, New_Connection *n_c)
+{
+    Bench_Peer *peer = object;
+    int id = accept_crypto_connection(peer->c, n_c);
+
+    if (id == -1) {
+        return -1;
+    }
+
+    peer->connection_id = id;
+    ++peer->accepted;
+    connection_data_handler(peer->c, id, &handle_peer_data, peer, id);
+    connection_lossy_data_handler(peer->c, id, &handle_peer_lossy_data, peer, id);
+    return 0;
+}
+
+int bench_peer_init(Bench_Peer *peer, IP ip)
+{
+    TCP_Proxy_Info proxy_info;
+    memset(&proxy_info, 0, sizeof(proxy_info));
+
+    memset(peer, 0, sizeof(Bench_Peer));
+    peer->connection_id = -1;
+
+    /* Some benchmarks run more instances than TOX_PORTRANGE_TO allows. */
+    peer->net = new_networking_ex(NULL, ip, TOX_PORTRANGE_FROM, 65535, NULL);
+
+    if (peer->net == NULL) {
+        return -1;
+    }
+
+    peer->dht = new_DHT(NULL, peer->net);
+
+    if (peer->dht == NULL) {
+        return -1;
+    }
+
+    peer->c = new_net_crypto(NULL, peer->dht, &proxy_info);
+
+    if (peer->c == NULL) {
+        return -1;
+    }
+
+    new_connection_handler(peer->c, &handle_peer_new_connection, peer);
+    return 0;
+}
+
+void bench_peer_kill(Bench_Peer *peer)
+{
+    kill_net_crypto(peer->c);
+    kill_DHT(peer->dht);
+    kill_networking(peer->net);
+}
+
+void bench_do_peer(Bench_Peer *peer)
+{
+    do_net_crypto(peer->c, NULL);
+    networking_poll(peer->net, NULL);
+}
+
+void bench_do_peers(Bench_Peer *sender, Bench_Peer *receiver)
+{
+    bench_do_peer(sender);
+    bench_do_peer(receiver);
+}
+
+int bench_new_connection(Bench_Peer *sender, const Bench_Peer *receiver, IP ip, uint16_t port)
+{
+    IP_Port ip_port;
+    memset(&ip_port, 0, sizeof(ip_port));
+    ip_port.ip = ip;
+    ip_port.port = port != 0 ? port : receiver->net->port;
+
+    int id = new_crypto_connection(sender->c, receiver->c->self_public_key, receiver->dht->self_public_key);
+
+    if (id == -1 || set_direct_ip_port(sender->c, id, ip_port, 1) == -1) {
+        return -1;
+    }
+
+    sender->connection_id = id;
+    return id;
+}
+
+int bench_connect_peers(Bench_Peer *sender, Bench_Peer *receiver, IP ip, uint16_t port,
+                        void (*do_other)(void *object), void *object)
+{
+    if (bench_new_connection(sender, receiver, ip, port) == -1) {
+        return -1;
+    }
+
+    uint64_t end = bench_time_us() + 20000000;
+
+    while (crypto_connection_status(sender->c, sender->connection_id, NULL, NULL) != CRYPTO_CONN_ESTABLISHED
+            || receiver->connection_id == -1) {
+        if (bench_time_us() > end) {
+            return -1;
+        }
+
+        bench_do_peers(sender, receiver);
+
+        if (do_other != NULL) {
+            do_other(object);
+        }
+
+        usleep(500);
+    }
+
+    return 0;
+}
+
+static int handle_sendnodes(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    Bench_DHT_Client *client = object;
+    ++client->responses;
+
+    if (client->in_flight > 0) {
+        --client->in_flight;
+    }
+
+    return 0;
+}
+
+int bench_dht_client_init(Bench_DHT_Client *client, const DHT *dht, IP ip, unsigned int num_keys)
+{
+    memset(client, 0, sizeof(Bench_DHT_Client));
+    client->net = new_networking(NULL, ip, TOX_PORTRANGE_FROM);
+    client->requests = calloc(num_keys, BENCH_GETNODES_SIZE);
+
+    if (client->net == NULL || client->requests == NULL) {
+        return -1;
+    }
+
+    networking_registerhandler(client->net, NET_PACKET_SEND_NODES_IPV6, &handle_sendnodes, client);
+    networking_set_recv_batch(client->net, MAX_RECV_BATCH_SIZE);
+    client->num_requests = num_keys;
+
+    unsigned int i;
+
+    for (i = 0; i < num_keys; ++i) {
+        uint8_t *request = client->requests[i];
+        uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+        uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+        crypto_box_keypair(public_key, secret_key);
+
+        uint8_t plain[crypto_box_PUBLICKEYBYTES + sizeof(uint64_t)];
+        randombytes(plain, sizeof(plain));
+
+        uint8_t *nonce = request + 1 + crypto_box_PUBLICKEYBYTES;
+        new_nonce(nonce);
+        request[0] = NET_PACKET_GET_NODES;
+        memcpy(request + 1, public_key, crypto_box_PUBLICKEYBYTES);
+
+        int len = encrypt_data(dht->self_public_key, secret_key, nonce, plain, sizeof(plain),
+                               request + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES);
+
+        if (len != sizeof(plain) + crypto_box_MACBYTES) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void bench_dht_client_kill(Bench_DHT_Client *client)
+{
+    kill_networking(client->net);
+    free(client->requests);
+}
+
+typedef struct {
+    DHT *dht;
+    void (*do_node)(void *object);
+    void *object;
+    uint8_t stop;
+} DHT_Thread;
+
+static void *run_dht(void *arg)
+{
+    DHT_Thread *dht_thread = arg;
+    DHT *dht = dht_thread->dht;
+
+    while (!__atomic_load_n(&dht_thread->stop, __ATOMIC_ACQUIRE)) {
+        struct pollfd fd;
+        fd.fd = dht->net->sock;
+        fd.events = POLLIN;
+        fd.revents = 0;
+        poll(&fd, 1, 1);
+
+        do_DHT(dht);
+        networking_poll(dht->net, NULL);
+
+        if (dht_thread->do_node != NULL) {
+            dht_thread->do_node(dht_thread->object);
+        }
+    }
+
+    return NULL;
+}
+
+double bench_dht_flood(DHT *dht, IP ip, Bench_DHT_Client *clients, unsigned int num_clients, uint32_t window,
+                       double seconds, void (*do_node)(void *object), void *object)
+{
+    DHT_Thread dht_thread;
+    dht_thread.dht = dht;
+    dht_thread.do_node = do_node;
+    dht_thread.object = object;
+    dht_thread.stop = 0;
+
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, &run_dht, &dht_thread) != 0) {
+        return -1;
+    }
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.port = dht->net->port;
+
+    unsigned int i;
+
+    for (i = 0; i < num_clients; ++i) {
+        clients[i].in_flight = 0;
+        clients[i].responses = 0;
+    }
+
+    double start = bench_time_seconds();
+    double last_refill = start;
+
+    while (bench_time_seconds() - start < seconds) {
+        double now = bench_time_seconds();
+
+        /* Lost requests would otherwise shrink the window for good. */
+        if (now - last_refill > 0.1) {
+            for (i = 0; i < num_clients; ++i) {
+                clients[i].in_flight = 0;
+            }
+
+            last_refill = now;
+        }
+
+        for (i = 0; i < num_clients; ++i) {
+            Bench_DHT_Client *client = &clients[i];
+
+            while (client->in_flight < window) {
+                sendpacket(client->net, ip_port, client->requests[client->next_request], BENCH_GETNODES_SIZE);
+                client->next_request = (client->next_request + 1) % client->num_requests;
+                ++client->in_flight;
+            }
+
+            networking_poll(client->net, NULL);
+        }
+    }
+
+    double elapsed = bench_time_seconds() - start;
+    uint64_t responses = 0;
+
+    for (i = 0; i < num_clients; ++i) {
+        responses += clients[i].responses;
+    }
+
+    __atomic_store_n(&dht_thread.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    return responses / elapsed;
+}
+
+static void *run_relay(void *arg)
+{
+    Bench_Relay_Thread *relay_thread = arg;
+    sock_t *socks = NULL;
+    uint32_t size_socks = 0;
+
+    while (!__atomic_load_n(&relay_thread->stop, __ATOMIC_ACQUIRE)) {
+        do_TCP_server(relay_thread->server);
+
+        uint32_t num_socks = TCP_server_get_socks(relay_thread->server, NULL, UINT32_MAX);
+
+        if (num_socks > size_socks) {
+            free(socks);
+            socks = malloc(num_socks * sizeof(sock_t));
+            size_socks = socks ? num_socks : 0;
+        }
+
+        num_socks = TCP_server_get_socks(relay_thread->server, socks, size_socks);
+        networking_wait(NULL, socks, num_socks, MIN(TCP_server_run_interval(relay_thread->server), 100));
+    }
+
+    free(socks);
+    return NULL;
+}
+
+int bench_relay_thread_start(Bench_Relay_Thread *relay_thread, TCP_Server *server)
+{
+    relay_thread->server = server;
+    relay_thread->stop = 0;
+
+    if (pthread_create(&relay_thread->thread, NULL, &run_relay, relay_thread) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void bench_relay_thread_stop(Bench_Relay_Thread *relay_thread)
+{
+    __atomic_store_n(&relay_thread->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(relay_thread->thread, NULL);
+}
+
+static int handle_relay_status(void *object, uint32_t number, uint8_t connection_id, uint8_t status)
+{
+    Bench_Relay_Client *client = object;
+    client->linked = (status == 2);
+    client->connection_id = connection_id;
+    return 0;
+}
+
+static int handle_relay_data(void *object, uint32_t number, uint8_t connection_id, const uint8_t *data,
+                             uint16_t length, void *userdata)
+{
+    Bench_Relay_Client *client = object;
+    ++client->received_packets;
+    return 0;
+}
+
+static _Bool relay_client_confirmed(const Bench_Relay_Client *client)
+{
+    return client->conn->status == TCP_CLIENT_CONFIRMED;
+}
+
+static _Bool relay_client_linked(const Bench_Relay_Client *client)
+{
+    return client->linked;
+}
+
+/* Run the clients until done returns 1 for all of them, for at most 10 seconds.
+ *
+ * return 0 if it did.
+ * return -1 if it didn't.
+ */
+static int run_relay_clients(Bench_Relay_Client *clients, unsigned int num_clients,
+                             _Bool (*done)(const Bench_Relay_Client *client))
+{
+    uint64_t end = bench_time_us() + 10000000;
+
+    while (bench_time_us() < end) {
+        unsigned int i, num_done = 0;
+
+        unix_time_update();
+
+        for (i = 0; i < num_clients; ++i) {
+            do_TCP_connection(clients[i].conn, NULL);
+            num_done += done(&clients[i]);
+        }
+
+        if (num_done == num_clients) {
+            return 0;
+        }
+
+        usleep(1000);
+    }
+
+    return -1;
+}
+
+Bench_Relay_Client *bench_relay_clients_new(IP_Port ip_port, const uint8_t *relay_public_key, unsigned int num_pairs)
+{
+    unsigned int num_clients = num_pairs * 2;
+    Bench_Relay_Client *clients = calloc(num_clients, sizeof(Bench_Relay_Client));
+
+    if (clients == NULL) {
+        return NULL;
+    }
+
+    unsigned int i;
+
+    for (i = 0; i < num_clients; ++i) {
+        crypto_box_keypair(clients[i].public_key, clients[i].secret_key);
+        clients[i].conn = new_TCP_connection(ip_port, relay_public_key, clients[i].public_key, clients[i].secret_key,
+                                             NULL);
+
+        if (clients[i].conn == NULL) {
+            printf("Failed to create client %u\n", i);
+            bench_relay_clients_kill(clients, num_clients);
+            return NULL;
+        }
+
+        routing_status_handler(clients[i].conn, &handle_relay_status, &clients[i]);
+        routing_data_handler(clients[i].conn, &handle_relay_data, &clients[i]);
+    }
+
+    if (run_relay_clients(clients, num_clients, &relay_client_confirmed) == -1) {
+        printf("Clients failed to connect\n");
+        bench_relay_clients_kill(clients, num_clients);
+        return NULL;
+    }
+
+    for (i = 0; i < num_clients; ++i) {
+        send_routing_request(clients[i].conn, clients[i ^ 1].public_key);
+    }
+
+    if (run_relay_clients(clients, num_clients, &relay_client_linked) == -1) {
+        printf("Clients failed to get routed to each other\n");
+        bench_relay_clients_kill(clients, num_clients);
+        return NULL;
+    }
+
+    return clients;
+}
+
+void bench_relay_clients_kill(Bench_Relay_Client *clients, unsigned int num_clients)
+{
+    unsigned int i;
+
+    for (i = 0; i < num_clients; ++i) {
+        kill_TCP_connection(clients[i].conn);
+    }
+
+    free(clients);
+}
+
+void bench_relay_clients_send(Bench_Relay_Client *clients, unsigned int num_clients, uint16_t size, uint64_t end)
+{
+    uint8_t data[MAX_PACKET_SIZE] = {0};
+    sock_t socks[num_clients];
+    unsigned int i;
+
+    for (i = 0; i < num_clients; ++i) {
+        socks[i] = clients[i].conn->sock;
+    }
+
+    while (bench_time_us() < end) {
+        _Bool sent = 0;
+
+        for (i = 0; i < num_clients; ++i) {
+            unsigned int j;
+
+            for (j = 0; j < MAX_RELAY_BURST && send_data(clients[i].conn, clients[i].connection_id, data, size) == 1;
+                    ++j) {
+                sent = 1;
+            }
+
+            do_TCP_connection(clients[i].conn, NULL);
+        }
+
+        if (!sent) {
+            networking_wait(NULL, socks, num_clients, 1);
+        }
+    }
+}
@@ -0,0 +1,186 @@
+/* bench_tools.h
+ *
+ * Clocks, peers and load generators shared by the benchmarks.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef BENCH_TOOLS_H
+#define BENCH_TOOLS_H
+
+#include "../toxcore/DHT.h"
+#include "../toxcore/TCP_client.h"
+#include "../toxcore/TCP_server.h"
+#include "../toxcore/net_crypto.h"
+#include "../toxcore/util.h"
+
+#include <pthread.h>
+#include <time.h>
+
+/* return the time of clock in ns. */
+uint64_t bench_clock_ns(clockid_t clock);
+
+/* return the monotonic time in s and in us. */
+double bench_time_seconds(void);
+uint64_t bench_time_us(void);
+
+/* return the CPU time used by the process in s. */
+double bench_cpu_seconds(void);
+
+/* return the resident set size of the process in bytes, 0 if unknown. */
+uint64_t bench_resident_size(void);
+
+/* return a random IPv4 ip_port, on 127.0.0.1 if loopback is set so that
+ * packets sent to it don't leave the host. */
+IP_Port bench_random_ip_port(_Bool loopback);
+
+/* Put a key that goes in close list bucket index of dht in public_key: the
+ * first index bits are the same as the DHT's. */
+void bench_close_key(const DHT *dht, unsigned int index, uint8_t *public_key);
+
+/* Fill every bucket of the close list of dht with nodes at
+ * bench_random_ip_port(loopback). */
+void bench_fill_close_list(DHT *dht, _Bool loopback);
+
+
+/* A Net_Crypto instance accepting all connections made to it. */
+typedef struct {
+    Networking_Core *net;
+    DHT *dht;
+    Net_Crypto *c;
+
+    int connection_id; /* The last one made or accepted, -1 if none. */
+    unsigned int accepted;
+
+    /* Lossless and lossy data packets received on accepted connections. */
+    uint64_t received;
+    uint64_t received_bytes;
+
+    /* If set, also called for the data packets received on connections
+     * accepted after they are, with handler_object. */
+    int (*data_handler)(void *object, int id, const uint8_t *data, uint16_t length, void *userdata);
+    int (*lossy_data_handler)(void *object, int id, const uint8_t *data, uint16_t length);
+    void *handler_object;
+} Bench_Peer;
+
+/* Start a peer on ip.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int bench_peer_init(Bench_Peer *peer, IP ip);
+
+void bench_peer_kill(Bench_Peer *peer);
+
+/* Run the peer once. */
+void bench_do_peer(Bench_Peer *peer);
+void bench_do_peers(Bench_Peer *sender, Bench_Peer *receiver);
+
+/* Make a connection from sender to receiver, sending directly to ip and port
+ * (in network byte order), the port of receiver if 0.
+ *
+ * return the connection id of sender on success.
+ * return -1 on failure.
+ */
+int bench_new_connection(Bench_Peer *sender, const Bench_Peer *receiver, IP ip, uint16_t port);
+
+/* Make a connection from sender to receiver like bench_new_connection() and
+ * run both, with do_other(object) if set, until it is established on the
+ * sender side and accepted by the receiver, for at most 20 seconds. The
+ * receiver's side is established by the first packet sent on it.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int bench_connect_peers(Bench_Peer *sender, Bench_Peer *receiver, IP ip, uint16_t port,
+                        void (*do_other)(void *object), void *object);
+
+
+#define BENCH_GETNODES_SIZE (1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES \
+                             + sizeof(uint64_t) + crypto_box_MACBYTES)
+
+/* A socket sending getnodes requests to a DHT node. */
+typedef struct {
+    Networking_Core *net;
+    uint8_t (*requests)[BENCH_GETNODES_SIZE];
+    unsigned int num_requests;
+    unsigned int next_request;
+    uint32_t in_flight;
+    uint64_t responses;
+} Bench_DHT_Client;
+
+/* Start a client on ip with num_keys requests to dht, each made with a
+ * keypair of its own.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int bench_dht_client_init(Bench_DHT_Client *client, const DHT *dht, IP ip, unsigned int num_keys);
+
+void bench_dht_client_kill(Bench_DHT_Client *client);
+
+/* Run dht on a thread of its own, like tox-bootstrapd's main loop with
+ * do_node(object) if set, while the clients flood it with getnodes requests,
+ * keeping window of them in flight each, for the given time.
+ *
+ * return the responses per second.
+ * return -1 on failure.
+ */
+double bench_dht_flood(DHT *dht, IP ip, Bench_DHT_Client *clients, unsigned int num_clients, uint32_t window,
+                       double seconds, void (*do_node)(void *object), void *object);
+
+
+/* Runs a TCP_Server made with new_TCP_server() on a thread of its own. */
+typedef struct {
+    TCP_Server *server;
+    uint8_t stop;
+    pthread_t thread;
+} Bench_Relay_Thread;
+
+/* return 0 on success.
+ * return -1 on failure.
+ */
+int bench_relay_thread_start(Bench_Relay_Thread *relay_thread, TCP_Server *server);
+
+void bench_relay_thread_stop(Bench_Relay_Thread *relay_thread);
+
+/* A TCP relay client routed to another. */
+typedef struct {
+    TCP_Client_Connection *conn;
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+    uint8_t connection_id;
+    _Bool linked;
+    uint64_t received_packets;
+} Bench_Relay_Client;
+
+/* Connect num_pairs * 2 clients to the relay at ip_port and route each
+ * client to the next one, client 2 * i to 2 * i + 1.
+ *
+ * return the clients on success, to free with bench_relay_clients_kill().
+ * return NULL on failure.
+ */
+Bench_Relay_Client *bench_relay_clients_new(IP_Port ip_port, const uint8_t *relay_public_key, unsigned int num_pairs);
+
+void bench_relay_clients_kill(Bench_Relay_Client *clients, unsigned int num_clients);
+
+/* Make every client send packets of size bytes to its pair as fast as the
+ * relay takes them until bench_time_us() reaches end. */
+void bench_relay_clients_send(Bench_Relay_Client *clients, unsigned int num_clients, uint16_t size, uint64_t end);
+
+#endif
@@ -0,0 +1,213 @@
+/* crypto_bench.c
+ *
+ * Micro-benchmark for the symmetric encryption functions of crypto_core.
+ *
+ * Usage: ./crypto_bench [seconds per measurement] [max precompute threads]
+ *
+ * For a few packet sizes, reports how many bytes per second go through
+ * encrypt_data_symmetric()/decrypt_data_symmetric(), their in place versions
+ * and, for comparison, the NaCl style padded crypto_box_afternm() calls with
+ * the temporary buffers and copies these functions used to need.
+ *
+ * It then reports how many shared keys per second encrypt_precompute() makes
+ * one by one and encrypt_precompute_batch() makes with 1, 2, 4, ... threads.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "bench_tools.h"
+
+#define MAX_SIZE 1400
+
+/* For encryption in holds the plain text starting crypto_box_MACBYTES bytes
+ * in, for decryption the encrypted data. */
+typedef int bench_func(const uint8_t *key, const uint8_t *nonce, uint8_t *in, uint8_t *out, uint32_t length);
+
+static int padded_encrypt(const uint8_t *key, const uint8_t *nonce, uint8_t *in, uint8_t *out, uint32_t length)
+{
+    uint8_t temp_plain[length + crypto_box_ZEROBYTES];
+    uint8_t temp_encrypted[length + crypto_box_MACBYTES + crypto_box_BOXZEROBYTES];
+
+    memset(temp_plain, 0, crypto_box_ZEROBYTES);
+    memcpy(temp_plain + crypto_box_ZEROBYTES, in + crypto_box_MACBYTES, length);
+
+    if (crypto_box_afternm(temp_encrypted, temp_plain, length + crypto_box_ZEROBYTES, nonce, key) != 0) {
+        return -1;
+    }
+
+    memcpy(out, temp_encrypted + crypto_box_BOXZEROBYTES, length + crypto_box_MACBYTES);
+    return length + crypto_box_MACBYTES;
+}
+
+static int padded_decrypt(const uint8_t *key, const uint8_t *nonce, uint8_t *in, uint8_t *out, uint32_t length)
+{
+    uint8_t temp_plain[length + crypto_box_ZEROBYTES];
+    uint8_t temp_encrypted[length + crypto_box_BOXZEROBYTES];
+
+    memset(temp_encrypted, 0, crypto_box_BOXZEROBYTES);
+    memcpy(temp_encrypted + crypto_box_BOXZEROBYTES, in, length);
+
+    if (crypto_box_open_afternm(temp_plain, temp_encrypted, length + crypto_box_BOXZEROBYTES, nonce, key) != 0) {
+        return -1;
+    }
+
+    memcpy(out, temp_plain + crypto_box_ZEROBYTES, length - crypto_box_MACBYTES);
+    return length - crypto_box_MACBYTES;
+}
+
+static int copy_encrypt(const uint8_t *key, const uint8_t *nonce, uint8_t *in, uint8_t *out, uint32_t length)
+{
+    return encrypt_data_symmetric(key, nonce, in + crypto_box_MACBYTES, length, out);
+}
+
+static int copy_decrypt(const uint8_t *key, const uint8_t *nonce, uint8_t *in, uint8_t *out, uint32_t length)
+{
+    return decrypt_data_symmetric(key, nonce, in, length, out);
+}
+
+static int inplace_encrypt(const uint8_t *key, const uint8_t *nonce, uint8_t *in, uint8_t *out, uint32_t length)
+{
+    return encrypt_data_symmetric_inplace(key, nonce, in, length);
+}
+
+static int inplace_decrypt(const uint8_t *key, const uint8_t *nonce, uint8_t *in, uint8_t *out, uint32_t length)
+{
+    return decrypt_data_symmetric_inplace(key, nonce, in, length);
+}
+
+/* return bytes of plain text per second. */
+static double measure(bench_func *func, int decrypt, uint32_t size, double seconds)
+{
+    uint8_t key[crypto_box_KEYBYTES];
+    uint8_t nonce[crypto_box_NONCEBYTES];
+    uint8_t plain[MAX_SIZE];
+    uint8_t encrypted[MAX_SIZE + crypto_box_MACBYTES];
+    uint8_t in[MAX_SIZE + crypto_box_MACBYTES];
+    uint8_t out[MAX_SIZE + crypto_box_MACBYTES];
+
+    new_symmetric_key(key);
+    random_nonce(nonce);
+    randombytes(plain, sizeof(plain));
+    encrypt_data_symmetric(key, nonce, plain, size, encrypted);
+
+    uint64_t runs = 0;
+    double start = bench_time_seconds();
+    double elapsed;
+
+    do {
+        unsigned int i;
+
+        for (i = 0; i < 1000; ++i) {
+            int ret;
+
+            /* The in place functions overwrite their input, so it is
+             * restored every time for all of them. */
+            if (decrypt) {
+                memcpy(in, encrypted, size + crypto_box_MACBYTES);
+                ret = func(key, nonce, in, out, size + crypto_box_MACBYTES);
+            } else {
+                memcpy(in + crypto_box_MACBYTES, plain, size);
+                ret = func(key, nonce, in, out, size);
+            }
+
+            if (ret == -1) {
+                printf("Failed\n");
+                return 0;
+            }
+        }
+
+        runs += 1000;
+        elapsed = bench_time_seconds() - start;
+    } while (elapsed < seconds);
+
+    return runs * size / elapsed;
+}
+
+#define PRECOMPUTE_BATCH_SIZE 256
+
+/* return shared keys per second, num_threads 0 meaning one encrypt_precompute()
+ * call per key. */
+static double measure_precompute(unsigned int num_threads, double seconds)
+{
+    static uint8_t public_keys[PRECOMPUTE_BATCH_SIZE][crypto_box_PUBLICKEYBYTES];
+    static uint8_t enc_keys[PRECOMPUTE_BATCH_SIZE][crypto_box_BEFORENMBYTES];
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+    unsigned int i;
+
+    crypto_box_keypair(public_key, secret_key);
+
+    for (i = 0; i < PRECOMPUTE_BATCH_SIZE; ++i) {
+        uint8_t other_secret_key[crypto_box_SECRETKEYBYTES];
+        crypto_box_keypair(public_keys[i], other_secret_key);
+    }
+
+    uint64_t keys = 0;
+    double start = bench_time_seconds();
+    double elapsed;
+
+    do {
+        if (num_threads == 0) {
+            for (i = 0; i < PRECOMPUTE_BATCH_SIZE; ++i) {
+                encrypt_precompute(public_keys[i], secret_key, enc_keys[i]);
+            }
+        } else {
+            encrypt_precompute_batch(public_keys[0], secret_key, enc_keys[0], PRECOMPUTE_BATCH_SIZE, num_threads);
+        }
+
+        keys += PRECOMPUTE_BATCH_SIZE;
+        elapsed = bench_time_seconds() - start;
+    } while (elapsed < seconds);
+
+    return keys / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 1;
+    unsigned int max_threads = argc > 2 ? atoi(argv[2]) : 8;
+    const uint32_t sizes[] = {64, 256, 1024, MAX_SIZE};
+    unsigned int i;
+
+    printf("%6s %10s %14s %14s %14s\n", "size", "", "padded MB/s", "copy MB/s", "in place MB/s");
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        printf("%6u %10s %14.1f %14.1f %14.1f\n", sizes[i], "encrypt",
+               measure(&padded_encrypt, 0, sizes[i], seconds) / 1e6,
+               measure(&copy_encrypt, 0, sizes[i], seconds) / 1e6,
+               measure(&inplace_encrypt, 0, sizes[i], seconds) / 1e6);
+        printf("%6u %10s %14.1f %14.1f %14.1f\n", sizes[i], "decrypt",
+               measure(&padded_decrypt, 1, sizes[i], seconds) / 1e6,
+               measure(&copy_decrypt, 1, sizes[i], seconds) / 1e6,
+               measure(&inplace_decrypt, 1, sizes[i], seconds) / 1e6);
+    }
+
+    printf("\n%u keys per batch\n", PRECOMPUTE_BATCH_SIZE);
+    printf("one by one:         %10.0f keys/s\n", measure_precompute(0, seconds));
+
+    for (i = 1; i <= max_threads && i <= MAX_PRECOMPUTE_THREADS; i *= 2) {
+        printf("batch, %2u threads:  %10.0f keys/s\n", i, measure_precompute(i, seconds));
+    }
+
+    return 0;
+}
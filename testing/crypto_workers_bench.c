@@ -0,0 +1,138 @@
+/* crypto_workers_bench.c
+ *
+ * Throughput benchmark for a DHT node answering getnodes requests with its
+ * decryption done inline or by networking_set_crypto_workers() threads.
+ *
+ * Usage: ./crypto_workers_bench [seconds per run] [max worker threads] [keys per client]
+ *
+ * A node is started on loopback and flooded with valid getnodes requests from
+ * several client sockets, keeping a fixed number of requests in flight per
+ * client. Each client cycles through requests made with different keypairs,
+ * so with enough keys per client the node's shared key cache misses and every
+ * request costs a key exchange as well as a decryption. The number of
+ * responses per second is reported with decryption inline and for 1, 2, 4, ...
+ * worker threads.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "bench_tools.h"
+
+#define NUM_CLIENTS 16
+
+/* Requests each client keeps in flight. */
+#define WINDOW_SIZE 32
+
+static void run(DHT *dht, Bench_DHT_Client *clients, unsigned int num_workers, double seconds, IP ip)
+{
+    if (networking_set_crypto_workers(dht->net, num_workers) == -1) {
+        printf("Failed to start %u crypto workers\n", num_workers);
+        return;
+    }
+
+    Shared_Keys_Stats before, after;
+    shared_keys_get_stats(dht->shared_keys_recv, &before);
+
+    double responses = bench_dht_flood(dht, ip, clients, NUM_CLIENTS, WINDOW_SIZE, seconds, NULL, NULL);
+
+    if (responses == -1) {
+        printf("Failed to start server thread\n");
+        return;
+    }
+
+    shared_keys_get_stats(dht->shared_keys_recv, &after);
+    uint64_t hits = after.hits - before.hits;
+    uint64_t misses = after.misses - before.misses;
+
+    if (num_workers == 0) {
+        printf("decrypting inline: ");
+    } else {
+        printf("%2u crypto workers: ", num_workers);
+    }
+
+    printf("%8.0f responses/s (shared key cache hit rate %.1f%%)\n", responses,
+           hits + misses ? hits * 100.0 / (hits + misses) : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 3;
+    unsigned int max_workers = argc > 2 ? atoi(argv[2]) : 8;
+    unsigned int num_keys = argc > 3 ? atoi(argv[3]) : 256;
+
+    if (max_workers > MAX_CRYPTO_WORKERS) {
+        max_workers = MAX_CRYPTO_WORKERS;
+    }
+
+    if (num_keys == 0) {
+        num_keys = 1;
+    }
+
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    Networking_Core *net = new_networking(NULL, ip, TOX_PORTRANGE_FROM);
+
+    if (net == NULL) {
+        printf("Failed to create networking\n");
+        return 1;
+    }
+
+    networking_set_recv_batch(net, MAX_RECV_BATCH_SIZE);
+    networking_set_send_batch(net, MAX_SEND_BATCH_SIZE);
+
+    DHT *dht = new_DHT(NULL, net);
+
+    if (dht == NULL) {
+        printf("Failed to create DHT\n");
+        return 1;
+    }
+
+    Bench_DHT_Client clients[NUM_CLIENTS];
+    unsigned int i;
+
+    for (i = 0; i < NUM_CLIENTS; ++i) {
+        if (bench_dht_client_init(&clients[i], dht, ip, num_keys) == -1) {
+            printf("Failed to create client\n");
+            return 1;
+        }
+    }
+
+    printf("%u clients, %u keys each, %u requests in flight each, %.1f s per run\n", NUM_CLIENTS, num_keys,
+           WINDOW_SIZE, seconds);
+
+    run(dht, clients, 0, seconds, ip);
+
+    for (i = 1; i <= max_workers; i *= 2) {
+        run(dht, clients, i, seconds, ip);
+    }
+
+    for (i = 0; i < NUM_CLIENTS; ++i) {
+        bench_dht_client_kill(&clients[i]);
+    }
+
+    kill_DHT(dht);
+    kill_networking(net);
+    return 0;
+}
@@ -0,0 +1,190 @@
+/* dht_close_bench.c
+ *
+ * Cost of get_close_nodes() on a DHT with a full close list.
+ *
+ * Usage: ./dht_close_bench [number of lookups]
+ *
+ * The close list is filled with nodes for every bucket of the routing table
+ * and get_close_nodes() is asked for the nodes closest to random keys and to
+ * keys close to ours. Its time per lookup is compared with a scan of the
+ * whole close list, which is how it found nodes before the list was looked at
+ * bucket by bucket. Both find the same nodes.
+ *
+ * The routing table is the close list array itself, so both take the same
+ * memory, which is reported too.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "bench_tools.h"
+
+static void scan_list(const uint8_t *public_key, Node_format *nodes_list, const Client_data *list, uint32_t length,
+                      uint32_t *num_nodes)
+{
+    uint32_t i, j;
+
+    for (i = 0; i < length; ++i) {
+        const Client_data *client = &list[i];
+
+        for (j = 0; j < *num_nodes; ++j) {
+            if (id_equal(nodes_list[j].public_key, client->public_key)) {
+                break;
+            }
+        }
+
+        if (j != *num_nodes || is_timeout(client->assoc4.timestamp, BAD_NODE_TIMEOUT)) {
+            continue;
+        }
+
+        if (*num_nodes < MAX_SENT_NODES) {
+            memcpy(nodes_list[*num_nodes].public_key, client->public_key, crypto_box_PUBLICKEYBYTES);
+            nodes_list[*num_nodes].ip_port = client->assoc4.ip_port;
+            ++*num_nodes;
+        } else {
+            add_to_list(nodes_list, MAX_SENT_NODES, client->public_key, client->assoc4.ip_port, public_key);
+        }
+    }
+}
+
+/* The get_close_nodes() of a flat close list. */
+static int flat_get_close_nodes(const DHT *dht, const uint8_t *public_key, Node_format *nodes_list)
+{
+    uint32_t num_nodes = 0, i;
+    memset(nodes_list, 0, MAX_SENT_NODES * sizeof(Node_format));
+    scan_list(public_key, nodes_list, dht->close_clientlist, LCLIENT_LIST, &num_nodes);
+
+    for (i = 0; i < dht->num_friends; ++i) {
+        scan_list(public_key, nodes_list, dht->friends_list[i].client_list, MAX_FRIEND_CLIENTS, &num_nodes);
+    }
+
+    return num_nodes;
+}
+
+static int same_nodes(const Node_format *nodes1, const Node_format *nodes2, int num)
+{
+    int i, j;
+
+    for (i = 0; i < num; ++i) {
+        for (j = 0; j < num; ++j) {
+            if (id_equal(nodes1[i].public_key, nodes2[j].public_key)) {
+                break;
+            }
+        }
+
+        if (j == num) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int num_lookups = argc > 1 ? atoi(argv[1]) : 100000;
+
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    Networking_Core *net = new_networking(NULL, ip, TOX_PORTRANGE_FROM);
+
+    if (net == NULL) {
+        printf("Failed to create networking\n");
+        return 1;
+    }
+
+    DHT *dht = new_DHT(NULL, net);
+
+    if (dht == NULL) {
+        printf("Failed to create DHT\n");
+        return 1;
+    }
+
+    bench_fill_close_list(dht, 0);
+
+    uint8_t (*keys)[crypto_box_PUBLICKEYBYTES] = malloc(num_lookups * crypto_box_PUBLICKEYBYTES);
+
+    if (keys == NULL) {
+        printf("Failed to allocate keys\n");
+        return 1;
+    }
+
+    unsigned int i, good = 0;
+
+    for (i = 0; i < LCLIENT_LIST; ++i) {
+        good += !is_timeout(dht->close_clientlist[i].assoc4.timestamp, BAD_NODE_TIMEOUT);
+    }
+
+    /* Half the lookups are for keys in one of the first 32 buckets, like the
+     * nodes that ask us for nodes close to themselves would be. */
+    for (i = 0; i < num_lookups; ++i) {
+        if (i % 2) {
+            randombytes(keys[i], crypto_box_PUBLICKEYBYTES);
+        } else {
+            bench_close_key(dht, rand() % 32, keys[i]);
+        }
+    }
+
+    printf("%u nodes in the close list, %u lookups\n", good, num_lookups);
+    printf("close list memory: %lu bytes (%u entries of %lu bytes) for both\n",
+           (unsigned long)sizeof(dht->close_clientlist), LCLIENT_LIST, (unsigned long)sizeof(Client_data));
+
+    Node_format nodes[MAX_SENT_NODES], flat_nodes[MAX_SENT_NODES];
+    unsigned int differ = 0;
+
+    for (i = 0; i < num_lookups; ++i) {
+        int num = get_close_nodes(dht, keys[i], nodes, AF_INET, 1, 0);
+
+        if (num != flat_get_close_nodes(dht, keys[i], flat_nodes) || !same_nodes(nodes, flat_nodes, num)) {
+            ++differ;
+        }
+    }
+
+    if (differ) {
+        printf("%u lookups found different nodes\n", differ);
+    }
+
+    double start = bench_time_seconds();
+
+    for (i = 0; i < num_lookups; ++i) {
+        get_close_nodes(dht, keys[i], nodes, AF_INET, 1, 0);
+    }
+
+    double buckets = bench_time_seconds() - start;
+    start = bench_time_seconds();
+
+    for (i = 0; i < num_lookups; ++i) {
+        flat_get_close_nodes(dht, keys[i], flat_nodes);
+    }
+
+    double flat = bench_time_seconds() - start;
+
+    printf("get_close_nodes():   %8.2f us per lookup\n", buckets * 1e6 / num_lookups);
+    printf("flat close list:     %8.2f us per lookup\n", flat * 1e6 / num_lookups);
+
+    free(keys);
+    kill_DHT(dht);
+    kill_networking(net);
+    return 0;
+}
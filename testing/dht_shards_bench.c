@@ -0,0 +1,140 @@
+/* dht_shards_bench.c
+ *
+ * Throughput benchmark for a DHT node answering getnodes requests, with the
+ * bootstrap daemon's SO_REUSEPORT worker threads (other/bootstrap_daemon/src/shards.c).
+ *
+ * Usage: ./dht_shards_bench [seconds per run] [max worker threads]
+ *
+ * A node is started on loopback and flooded with valid getnodes requests from
+ * several client sockets, each with its own keypair, keeping a fixed number
+ * of requests in flight per client. The number of responses per second is
+ * reported for the main thread alone and for 1, 2, 4, ... worker threads.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../other/bootstrap_daemon/src/shards.h"
+#include "bench_tools.h"
+
+#define NUM_CLIENTS 16
+
+/* Requests each client keeps in flight. */
+#define WINDOW_SIZE 32
+
+static void do_node(void *object)
+{
+    do_shards(object);
+}
+
+static void run(DHT *dht, Bench_DHT_Client *clients, unsigned int num_workers, double seconds, IP ip)
+{
+    Shards *shards = NULL;
+
+    if (num_workers > 0) {
+        shards = new_shards(dht, ip, num_workers);
+
+        if (shards == NULL) {
+            printf("Failed to start %u worker threads\n", num_workers);
+            return;
+        }
+    }
+
+    double responses = bench_dht_flood(dht, ip, clients, NUM_CLIENTS, WINDOW_SIZE, seconds,
+                                       shards != NULL ? &do_node : NULL, shards);
+
+    if (responses == -1) {
+        printf("Failed to start server thread\n");
+        kill_shards(shards);
+        return;
+    }
+
+    if (shards == NULL) {
+        printf("main thread only: %8.0f responses/s\n", responses);
+        return;
+    }
+
+    Shard_Stats stats;
+    shards_get_stats(shards, &stats);
+    printf("%2u worker threads: %8.0f responses/s (%llu answered by workers, %llu forwarded, %llu dropped)\n",
+           num_workers, responses, (unsigned long long)stats.packets_answered,
+           (unsigned long long)stats.packets_forwarded, (unsigned long long)stats.packets_dropped);
+    kill_shards(shards);
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 3;
+    unsigned int max_workers = argc > 2 ? atoi(argv[2]) : 8;
+
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    Networking_Core *net = new_networking_reuseport(NULL, ip, TOX_PORTRANGE_TO, NULL);
+
+    if (net == NULL) {
+        printf("Failed to create networking (SO_REUSEPORT not supported?)\n");
+        return 1;
+    }
+
+    networking_set_recv_batch(net, MAX_RECV_BATCH_SIZE);
+    networking_set_send_batch(net, MAX_SEND_BATCH_SIZE);
+
+    DHT *dht = new_DHT(NULL, net);
+
+    if (dht == NULL) {
+        printf("Failed to create DHT\n");
+        return 1;
+    }
+
+    Bench_DHT_Client clients[NUM_CLIENTS];
+    unsigned int i;
+
+    for (i = 0; i < NUM_CLIENTS; ++i) {
+        if (bench_dht_client_init(&clients[i], dht, ip, 1) == -1) {
+            printf("Failed to create client\n");
+            return 1;
+        }
+    }
+
+    printf("%u clients, %u requests in flight each, %.1f s per run\n", NUM_CLIENTS, WINDOW_SIZE, seconds);
+
+    run(dht, clients, 0, seconds, ip);
+
+    for (i = 1; i <= max_workers; i *= 2) {
+        run(dht, clients, i, seconds, ip);
+    }
+
+    Shared_Keys_Stats key_stats;
+    shared_keys_get_stats(dht->shared_keys_recv, &key_stats);
+    printf("shared key cache: %llu hits, %llu misses, %llu evictions\n", (unsigned long long)key_stats.hits,
+           (unsigned long long)key_stats.misses, (unsigned long long)key_stats.evictions);
+
+    for (i = 0; i < NUM_CLIENTS; ++i) {
+        bench_dht_client_kill(&clients[i]);
+    }
+
+    kill_DHT(dht);
+    kill_networking(net);
+    return 0;
+}
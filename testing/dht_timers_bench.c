@@ -0,0 +1,157 @@
+/* dht_timers_bench.c
+ *
+ * Cost of the DHT's periodic work with many friends and a full close list.
+ *
+ * Usage: ./dht_timers_bench [number of friends] [seconds]
+ *
+ * A DHT is given a full close list (LCLIENT_LIST nodes) and friends with full
+ * client lists, all of them fresh and never pinged. The first do_DHT() pings
+ * every node; after that hardly anything is due until PING_INTERVAL is up. The time do_DHT() takes is reported for the first run and
+ * as an average over the following ones (one per second), which is what an
+ * idle node spends per second.
+ *
+ * The nodes don't exist, so they never answer and no node is ever replaced.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "bench_tools.h"
+
+#include <unistd.h>
+
+/* Fill the client list of every friend, all of them sharing one node which
+ * gets added through addto_lists() last so the DHT notices the new nodes. */
+static int add_friends(DHT *dht, unsigned int num_friends)
+{
+    unsigned int i, j;
+    uint8_t common_key[crypto_box_PUBLICKEYBYTES];
+    IP_Port common_ip_port = bench_random_ip_port(1);
+    randombytes(common_key, sizeof(common_key));
+
+    for (i = 0; i < num_friends; ++i) {
+        uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+        randombytes(public_key, sizeof(public_key));
+
+        if (DHT_addfriend(dht, public_key, NULL, NULL, 0, NULL) != 0) {
+            return -1;
+        }
+    }
+
+    /* Adding that many friends takes a while. */
+    unix_time_update();
+
+    for (i = 0; i < dht->num_friends; ++i) {
+        DHT_Friend *friend = &dht->friends_list[i];
+
+        for (j = 0; j < MAX_FRIEND_CLIENTS; ++j) {
+            Client_data *client = &friend->client_list[j];
+            memset(client, 0, sizeof(Client_data));
+
+            if (j == 0) {
+                memcpy(client->public_key, common_key, crypto_box_PUBLICKEYBYTES);
+                client->assoc4.ip_port = common_ip_port;
+            } else {
+                randombytes(client->public_key, crypto_box_PUBLICKEYBYTES);
+                client->assoc4.ip_port = bench_random_ip_port(1);
+            }
+
+            client->assoc4.timestamp = unix_time();
+        }
+
+        /* Done with the first burst of get nodes requests. */
+        friend->bootstrap_times = UINT16_MAX;
+        friend->lastgetnode = unix_time();
+    }
+
+    addto_lists(dht, common_ip_port, common_key);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int num_friends = argc > 1 ? atoi(argv[1]) : 10000;
+    unsigned int seconds = argc > 2 ? atoi(argv[2]) : 10;
+
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    Networking_Core *net = new_networking(NULL, ip, TOX_PORTRANGE_FROM);
+
+    if (net == NULL) {
+        printf("Failed to create networking\n");
+        return 1;
+    }
+
+    DHT *dht = new_DHT(NULL, net);
+
+    if (dht == NULL) {
+        printf("Failed to create DHT\n");
+        return 1;
+    }
+
+    bench_fill_close_list(dht, 1);
+
+    if (add_friends(dht, num_friends) == -1) {
+        printf("Failed to add friends\n");
+        return 1;
+    }
+
+    printf("%u friends (%u with the DHT's own), %u close list slots, %u s\n", num_friends, dht->num_friends,
+           LCLIENT_LIST, seconds);
+
+    double first = 0, total = 0;
+    unsigned int runs = 0;
+
+    while (runs <= seconds) {
+        usleep(DHT_run_interval(dht) * 1000);
+        unix_time_update();
+
+        uint64_t last_run = dht->last_run;
+        double start = bench_time_seconds();
+        do_DHT(dht);
+        double elapsed = bench_time_seconds() - start;
+
+        /* Drain the unreachable errors of the packets sent. */
+        networking_poll(net, NULL);
+
+        if (dht->last_run == last_run) {
+            continue;
+        }
+
+        if (runs == 0) {
+            first = elapsed;
+        } else {
+            total += elapsed;
+        }
+
+        ++runs;
+    }
+
+    printf("first do_DHT():  %10.1f us\n", first * 1e6);
+    printf("later do_DHT():  %10.1f us on average\n", total * 1e6 / seconds);
+
+    kill_DHT(dht);
+    kill_networking(net);
+    return 0;
+}
@@ -0,0 +1,296 @@
+/* net_crypto_cc_bench.c
+ *
+ * Throughput of the net_crypto congestion controllers against the round trip
+ * time of the link.
+ *
+ * Usage: ./net_crypto_cc_bench [seconds] [loss percent] [link MB/s] [rtt ms ...]
+ *
+ * Two Net_Crypto instances on loopback are connected through a relay that
+ * emulates a link: packets are held for half the rtt in each direction, go
+ * through a bottleneck of the given rate (5 MB/s by default) with a queue of
+ * one bandwidth delay product and are dropped at random with the given
+ * probability. One instance sends lossless packets to the other as fast as
+ * congestion control lets it for each rtt (10, 50, 100, 200 and 400 ms by
+ * default) and loss rate (0 and 1% by default) with each controller, and the
+ * goodput is reported along with the share of the link it used.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "bench_tools.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define PACKET_ID_BENCH 160
+
+/* Packets a direction of the link can hold, queued and in flight. */
+#define LINK_QUEUE_SIZE 16384
+#define LINK_PACKET_SIZE 2048
+
+typedef struct {
+    uint64_t deliver_time; /* in us */
+    uint16_t length;
+    uint8_t data[LINK_PACKET_SIZE];
+} Link_Packet;
+
+/* One direction of the emulated link: packets received on sock_in leave
+ * from sock_out to dest. */
+typedef struct {
+    int sock_in;
+    int sock_out;
+    struct sockaddr_in dest;
+
+    Link_Packet *queue;
+    uint32_t start, end;
+
+    uint64_t free_time; /* Time in us at which the bottleneck is done with the queued packets. */
+    uint64_t delay; /* One way delay in us. */
+    uint64_t max_backlog; /* Longest queue at the bottleneck in us. */
+    double rate; /* Bytes per us. */
+    double loss;
+
+    uint64_t dropped;
+} Link;
+
+static const char *controller_names[CRYPTO_CONGESTION_NUM] = {"classic", "bbr"};
+
+/* return a non blocking UDP socket bound to an ephemeral port of 127.0.0.1, -1 on failure. */
+static int new_relay_socket(struct sockaddr_in *addr)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (sock == -1) {
+        return -1;
+    }
+
+    socklen_t addr_len = sizeof(struct sockaddr_in);
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(0x7F000001);
+
+    int size = 4 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    if (bind(sock, (struct sockaddr *)addr, addr_len) != 0
+            || getsockname(sock, (struct sockaddr *)addr, &addr_len) != 0
+            || fcntl(sock, F_SETFL, O_NONBLOCK) != 0) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+static int init_link(Link *link, int sock_in, int sock_out, uint16_t dest_port, double rtt_ms, double loss,
+                     double rate)
+{
+    memset(link, 0, sizeof(Link));
+    link->queue = malloc(LINK_QUEUE_SIZE * sizeof(Link_Packet));
+
+    if (link->queue == NULL) {
+        return -1;
+    }
+
+    link->sock_in = sock_in;
+    link->sock_out = sock_out;
+    link->dest.sin_family = AF_INET;
+    link->dest.sin_addr.s_addr = htonl(0x7F000001);
+    link->dest.sin_port = dest_port;
+    link->delay = rtt_ms * 500;
+    link->max_backlog = rtt_ms > 20 ? rtt_ms * 1000 : 20000;
+    link->rate = rate;
+    link->loss = loss;
+    return 0;
+}
+
+static void do_link(Link *link)
+{
+    uint64_t now = bench_time_us();
+    Link_Packet *packet = &link->queue[link->end % LINK_QUEUE_SIZE];
+    ssize_t length;
+
+    while ((length = recv(link->sock_in, packet->data, LINK_PACKET_SIZE, 0)) > 0) {
+        uint64_t backlog = link->free_time > now ? link->free_time - now : 0;
+
+        if (link->end - link->start == LINK_QUEUE_SIZE || backlog > link->max_backlog
+                || random_int() < link->loss * UINT32_MAX) {
+            ++link->dropped;
+            continue;
+        }
+
+        link->free_time = (link->free_time > now ? link->free_time : now) + (uint64_t)(length / link->rate);
+        packet->deliver_time = link->free_time + link->delay;
+        packet->length = length;
+        ++link->end;
+        packet = &link->queue[link->end % LINK_QUEUE_SIZE];
+    }
+
+    while (link->start != link->end) {
+        packet = &link->queue[link->start % LINK_QUEUE_SIZE];
+
+        if (packet->deliver_time > now) {
+            break;
+        }
+
+        sendto(link->sock_out, packet->data, packet->length, 0, (struct sockaddr *)&link->dest, sizeof(link->dest));
+        ++link->start;
+    }
+}
+
+static void do_links(void *object)
+{
+    Link *links = object;
+    do_link(&links[0]);
+    do_link(&links[1]);
+}
+
+/* return goodput in bytes per second, -1 on failure. */
+static double transfer(IP ip, uint8_t controller, double seconds, double rtt_ms, double loss, double rate)
+{
+    Bench_Peer sender, receiver;
+
+    if (bench_peer_init(&sender, ip) == -1 || bench_peer_init(&receiver, ip) == -1) {
+        printf("Failed to create peers\n");
+        return -1;
+    }
+
+    net_crypto_congestion_control(sender.c, controller);
+    net_crypto_congestion_control(receiver.c, controller);
+
+    struct sockaddr_in addr_sender_side, addr_receiver_side;
+    int sock_sender_side = new_relay_socket(&addr_sender_side);
+    int sock_receiver_side = new_relay_socket(&addr_receiver_side);
+    Link links[2];
+    Link *forward = &links[0], *backward = &links[1];
+
+    if (sock_sender_side == -1 || sock_receiver_side == -1
+            || init_link(forward, sock_sender_side, sock_receiver_side, receiver.net->port, rtt_ms, loss, rate) == -1
+            || init_link(backward, sock_receiver_side, sock_sender_side, sender.net->port, rtt_ms, loss, rate) == -1) {
+        printf("Failed to create link\n");
+        return -1;
+    }
+
+    if (bench_connect_peers(&sender, &receiver, ip, addr_sender_side.sin_port, &do_links, links) == -1) {
+        printf("Failed to connect\n");
+        return -1;
+    }
+
+    uint8_t packet[MAX_CRYPTO_DATA_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = PACKET_ID_BENCH;
+
+    uint64_t end = bench_time_us() + seconds * 1000000;
+
+    while (bench_time_us() < end) {
+        while (!max_speed_reached(sender.c, sender.connection_id)) {
+            if (write_cryptpacket(sender.c, sender.connection_id, packet, sizeof(packet), 1) == -1) {
+                break;
+            }
+        }
+
+        bench_do_peers(&sender, &receiver);
+        do_links(links);
+    }
+
+    double goodput = receiver.received_bytes / seconds;
+
+    bench_peer_kill(&sender);
+    bench_peer_kill(&receiver);
+    close(sock_sender_side);
+    close(sock_receiver_side);
+    free(forward->queue);
+    free(backward->queue);
+    return goodput;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 10;
+    double losses[] = {0, 1};
+    unsigned int num_losses = 2;
+    double rate = argc > 3 ? atof(argv[3]) : 5;
+    double default_rtts[] = {10, 50, 100, 200, 400};
+    unsigned int num_rtts = sizeof(default_rtts) / sizeof(double);
+    double *rtts = default_rtts;
+
+    if (argc > 2) {
+        losses[0] = atof(argv[2]);
+        num_losses = 1;
+    }
+
+    if (argc > 4) {
+        num_rtts = argc - 4;
+        rtts = malloc(num_rtts * sizeof(double));
+
+        unsigned int i;
+
+        for (i = 0; i < num_rtts; ++i) {
+            rtts[i] = atof(argv[i + 4]);
+        }
+    }
+
+    if (seconds <= 0 || rate <= 0) {
+        printf("Nothing to do\n");
+        return 1;
+    }
+
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    unsigned int i, j, k;
+
+    for (i = 0; i < num_losses; ++i) {
+        printf("%.1f MB/s link, %.1f%% loss, %.0f s per run\n", rate, losses[i], seconds);
+        printf("%8s", "rtt ms");
+
+        for (k = 0; k < CRYPTO_CONGESTION_NUM; ++k) {
+            printf("  %9s MB/s   use", controller_names[k]);
+        }
+
+        printf("\n");
+
+        for (j = 0; j < num_rtts; ++j) {
+            printf("%8.0f", rtts[j]);
+
+            for (k = 0; k < CRYPTO_CONGESTION_NUM; ++k) {
+                double goodput = transfer(ip, k, seconds, rtts[j], losses[i] / 100.0, rate);
+
+                if (goodput < 0) {
+                    return 1;
+                }
+
+                printf("  %14.2f  %3.0f%%", goodput / 1e6, goodput / 1e4 / rate);
+                fflush(stdout);
+            }
+
+            printf("\n");
+        }
+
+        printf("\n");
+    }
+
+    return 0;
+}
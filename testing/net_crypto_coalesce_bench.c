@@ -0,0 +1,175 @@
+/* net_crypto_coalesce_bench.c
+ *
+ * Goodput of small lossless packets with and without coalescing.
+ *
+ * Usage: ./net_crypto_coalesce_bench [seconds] [packet size] [packets per ms]
+ *
+ * Two Net_Crypto instances are connected to each other on loopback and one
+ * sends lossless packets of the given size (32 bytes by default) to the
+ * other, either the given number of them every ms or, with 0 (the default),
+ * as many as congestion control lets it. This is done once with each packet
+ * sent on its own and once with net_crypto_coalesce_packets() turned on, and
+ * for each the goodput, the UDP packets and bytes the receiver got per
+ * packet written and the mean latency of the packets are reported.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "bench_tools.h"
+
+#include <unistd.h>
+
+#define PACKET_ID_BENCH 160
+
+typedef struct {
+    Bench_Peer peer;
+    Packet_Handles handle;
+    uint64_t udp_packets, udp_bytes;
+    double latency;
+} Receiver;
+
+static int handle_data(void *object, int id, const uint8_t *data, uint16_t length, void *userdata)
+{
+    Receiver *receiver = object;
+    double sent_time;
+    memcpy(&sent_time, data + 1, sizeof(sent_time));
+    receiver->latency += bench_time_seconds() - sent_time;
+    return 0;
+}
+
+/* Counts the UDP data packets before net_crypto gets them. */
+static int handle_udp_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    Receiver *receiver = object;
+    ++receiver->udp_packets;
+    receiver->udp_bytes += length;
+    return receiver->handle.function(receiver->handle.object, source, packet, length, userdata);
+}
+
+static int run(IP ip, _Bool coalesce, double seconds, uint16_t size, unsigned int per_ms)
+{
+    Bench_Peer sender;
+    Receiver receiver;
+    memset(&receiver, 0, sizeof(receiver));
+
+    if (bench_peer_init(&sender, ip) == -1 || bench_peer_init(&receiver.peer, ip) == -1) {
+        printf("Failed to create peers\n");
+        return -1;
+    }
+
+    net_crypto_coalesce_packets(sender.c, coalesce);
+    receiver.peer.data_handler = &handle_data;
+    receiver.peer.handler_object = &receiver;
+    receiver.handle = receiver.peer.net->packethandlers[NET_PACKET_CRYPTO_DATA];
+    networking_registerhandler(receiver.peer.net, NET_PACKET_CRYPTO_DATA, &handle_udp_packet, &receiver);
+
+    if (bench_connect_peers(&sender, &receiver.peer, ip, 0, NULL, NULL) == -1) {
+        printf("Failed to connect\n");
+        return -1;
+    }
+
+    /* The peer versions are known after the first request packets. */
+    const Crypto_Connection *conn = &sender.c->crypto_connections[sender.connection_id];
+
+    while (conn->peer_version < 2) {
+        bench_do_peers(&sender, &receiver.peer);
+        usleep(1000);
+    }
+
+    uint8_t packet[MAX_CRYPTO_DATA_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = PACKET_ID_BENCH;
+
+    receiver.udp_packets = receiver.udp_bytes = 0;
+    uint64_t written = 0;
+    double start = bench_time_seconds();
+    double elapsed;
+
+    do {
+        unsigned int i;
+
+        for (i = 0; per_ms == 0 || i < per_ms; ++i) {
+            double now = bench_time_seconds();
+            memcpy(packet + 1, &now, sizeof(now));
+
+            if (write_cryptpacket(sender.c, sender.connection_id, packet, size, 1) == -1) {
+                break;
+            }
+
+            ++written;
+        }
+
+        bench_do_peers(&sender, &receiver.peer);
+
+        if (per_ms != 0) {
+            usleep(1000);
+        }
+
+        elapsed = bench_time_seconds() - start;
+    } while (elapsed < seconds);
+
+    uint64_t received = receiver.peer.received;
+    printf("%-11s %10.0f %8.2f %10.3f %10.1f %8.2f %9.0f%%\n", coalesce ? "coalesced" : "one by one",
+           received / elapsed, receiver.peer.received_bytes / elapsed / 1e6,
+           (double)receiver.udp_packets / received, (double)receiver.udp_bytes / received,
+           receiver.latency * 1000 / received, 100.0 * received / written);
+
+    bench_peer_kill(&sender);
+    bench_peer_kill(&receiver.peer);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 5;
+    int size = argc > 2 ? atoi(argv[2]) : 32;
+    unsigned int per_ms = argc > 3 ? atoi(argv[3]) : 0;
+
+    if (size < 1 + (int)sizeof(double) || size > MAX_CRYPTO_DATA_SIZE) {
+        printf("Packet size must be between %u and %u\n", 1 + (unsigned int)sizeof(double),
+               (unsigned int)MAX_CRYPTO_DATA_SIZE);
+        return 1;
+    }
+
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    printf("%d byte packets, ", size);
+
+    if (per_ms) {
+        printf("%u per ms, ", per_ms);
+    } else {
+        printf("as fast as possible, ");
+    }
+
+    printf("%.1f s per run\n", seconds);
+    printf("%-11s %10s %8s %10s %10s %8s %10s\n", "", "packets/s", "MB/s", "UDP/packet", "bytes/pkt", "lat ms",
+           "delivered");
+
+    if (run(ip, 0, seconds, size, per_ms) == -1 || run(ip, 1, seconds, size, per_ms) == -1) {
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,168 @@
+/* net_crypto_handshake_flood_bench.c
+ *
+ * Goodput of an established connection while its receiver is flooded with
+ * cookie requests.
+ *
+ * Usage: ./net_crypto_handshake_flood_bench [seconds] [requests per ms] [sockets]
+ *
+ * Two Net_Crypto instances are connected to each other on loopback and one
+ * sends lossless 1000 byte packets to the other as fast as congestion control
+ * lets it, first on its own and then while the given number of sockets (16
+ * by default) send cookie requests to the receiver, the given number of them
+ * every ms in total (100 by default). Each request has a new random DHT public
+ * key, so without limits every one of them costs the receiver a Curve25519
+ * shared key computation. For each run the goodput, the share of the time the
+ * receiver was busy and what happened to the cookie requests are reported.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "bench_tools.h"
+
+#include <unistd.h>
+
+#define MAX_FLOOD_SOCKETS 256
+#define PACKET_ID_BENCH 160
+#define PACKET_SIZE 1000
+#define COOKIE_REQUEST_LENGTH (1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES * 2 \
+                               + sizeof(uint64_t) + crypto_box_MACBYTES)
+
+static int run(IP ip, double seconds, unsigned int per_ms, unsigned int num_sockets)
+{
+    Bench_Peer sender, receiver;
+
+    if (bench_peer_init(&sender, ip) == -1 || bench_peer_init(&receiver, ip) == -1) {
+        printf("Failed to create peers\n");
+        return -1;
+    }
+
+    Networking_Core *flooders[MAX_FLOOD_SOCKETS];
+    unsigned int i;
+
+    /* Sources are IPs, so each flood socket gets an address of its own. */
+    IP flooder_ip = ip;
+
+    for (i = 0; i < num_sockets; ++i) {
+        flooder_ip.ip4.uint32 = htonl(ntohl(ip.ip4.uint32) + 1 + i);
+        flooders[i] = new_networking(NULL, flooder_ip, TOX_PORTRANGE_FROM);
+
+        if (flooders[i] == NULL) {
+            printf("Failed to create flood sockets\n");
+            return -1;
+        }
+    }
+
+    if (bench_connect_peers(&sender, &receiver, ip, 0, NULL, NULL) == -1) {
+        printf("Failed to connect\n");
+        return -1;
+    }
+
+    IP_Port ip_port;
+    memset(&ip_port, 0, sizeof(ip_port));
+    ip_port.ip = ip;
+    ip_port.port = receiver.net->port;
+
+    uint8_t packet[PACKET_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = PACKET_ID_BENCH;
+
+    uint8_t request[COOKIE_REQUEST_LENGTH];
+    randombytes(request, sizeof(request));
+    request[0] = NET_PACKET_COOKIE_REQUEST;
+
+    Crypto_Handshake_Stats stats_start, stats;
+    net_crypto_get_handshake_stats(receiver.c, &stats_start);
+    receiver.received = 0;
+    uint64_t requests = 0;
+    double busy = 0;
+    double start = bench_time_seconds();
+    double last = start, elapsed;
+
+    do {
+        while (write_cryptpacket(sender.c, sender.connection_id, packet, sizeof(packet), 1) != -1) {
+        }
+
+        bench_do_peer(&sender);
+
+        /* The requests that should have been sent by now. */
+        double now = bench_time_seconds();
+        uint64_t due = (now - start) * 1000 * per_ms;
+
+        for (; requests < due; ++requests) {
+            randombytes(request + 1, crypto_box_PUBLICKEYBYTES);
+            sendpacket(flooders[requests % num_sockets], ip_port, request, sizeof(request));
+        }
+
+        double busy_start = bench_time_seconds();
+        bench_do_peer(&receiver);
+        busy += bench_time_seconds() - busy_start;
+
+        /* Don't sleep while flooding, or the flood would come in bursts. */
+        if (per_ms == 0 && bench_time_seconds() - last < 0.001) {
+            usleep(1000);
+        }
+
+        last = bench_time_seconds();
+        elapsed = last - start;
+    } while (elapsed < seconds);
+
+    net_crypto_get_handshake_stats(receiver.c, &stats);
+    printf("%10u %10.0f %8.1f%% %10.0f %10.0f %10.0f %10.0f\n", per_ms * 1000, receiver.received / elapsed,
+           100 * busy / elapsed, requests / elapsed, (stats.handled - stats_start.handled) / elapsed,
+           (stats.rate_limited - stats_start.rate_limited) / elapsed,
+           (stats.dropped - stats_start.dropped) / elapsed);
+
+    for (i = 0; i < num_sockets; ++i) {
+        kill_networking(flooders[i]);
+    }
+
+    bench_peer_kill(&sender);
+    bench_peer_kill(&receiver);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 5;
+    unsigned int per_ms = argc > 2 ? atoi(argv[2]) : 100;
+    unsigned int num_sockets = argc > 3 ? atoi(argv[3]) : 16;
+
+    if (num_sockets == 0 || num_sockets > MAX_FLOOD_SOCKETS) {
+        printf("Sockets must be between 1 and %u\n", MAX_FLOOD_SOCKETS);
+        return 1;
+    }
+
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    printf("%u flood sockets on addresses of their own, %.1f s per run\n", num_sockets, seconds);
+    printf("%10s %10s %9s %10s %10s %10s %10s\n", "flood/s", "packets/s", "busy", "sent/s", "handled/s", "limited/s",
+           "dropped/s");
+
+    if (run(ip, seconds, 0, num_sockets) == -1 || run(ip, seconds, per_ms, num_sockets) == -1) {
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,231 @@
+/* net_crypto_lookup_bench.c
+ *
+ * Cost of finding net_crypto connections by public key and by IP_Port.
+ *
+ * Usage: ./net_crypto_lookup_bench [number of connections] [number of lookups]
+ *
+ * A Net_Crypto instance is given 50000 connections (by default), each with a
+ * direct IPv4 ip_port. Then it reports:
+ *
+ *  - lookups by real public key (new_crypto_connection() for a key that
+ *    already has a connection), against the scan of all connections that
+ *    was used before the public key index,
+ *  - UDP data packets demultiplexed to their connection by source ip_port,
+ *    from known and unknown sources, against a BS_LIST find,
+ *  - ip_port changes, against a BS_LIST add and remove, which shift the
+ *    sorted array.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "../toxcore/list.h"
+#include "bench_tools.h"
+
+/* How connections were found by public key before the index. */
+static int flat_find(const Net_Crypto *c, const uint8_t *public_key)
+{
+    uint32_t i;
+
+    for (i = 0; i < c->crypto_connections_length; ++i) {
+        if (c->crypto_connections[i].status != CRYPTO_CONN_NO_CONNECTION) {
+            if (public_key_cmp(public_key, c->crypto_connections[i].public_key) == 0) {
+                return i;
+            }
+        }
+    }
+
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int num = argc > 1 ? atoi(argv[1]) : 50000;
+    unsigned int num_lookups = argc > 2 ? atoi(argv[2]) : 1000000;
+
+    if (num == 0 || num_lookups == 0) {
+        printf("Nothing to do\n");
+        return 1;
+    }
+
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    Networking_Core *net = new_networking(NULL, ip, TOX_PORTRANGE_FROM);
+    DHT *dht = net ? new_DHT(NULL, net) : NULL;
+    TCP_Proxy_Info proxy_info;
+    memset(&proxy_info, 0, sizeof(proxy_info));
+    Net_Crypto *c = dht ? new_net_crypto(NULL, dht, &proxy_info) : NULL;
+
+    if (c == NULL) {
+        printf("Failed to create net_crypto\n");
+        return 1;
+    }
+
+    uint8_t (*keys)[crypto_box_PUBLICKEYBYTES] = malloc(num * crypto_box_PUBLICKEYBYTES);
+    IP_Port *ip_ports = malloc(num * sizeof(IP_Port));
+    int *ids = malloc(num * sizeof(int));
+
+    if (keys == NULL || ip_ports == NULL || ids == NULL) {
+        printf("Failed to allocate\n");
+        return 1;
+    }
+
+    unsigned int i;
+    double start = bench_time_seconds();
+    double direct_time = 0;
+
+    for (i = 0; i < num; ++i) {
+        uint8_t dht_public_key[crypto_box_PUBLICKEYBYTES];
+        randombytes(keys[i], crypto_box_PUBLICKEYBYTES);
+        randombytes(dht_public_key, crypto_box_PUBLICKEYBYTES);
+        ids[i] = new_crypto_connection(c, keys[i], dht_public_key);
+
+        double direct_start = bench_time_seconds();
+
+        do {
+            ip_ports[i] = bench_random_ip_port(0);
+        } while (ids[i] != -1 && set_direct_ip_port(c, ids[i], ip_ports[i], 0) != 0);
+
+        direct_time += bench_time_seconds() - direct_start;
+
+        if (ids[i] == -1) {
+            printf("Failed to create connection %u\n", i);
+            return 1;
+        }
+    }
+
+    printf("%u connections made in %.2f s, %.0f ns per set_direct_ip_port()\n", num, bench_time_seconds() - start,
+           direct_time * 1e9 / num);
+
+    /* Public key lookups. */
+    unsigned int wrong = 0;
+    start = bench_time_seconds();
+
+    for (i = 0; i < num_lookups; ++i) {
+        unsigned int n = i % num;
+        wrong += new_crypto_connection(c, keys[n], keys[n]) != ids[n];
+    }
+
+    double index_time = bench_time_seconds() - start;
+    unsigned int num_flat = num_lookups / 100 + 1;
+    start = bench_time_seconds();
+
+    for (i = 0; i < num_flat; ++i) {
+        unsigned int n = random_int() % num;
+        wrong += flat_find(c, keys[n]) != ids[n];
+    }
+
+    double flat_time = bench_time_seconds() - start;
+
+    printf("\nby public key:\n");
+    printf("  index:               %10.0f ns per lookup\n", index_time * 1e9 / num_lookups);
+    printf("  scan:                %10.0f ns per lookup\n", flat_time * 1e9 / num_flat);
+
+    /* UDP demux: data packets are dropped by the connections right after
+     * they are found as none of them is established. */
+    const Packet_Handles *handle = &net->packethandlers[NET_PACKET_CRYPTO_DATA];
+    uint8_t packet[MAX_CRYPTO_DATA_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = NET_PACKET_CRYPTO_DATA;
+
+    start = bench_time_seconds();
+
+    for (i = 0; i < num_lookups; ++i) {
+        handle->function(handle->object, ip_ports[i % num], packet, 100, NULL);
+    }
+
+    double known_time = bench_time_seconds() - start;
+    IP_Port unknown = bench_random_ip_port(0);
+    start = bench_time_seconds();
+
+    for (i = 0; i < num_lookups; ++i) {
+        unknown.port = i;
+        handle->function(handle->object, unknown, packet, 100, NULL);
+    }
+
+    double unknown_time = bench_time_seconds() - start;
+
+    BS_LIST list;
+    bs_list_init(&list, sizeof(IP_Port), 8);
+
+    for (i = 0; i < num; ++i) {
+        bs_list_add(&list, (uint8_t *)&ip_ports[i], ids[i]);
+    }
+
+    start = bench_time_seconds();
+
+    for (i = 0; i < num_lookups; ++i) {
+        unsigned int n = i % num;
+        wrong += bs_list_find(&list, (uint8_t *)&ip_ports[n]) != ids[n];
+    }
+
+    double list_time = bench_time_seconds() - start;
+
+    printf("\nUDP packets by source ip_port:\n");
+    printf("  index, known source:   %10.0f ns per packet\n", known_time * 1e9 / num_lookups);
+    printf("  index, unknown source: %10.0f ns per packet\n", unknown_time * 1e9 / num_lookups);
+    printf("  BS_LIST find:          %10.0f ns per lookup\n", list_time * 1e9 / num_lookups);
+
+    /* ip_port changes. */
+    unsigned int num_changes = num < 10000 ? num : 10000;
+    start = bench_time_seconds();
+
+    for (i = 0; i < num_changes; ++i) {
+        IP_Port ip_port = bench_random_ip_port(0);
+
+        if (set_direct_ip_port(c, ids[i], ip_port, 0) == 0) {
+            ip_ports[i] = ip_port;
+        }
+    }
+
+    double change_time = bench_time_seconds() - start;
+    start = bench_time_seconds();
+
+    for (i = 0; i < num_changes; ++i) {
+        IP_Port ip_port = bench_random_ip_port(0);
+
+        if (bs_list_add(&list, (uint8_t *)&ip_port, ids[i])) {
+            bs_list_remove(&list, (uint8_t *)&ip_port, ids[i]);
+        }
+    }
+
+    double list_change_time = bench_time_seconds() - start;
+
+    printf("\nip_port changes:\n");
+    printf("  index:               %10.0f ns per change\n", change_time * 1e9 / num_changes);
+    printf("  BS_LIST add+remove:  %10.0f ns per change\n", list_change_time * 1e9 / num_changes);
+
+    if (wrong) {
+        printf("\n%u lookups found the wrong connection\n", wrong);
+    }
+
+    bs_list_free(&list);
+    free(keys);
+    free(ip_ports);
+    free(ids);
+    kill_net_crypto(c);
+    kill_DHT(dht);
+    kill_networking(net);
+    return 0;
+}
@@ -0,0 +1,182 @@
+/* net_crypto_memory_bench.c
+ *
+ * Memory used by net_crypto connections.
+ *
+ * Usage: ./net_crypto_memory_bench [seconds of transfer] [number of connections ...]
+ *
+ * For each number of connections (1000 and 10000 by default), a Net_Crypto
+ * instance is made to connect to that many peers that never answer, like the
+ * offline friends of a client with a big friend list. The growth of the
+ * resident set size is reported along with the bytes per connection. Each
+ * connection used to embed two packet arrays of CRYPTO_PACKET_BUFFER_SIZE
+ * pointers, which alone is reported for comparison.
+ *
+ * Then two Net_Crypto instances on loopback transfer data over one connection
+ * to show the packet arrays growing while the window fills and shrinking
+ * again once the connection is idle.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "bench_tools.h"
+
+#include <unistd.h>
+
+#define PACKET_ID_BENCH 160
+
+static int idle_connections(IP ip, unsigned int num)
+{
+    Bench_Peer peer;
+
+    if (bench_peer_init(&peer, ip) == -1) {
+        printf("Failed to create peer\n");
+        return -1;
+    }
+
+    uint64_t before = bench_resident_size();
+    double start = bench_time_seconds();
+    unsigned int i;
+
+    for (i = 0; i < num; ++i) {
+        uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+        uint8_t dht_public_key[crypto_box_PUBLICKEYBYTES];
+        randombytes(public_key, sizeof(public_key));
+        randombytes(dht_public_key, sizeof(dht_public_key));
+
+        if (new_crypto_connection(peer.c, public_key, dht_public_key) == -1) {
+            printf("Failed to create connection %u\n", i);
+            return -1;
+        }
+    }
+
+    double elapsed = bench_time_seconds() - start;
+    uint64_t after = bench_resident_size();
+
+    printf("%6u connections: RSS +%8.1f MB, %6.0f bytes per connection, created in %.2f s\n", num,
+           (after - before) / 1e6, (double)(after - before) / num, elapsed);
+    printf("%6s              fixed packet arrays would add %.1f MB\n", "",
+           (double)num * 2 * CRYPTO_PACKET_BUFFER_SIZE * sizeof(Packet_Data *) / 1e6);
+
+    bench_peer_kill(&peer);
+    return 0;
+}
+
+static void print_capacity(const char *when, const Bench_Peer *sender, const Bench_Peer *receiver, uint32_t send_peak,
+                           uint32_t recv_peak)
+{
+    const Crypto_Connection *send_conn = &sender->c->crypto_connections[sender->connection_id];
+    const Crypto_Connection *recv_conn = &receiver->c->crypto_connections[receiver->connection_id];
+
+    printf("%-20s send array %5u slots (peak %5u), receive array %5u slots (peak %5u)\n", when,
+           send_conn->send_array.capacity, send_peak, recv_conn->recv_array.capacity, recv_peak);
+}
+
+static int transfer(IP ip, double seconds)
+{
+    Bench_Peer sender, receiver;
+
+    if (bench_peer_init(&sender, ip) == -1 || bench_peer_init(&receiver, ip) == -1) {
+        printf("Failed to create peers\n");
+        return -1;
+    }
+
+    if (bench_connect_peers(&sender, &receiver, ip, 0, NULL, NULL) == -1) {
+        printf("Failed to connect\n");
+        return -1;
+    }
+
+    print_capacity("connected:", &sender, &receiver, 0, 0);
+
+    uint8_t packet[MAX_CRYPTO_DATA_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = PACKET_ID_BENCH;
+
+    uint32_t send_peak = 0, recv_peak = 0;
+    double start = bench_time_seconds();
+
+    while (bench_time_seconds() - start < seconds) {
+        while (!max_speed_reached(sender.c, sender.connection_id)) {
+            if (write_cryptpacket(sender.c, sender.connection_id, packet, sizeof(packet), 1) == -1) {
+                break;
+            }
+        }
+
+        bench_do_peers(&sender, &receiver);
+
+        const Crypto_Connection *send_conn = &sender.c->crypto_connections[sender.connection_id];
+        const Crypto_Connection *recv_conn = &receiver.c->crypto_connections[receiver.connection_id];
+
+        if (send_conn->send_array.capacity > send_peak) {
+            send_peak = send_conn->send_array.capacity;
+        }
+
+        if (recv_conn->recv_array.capacity > recv_peak) {
+            recv_peak = recv_conn->recv_array.capacity;
+        }
+    }
+
+    printf("%.1f MB/s over %.1f s\n", receiver.received_bytes / seconds / 1e6, seconds);
+    print_capacity("after transfer:", &sender, &receiver, send_peak, recv_peak);
+
+    start = bench_time_seconds();
+
+    while (bench_time_seconds() - start < 3) {
+        bench_do_peers(&sender, &receiver);
+        usleep(1000);
+    }
+
+    print_capacity("idle for 3 s:", &sender, &receiver, send_peak, recv_peak);
+
+    bench_peer_kill(&sender);
+    bench_peer_kill(&receiver);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 10;
+
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    if (argc > 2) {
+        int i;
+
+        for (i = 2; i < argc; ++i) {
+            if (idle_connections(ip, atoi(argv[i])) == -1) {
+                return 1;
+            }
+        }
+    } else if (idle_connections(ip, 1000) == -1 || idle_connections(ip, 10000) == -1) {
+        return 1;
+    }
+
+    printf("\n");
+
+    if (transfer(ip, seconds) == -1) {
+        return 1;
+    }
+
+    return 0;
+}
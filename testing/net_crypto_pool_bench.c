@@ -0,0 +1,171 @@
+/* net_crypto_pool_bench.c
+ *
+ * Allocation cost of the net_crypto packet buffers.
+ *
+ * Usage: ./net_crypto_pool_bench [seconds] [1 to use huge pages]
+ *
+ * Two Net_Crypto instances are connected to each other on loopback and one
+ * sends lossless packets to the other as fast as congestion control lets it.
+ * Every packet sent and received takes a buffer from the Net_Crypto packet
+ * pool, which used to be a malloc()/free() pair each. The throughput is
+ * reported along with how many buffers were taken from the pool and how many
+ * times the pool had to ask the system for memory.
+ *
+ * The alloc/free pattern of the transfer, buffers freed in the order they were
+ * taken with a window of them in use, is then timed for the pool and for
+ * malloc()/free().
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "bench_tools.h"
+
+#define PACKET_ID_BENCH 160
+
+/* Buffers in use at once in the alloc/free timings. */
+#define WINDOW_SIZE 1024
+
+static void print_stats(const char *name, Net_Crypto *c, double seconds)
+{
+    Packet_Pool_Stats stats;
+    packet_pool_get_stats(c->packet_pool, &stats);
+    printf("%-9s %10.0f buffers/s from the pool, %llu slab allocations, peak %u buffers, %u slabs (%u huge)\n",
+           name, stats.allocations / seconds, (unsigned long long)stats.slab_allocations, stats.items_peak,
+           stats.slabs, stats.hugepage_slabs);
+}
+
+static int transfer(Bench_Peer *sender, Bench_Peer *receiver, IP ip, double seconds)
+{
+    if (bench_connect_peers(sender, receiver, ip, 0, NULL, NULL) == -1) {
+        printf("Failed to connect\n");
+        return -1;
+    }
+
+    uint8_t packet[MAX_CRYPTO_DATA_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = PACKET_ID_BENCH;
+
+    double start = bench_time_seconds();
+    double elapsed;
+
+    do {
+        while (!max_speed_reached(sender->c, sender->connection_id)) {
+            if (write_cryptpacket(sender->c, sender->connection_id, packet, sizeof(packet), 1) == -1) {
+                break;
+            }
+        }
+
+        bench_do_peers(sender, receiver);
+        elapsed = bench_time_seconds() - start;
+    } while (elapsed < seconds);
+
+    printf("%.1f MB/s over %.1f s\n", receiver->received_bytes / elapsed / 1e6, elapsed);
+    print_stats("sender", sender->c, elapsed);
+    print_stats("receiver", receiver->c, elapsed);
+    return 0;
+}
+
+/* return nanoseconds per alloc/free pair, from pool or from malloc() if pool
+ * is NULL. */
+static double measure_alloc(Packet_Pool *pool, unsigned int num)
+{
+    static void *window[WINDOW_SIZE];
+    unsigned int i;
+
+    for (i = 0; i < WINDOW_SIZE; ++i) {
+        window[i] = pool ? packet_pool_alloc(pool) : malloc(sizeof(Packet_Data));
+    }
+
+    double start = bench_time_seconds();
+
+    for (i = 0; i < num; ++i) {
+        void **item = &window[i % WINDOW_SIZE];
+
+        if (pool) {
+            packet_pool_free(pool, *item);
+            *item = packet_pool_alloc(pool);
+        } else {
+            free(*item);
+            *item = malloc(sizeof(Packet_Data));
+        }
+
+        /* Touch it like a packet would be. */
+        ((Packet_Data *)*item)->length = i;
+    }
+
+    double elapsed = bench_time_seconds() - start;
+
+    for (i = 0; i < WINDOW_SIZE; ++i) {
+        if (pool) {
+            packet_pool_free(pool, window[i]);
+        } else {
+            free(window[i]);
+        }
+    }
+
+    return elapsed * 1e9 / num;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 15;
+    _Bool hugepages = argc > 2 ? atoi(argv[2]) : 0;
+
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    Bench_Peer sender, receiver;
+
+    if (bench_peer_init(&sender, ip) == -1 || bench_peer_init(&receiver, ip) == -1) {
+        printf("Failed to create peers\n");
+        return 1;
+    }
+
+    packet_pool_use_hugepages(sender.c->packet_pool, hugepages);
+    packet_pool_use_hugepages(receiver.c->packet_pool, hugepages);
+
+    if (transfer(&sender, &receiver, ip, seconds) == -1) {
+        return 1;
+    }
+
+    bench_peer_kill(&sender);
+    bench_peer_kill(&receiver);
+
+    Packet_Pool *pool = new_packet_pool(sizeof(Packet_Data));
+
+    if (pool == NULL) {
+        printf("Failed to create pool\n");
+        return 1;
+    }
+
+    packet_pool_use_hugepages(pool, hugepages);
+
+    unsigned int num = 10000000;
+    printf("\n%u buffers of %lu bytes in use\n", WINDOW_SIZE, (unsigned long)sizeof(Packet_Data));
+    printf("packet pool:    %6.1f ns per alloc/free\n", measure_alloc(pool, num));
+    printf("malloc/free:    %6.1f ns per alloc/free\n", measure_alloc(NULL, num));
+
+    kill_packet_pool(pool);
+    return 0;
+}
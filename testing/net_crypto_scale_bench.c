@@ -0,0 +1,497 @@
+/* net_crypto_scale_bench.c
+ *
+ * Throughput, latency and cost of net_crypto against the number of
+ * connections.
+ *
+ * Usage: ./net_crypto_scale_bench [seconds] [loss percent] [delay ms] [packets per s] [lossy percent]
+ *                                 [connections ...]
+ *
+ * For each number of connections (1, 10, 100 and 500 by default) enough
+ * Net_Crypto instances to make them are created on loopback and connected to
+ * each other directly, without the DHT or onion. The instance that made each
+ * connection then sends packets of MAX_CRYPTO_DATA_SIZE bytes on it, the
+ * given number per second or, with 0 (the default), as many as congestion
+ * control lets it, for the given number of seconds (10 by default). The given
+ * share of them (10% by default) are lossy packets, the others lossless. The
+ * data packets each instance receives are dropped at random with the given
+ * probability (0 by default) and held for the given delay (0 by default)
+ * before net_crypto sees them.
+ *
+ * For each run the time it took to connect, the goodput, the share of the
+ * lossy packets that arrived, the median and 99th percentile time from
+ * writing a packet to reading it (lossless ones include the time spent in the
+ * send queue), the CPU time per MB received and the resident memory (total and
+ * per connection) are reported.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "bench_tools.h"
+
+#include <unistd.h>
+
+#define PACKET_ID_BENCH 160
+#define PACKET_ID_LOSSY_BENCH 200
+
+/* Packets the instances can hold back for the delay, together. */
+#define DELAY_QUEUE_SIZE 16384
+
+/* Packets written on a connection in a row before going to the next one. */
+#define MAX_BURST 64
+
+/* Latencies are counted in buckets of 10 us up to 100 ms, then of 1 ms up to
+ * 10 s. */
+#define FINE_BUCKETS 10000
+#define NUM_BUCKETS (FINE_BUCKETS + 9900)
+
+typedef struct {
+    uint64_t counts[NUM_BUCKETS];
+    uint64_t total;
+} Histogram;
+
+typedef struct Bench Bench;
+
+typedef struct {
+    Bench_Peer peer;
+    Bench *bench;
+
+    Packet_Handles handle; /* Of the data packets, called after the loss and delay. */
+} Peer;
+
+typedef struct {
+    uint64_t deliver_time; /* in us */
+    Peer *peer;
+    IP_Port source;
+    uint16_t length;
+    uint8_t data[MAX_CRYPTO_PACKET_SIZE];
+} Delayed_Packet;
+
+typedef struct {
+    Peer *sender, *receiver;
+    int connection_id;
+    uint64_t sent;
+} Connection;
+
+struct Bench {
+    double loss;
+    uint64_t delay; /* in us */
+    unsigned int lossy_percent;
+
+    /* The delay is the same for every packet so they are delivered in the
+     * order they were received. */
+    Delayed_Packet *queue;
+    uint32_t start, end;
+
+    _Bool measuring;
+    uint64_t received_bytes, lossy_sent, lossy_received;
+    Histogram lossless, lossy;
+};
+
+static void histogram_add(Histogram *histogram, uint64_t us)
+{
+    uint32_t bucket;
+
+    if (us < FINE_BUCKETS * 10) {
+        bucket = us / 10;
+    } else {
+        bucket = FINE_BUCKETS + (us - FINE_BUCKETS * 10) / 1000;
+
+        if (bucket >= NUM_BUCKETS) {
+            bucket = NUM_BUCKETS - 1;
+        }
+    }
+
+    ++histogram->counts[bucket];
+    ++histogram->total;
+}
+
+/* return the upper bound in ms of the bucket the given share of the samples are in or below. */
+static double histogram_percentile(const Histogram *histogram, double share)
+{
+    uint64_t target = histogram->total * share, count = 0;
+    uint32_t i;
+
+    for (i = 0; i < NUM_BUCKETS; ++i) {
+        count += histogram->counts[i];
+
+        if (count > target) {
+            break;
+        }
+    }
+
+    if (i < FINE_BUCKETS) {
+        return (i + 1) / 100.0;
+    }
+
+    return 100 + (i - FINE_BUCKETS + 1);
+}
+
+static void print_percentiles(const Histogram *histogram)
+{
+    if (histogram->total == 0) {
+        printf(" %9s %9s", "-", "-");
+        return;
+    }
+
+    printf(" %9.2f %9.2f", histogram_percentile(histogram, 0.5), histogram_percentile(histogram, 0.99));
+}
+
+static void write_time(uint8_t *packet)
+{
+    uint64_t now = bench_time_us();
+    memcpy(packet + 1, &now, sizeof(now));
+}
+
+static void count_packet(Bench *bench, Histogram *histogram, const uint8_t *data, uint16_t length)
+{
+    if (!bench->measuring || length < 1 + sizeof(uint64_t)) {
+        return;
+    }
+
+    uint64_t sent_time;
+    memcpy(&sent_time, data + 1, sizeof(sent_time));
+    histogram_add(histogram, bench_time_us() - sent_time);
+    bench->received_bytes += length;
+}
+
+static int handle_data(void *object, int id, const uint8_t *data, uint16_t length, void *userdata)
+{
+    Bench *bench = object;
+    count_packet(bench, &bench->lossless, data, length);
+    return 0;
+}
+
+static int handle_lossy_data(void *object, int id, const uint8_t *data, uint16_t length)
+{
+    Bench *bench = object;
+
+    if (bench->measuring) {
+        ++bench->lossy_received;
+    }
+
+    count_packet(bench, &bench->lossy, data, length);
+    return 0;
+}
+
+/* Drop the data packet or hold it for the delay. */
+static int handle_impaired_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
+                                  void *userdata)
+{
+    Peer *peer = object;
+    Bench *bench = peer->bench;
+
+    if (random_int() < bench->loss * UINT32_MAX) {
+        return 1;
+    }
+
+    if (bench->delay == 0) {
+        return peer->handle.function(peer->handle.object, source, packet, length, userdata);
+    }
+
+    if (bench->end - bench->start == DELAY_QUEUE_SIZE || length > MAX_CRYPTO_PACKET_SIZE) {
+        return 1;
+    }
+
+    Delayed_Packet *delayed = &bench->queue[bench->end % DELAY_QUEUE_SIZE];
+    delayed->deliver_time = bench_time_us() + bench->delay;
+    delayed->peer = peer;
+    delayed->source = source;
+    delayed->length = length;
+    memcpy(delayed->data, packet, length);
+    ++bench->end;
+    return 0;
+}
+
+static int init_peer(Peer *peer, Bench *bench, IP ip)
+{
+    memset(peer, 0, sizeof(Peer));
+    peer->bench = bench;
+
+    if (bench_peer_init(&peer->peer, ip) == -1) {
+        return -1;
+    }
+
+    peer->peer.data_handler = &handle_data;
+    peer->peer.lossy_data_handler = &handle_lossy_data;
+    peer->peer.handler_object = bench;
+
+    if (bench->loss != 0 || bench->delay != 0) {
+        peer->handle = peer->peer.net->packethandlers[NET_PACKET_CRYPTO_DATA];
+        networking_registerhandler(peer->peer.net, NET_PACKET_CRYPTO_DATA, &handle_impaired_packet, peer);
+    }
+
+    return 0;
+}
+
+static void do_peers(Bench *bench, Peer *peers, unsigned int num_peers)
+{
+    uint64_t now = bench_time_us();
+
+    while (bench->start != bench->end && bench->queue[bench->start % DELAY_QUEUE_SIZE].deliver_time <= now) {
+        Delayed_Packet *delayed = &bench->queue[bench->start % DELAY_QUEUE_SIZE];
+        Peer *peer = delayed->peer;
+        peer->handle.function(peer->handle.object, delayed->source, delayed->data, delayed->length, NULL);
+        ++bench->start;
+    }
+
+    unsigned int i;
+
+    for (i = 0; i < num_peers; ++i) {
+        bench_do_peer(&peers[i].peer);
+    }
+}
+
+/* Write the packets due on the connection.
+ *
+ * return 1 if congestion control stopped it before all of them.
+ * return 0 otherwise.
+ */
+static int send_packets(Bench *bench, Connection *conn, uint8_t *packet, uint64_t due)
+{
+    unsigned int i;
+
+    for (i = 0; i < MAX_BURST && conn->sent < due; ++i) {
+        if (random_int() % 100 < bench->lossy_percent) {
+            packet[0] = PACKET_ID_LOSSY_BENCH;
+            write_time(packet);
+
+            if (send_lossy_cryptpacket(conn->sender->peer.c, conn->connection_id, packet, MAX_CRYPTO_DATA_SIZE) == 0) {
+                ++bench->lossy_sent;
+            }
+        } else {
+            if (max_speed_reached(conn->sender->peer.c, conn->connection_id)) {
+                return 1;
+            }
+
+            packet[0] = PACKET_ID_BENCH;
+            write_time(packet);
+
+            if (write_cryptpacket(conn->sender->peer.c, conn->connection_id, packet, MAX_CRYPTO_DATA_SIZE, 1) == -1) {
+                return 1;
+            }
+        }
+
+        ++conn->sent;
+    }
+
+    return 0;
+}
+
+static int run(IP ip, unsigned int num_connections, double seconds, double loss, double delay_ms, double rate,
+               unsigned int lossy_percent)
+{
+    /* Every instance makes a connection to each of the ones after it. */
+    unsigned int num_peers = 2;
+
+    while (num_peers * (num_peers - 1) / 2 < num_connections) {
+        ++num_peers;
+    }
+
+    Bench *bench = calloc(1, sizeof(Bench));
+    Peer *peers = calloc(num_peers, sizeof(Peer));
+    Connection *connections = calloc(num_connections, sizeof(Connection));
+
+    if (bench == NULL || peers == NULL || connections == NULL) {
+        printf("Failed to allocate memory\n");
+        return -1;
+    }
+
+    bench->loss = loss;
+    bench->delay = delay_ms * 1000;
+    bench->lossy_percent = lossy_percent;
+
+    if (bench->delay != 0) {
+        bench->queue = malloc(DELAY_QUEUE_SIZE * sizeof(Delayed_Packet));
+
+        if (bench->queue == NULL) {
+            printf("Failed to allocate memory\n");
+            return -1;
+        }
+    }
+
+    uint64_t memory_start = bench_resident_size();
+    unsigned int i, j, k = 0;
+
+    for (i = 0; i < num_peers; ++i) {
+        if (init_peer(&peers[i], bench, ip) == -1) {
+            printf("Failed to create instance %u\n", i);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < num_peers && k < num_connections; ++i) {
+        for (j = i + 1; j < num_peers && k < num_connections; ++j, ++k) {
+            Connection *conn = &connections[k];
+            conn->sender = &peers[i];
+            conn->receiver = &peers[j];
+            conn->connection_id = bench_new_connection(&conn->sender->peer, &conn->receiver->peer, ip, 0);
+
+            if (conn->connection_id == -1) {
+                printf("Failed to create connection %u\n", k);
+                return -1;
+            }
+        }
+    }
+
+    uint64_t start = bench_time_us();
+    unsigned int established = 0, accepted = 0;
+
+    while (established != num_connections || accepted != num_connections) {
+        if (bench_time_us() - start > 60000000) {
+            printf("Only %u of %u connections made\n", established, num_connections);
+            return -1;
+        }
+
+        do_peers(bench, peers, num_peers);
+        usleep(500);
+        established = 0;
+        accepted = 0;
+
+        for (i = 0; i < num_peers; ++i) {
+            accepted += peers[i].peer.accepted;
+        }
+
+        for (k = 0; k < num_connections; ++k) {
+            if (crypto_connection_status(connections[k].sender->peer.c, connections[k].connection_id, NULL,
+                                         NULL) == CRYPTO_CONN_ESTABLISHED) {
+                ++established;
+            }
+        }
+    }
+
+    double connect_time = (bench_time_us() - start) / 1e6;
+    uint64_t memory_connected = bench_resident_size();
+
+    uint8_t packet[MAX_CRYPTO_DATA_SIZE];
+    memset(packet, 0, sizeof(packet));
+
+    bench->measuring = 1;
+    double cpu_start = bench_cpu_seconds();
+    start = bench_time_us();
+    uint64_t now = start, end = start + seconds * 1000000;
+
+    while (now < end) {
+        uint64_t due = rate == 0 ? UINT64_MAX : (now - start) * rate / 1000000;
+        _Bool blocked = 1;
+
+        for (k = 0; k < num_connections; ++k) {
+            if (send_packets(bench, &connections[k], packet, due) == 0) {
+                blocked = 0;
+            }
+        }
+
+        do_peers(bench, peers, num_peers);
+
+        /* Don't spin while waiting for the next packets to be due. */
+        if (rate != 0 && !blocked) {
+            usleep(100);
+        }
+
+        now = bench_time_us();
+    }
+
+    bench->measuring = 0;
+    double elapsed = (now - start) / 1e6;
+    double cpu = bench_cpu_seconds() - cpu_start;
+    double megabytes = bench->received_bytes / 1e6;
+    uint64_t memory_end = bench_resident_size();
+
+    printf("%11u %9u %9.2f %9.2f", num_connections, num_peers, connect_time, megabytes / elapsed);
+
+    if (bench->lossy_sent != 0) {
+        printf(" %6.1f%%", 100.0 * bench->lossy_received / bench->lossy_sent);
+    } else {
+        printf(" %7s", "-");
+    }
+
+    print_percentiles(&bench->lossless);
+    print_percentiles(&bench->lossy);
+
+    printf(" %10.1f %8.1f %8.1f\n", megabytes > 0 ? cpu * 1000 / megabytes : 0, memory_end / 1e6,
+           memory_connected > memory_start ? (memory_connected - memory_start) / 1e3 / num_connections : 0);
+    fflush(stdout);
+
+    for (i = 0; i < num_peers; ++i) {
+        bench_peer_kill(&peers[i].peer);
+    }
+
+    free(connections);
+    free(peers);
+    free(bench->queue);
+    free(bench);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 10;
+    double loss = argc > 2 ? atof(argv[2]) : 0;
+    double delay = argc > 3 ? atof(argv[3]) : 0;
+    double rate = argc > 4 ? atof(argv[4]) : 0;
+    int lossy_percent = argc > 5 ? atoi(argv[5]) : 10;
+    unsigned int default_connections[] = {1, 10, 100, 500};
+    unsigned int num_runs = sizeof(default_connections) / sizeof(unsigned int);
+    unsigned int *connections = default_connections;
+
+    if (argc > 6) {
+        num_runs = argc - 6;
+        connections = malloc(num_runs * sizeof(unsigned int));
+
+        unsigned int i;
+
+        for (i = 0; i < num_runs; ++i) {
+            connections[i] = atoi(argv[i + 6]);
+        }
+    }
+
+    if (seconds <= 0 || loss < 0 || loss >= 100 || delay < 0 || rate < 0 || lossy_percent < 0 || lossy_percent > 100) {
+        printf("Nothing to do\n");
+        return 1;
+    }
+
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    printf("%.1f%% loss, %.0f ms delay, ", loss, delay);
+
+    if (rate != 0) {
+        printf("%.0f packets/s per connection, ", rate);
+    } else {
+        printf("as fast as congestion control allows, ");
+    }
+
+    printf("%d%% lossy, %.0f s per run\n", lossy_percent, seconds);
+    printf("%11s %9s %9s %9s %7s %9s %9s %9s %9s %10s %8s %8s\n", "connections", "instances", "connect s", "MB/s",
+           "lossy", "p50 ms", "p99 ms", "lossy p50", "lossy p99", "CPU ms/MB", "RSS MB", "KB/conn");
+
+    unsigned int i;
+
+    for (i = 0; i < num_runs; ++i) {
+        if (connections[i] == 0 || run(ip, connections[i], seconds, loss / 100.0, delay, rate, lossy_percent) == -1) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
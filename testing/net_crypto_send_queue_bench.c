@@ -0,0 +1,231 @@
+/* net_crypto_send_queue_bench.c
+ *
+ * Latency of send_lossy_cryptpacket() with threads sending at the same time.
+ *
+ * Usage: ./net_crypto_send_queue_bench [seconds] [packet size] [packets per ms]
+ *
+ * Two Net_Crypto instances are connected to each other on loopback and, while
+ * the main thread runs them, 1, 2 and then 4 threads (like the audio and video
+ * threads of a couple of calls) send lossy packets of the given size (1000
+ * bytes by default) on the connection, the given number of them every ms
+ * each or, with 0 (the default), as fast as they can. For each run the time
+ * a send_lossy_cryptpacket() call takes (median, 99th percentile and max),
+ * the calls per second and the packets per second the other side got are
+ * reported.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "bench_tools.h"
+
+#include <unistd.h>
+
+#define MAX_THREADS 4
+#define MAX_SAMPLES (1 << 20)
+#define PACKET_ID_BENCH 200
+
+typedef struct {
+    Net_Crypto *c;
+    int connection_id;
+    uint16_t size;
+    unsigned int per_ms;
+    volatile int *stop;
+
+    uint64_t calls, failed;
+    uint32_t num_samples;
+    double *samples; /* Call times in us, the first MAX_SAMPLES. */
+} Sender;
+
+static void *send_thread(void *arg)
+{
+    Sender *sender = arg;
+    uint8_t packet[MAX_CRYPTO_DATA_SIZE];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = PACKET_ID_BENCH;
+
+    while (!*sender->stop) {
+        unsigned int i;
+
+        for (i = 0; sender->per_ms == 0 || i < sender->per_ms; ++i) {
+            double start = bench_time_seconds();
+
+            if (send_lossy_cryptpacket(sender->c, sender->connection_id, packet, sender->size) == -1) {
+                ++sender->failed;
+            }
+
+            double end = bench_time_seconds();
+
+            if (sender->num_samples < MAX_SAMPLES) {
+                sender->samples[sender->num_samples++] = (end - start) * 1e6;
+            }
+
+            ++sender->calls;
+
+            if (*sender->stop) {
+                break;
+            }
+        }
+
+        if (sender->per_ms != 0) {
+            usleep(1000);
+        }
+    }
+
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int run(IP ip, unsigned int num_threads, double seconds, uint16_t size, unsigned int per_ms)
+{
+    Bench_Peer sender, receiver;
+
+    if (bench_peer_init(&sender, ip) == -1 || bench_peer_init(&receiver, ip) == -1) {
+        printf("Failed to create peers\n");
+        return -1;
+    }
+
+    if (bench_connect_peers(&sender, &receiver, ip, 0, NULL, NULL) == -1) {
+        printf("Failed to connect\n");
+        return -1;
+    }
+
+    volatile int stop = 0;
+    Sender senders[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    unsigned int i;
+
+    for (i = 0; i < num_threads; ++i) {
+        memset(&senders[i], 0, sizeof(Sender));
+        senders[i].c = sender.c;
+        senders[i].connection_id = sender.connection_id;
+        senders[i].size = size;
+        senders[i].per_ms = per_ms;
+        senders[i].stop = &stop;
+        senders[i].samples = malloc(MAX_SAMPLES * sizeof(double));
+
+        if (senders[i].samples == NULL || pthread_create(&threads[i], NULL, &send_thread, &senders[i]) != 0) {
+            printf("Failed to start thread\n");
+            return -1;
+        }
+    }
+
+    double start = bench_time_seconds();
+
+    while (bench_time_seconds() - start < seconds) {
+        bench_do_peers(&sender, &receiver);
+        usleep(1000);
+    }
+
+    stop = 1;
+
+    for (i = 0; i < num_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    double elapsed = bench_time_seconds() - start;
+
+    /* Let the last packets arrive. */
+    for (i = 0; i < 50; ++i) {
+        bench_do_peers(&sender, &receiver);
+        usleep(1000);
+    }
+
+    uint64_t calls = 0, failed = 0;
+    uint32_t num_samples = 0;
+
+    for (i = 0; i < num_threads; ++i) {
+        calls += senders[i].calls;
+        failed += senders[i].failed;
+        num_samples += senders[i].num_samples;
+    }
+
+    double *samples = malloc(num_samples * sizeof(double) + 1);
+
+    if (samples == NULL) {
+        return -1;
+    }
+
+    num_samples = 0;
+
+    for (i = 0; i < num_threads; ++i) {
+        memcpy(samples + num_samples, senders[i].samples, senders[i].num_samples * sizeof(double));
+        num_samples += senders[i].num_samples;
+        free(senders[i].samples);
+    }
+
+    qsort(samples, num_samples, sizeof(double), &cmp_double);
+
+    if (num_samples != 0) {
+        printf("%7u %9.2f %9.2f %10.1f %10.0f %10.0f %8llu\n", num_threads, samples[num_samples / 2],
+               samples[num_samples * 99 / 100], samples[num_samples - 1], calls / elapsed, receiver.received / elapsed,
+               (unsigned long long)failed);
+    }
+
+    free(samples);
+    bench_peer_kill(&sender);
+    bench_peer_kill(&receiver);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 5;
+    int size = argc > 2 ? atoi(argv[2]) : 1000;
+    unsigned int per_ms = argc > 3 ? atoi(argv[3]) : 0;
+
+    if (size < 1 || size > MAX_CRYPTO_DATA_SIZE) {
+        printf("Packet size must be between 1 and %u\n", (unsigned int)MAX_CRYPTO_DATA_SIZE);
+        return 1;
+    }
+
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    printf("%d byte packets, ", size);
+
+    if (per_ms) {
+        printf("%u per ms per thread, ", per_ms);
+    } else {
+        printf("as fast as possible, ");
+    }
+
+    printf("%.1f s per run\n", seconds);
+    printf("%7s %9s %9s %10s %10s %10s %8s\n", "threads", "p50 us", "p99 us", "max us", "calls/s", "recv/s",
+           "failed");
+
+    unsigned int num_threads;
+
+    for (num_threads = 1; num_threads <= MAX_THREADS; num_threads *= 2) {
+        if (run(ip, num_threads, seconds, size, per_ms) == -1) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
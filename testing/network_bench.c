@@ -0,0 +1,201 @@
+/* network_bench.c
+ *
+ * Packets-per-second benchmark for the UDP receive and transmit paths.
+ *
+ * Usage: ./network_bench [number of packets] [packet size]
+ *
+ * Receive: floods a loopback socket in bursts and measures how fast
+ * networking_poll() drains it, once with per-datagram recvfrom() and once for
+ * each batched receive size.
+ *
+ * Transmit: sends bursts through sendpacket() + networking_flush() for each
+ * transmit queue size, once to a single destination (coalescable with UDP GSO)
+ * and once round-robin over several destinations like the DHT does, and
+ * reports how many syscalls the queue saved.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "bench_tools.h"
+
+/* Packets sent before each networking_poll(), kept well below what fits in
+ * the 2 MiB socket receive buffer so nothing is dropped. */
+#define BURST_SIZE 512
+
+#define BENCH_PACKET_ID 200
+
+#define NUM_DESTINATIONS 4
+
+static uint64_t packets_received;
+
+static int handle_bench_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    ++packets_received;
+    return 0;
+}
+
+static void run_recv(Networking_Core *sender, Networking_Core *receiver, IP ip, uint16_t batch_size,
+                uint32_t num_packets, uint16_t packet_size)
+{
+    if (networking_set_recv_batch(receiver, batch_size) != 0) {
+        printf("Failed to set batch size %u\n", batch_size);
+        return;
+    }
+
+    IP_Port ip_port;
+    ip_port.ip = ip;
+    ip_port.port = receiver->port;
+
+    uint8_t packet[MAX_UDP_PACKET_SIZE] = {BENCH_PACKET_ID};
+    uint32_t sent = 0;
+    double recv_time = 0;
+    packets_received = 0;
+
+    while (sent < num_packets) {
+        uint32_t i;
+
+        for (i = 0; i < BURST_SIZE && sent < num_packets; ++i, ++sent) {
+            sendpacket(sender, ip_port, packet, packet_size);
+        }
+
+        double start = bench_time_seconds();
+        networking_poll(receiver, NULL);
+        recv_time += bench_time_seconds() - start;
+    }
+
+    printf("recv batch %3u: %8.0f packets/s (%llu/%u received)\n", batch_size,
+           packets_received / recv_time, (unsigned long long)packets_received, num_packets);
+}
+
+static void drain(Networking_Core **receivers, uint16_t num_receivers)
+{
+    uint16_t i;
+
+    for (i = 0; i < num_receivers; ++i) {
+        networking_poll(receivers[i], NULL);
+    }
+}
+
+static void run_send(Networking_Core *sender, Networking_Core **receivers, uint16_t num_receivers, IP ip,
+                     uint16_t batch_size, uint32_t num_packets, uint16_t packet_size)
+{
+    if (networking_set_send_batch(sender, batch_size) != 0) {
+        printf("Failed to set queue size %u\n", batch_size);
+        return;
+    }
+
+    memset(&sender->send_stats, 0, sizeof(sender->send_stats));
+
+    uint8_t packet[MAX_UDP_PACKET_SIZE] = {BENCH_PACKET_ID};
+    uint32_t sent = 0;
+    double send_time = 0;
+
+    while (sent < num_packets) {
+        double start = bench_time_seconds();
+        uint32_t i;
+
+        for (i = 0; i < BURST_SIZE && sent < num_packets; ++i, ++sent) {
+            IP_Port ip_port;
+            ip_port.ip = ip;
+            ip_port.port = receivers[sent % num_receivers]->port;
+            sendpacket(sender, ip_port, packet, packet_size);
+        }
+
+        networking_flush(sender);
+        send_time += bench_time_seconds() - start;
+
+        drain(receivers, num_receivers);
+    }
+
+    const Net_Send_Stats *stats = &sender->send_stats;
+
+    if (batch_size <= 1) {
+        printf("send queue %3u, %u dest: %8.0f packets/s (1 syscall per packet)\n", batch_size, num_receivers,
+               num_packets / send_time);
+    } else {
+        printf("send queue %3u, %u dest: %8.0f packets/s, %.3f syscalls per packet, %.1f syscalls saved per flush\n",
+               batch_size, num_receivers, num_packets / send_time, (double)stats->syscalls / stats->packets,
+               (double)(stats->packets - stats->syscalls) / stats->flushes);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t num_packets = argc > 1 ? atoi(argv[1]) : 1000000;
+    uint16_t packet_size = argc > 2 ? atoi(argv[2]) : 100;
+
+    if (packet_size < 1 || packet_size > MAX_UDP_PACKET_SIZE) {
+        printf("Packet size must be between 1 and %u\n", MAX_UDP_PACKET_SIZE);
+        return 1;
+    }
+
+    IP ip;
+    ip_init(&ip, 0);
+    ip.ip4.uint32 = htonl(0x7F000001);
+
+    Networking_Core *sender = new_networking(NULL, ip, TOX_PORTRANGE_FROM);
+    Networking_Core *receivers[NUM_DESTINATIONS];
+    unsigned int i;
+
+    for (i = 0; i < NUM_DESTINATIONS; ++i) {
+        receivers[i] = new_networking(NULL, ip, TOX_PORTRANGE_FROM);
+
+        if (!receivers[i]) {
+            printf("Failed to create networking\n");
+            return 1;
+        }
+
+        networking_registerhandler(receivers[i], BENCH_PACKET_ID, &handle_bench_packet, NULL);
+        networking_set_recv_batch(receivers[i], MAX_RECV_BATCH_SIZE);
+    }
+
+    if (!sender) {
+        printf("Failed to create networking\n");
+        return 1;
+    }
+
+    printf("%u packets of %u bytes\n", num_packets, packet_size);
+
+    uint16_t recv_batch_sizes[] = {1, 8, 16, 32, MAX_RECV_BATCH_SIZE};
+
+    for (i = 0; i < sizeof(recv_batch_sizes) / sizeof(recv_batch_sizes[0]); ++i) {
+        run_recv(sender, receivers[0], ip, recv_batch_sizes[i], num_packets, packet_size);
+    }
+
+    networking_set_recv_batch(receivers[0], MAX_RECV_BATCH_SIZE);
+
+    uint16_t send_batch_sizes[] = {1, 16, 64, MAX_SEND_BATCH_SIZE};
+
+    for (i = 0; i < sizeof(send_batch_sizes) / sizeof(send_batch_sizes[0]); ++i) {
+        run_send(sender, receivers, 1, ip, send_batch_sizes[i], num_packets, packet_size);
+        run_send(sender, receivers, NUM_DESTINATIONS, ip, send_batch_sizes[i], num_packets, packet_size);
+    }
+
+    kill_networking(sender);
+
+    for (i = 0; i < NUM_DESTINATIONS; ++i) {
+        kill_networking(receivers[i]);
+    }
+
+    return 0;
+}
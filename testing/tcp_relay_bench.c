@@ -0,0 +1,152 @@
+/* tcp_relay_bench.c
+ *
+ * Throughput of the TCP relay server against the size of the packets it
+ * relays.
+ *
+ * Usage: ./tcp_relay_bench [seconds] [pairs] [packet sizes ...]
+ *
+ * A relay (new_TCP_server()) is started on loopback, run by a thread of its
+ * own, and the given number of pairs of clients (16 by default) connect to it
+ * and get routed to each other. For each packet size (64, 256, 1024 and 1400
+ * bytes by default) each client then sends its pair data packets of that size
+ * as fast as the relay takes them for the given number of seconds (5 by
+ * default).
+ *
+ * For each size the data relayed (in Mbit/s and packets/s) and the CPU time
+ * the thread running the relay used per packet are reported. Small packets
+ * show the cost of the syscalls made per packet.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "bench_tools.h"
+
+#define BENCH_PORT 33447
+
+/* Largest data packet a client can send. */
+#define MAX_DATA_SIZE (MAX_PACKET_SIZE - crypto_box_MACBYTES - 1)
+
+/* Send packets of size bytes between the clients for the given time and
+ * report the numbers. */
+static void run(clockid_t relay_cpu_clock, Bench_Relay_Client *clients, unsigned int num_clients, uint16_t size,
+                double seconds)
+{
+    unsigned int i;
+
+    for (i = 0; i < num_clients; ++i) {
+        clients[i].received_packets = 0;
+    }
+
+    uint64_t start = bench_time_us();
+    uint64_t cpu_start = bench_clock_ns(relay_cpu_clock);
+
+    bench_relay_clients_send(clients, num_clients, size, start + seconds * 1e6);
+
+    double elapsed = (bench_time_us() - start) / 1e6;
+    uint64_t cpu = bench_clock_ns(relay_cpu_clock) - cpu_start;
+    uint64_t received = 0;
+
+    for (i = 0; i < num_clients; ++i) {
+        received += clients[i].received_packets;
+    }
+
+    printf("%11u %12.1f %12.0f %20.2f\n", size, received * (double)size * 8 / 1e6 / elapsed, received / elapsed,
+           received ? cpu / 1e3 / received : 0);
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 5;
+    int num_pairs = argc > 2 ? atoi(argv[2]) : 16;
+    unsigned int default_sizes[] = {64, 256, 1024, 1400};
+    unsigned int num_sizes = sizeof(default_sizes) / sizeof(unsigned int);
+    unsigned int *sizes = default_sizes;
+    unsigned int i;
+
+    if (argc > 3) {
+        num_sizes = argc - 3;
+        sizes = malloc(num_sizes * sizeof(unsigned int));
+
+        for (i = 0; i < num_sizes; ++i) {
+            sizes[i] = atoi(argv[i + 3]);
+
+            if (sizes[i] == 0 || sizes[i] > MAX_DATA_SIZE) {
+                printf("Packet sizes must be between 1 and %u\n", MAX_DATA_SIZE);
+                return 1;
+            }
+        }
+    }
+
+    if (seconds <= 0 || num_pairs <= 0 || num_pairs > 10000) {
+        printf("Nothing to do\n");
+        return 1;
+    }
+
+    unix_time_update();
+
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(public_key, secret_key);
+    uint16_t port = BENCH_PORT;
+    TCP_Server *server = new_TCP_server(0, 1, &port, secret_key, NULL);
+
+    if (server == NULL) {
+        printf("Failed to start the relay\n");
+        return 1;
+    }
+
+    /* All the clients connect from the same address at once. */
+    TCP_server_set_handshake_limit(server, 0, 0);
+
+    Bench_Relay_Thread relay_thread;
+    clockid_t relay_cpu_clock;
+
+    if (bench_relay_thread_start(&relay_thread, server) == -1
+            || pthread_getcpuclockid(relay_thread.thread, &relay_cpu_clock) != 0) {
+        return 1;
+    }
+
+    unsigned int num_clients = num_pairs * 2;
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint32 = htonl(0x7F000001);
+    ip_port.port = htons(port);
+
+    Bench_Relay_Client *clients = bench_relay_clients_new(ip_port, public_key, num_pairs);
+
+    if (clients == NULL) {
+        return 1;
+    }
+
+    printf("%d pairs of clients, %.0f s per size\n", num_pairs, seconds);
+    printf("%11s %12s %12s %20s\n", "packet size", "Mbit/s", "packets/s", "relay CPU us/packet");
+
+    for (i = 0; i < num_sizes; ++i) {
+        run(relay_cpu_clock, clients, num_clients, sizes[i], seconds);
+    }
+
+    bench_relay_thread_stop(&relay_thread);
+    bench_relay_clients_kill(clients, num_clients);
+    kill_TCP_server(server);
+    return 0;
+}
@@ -0,0 +1,317 @@
+/* tcp_relay_churn_bench.c
+ *
+ * Cost of clients connecting to and reconnecting to a TCP relay server
+ * against the number of clients connected to it.
+ *
+ * Usage: ./tcp_relay_churn_bench [reconnects] [numbers of clients ...]
+ *
+ * For each number of clients (1000, 2000, 4000 and 8000 by default) a relay
+ * (new_TCP_server()) is started on loopback, run by a thread of its own, and
+ * that many clients connect to it. Then clients picked at random reconnect
+ * with the same key, the given number of times (4000 by default): the relay
+ * finds the old connection of the key, kills it and adds the new one.
+ *
+ * Last, all of them reconnect at once, a reconnect storm.
+ *
+ * For each number of clients the CPU time the thread running the relay used
+ * per connect and per reconnect, the reconnects done per second, and how many
+ * of the clients reconnecting at once got in within 10 seconds and how long
+ * that took are reported. All the clients connect from the same address, the
+ * relay's handshake rate limit is lifted. Each client needs two file
+ * descriptors, the soft limit is raised to the hard one and the numbers of
+ * clients that don't fit are skipped.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "bench_tools.h"
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define BENCH_PORT 33448
+
+/* Clients connecting at the same time, outside of the reconnect storm. */
+#define BATCH_SIZE 64
+
+/* File descriptors kept for everything but the clients. */
+#define RESERVED_FDS 64
+
+typedef struct {
+    TCP_Client_Connection *conn;
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+    _Bool requested;
+    _Bool accepted; /* Got the answer to its routing request. */
+} Client;
+
+static uint8_t server_public_key[crypto_box_PUBLICKEYBYTES];
+static uint8_t other_public_key[crypto_box_PUBLICKEYBYTES];
+static IP_Port server_ip_port;
+
+static int handle_response(void *object, uint8_t connection_id, const uint8_t *public_key)
+{
+    Client *client = object;
+    client->accepted = 1;
+    return 0;
+}
+
+/* (Re)connect the client to the relay.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int connect_client(Client *client)
+{
+    kill_TCP_connection(client->conn);
+    client->conn = new_TCP_connection(server_ip_port, server_public_key, client->public_key, client->secret_key, NULL);
+
+    if (client->conn == NULL) {
+        return -1;
+    }
+
+    routing_response_handler(client->conn, &handle_response, client);
+    client->requested = 0;
+    client->accepted = 0;
+    return 0;
+}
+
+/* Run the clients until the relay accepted all of them: their first packet,
+ * a routing request, is what makes it do that. For at most 10 seconds.
+ *
+ * return the number of clients it accepted.
+ */
+static unsigned int run_clients(Client **clients, unsigned int num_clients)
+{
+    uint64_t end = bench_clock_ns(CLOCK_MONOTONIC) + 10000000000ULL;
+    unsigned int num_done = 0;
+
+    while (bench_clock_ns(CLOCK_MONOTONIC) < end) {
+        unsigned int i;
+        num_done = 0;
+
+        unix_time_update();
+
+        for (i = 0; i < num_clients; ++i) {
+            Client *client = clients[i];
+            do_TCP_connection(client->conn, NULL);
+
+            if (client->conn->status == TCP_CLIENT_CONFIRMED && !client->requested) {
+                client->requested = send_routing_request(client->conn, other_public_key) == 1;
+            }
+
+            num_done += client->accepted;
+        }
+
+        if (num_done == num_clients) {
+            break;
+        }
+
+        usleep(200);
+    }
+
+    return num_done;
+}
+
+/* Run all the clients once, so none of them gets timed out by the relay. */
+static void run_idle_clients(Client *clients, unsigned int num_clients, uint64_t *last_run)
+{
+    if (bench_clock_ns(CLOCK_MONOTONIC) < *last_run + 1000000000ULL) {
+        return;
+    }
+
+    unsigned int i;
+
+    for (i = 0; i < num_clients; ++i) {
+        do_TCP_connection(clients[i].conn, NULL);
+    }
+
+    *last_run = bench_clock_ns(CLOCK_MONOTONIC);
+}
+
+static int run(unsigned int num_clients, unsigned int num_reconnects)
+{
+    uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(server_public_key, secret_key);
+    uint16_t port = BENCH_PORT;
+    TCP_Server *server = new_TCP_server(0, 1, &port, secret_key, NULL);
+
+    if (server == NULL) {
+        printf("Failed to start the relay\n");
+        return -1;
+    }
+
+    TCP_server_set_handshake_limit(server, 0, 0);
+
+    Bench_Relay_Thread relay_thread;
+    clockid_t relay_cpu_clock;
+
+    if (bench_relay_thread_start(&relay_thread, server) == -1
+            || pthread_getcpuclockid(relay_thread.thread, &relay_cpu_clock) != 0) {
+        return -1;
+    }
+
+    ip_init(&server_ip_port.ip, 0);
+    server_ip_port.ip.ip4.uint32 = htonl(0x7F000001);
+    server_ip_port.port = htons(port);
+
+    Client *clients = calloc(num_clients, sizeof(Client));
+    Client *batch[BATCH_SIZE];
+    uint64_t last_run = bench_clock_ns(CLOCK_MONOTONIC);
+    unsigned int i, j;
+
+    for (i = 0; i < num_clients; ++i) {
+        crypto_box_keypair(clients[i].public_key, clients[i].secret_key);
+    }
+
+    uint64_t cpu_start = bench_clock_ns(relay_cpu_clock);
+
+    for (i = 0; i < num_clients; i += BATCH_SIZE) {
+        unsigned int batch_size = MIN(BATCH_SIZE, num_clients - i);
+
+        for (j = 0; j < batch_size; ++j) {
+            batch[j] = &clients[i + j];
+
+            if (connect_client(batch[j]) == -1) {
+                printf("Failed to create client %u\n", i + j);
+                return -1;
+            }
+        }
+
+        if (run_clients(batch, batch_size) != batch_size) {
+            printf("Clients failed to connect\n");
+            return -1;
+        }
+
+        run_idle_clients(clients, i, &last_run);
+    }
+
+    double connect_cpu = (bench_clock_ns(relay_cpu_clock) - cpu_start) / 1e3 / num_clients;
+    uint64_t start = bench_clock_ns(CLOCK_MONOTONIC);
+    cpu_start = bench_clock_ns(relay_cpu_clock);
+
+    for (i = 0; i < num_reconnects; i += BATCH_SIZE) {
+        unsigned int batch_size = MIN(BATCH_SIZE, num_reconnects - i);
+
+        /* A client picked twice in a batch would be waited for once. */
+        for (j = 0; j < batch_size; ++j) {
+            batch[j] = &clients[(random_int() % (num_clients / batch_size)) * batch_size + j];
+
+            if (connect_client(batch[j]) == -1) {
+                printf("Failed to recreate a client\n");
+                return -1;
+            }
+        }
+
+        if (run_clients(batch, batch_size) != batch_size) {
+            printf("Clients failed to reconnect\n");
+            return -1;
+        }
+
+        run_idle_clients(clients, num_clients, &last_run);
+    }
+
+    double reconnect_cpu = (bench_clock_ns(relay_cpu_clock) - cpu_start) / 1e3 / num_reconnects;
+    double elapsed = (bench_clock_ns(CLOCK_MONOTONIC) - start) / 1e9;
+
+    Client **storm = malloc(num_clients * sizeof(Client *));
+
+    for (i = 0; i < num_clients; ++i) {
+        storm[i] = &clients[i];
+
+        if (connect_client(storm[i]) == -1) {
+            printf("Failed to recreate a client\n");
+            return -1;
+        }
+    }
+
+    start = bench_clock_ns(CLOCK_MONOTONIC);
+    unsigned int storm_done = run_clients(storm, num_clients);
+    double storm_elapsed = (bench_clock_ns(CLOCK_MONOTONIC) - start) / 1e9;
+    free(storm);
+
+    printf("%8u %22.1f %24.1f %14.0f %16u %10.2f\n", num_clients, connect_cpu, reconnect_cpu, num_reconnects / elapsed,
+           storm_done, storm_elapsed);
+
+    bench_relay_thread_stop(&relay_thread);
+
+    for (i = 0; i < num_clients; ++i) {
+        kill_TCP_connection(clients[i].conn);
+    }
+
+    kill_TCP_server(server);
+    free(clients);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int num_reconnects = argc > 1 ? atoi(argv[1]) : 4000;
+    unsigned int default_clients[] = {1000, 2000, 4000, 8000};
+    unsigned int num_runs = sizeof(default_clients) / sizeof(unsigned int);
+    unsigned int *clients = default_clients;
+    unsigned int i;
+
+    if (argc > 2) {
+        num_runs = argc - 2;
+        clients = malloc(num_runs * sizeof(unsigned int));
+
+        for (i = 0; i < num_runs; ++i) {
+            clients[i] = atoi(argv[i + 2]);
+        }
+    }
+
+    if (num_reconnects <= 0) {
+        printf("Nothing to do\n");
+        return 1;
+    }
+
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+
+    unix_time_update();
+
+    uint8_t other_secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(other_public_key, other_secret_key);
+
+    printf("%d reconnects per run\n", num_reconnects);
+    printf("%8s %22s %24s %14s %16s %10s\n", "clients", "relay CPU us/connect", "relay CPU us/reconnect", "reconnects/s",
+           "storm: got in", "storm: s");
+
+    for (i = 0; i < num_runs; ++i) {
+        if (clients[i] < BATCH_SIZE || (rlim_t)clients[i] * 2 + RESERVED_FDS > limit.rlim_cur) {
+            printf("%8u skipped: between %u and %u clients fit\n", clients[i], BATCH_SIZE,
+                   (unsigned int)((limit.rlim_cur - RESERVED_FDS) / 2));
+            continue;
+        }
+
+        if (run(clients[i], num_reconnects) == -1) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,187 @@
+/* tcp_relay_threads_bench.c
+ *
+ * Throughput of the TCP relay server against its number of threads.
+ *
+ * Usage: ./tcp_relay_threads_bench [seconds] [pairs] [client threads] [server threads ...]
+ *
+ * For each number of server threads (0, 1, 2, 4 and 8 by default, 0 being
+ * new_TCP_server() run by one thread of its own, the others
+ * new_TCP_server_threaded()) a relay is started on loopback and the given
+ * number of pairs of clients (64 by default) connect to it and get routed to
+ * each other. Each client then sends its pair data packets of 1024 bytes as
+ * fast as the relay takes them for the given number of seconds (10 by
+ * default). The clients are run by the given number of threads (4 by
+ * default), both clients of a pair by the same one.
+ *
+ * For each run the data relayed (in Mbit/s and packets/s) and the CPU time
+ * the process used per MB relayed are reported. The clients run in the same
+ * process and use CPU too, so the numbers only mean something with more
+ * cores than server and client threads.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "bench_tools.h"
+
+#define BENCH_PORT 33446
+
+#define DATA_SIZE 1024
+
+typedef struct {
+    Bench_Relay_Client *clients;
+    unsigned int num_clients;
+    uint64_t end;
+    pthread_t thread;
+} Client_Thread;
+
+static void *run_clients(void *arg)
+{
+    Client_Thread *client_thread = arg;
+    bench_relay_clients_send(client_thread->clients, client_thread->num_clients, DATA_SIZE, client_thread->end);
+    return NULL;
+}
+
+static int run(unsigned int num_server_threads, unsigned int num_pairs, unsigned int num_client_threads,
+               double seconds)
+{
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(public_key, secret_key);
+    uint16_t port = BENCH_PORT;
+    Bench_Relay_Thread relay_thread;
+    TCP_Server *server;
+
+    /* With 0 threads new_TCP_server() is run by one thread of its own. */
+    if (num_server_threads == 0) {
+        server = new_TCP_server(0, 1, &port, secret_key, NULL);
+    } else {
+        server = new_TCP_server_threaded(0, 1, &port, secret_key, NULL, num_server_threads);
+    }
+
+    if (server == NULL) {
+        printf("Failed to start the relay with %u threads\n", num_server_threads);
+        return -1;
+    }
+
+    /* All the clients connect from the same address at once. */
+    TCP_server_set_handshake_limit(server, 0, 0);
+
+    if (num_server_threads == 0 && bench_relay_thread_start(&relay_thread, server) == -1) {
+        kill_TCP_server(server);
+        return -1;
+    }
+
+    unsigned int num_clients = num_pairs * 2;
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint32 = htonl(0x7F000001);
+    ip_port.port = htons(port);
+
+    Bench_Relay_Client *clients = bench_relay_clients_new(ip_port, public_key, num_pairs);
+
+    if (clients == NULL) {
+        return -1;
+    }
+
+    Client_Thread *client_threads = calloc(num_client_threads, sizeof(Client_Thread));
+    uint64_t start = bench_time_us();
+    double cpu_start = bench_cpu_seconds();
+    unsigned int i;
+
+    for (i = 0; i < num_client_threads; ++i) {
+        unsigned int first_pair = num_pairs * i / num_client_threads;
+        unsigned int end_pair = num_pairs * (i + 1) / num_client_threads;
+        client_threads[i].clients = clients + first_pair * 2;
+        client_threads[i].num_clients = (end_pair - first_pair) * 2;
+        client_threads[i].end = start + seconds * 1000000;
+        pthread_create(&client_threads[i].thread, NULL, &run_clients, &client_threads[i]);
+    }
+
+    for (i = 0; i < num_client_threads; ++i) {
+        pthread_join(client_threads[i].thread, NULL);
+    }
+
+    double elapsed = (bench_time_us() - start) / 1e6;
+    double cpu = bench_cpu_seconds() - cpu_start;
+    uint64_t received = 0;
+
+    for (i = 0; i < num_clients; ++i) {
+        received += clients[i].received_packets;
+    }
+
+    double mbytes = received * (double)DATA_SIZE / 1e6;
+    printf("%14u %12.1f %12.0f %10.1f\n", num_server_threads, mbytes * 8 / elapsed, received / elapsed,
+           mbytes > 0 ? cpu * 1000 / mbytes : 0);
+
+    if (num_server_threads == 0) {
+        bench_relay_thread_stop(&relay_thread);
+    }
+
+    bench_relay_clients_kill(clients, num_clients);
+    kill_TCP_server(server);
+    free(client_threads);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 10;
+    int num_pairs = argc > 2 ? atoi(argv[2]) : 64;
+    int num_client_threads = argc > 3 ? atoi(argv[3]) : 4;
+    unsigned int default_threads[] = {0, 1, 2, 4, 8};
+    unsigned int num_runs = sizeof(default_threads) / sizeof(unsigned int);
+    unsigned int *threads = default_threads;
+
+    if (argc > 4) {
+        num_runs = argc - 4;
+        threads = malloc(num_runs * sizeof(unsigned int));
+
+        unsigned int i;
+
+        for (i = 0; i < num_runs; ++i) {
+            threads[i] = atoi(argv[i + 4]);
+        }
+    }
+
+    if (seconds <= 0 || num_pairs <= 0 || num_pairs > 100000 || num_client_threads <= 0
+            || num_client_threads > num_pairs) {
+        printf("Nothing to do\n");
+        return 1;
+    }
+
+    unix_time_update();
+
+    printf("%d pairs of clients run by %d threads, %u byte packets, %.0f s per run\n", num_pairs, num_client_threads,
+           DATA_SIZE, seconds);
+    printf("%14s %12s %12s %10s\n", "server threads", "Mbit/s", "packets/s", "CPU ms/MB");
+
+    unsigned int i;
+
+    for (i = 0; i < num_runs; ++i) {
+        if (run(threads[i], num_pairs, num_client_threads, seconds) == -1) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -116,6 +116,178 @@ static unsigned int bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
     return i * 8 + j;
 }
 
+#define SHARED_KEYS_LOCKS 16
+
+typedef struct {
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+} Shared_Key;
+
+typedef struct {
+    uint8_t stored;     /* bit n set if way n holds a key */
+    uint8_t referenced; /* bit n set if way n was used since the clock hand passed it */
+    uint8_t hand;
+} Shared_Keys_Set;
+
+/* Each lock covers every SHARED_KEYS_LOCKS'th set and counts for them. */
+typedef struct {
+    pthread_mutex_t mutex;
+    Shared_Keys_Stats stats;
+} Shared_Keys_Lock;
+
+struct Shared_Keys {
+    Shared_Key *keys; /* SHARED_KEYS_WAYS entries per set, aligned to 64 bytes */
+    void *keys_memory;
+    Shared_Keys_Set *sets;
+    uint32_t set_mask;
+    uint64_t seed[2];
+    Shared_Keys_Lock locks[SHARED_KEYS_LOCKS];
+};
+
+Shared_Keys *new_shared_keys(uint32_t size)
+{
+    uint32_t num_sets = 1;
+
+    while (num_sets * SHARED_KEYS_WAYS < size) {
+        if (num_sets >= (1 << 24)) {
+            return NULL;
+        }
+
+        num_sets *= 2;
+    }
+
+    Shared_Keys *shared_keys = calloc(1, sizeof(Shared_Keys));
+
+    if (shared_keys == NULL) {
+        return NULL;
+    }
+
+    shared_keys->keys_memory = calloc(1, num_sets * SHARED_KEYS_WAYS * sizeof(Shared_Key) + 63);
+    shared_keys->sets = calloc(num_sets, sizeof(Shared_Keys_Set));
+
+    if (shared_keys->keys_memory == NULL || shared_keys->sets == NULL) {
+        free(shared_keys->keys_memory);
+        free(shared_keys->sets);
+        free(shared_keys);
+        return NULL;
+    }
+
+    unsigned int i;
+
+    for (i = 0; i < SHARED_KEYS_LOCKS; ++i) {
+        if (pthread_mutex_init(&shared_keys->locks[i].mutex, NULL) != 0) {
+            while (i--) {
+                pthread_mutex_destroy(&shared_keys->locks[i].mutex);
+            }
+
+            free(shared_keys->keys_memory);
+            free(shared_keys->sets);
+            free(shared_keys);
+            return NULL;
+        }
+    }
+
+    shared_keys->keys = (Shared_Key *)(((uintptr_t)shared_keys->keys_memory + 63) & ~(uintptr_t)63);
+    shared_keys->set_mask = num_sets - 1;
+    shared_keys->seed[0] = random_64b();
+    shared_keys->seed[1] = random_64b();
+    return shared_keys;
+}
+
+void kill_shared_keys(Shared_Keys *shared_keys)
+{
+    if (shared_keys == NULL) {
+        return;
+    }
+
+    unsigned int i;
+
+    for (i = 0; i < SHARED_KEYS_LOCKS; ++i) {
+        pthread_mutex_destroy(&shared_keys->locks[i].mutex);
+    }
+
+    sodium_memzero(shared_keys->keys_memory, (shared_keys->set_mask + 1) * SHARED_KEYS_WAYS * sizeof(Shared_Key) + 63);
+    free(shared_keys->keys_memory);
+    free(shared_keys->sets);
+    free(shared_keys);
+}
+
+static uint32_t shared_keys_set(const Shared_Keys *shared_keys, const uint8_t *public_key)
+{
+    uint64_t a, b;
+    memcpy(&a, public_key, sizeof(a));
+    memcpy(&b, public_key + sizeof(a), sizeof(b));
+
+    uint64_t hash = (a ^ shared_keys->seed[0]) * 0x9E3779B97F4A7C15ULL;
+    hash ^= hash >> 32;
+    hash = (hash ^ b ^ shared_keys->seed[1]) * 0xC2B2AE3D27D4EB4FULL;
+    hash ^= hash >> 29;
+    return hash & shared_keys->set_mask;
+}
+
+/* return the way of set holding public_key, -1 if none. */
+static int shared_keys_find(const Shared_Keys_Set *set, const Shared_Key *keys, const uint8_t *public_key)
+{
+    unsigned int i;
+
+    for (i = 0; i < SHARED_KEYS_WAYS; ++i) {
+        if ((set->stored & (1 << i)) && public_key_cmp(keys[i].public_key, public_key) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* return the way of set to store a new key in, a free one if there is any. */
+static unsigned int shared_keys_victim(Shared_Keys_Set *set)
+{
+    unsigned int i;
+
+    for (i = 0; i < SHARED_KEYS_WAYS; ++i) {
+        if (!(set->stored & (1 << i))) {
+            return i;
+        }
+    }
+
+    while (set->referenced & (1 << set->hand)) {
+        set->referenced &= ~(1 << set->hand);
+        set->hand = (set->hand + 1) % SHARED_KEYS_WAYS;
+    }
+
+    i = set->hand;
+    set->hand = (set->hand + 1) % SHARED_KEYS_WAYS;
+    return i;
+}
+
+/* Store the shared key for public_key in set set_num unless it already is. */
+static void shared_keys_store(Shared_Keys *shared_keys, uint32_t set_num, const uint8_t *shared_key,
+                              const uint8_t *public_key)
+{
+    Shared_Keys_Set *set = &shared_keys->sets[set_num];
+    Shared_Key *keys = &shared_keys->keys[set_num * SHARED_KEYS_WAYS];
+    Shared_Keys_Lock *lock = &shared_keys->locks[set_num % SHARED_KEYS_LOCKS];
+
+    pthread_mutex_lock(&lock->mutex);
+
+    /* Another thread may have stored it in the meantime. */
+    if (shared_keys_find(set, keys, public_key) == -1) {
+        unsigned int victim = shared_keys_victim(set);
+
+        if (set->stored & (1 << victim)) {
+            ++lock->stats.evictions;
+        }
+
+        memcpy(keys[victim].public_key, public_key, crypto_box_PUBLICKEYBYTES);
+        memcpy(keys[victim].shared_key, shared_key, crypto_box_BEFORENMBYTES);
+        set->stored |= 1 << victim;
+        /* Not referenced yet: keys only ever used once go first. */
+        set->referenced &= ~(1 << victim);
+    }
+
+    pthread_mutex_unlock(&lock->mutex);
+}
+
 /* Shared key generations are costly, it is therefor smart to store commonly used
  * ones so that they can re used later without being computed again.
  *
@@ -124,44 +296,91 @@ static unsigned int bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
  */
 void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key, const uint8_t *public_key)
 {
-    uint32_t i, num = ~0, curr = 0;
+    uint32_t set_num = shared_keys_set(shared_keys, public_key);
+    Shared_Keys_Set *set = &shared_keys->sets[set_num];
+    Shared_Key *keys = &shared_keys->keys[set_num * SHARED_KEYS_WAYS];
+    Shared_Keys_Lock *lock = &shared_keys->locks[set_num % SHARED_KEYS_LOCKS];
 
-    for (i = 0; i < MAX_KEYS_PER_SLOT; ++i) {
-        int index = public_key[30] * MAX_KEYS_PER_SLOT + i;
+    pthread_mutex_lock(&lock->mutex);
+    int way = shared_keys_find(set, keys, public_key);
 
-        if (shared_keys->keys[index].stored) {
-            if (public_key_cmp(public_key, shared_keys->keys[index].public_key) == 0) {
-                memcpy(shared_key, shared_keys->keys[index].shared_key, crypto_box_BEFORENMBYTES);
-                ++shared_keys->keys[index].times_requested;
-                shared_keys->keys[index].time_last_requested = unix_time();
-                return;
-            }
+    if (way != -1) {
+        memcpy(shared_key, keys[way].shared_key, crypto_box_BEFORENMBYTES);
+        set->referenced |= 1 << way;
+        ++lock->stats.hits;
+        pthread_mutex_unlock(&lock->mutex);
+        return;
+    }
 
-            if (num != 0) {
-                if (is_timeout(shared_keys->keys[index].time_last_requested, KEYS_TIMEOUT)) {
-                    num = 0;
-                    curr = index;
-                } else if (num > shared_keys->keys[index].times_requested) {
-                    num = shared_keys->keys[index].times_requested;
-                    curr = index;
-                }
-            }
-        } else {
-            if (num != 0) {
-                num = 0;
-                curr = index;
-            }
+    ++lock->stats.misses;
+    pthread_mutex_unlock(&lock->mutex);
+
+    /* Not holding the lock for the expensive part. */
+    encrypt_precompute(public_key, secret_key, shared_key);
+
+    shared_keys_store(shared_keys, set_num, shared_key, public_key);
+}
+
+void shared_keys_prefill(Shared_Keys *shared_keys, const uint8_t *secret_key, const uint8_t *public_keys,
+                         uint32_t num)
+{
+    if (num == 0) {
+        return;
+    }
+
+    uint8_t *missing = malloc(num * crypto_box_PUBLICKEYBYTES);
+    uint8_t *shared = malloc(num * crypto_box_BEFORENMBYTES);
+    uint32_t num_missing = 0;
+    uint32_t i;
+
+    if (missing == NULL || shared == NULL) {
+        free(missing);
+        free(shared);
+        return;
+    }
+
+    for (i = 0; i < num; ++i) {
+        const uint8_t *public_key = public_keys + i * crypto_box_PUBLICKEYBYTES;
+        uint32_t set_num = shared_keys_set(shared_keys, public_key);
+        Shared_Keys_Lock *lock = &shared_keys->locks[set_num % SHARED_KEYS_LOCKS];
+
+        pthread_mutex_lock(&lock->mutex);
+        int way = shared_keys_find(&shared_keys->sets[set_num], &shared_keys->keys[set_num * SHARED_KEYS_WAYS], public_key);
+        pthread_mutex_unlock(&lock->mutex);
+
+        if (way == -1) {
+            memcpy(missing + num_missing * crypto_box_PUBLICKEYBYTES, public_key, crypto_box_PUBLICKEYBYTES);
+            ++num_missing;
         }
     }
 
-    encrypt_precompute(public_key, secret_key, shared_key);
+    if (num_missing != 0) {
+        encrypt_precompute_batch(missing, secret_key, shared, num_missing, 0);
+    }
+
+    for (i = 0; i < num_missing; ++i) {
+        const uint8_t *public_key = missing + i * crypto_box_PUBLICKEYBYTES;
+        shared_keys_store(shared_keys, shared_keys_set(shared_keys, public_key), shared + i * crypto_box_BEFORENMBYTES,
+                          public_key);
+    }
+
+    sodium_memzero(shared, num * crypto_box_BEFORENMBYTES);
+    free(missing);
+    free(shared);
+}
 
-    if (num != (uint32_t)~0) {
-        shared_keys->keys[curr].stored = 1;
-        shared_keys->keys[curr].times_requested = 1;
-        memcpy(shared_keys->keys[curr].public_key, public_key, crypto_box_PUBLICKEYBYTES);
-        memcpy(shared_keys->keys[curr].shared_key, shared_key, crypto_box_BEFORENMBYTES);
-        shared_keys->keys[curr].time_last_requested = unix_time();
+void shared_keys_get_stats(Shared_Keys *shared_keys, Shared_Keys_Stats *stats)
+{
+    memset(stats, 0, sizeof(Shared_Keys_Stats));
+    unsigned int i;
+
+    for (i = 0; i < SHARED_KEYS_LOCKS; ++i) {
+        Shared_Keys_Lock *lock = &shared_keys->locks[i];
+        pthread_mutex_lock(&lock->mutex);
+        stats->hits += lock->stats.hits;
+        stats->misses += lock->stats.misses;
+        stats->evictions += lock->stats.evictions;
+        pthread_mutex_unlock(&lock->mutex);
     }
 }
 
@@ -170,7 +389,7 @@ void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t
  */
 void DHT_get_shared_key_recv(DHT *dht, uint8_t *shared_key, const uint8_t *public_key)
 {
-    get_shared_key(&dht->shared_keys_recv, shared_key, dht->self_secret_key, public_key);
+    get_shared_key(dht->shared_keys_recv, shared_key, dht->self_secret_key, public_key);
 }
 
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
@@ -178,7 +397,66 @@ void DHT_get_shared_key_recv(DHT *dht, uint8_t *shared_key, const uint8_t *publi
  */
 void DHT_get_shared_key_sent(DHT *dht, uint8_t *shared_key, const uint8_t *public_key)
 {
-    get_shared_key(&dht->shared_keys_sent, shared_key, dht->self_secret_key, public_key);
+    get_shared_key(dht->shared_keys_sent, shared_key, dht->self_secret_key, public_key);
+}
+
+/* Get the shared keys for packets we are about to send to num nodes ready in
+ * one go. */
+static void prefill_shared_keys_sent(DHT *dht, const Node_format *nodes, unsigned int num)
+{
+    uint8_t public_keys[MAX_CLOSE_TO_BOOTSTRAP_NODES * crypto_box_PUBLICKEYBYTES];
+    unsigned int i;
+
+    if (num > MAX_CLOSE_TO_BOOTSTRAP_NODES) {
+        num = MAX_CLOSE_TO_BOOTSTRAP_NODES;
+    }
+
+    for (i = 0; i < num; ++i) {
+        memcpy(public_keys + i * crypto_box_PUBLICKEYBYTES, nodes[i].public_key, crypto_box_PUBLICKEYBYTES);
+    }
+
+    shared_keys_prefill(dht->shared_keys_sent, dht->self_secret_key, public_keys, num);
+}
+
+/* Get the shared keys for the nodes of the close and friend to_bootstrap
+ * lists ready in one go, if nodes were put in them since the last time.
+ * Their get nodes requests go out from do_Close() and the friend timers.
+ */
+static void prefill_to_bootstrap(DHT *dht)
+{
+    if (!dht->to_bootstrap_changed) {
+        return;
+    }
+
+    dht->to_bootstrap_changed = 0;
+
+    uint32_t max_num = MAX_CLOSE_TO_BOOTSTRAP_NODES + (uint32_t)dht->num_friends * MAX_SENT_NODES;
+    uint8_t *public_keys = malloc(max_num * crypto_box_PUBLICKEYBYTES);
+
+    if (public_keys == NULL) {
+        return;
+    }
+
+    uint32_t i, j, num = 0;
+
+    for (i = 0; i < dht->num_to_bootstrap; ++i) {
+        memcpy(public_keys + num * crypto_box_PUBLICKEYBYTES, dht->to_bootstrap[i].public_key,
+               crypto_box_PUBLICKEYBYTES);
+        ++num;
+    }
+
+    for (i = 0; i < dht->num_friends; ++i) {
+        const DHT_Friend *friend = &dht->friends_list[i];
+
+        for (j = 0; j < friend->num_to_bootstrap; ++j) {
+            memcpy(public_keys + num * crypto_box_PUBLICKEYBYTES, friend->to_bootstrap[j].public_key,
+                   crypto_box_PUBLICKEYBYTES);
+            ++num;
+        }
+    }
+
+    shared_keys_prefill(dht->shared_keys_sent, dht->self_secret_key, public_keys, num);
+    free(public_keys);
 }
 
 void to_net_family(IP *ip)
@@ -380,7 +658,8 @@ int unpack_nodes(Node_format *nodes, uint16_t max_num_nodes, uint16_t *processed
  * If the id is already in the list with a different ip_port, update it.
  *  TODO: Maybe optimize this.
  *
- *  return True(1) or False(0)
+ *  return index + 1 of the entry that was updated (True).
+ *  return 0 if client isn't in list (False).
  */
 static int client_or_ip_port_in_list(Logger *log, Client_data *list, uint16_t length, const uint8_t *public_key,
                                      IP_Port ip_port)
@@ -401,7 +680,7 @@ static int client_or_ip_port_in_list(Logger *log, Client_data *list, uint16_t le
                 }
 
                 if (LAN_ip(list[i].assoc4.ip_port.ip) != 0 && LAN_ip(ip_port.ip) == 0) {
-                    return 1;
+                    return i + 1;
                 }
 
                 list[i].assoc4.ip_port = ip_port;
@@ -415,14 +694,14 @@ static int client_or_ip_port_in_list(Logger *log, Client_data *list, uint16_t le
                 }
 
                 if (LAN_ip(list[i].assoc6.ip_port.ip) != 0 && LAN_ip(ip_port.ip) == 0) {
-                    return 1;
+                    return i + 1;
                 }
 
                 list[i].assoc6.ip_port = ip_port;
                 list[i].assoc6.timestamp = temp_time;
             }
 
-            return 1;
+            return i + 1;
         }
     }
 
@@ -441,7 +720,7 @@ static int client_or_ip_port_in_list(Logger *log, Client_data *list, uint16_t le
 
             /* kill the other address, if it was set */
             memset(&list[i].assoc6, 0, sizeof(list[i].assoc6));
-            return 1;
+            return i + 1;
         }
 
         if ((ip_port.ip.family == AF_INET6) && ipport_equal(&list[i].assoc6.ip_port, &ip_port)) {
@@ -453,7 +732,7 @@ static int client_or_ip_port_in_list(Logger *log, Client_data *list, uint16_t le
 
             /* kill the other address, if it was set */
             memset(&list[i].assoc4, 0, sizeof(list[i].assoc4));
-            return 1;
+            return i + 1;
         }
     }
 
@@ -494,6 +773,123 @@ static int friend_number(const DHT *dht, const uint8_t *public_key)
     return -1;
 }
 
+uint32_t close_list_bucket(const DHT *dht, const uint8_t *public_key)
+{
+    unsigned int bucket = bit_by_bit_cmp(public_key, dht->self_public_key);
+
+    if (bucket >= LCLIENT_LENGTH) {
+        bucket = LCLIENT_LENGTH - 1;
+    }
+
+    return bucket * LCLIENT_NODES;
+}
+
+/* return the index of the node with public_key in the close list, -1 if it isn't in it. */
+static int close_list_index(const DHT *dht, const uint8_t *public_key)
+{
+    uint32_t bucket = close_list_bucket(dht, public_key);
+    uint32_t i;
+
+    for (i = bucket; i < bucket + LCLIENT_NODES; ++i) {
+        if (id_equal(dht->close_clientlist[i].public_key, public_key)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static _Bool close_ip_port_match(const void *object, uint32_t index, const void *key)
+{
+    const DHT *dht = object;
+    const Client_data *client = &dht->close_clientlist[index];
+    return ipport_equal(&client->assoc4.ip_port, key) || ipport_equal(&client->assoc6.ip_port, key);
+}
+
+/* Index the ip_ports of the close list node index.
+ *
+ * If the index can't grow the node just isn't found by its ip_port, which
+ * only means one that changes its key stays in its old bucket until it
+ * times out.
+ */
+static void close_ip_ports_add(DHT *dht, uint32_t index)
+{
+    const Client_data *client = &dht->close_clientlist[index];
+
+    if (client->assoc4.ip_port.ip.family == AF_INET) {
+        key_index_add(&dht->close_ip_port_index, key_index_hash_ip_port(dht->close_index_seed, &client->assoc4.ip_port),
+                      index);
+    }
+
+    if (client->assoc6.ip_port.ip.family == AF_INET6) {
+        key_index_add(&dht->close_ip_port_index, key_index_hash_ip_port(dht->close_index_seed, &client->assoc6.ip_port),
+                      index);
+    }
+}
+
+/* Call before changing the ip_ports of the close list node index. */
+static void close_ip_ports_remove(DHT *dht, uint32_t index)
+{
+    const Client_data *client = &dht->close_clientlist[index];
+
+    if (client->assoc4.ip_port.ip.family == AF_INET) {
+        key_index_remove(&dht->close_ip_port_index,
+                         key_index_hash_ip_port(dht->close_index_seed, &client->assoc4.ip_port), index);
+    }
+
+    if (client->assoc6.ip_port.ip.family == AF_INET6) {
+        key_index_remove(&dht->close_ip_port_index,
+                         key_index_hash_ip_port(dht->close_index_seed, &client->assoc6.ip_port), index);
+    }
+}
+
+/* Like client_or_ip_port_in_list() for the close list, only looking at the
+ * bucket of public_key.
+ *
+ * A node elsewhere in the list with the same ip_port changed its key and
+ * doesn't belong in its bucket any more, so it is removed.
+ *
+ *  return index + 1 of the entry that was updated.
+ *  return 0 if the node isn't in the close list.
+ */
+static int client_or_ip_port_in_close_list(DHT *dht, const uint8_t *public_key, IP_Port ip_port)
+{
+    uint32_t bucket = close_list_bucket(dht, public_key);
+
+    /* The entry client_or_ip_port_in_list() will update: the one with
+     * public_key, else the first one of the bucket with ip_port. */
+    int changed = close_list_index(dht, public_key);
+    uint32_t i;
+
+    for (i = bucket; changed == -1 && i < bucket + LCLIENT_NODES; ++i) {
+        const Client_data *client = &dht->close_clientlist[i];
+
+        if ((ip_port.ip.family == AF_INET && ipport_equal(&client->assoc4.ip_port, &ip_port))
+                || (ip_port.ip.family == AF_INET6 && ipport_equal(&client->assoc6.ip_port, &ip_port))) {
+            changed = i;
+        }
+    }
+
+    if (changed != -1) {
+        close_ip_ports_remove(dht, changed);
+        int index = client_or_ip_port_in_list(dht->log, &dht->close_clientlist[bucket], LCLIENT_NODES, public_key,
+                                              ip_port);
+        close_ip_ports_add(dht, changed);
+        return bucket + index;
+    }
+
+    int32_t index = key_index_find(&dht->close_ip_port_index, key_index_hash_ip_port(dht->close_index_seed, &ip_port),
+                                   &close_ip_port_match, dht, &ip_port);
+
+    if (index != -1) {
+        LOGGER_DEBUG(dht->log, "close list[%u]: node changed its public_key", index);
+        close_ip_ports_remove(dht, index);
+        memset(&dht->close_clientlist[index], 0, sizeof(Client_data));
+    }
+
+    return 0;
+}
+
 /* Add node to the node list making sure only the nodes closest to cmp_pk are in the list.
  */
 _Bool add_to_list(Node_format *nodes_list, unsigned int length, const uint8_t *pk, IP_Port ip_port,
@@ -534,6 +930,59 @@ static uint8_t hardening_correct(const Hardening *h)
 {
     return h->routes_requests_ok + (h->send_nodes_ok << 1) + (h->testing_requests << 2);
 }
+/*
+ * helper for get_close_nodes(): add client to nodes_list if it is good enough
+ * and closer to public_key than the nodes already there.
+ */
+static void get_close_node(const uint8_t *public_key, Node_format *nodes_list, sa_family_t sa_family,
+                           const Client_data *client, uint32_t *num_nodes_ptr, uint8_t is_LAN, uint8_t want_good)
+{
+    /* node already in list? */
+    if (client_in_nodelist(nodes_list, MAX_SENT_NODES, client->public_key)) {
+        return;
+    }
+
+    const IPPTsPng *ipptp = NULL;
+
+    if (sa_family == AF_INET) {
+        ipptp = &client->assoc4;
+    } else if (sa_family == AF_INET6) {
+        ipptp = &client->assoc6;
+    } else {
+        if (client->assoc4.timestamp >= client->assoc6.timestamp) {
+            ipptp = &client->assoc4;
+        } else {
+            ipptp = &client->assoc6;
+        }
+    }
+
+    /* node not in a good condition? */
+    if (is_timeout(ipptp->timestamp, BAD_NODE_TIMEOUT)) {
+        return;
+    }
+
+    /* don't send LAN ips to non LAN peers */
+    if (LAN_ip(ipptp->ip_port.ip) == 0 && !is_LAN) {
+        return;
+    }
+
+    if (LAN_ip(ipptp->ip_port.ip) != 0 && want_good && hardening_correct(&ipptp->hardening) != HARDENING_ALL_OK
+            && !id_equal(public_key, client->public_key)) {
+        return;
+    }
+
+    if (*num_nodes_ptr < MAX_SENT_NODES) {
+        memcpy(nodes_list[*num_nodes_ptr].public_key,
+               client->public_key,
+               crypto_box_PUBLICKEYBYTES );
+
+        nodes_list[*num_nodes_ptr].ip_port = ipptp->ip_port;
+        ++*num_nodes_ptr;
+    } else {
+        add_to_list(nodes_list, MAX_SENT_NODES, client->public_key, ipptp->ip_port, public_key);
+    }
+}
+
 /*
  * helper for get_close_nodes(). argument list is a monster :D
  */
@@ -545,59 +994,48 @@ static void get_close_nodes_inner(const uint8_t *public_key, Node_format *nodes_
         return;
     }
 
-    uint32_t num_nodes = *num_nodes_ptr;
     uint32_t i;
 
     for (i = 0; i < client_list_length; i++) {
-        const Client_data *client = &client_list[i];
-
-        /* node already in list? */
-        if (client_in_nodelist(nodes_list, MAX_SENT_NODES, client->public_key)) {
-            continue;
-        }
-
-        const IPPTsPng *ipptp = NULL;
+        get_close_node(public_key, nodes_list, sa_family, &client_list[i], num_nodes_ptr, is_LAN, want_good);
+    }
+}
 
-        if (sa_family == AF_INET) {
-            ipptp = &client->assoc4;
-        } else if (sa_family == AF_INET6) {
-            ipptp = &client->assoc6;
-        } else {
-            if (client->assoc4.timestamp >= client->assoc6.timestamp) {
-                ipptp = &client->assoc4;
-            } else {
-                ipptp = &client->assoc6;
-            }
-        }
+/*
+ * helper for get_close_nodes(): get_close_nodes_inner() for the close list,
+ * looking at its buckets closest to public_key first.
+ *
+ * Say public_key shares a prefix of length n with ours. The nodes in bucket n
+ * share more than n bits with public_key, those in the buckets after it
+ * exactly n and those in a bucket i before it exactly i. Every one of these
+ * groups of buckets holds nodes closer than any in the next, so once
+ * MAX_SENT_NODES nodes were found after one of them the rest can be skipped.
+ */
+static void get_close_nodes_close_list(const DHT *dht, const uint8_t *public_key, Node_format *nodes_list,
+                                       sa_family_t sa_family, uint32_t *num_nodes_ptr, uint8_t is_LAN, uint8_t want_good)
+{
+    if ((sa_family != AF_INET) && (sa_family != AF_INET6) && (sa_family != 0)) {
+        return;
+    }
 
-        /* node not in a good condition? */
-        if (is_timeout(ipptp->timestamp, BAD_NODE_TIMEOUT)) {
-            continue;
-        }
+    const Client_data *list = dht->close_clientlist;
+    uint32_t bucket = close_list_bucket(dht, public_key);
 
-        /* don't send LAN ips to non LAN peers */
-        if (LAN_ip(ipptp->ip_port.ip) == 0 && !is_LAN) {
-            continue;
-        }
+    get_close_nodes_inner(public_key, nodes_list, sa_family, &list[bucket], LCLIENT_NODES, num_nodes_ptr, is_LAN,
+                          want_good);
 
-        if (LAN_ip(ipptp->ip_port.ip) != 0 && want_good && hardening_correct(&ipptp->hardening) != HARDENING_ALL_OK
-                && !id_equal(public_key, client->public_key)) {
-            continue;
-        }
+    if (*num_nodes_ptr >= MAX_SENT_NODES) {
+        return;
+    }
 
-        if (num_nodes < MAX_SENT_NODES) {
-            memcpy(nodes_list[num_nodes].public_key,
-                   client->public_key,
-                   crypto_box_PUBLICKEYBYTES );
+    get_close_nodes_inner(public_key, nodes_list, sa_family, &list[bucket + LCLIENT_NODES],
+                          LCLIENT_LIST - (bucket + LCLIENT_NODES), num_nodes_ptr, is_LAN, want_good);
 
-            nodes_list[num_nodes].ip_port = ipptp->ip_port;
-            num_nodes++;
-        } else {
-            add_to_list(nodes_list, MAX_SENT_NODES, client->public_key, ipptp->ip_port, public_key);
-        }
+    while (bucket != 0 && *num_nodes_ptr < MAX_SENT_NODES) {
+        bucket -= LCLIENT_NODES;
+        get_close_nodes_inner(public_key, nodes_list, sa_family, &list[bucket], LCLIENT_NODES, num_nodes_ptr, is_LAN,
+                              want_good);
     }
-
-    *num_nodes_ptr = num_nodes;
 }
 
 /* Find MAX_SENT_NODES nodes closest to the public_key for the send nodes request:
@@ -612,8 +1050,7 @@ static int get_somewhat_close_nodes(const DHT *dht, const uint8_t *public_key, N
                                     sa_family_t sa_family, uint8_t is_LAN, uint8_t want_good)
 {
     uint32_t num_nodes = 0, i;
-    get_close_nodes_inner(public_key, nodes_list, sa_family,
-                          dht->close_clientlist, LCLIENT_LIST, &num_nodes, is_LAN, 0);
+    get_close_nodes_close_list(dht, public_key, nodes_list, sa_family, &num_nodes, is_LAN, 0);
 
     /*TODO uncomment this when hardening is added to close friend clients
         for (i = 0; i < dht->num_friends; ++i)
@@ -783,37 +1220,140 @@ static int replace_all(   Client_data    *list,
         return 0;
     }
 
-    if (store_node_ok(&list[1], public_key, comp_public_key) || store_node_ok(&list[0], public_key, comp_public_key)) {
-        sort_client_list(list, length, comp_public_key);
-
-        IPPTsPng *ipptp_write = NULL;
-        IPPTsPng *ipptp_clear = NULL;
+    if (store_node_ok(&list[1], public_key, comp_public_key) || store_node_ok(&list[0], public_key, comp_public_key)) {
+        sort_client_list(list, length, comp_public_key);
+
+        IPPTsPng *ipptp_write = NULL;
+        IPPTsPng *ipptp_clear = NULL;
+
+        Client_data *client = &list[0];
+
+        if (ip_port.ip.family == AF_INET) {
+            ipptp_write = &client->assoc4;
+            ipptp_clear = &client->assoc6;
+        } else {
+            ipptp_write = &client->assoc6;
+            ipptp_clear = &client->assoc4;
+        }
+
+        id_copy(client->public_key, public_key);
+        ipptp_write->ip_port = ip_port;
+        ipptp_write->timestamp = unix_time();
+
+        ip_reset(&ipptp_write->ret_ip_port.ip);
+        ipptp_write->ret_ip_port.port = 0;
+        ipptp_write->ret_timestamp = 0;
+
+        /* zero out other address */
+        memset(ipptp_clear, 0, sizeof(*ipptp_clear));
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/* The first time do_ping_and_sendnode_requests() has something to do for
+ * client: pinging one of its addresses or noticing that it timed out.
+ *
+ * return 0 if all its addresses are already dead.
+ */
+static uint64_t client_next_run(const Client_data *client)
+{
+    uint64_t next_run = 0;
+    const IPPTsPng *assoc;
+    uint32_t a;
+
+    for (a = 0, assoc = &client->assoc6; a < 2; a++, assoc = &client->assoc4) {
+        if (is_timeout(assoc->timestamp, KILL_NODE_TIMEOUT)) {
+            continue;
+        }
+
+        uint64_t deadline = MIN(assoc->last_pinged + PING_INTERVAL, assoc->timestamp + KILL_NODE_TIMEOUT);
+
+        if (next_run == 0 || deadline < next_run) {
+            next_run = deadline;
+        }
+    }
+
+    return next_run;
+}
+
+static uint64_t friend_next_run(const DHT_Friend *friend)
+{
+    if (friend->num_to_bootstrap != 0) {
+        return unix_time();
+    }
+
+    uint64_t next_run = 0;
+    _Bool good = 0;
+    uint32_t i;
+
+    for (i = 0; i < MAX_FRIEND_CLIENTS; ++i) {
+        const Client_data *client = &friend->client_list[i];
+        uint64_t deadline = client_next_run(client);
+
+        if (deadline != 0 && (next_run == 0 || deadline < next_run)) {
+            next_run = deadline;
+        }
+
+        if (!is_timeout(client->assoc4.timestamp, BAD_NODE_TIMEOUT) || !is_timeout(client->assoc6.timestamp, BAD_NODE_TIMEOUT)) {
+            good = 1;
+        }
+    }
+
+    if (good) {
+        uint64_t deadline = friend->bootstrap_times < MAX_BOOTSTRAP_TIMES ? unix_time() : friend->lastgetnode + GET_NODE_INTERVAL;
+
+        if (next_run == 0 || deadline < next_run) {
+            next_run = deadline;
+        }
+    }
+
+    return next_run;
+}
+
+/* Make sure the timer with id fires at deadline or earlier.
+ * next_run is the deadline of its pending timer (0 if none).
+ */
+static void schedule_timer(DHT *dht, uint64_t *next_run, uint32_t id, uint64_t deadline)
+{
+    if (deadline == 0 || (*next_run != 0 && *next_run <= deadline)) {
+        return;
+    }
+
+    uint64_t added = timer_wheel_add(dht->timers, deadline, id);
 
-        Client_data *client = &list[0];
+    if (added != 0) {
+        *next_run = added;
+    }
+}
 
-        if (ip_port.ip.family == AF_INET) {
-            ipptp_write = &client->assoc4;
-            ipptp_clear = &client->assoc6;
-        } else {
-            ipptp_write = &client->assoc6;
-            ipptp_clear = &client->assoc4;
-        }
+/* Call when node index in the close list was added or refreshed. */
+static void close_node_updated(DHT *dht, uint32_t index)
+{
+    schedule_timer(dht, &dht->close_next_run[index], index,
+                   client_next_run(&dht->close_clientlist[index]));
 
-        id_copy(client->public_key, public_key);
-        ipptp_write->ip_port = ip_port;
-        ipptp_write->timestamp = unix_time();
+    if (dht->close_next_getnodes == 0) {
+        dht->close_next_getnodes = unix_time();
+    }
+}
 
-        ip_reset(&ipptp_write->ret_ip_port.ip);
-        ipptp_write->ret_ip_port.port = 0;
-        ipptp_write->ret_timestamp = 0;
+static uint64_t NAT_next_run(const DHT *dht, uint32_t friend_num);
 
-        /* zero out other address */
-        memset(ipptp_clear, 0, sizeof(*ipptp_clear));
+/* Call when the client list, nodes to bootstrap from or NAT state of friend num changed. */
+static void friend_updated(DHT *dht, uint32_t num)
+{
+    DHT_Friend *friend = &dht->friends_list[num];
+    uint64_t next_run = friend_next_run(friend);
+    uint64_t nat_next_run = NAT_next_run(dht, num);
 
-        return 1;
+    if (next_run == 0 || (nat_next_run != 0 && nat_next_run < next_run)) {
+        next_run = nat_next_run;
     }
 
-    return 0;
+    schedule_timer(dht, &friend->next_run, LCLIENT_LIST + num, next_run);
 }
 
 /* Add node to close list.
@@ -827,14 +1367,10 @@ static int add_to_close(DHT *dht, const uint8_t *public_key, IP_Port ip_port, _B
 {
     unsigned int i;
 
-    unsigned int index = bit_by_bit_cmp(public_key, dht->self_public_key);
-
-    if (index > LCLIENT_LENGTH) {
-        index = LCLIENT_LENGTH - 1;
-    }
+    uint32_t bucket = close_list_bucket(dht, public_key);
 
     for (i = 0; i < LCLIENT_NODES; ++i) {
-        Client_data *client = &dht->close_clientlist[(index * LCLIENT_NODES) + i];
+        Client_data *client = &dht->close_clientlist[bucket + i];
 
         if (is_timeout(client->assoc4.timestamp, BAD_NODE_TIMEOUT) && is_timeout(client->assoc6.timestamp, BAD_NODE_TIMEOUT)) {
             if (!simulate) {
@@ -849,6 +1385,7 @@ static int add_to_close(DHT *dht, const uint8_t *public_key, IP_Port ip_port, _B
                     ipptp_clear = &client->assoc4;
                 }
 
+                close_ip_ports_remove(dht, bucket + i);
                 id_copy(client->public_key, public_key);
                 ipptp_write->ip_port = ip_port;
                 ipptp_write->timestamp = unix_time();
@@ -859,6 +1396,9 @@ static int add_to_close(DHT *dht, const uint8_t *public_key, IP_Port ip_port, _B
 
                 /* zero out other address */
                 memset(ipptp_clear, 0, sizeof(*ipptp_clear));
+
+                close_ip_ports_add(dht, bucket + i);
+                close_node_updated(dht, bucket + i);
             }
 
             return 0;
@@ -919,6 +1459,8 @@ static unsigned int ping_node_from_getnodes_ok(DHT *dht, const uint8_t *public_k
             //TODO: ipv6 vs v4
             add_to_list(dht->to_bootstrap, MAX_CLOSE_TO_BOOTSTRAP_NODES, public_key, ip_port, dht->self_public_key);
         }
+
+        dht->to_bootstrap_changed = 1;
     }
 
     unsigned int i;
@@ -946,6 +1488,8 @@ static unsigned int ping_node_from_getnodes_ok(DHT *dht, const uint8_t *public_k
                 add_to_list(friend->to_bootstrap, MAX_SENT_NODES, public_key, ip_port, friend->public_key);
             }
 
+            dht->to_bootstrap_changed = 1;
+            friend_updated(dht, i);
             ret = 1;
         }
     }
@@ -971,11 +1515,14 @@ int addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key)
     /* NOTE: Current behavior if there are two clients with the same id is
      * to replace the first ip by the second.
      */
-    if (!client_or_ip_port_in_list(dht->log, dht->close_clientlist, LCLIENT_LIST, public_key, ip_port)) {
+    int close_index = client_or_ip_port_in_close_list(dht, public_key, ip_port);
+
+    if (!close_index) {
         if (add_to_close(dht, public_key, ip_port, 0)) {
             used++;
         }
     } else {
+        close_node_updated(dht, close_index - 1);
         used++;
     }
 
@@ -993,6 +1540,7 @@ int addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key)
                     friend_foundip = friend;
                 }
 
+                friend_updated(dht, i);
                 used++;
             }
         } else {
@@ -1002,6 +1550,7 @@ int addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key)
                 friend_foundip = friend;
             }
 
+            friend_updated(dht, i);
             used++;
         }
     }
@@ -1049,19 +1598,18 @@ static int returnedip_ports(DHT *dht, IP_Port ip_port, const uint8_t *public_key
     }
 
     if (id_equal(public_key, dht->self_public_key)) {
-        for (i = 0; i < LCLIENT_LIST; ++i) {
-            if (id_equal(nodepublic_key, dht->close_clientlist[i].public_key)) {
-                if (ip_port.ip.family == AF_INET) {
-                    dht->close_clientlist[i].assoc4.ret_ip_port = ip_port;
-                    dht->close_clientlist[i].assoc4.ret_timestamp = temp_time;
-                } else if (ip_port.ip.family == AF_INET6) {
-                    dht->close_clientlist[i].assoc6.ret_ip_port = ip_port;
-                    dht->close_clientlist[i].assoc6.ret_timestamp = temp_time;
-                }
+        int index = close_list_index(dht, nodepublic_key);
 
-                ++used;
-                break;
+        if (index != -1) {
+            if (ip_port.ip.family == AF_INET) {
+                dht->close_clientlist[index].assoc4.ret_ip_port = ip_port;
+                dht->close_clientlist[index].assoc4.ret_timestamp = temp_time;
+            } else if (ip_port.ip.family == AF_INET6) {
+                dht->close_clientlist[index].assoc6.ret_ip_port = ip_port;
+                dht->close_clientlist[index].assoc6.ret_timestamp = temp_time;
             }
+
+            ++used;
         }
     } else {
         for (i = 0; i < dht->num_friends; ++i) {
@@ -1076,6 +1624,7 @@ static int returnedip_ports(DHT *dht, IP_Port ip_port, const uint8_t *public_key
                             dht->friends_list[i].client_list[j].assoc6.ret_timestamp = temp_time;
                         }
 
+                        friend_updated(dht, i);
                         ++used;
                         goto end;
                     }
@@ -1161,9 +1710,10 @@ static int getnodes(DHT *dht, IP_Port ip_port, const uint8_t *public_key, const
     return sendpacket(dht->net, ip_port, data, sizeof(data));
 }
 
-/* Send a send nodes response: message for IPv6 nodes */
-static int sendnodes_ipv6(const DHT *dht, IP_Port ip_port, const uint8_t *public_key, const uint8_t *client_id,
-                          const uint8_t *sendback_data, uint16_t length, const uint8_t *shared_encryption_key)
+/* Send a send nodes response with nodes_list from net: message for IPv6 nodes */
+static int sendnodes_ipv6(const DHT *dht, Networking_Core *net, IP_Port ip_port, const uint8_t *public_key,
+                          const Node_format *nodes_list, uint32_t num_nodes, const uint8_t *sendback_data,
+                          uint16_t length, const uint8_t *shared_encryption_key)
 {
     /* Check if packet is going to be sent to ourself. */
     if (id_equal(public_key, dht->self_public_key)) {
@@ -1175,15 +1725,13 @@ static int sendnodes_ipv6(const DHT *dht, IP_Port ip_port, const uint8_t *public
     }
 
     size_t Node_format_size = sizeof(Node_format);
-    uint8_t data[1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES
-                 + Node_format_size * MAX_SENT_NODES + length + crypto_box_MACBYTES];
-
-    Node_format nodes_list[MAX_SENT_NODES];
-    uint32_t num_nodes = get_close_nodes(dht, client_id, nodes_list, 0, LAN_ip(ip_port.ip) == 0, 1);
+    uint8_t data[1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + crypto_box_MACBYTES
+                 + 1 + Node_format_size * MAX_SENT_NODES + length];
 
-    uint8_t plain[1 + Node_format_size * MAX_SENT_NODES + length];
-    uint8_t encrypt[sizeof(plain) + crypto_box_MACBYTES];
-    uint8_t nonce[crypto_box_NONCEBYTES];
+    uint8_t *nonce = data + 1 + crypto_box_PUBLICKEYBYTES;
+    uint8_t *encrypt = nonce + crypto_box_NONCEBYTES;
+    /* Encrypted in place. */
+    uint8_t *plain = encrypt + crypto_box_MACBYTES;
     new_nonce(nonce);
 
     int nodes_length = 0;
@@ -1198,11 +1746,7 @@ static int sendnodes_ipv6(const DHT *dht, IP_Port ip_port, const uint8_t *public
 
     plain[0] = num_nodes;
     memcpy(plain + 1 + nodes_length, sendback_data, length);
-    int len = encrypt_data_symmetric( shared_encryption_key,
-                                      nonce,
-                                      plain,
-                                      1 + nodes_length + length,
-                                      encrypt );
+    int len = encrypt_data_symmetric_inplace(shared_encryption_key, nonce, encrypt, 1 + nodes_length + length);
 
     if (len != 1 + nodes_length + length + crypto_box_MACBYTES) {
         return -1;
@@ -1210,30 +1754,30 @@ static int sendnodes_ipv6(const DHT *dht, IP_Port ip_port, const uint8_t *public
 
     data[0] = NET_PACKET_SEND_NODES_IPV6;
     memcpy(data + 1, dht->self_public_key, crypto_box_PUBLICKEYBYTES);
-    memcpy(data + 1 + crypto_box_PUBLICKEYBYTES, nonce, crypto_box_NONCEBYTES);
-    memcpy(data + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES, encrypt, len);
 
-    return sendpacket(dht->net, ip_port, data, 1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + len);
+    return sendpacket(net, ip_port, data, 1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + len);
 }
 
-static int handle_getnodes(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+/* Check and decrypt a getnodes request.
+ * The shared key used is put in shared_key.
+ *
+ * return 0 on success.
+ * return -1 if the packet is invalid.
+ */
+static int open_getnodes(const DHT *dht, Shared_Keys *shared_keys, const uint8_t *packet, uint16_t length,
+                         uint8_t *plain, uint8_t *shared_key)
 {
     if (length != (1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + sizeof(
                        uint64_t) + crypto_box_MACBYTES)) {
-        return 1;
+        return -1;
     }
 
-    DHT *dht = object;
-
     /* Check if packet is from ourself. */
     if (id_equal(packet + 1, dht->self_public_key)) {
-        return 1;
+        return -1;
     }
 
-    uint8_t plain[crypto_box_PUBLICKEYBYTES + sizeof(uint64_t)];
-    uint8_t shared_key[crypto_box_BEFORENMBYTES];
-
-    DHT_get_shared_key_recv(dht, shared_key, packet + 1);
+    get_shared_key(shared_keys, shared_key, dht->self_secret_key, packet + 1);
     int len = decrypt_data_symmetric( shared_key,
                                       packet + 1 + crypto_box_PUBLICKEYBYTES,
                                       packet + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES,
@@ -1241,15 +1785,80 @@ static int handle_getnodes(void *object, IP_Port source, const uint8_t *packet,
                                       plain );
 
     if (len != crypto_box_PUBLICKEYBYTES + sizeof(uint64_t)) {
-        return 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Decrypt callback of getnodes requests, plain is followed by the shared key. */
+static int decrypt_getnodes(void *object, IP_Port source, const uint8_t *packet, uint16_t length, uint8_t *plain)
+{
+    const DHT *dht = object;
+
+    if (open_getnodes(dht, dht->shared_keys_recv, packet, length, plain,
+                      plain + crypto_box_PUBLICKEYBYTES + sizeof(uint64_t)) == -1) {
+        return -1;
     }
 
-    sendnodes_ipv6(dht, source, packet + 1, plain, plain + crypto_box_PUBLICKEYBYTES, sizeof(uint64_t), shared_key);
+    return crypto_box_PUBLICKEYBYTES + sizeof(uint64_t) + crypto_box_BEFORENMBYTES;
+}
+
+static int handle_getnodes(void *object, IP_Port source, const uint8_t *packet, uint16_t length, const uint8_t *plain,
+                           uint16_t plain_length, void *userdata)
+{
+    DHT *dht = object;
+    const uint8_t *shared_key = plain + crypto_box_PUBLICKEYBYTES + sizeof(uint64_t);
+
+    Node_format nodes_list[MAX_SENT_NODES];
+    uint32_t num_nodes = get_close_nodes(dht, plain, nodes_list, 0, LAN_ip(source.ip) == 0, 1);
+
+    sendnodes_ipv6(dht, dht->net, source, packet + 1, nodes_list, num_nodes, plain + crypto_box_PUBLICKEYBYTES,
+                   sizeof(uint64_t), shared_key);
 
     add_to_ping(dht->ping, packet + 1, source);
 
     return 0;
 }
+
+uint32_t DHT_copy_nodes(const DHT *dht, Client_data *list, uint32_t max_num)
+{
+    uint32_t num = MIN(max_num, LCLIENT_LIST);
+    memcpy(list, dht->close_clientlist, num * sizeof(Client_data));
+
+    uint32_t i;
+
+    for (i = 0; i < dht->num_friends && num + MAX_FRIEND_CLIENTS <= max_num; ++i) {
+        memcpy(list + num, dht->friends_list[i].client_list, MAX_FRIEND_CLIENTS * sizeof(Client_data));
+        num += MAX_FRIEND_CLIENTS;
+    }
+
+    return num;
+}
+
+int DHT_answer_getnodes(const DHT *dht, Networking_Core *net, Shared_Keys *shared_keys, const Client_data *list,
+                        uint32_t list_length, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    uint8_t plain[crypto_box_PUBLICKEYBYTES + sizeof(uint64_t)];
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+
+    if (open_getnodes(dht, shared_keys, packet, length, plain, shared_key) == -1) {
+        return -1;
+    }
+
+    Node_format nodes_list[MAX_SENT_NODES];
+    memset(nodes_list, 0, sizeof(nodes_list));
+    uint32_t num_nodes = 0;
+    get_close_nodes_inner(plain, nodes_list, 0, list, list_length, &num_nodes, LAN_ip(source.ip) == 0, 1);
+
+    if (sendnodes_ipv6(dht, net, source, packet + 1, nodes_list, num_nodes, plain + crypto_box_PUBLICKEYBYTES,
+                       sizeof(uint64_t), shared_key) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
 /* return 0 if no
    return 1 if yes */
 static uint8_t sent_getnode_to_node(DHT *dht, const uint8_t *public_key, IP_Port node_ip_port, uint64_t ping_id,
@@ -1279,27 +1888,27 @@ static uint8_t sent_getnode_to_node(DHT *dht, const uint8_t *public_key, IP_Port
 static int send_hardening_getnode_res(const DHT *dht, const Node_format *sendto, const uint8_t *queried_client_id,
                                       const uint8_t *nodes_data, uint16_t nodes_data_length);
 
-static int handle_sendnodes_core(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
-                                 Node_format *plain_nodes, uint16_t size_plain_nodes, uint32_t *num_nodes_out)
+#define SENDNODES_OVERHEAD (1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + 1 + sizeof(uint64_t) + crypto_box_MACBYTES)
+
+/* Decrypt callback of sendnodes responses. */
+static int decrypt_sendnodes(void *object, IP_Port source, const uint8_t *packet, uint16_t length, uint8_t *plain)
 {
     DHT *dht = object;
-    uint32_t cid_size = 1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + 1 + sizeof(uint64_t) + crypto_box_MACBYTES;
 
-    if (length < cid_size) { /* too short */
-        return 1;
+    if (length < SENDNODES_OVERHEAD) { /* too short */
+        return -1;
     }
 
-    uint32_t data_size = length - cid_size;
+    uint32_t data_size = length - SENDNODES_OVERHEAD;
 
     if (data_size == 0) {
-        return 1;
+        return -1;
     }
 
     if (data_size > sizeof(Node_format) * MAX_SENT_NODES) { /* invalid length */
-        return 1;
+        return -1;
     }
 
-    uint8_t plain[1 + data_size + sizeof(uint64_t)];
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
     DHT_get_shared_key_sent(dht, shared_key, packet + 1);
     int len = decrypt_data_symmetric(
@@ -1309,10 +1918,20 @@ static int handle_sendnodes_core(void *object, IP_Port source, const uint8_t *pa
                   1 + data_size + sizeof(uint64_t) + crypto_box_MACBYTES,
                   plain);
 
-    if ((unsigned int)len != sizeof(plain)) {
-        return 1;
+    if ((unsigned int)len != 1 + data_size + sizeof(uint64_t)) {
+        return -1;
     }
 
+    return len;
+}
+
+static int handle_sendnodes_core(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
+                                 const uint8_t *plain, Node_format *plain_nodes, uint16_t size_plain_nodes,
+                                 uint32_t *num_nodes_out)
+{
+    DHT *dht = object;
+    uint32_t data_size = length - SENDNODES_OVERHEAD;
+
     if (plain[0] > size_plain_nodes) {
         return 1;
     }
@@ -1350,13 +1969,14 @@ static int handle_sendnodes_core(void *object, IP_Port source, const uint8_t *pa
     return 0;
 }
 
-static int handle_sendnodes_ipv6(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+static int handle_sendnodes_ipv6(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
+                                 const uint8_t *plain, uint16_t plain_length, void *userdata)
 {
     DHT *dht = object;
     Node_format plain_nodes[MAX_SENT_NODES];
     uint32_t num_nodes;
 
-    if (handle_sendnodes_core(object, source, packet, length, plain_nodes, MAX_SENT_NODES, &num_nodes)) {
+    if (handle_sendnodes_core(object, source, packet, length, plain, plain_nodes, MAX_SENT_NODES, &num_nodes)) {
         return 1;
     }
 
@@ -1433,6 +2053,8 @@ int DHT_addfriend(DHT *dht, const uint8_t *public_key, void (*ip_callback)(void
     }
 
     friend->num_to_bootstrap = get_close_nodes(dht, friend->public_key, friend->to_bootstrap, 0, 1, 0);
+    dht->to_bootstrap_changed = 1;
+    friend_updated(dht, dht->num_friends - 1);
 
     return 0;
 }
@@ -1464,6 +2086,10 @@ int DHT_delfriend(DHT *dht, const uint8_t *public_key, uint16_t lock_count)
         memcpy( &dht->friends_list[friend_num],
                 &dht->friends_list[dht->num_friends],
                 sizeof(DHT_Friend) );
+
+        /* Its timer is still under its old number. */
+        dht->friends_list[friend_num].next_run = 0;
+        friend_updated(dht, friend_num);
     }
 
     if (dht->num_friends == 0) {
@@ -1586,26 +2212,74 @@ static uint8_t do_ping_and_sendnode_requests(DHT *dht, uint64_t *lastgetnode, co
 /* Ping each client in the "friends" list every PING_INTERVAL seconds. Send a get nodes request
  * every GET_NODE_INTERVAL seconds to a random good node for each "friend" in our "friends" list.
  */
-static void do_DHT_friends(DHT *dht)
+static void do_DHT_friend(DHT *dht, uint32_t num)
 {
-    unsigned int i, j;
+    DHT_Friend *friend = &dht->friends_list[num];
+    unsigned int j;
 
-    for (i = 0; i < dht->num_friends; ++i) {
-        DHT_Friend *friend = &dht->friends_list[i];
+    for (j = 0; j < friend->num_to_bootstrap; ++j) {
+        getnodes(dht, friend->to_bootstrap[j].ip_port, friend->to_bootstrap[j].public_key, friend->public_key, NULL);
+    }
 
-        for (j = 0; j < friend->num_to_bootstrap; ++j) {
-            getnodes(dht, friend->to_bootstrap[j].ip_port, friend->to_bootstrap[j].public_key, friend->public_key, NULL);
+    friend->num_to_bootstrap = 0;
+
+    do_ping_and_sendnode_requests(dht, &friend->lastgetnode, friend->public_key, friend->client_list, MAX_FRIEND_CLIENTS,
+                                  &friend->bootstrap_times, 1);
+}
+
+/* Ping a node in the close list if it's due. */
+static void do_Close_node(DHT *dht, uint32_t index)
+{
+    Client_data *client = &dht->close_clientlist[index];
+    IPPTsPng *assoc;
+    uint32_t a;
+
+    for (a = 0, assoc = &client->assoc6; a < 2; a++, assoc = &client->assoc4) {
+        if (!is_timeout(assoc->timestamp, KILL_NODE_TIMEOUT) && is_timeout(assoc->last_pinged, PING_INTERVAL)) {
+            getnodes(dht, assoc->ip_port, client->public_key, dht->self_public_key, NULL);
+            assoc->last_pinged = unix_time();
+        }
+    }
+
+    uint64_t next_run = client_next_run(client);
+
+    if (next_run == 0) {
+        dht->close_node_killed = 1;
+    }
+
+    schedule_timer(dht, &dht->close_next_run[index], index, next_run);
+}
+
+static void do_NAT_friend(DHT *dht, uint32_t num);
+
+static void DHT_timer_fired(void *object, uint32_t id, uint64_t deadline)
+{
+    DHT *dht = object;
+
+    if (id < LCLIENT_LIST) {
+        if (dht->close_next_run[id] == deadline) {
+            dht->close_next_run[id] = 0;
+            do_Close_node(dht, id);
         }
 
-        friend->num_to_bootstrap = 0;
+        return;
+    }
 
-        do_ping_and_sendnode_requests(dht, &friend->lastgetnode, friend->public_key, friend->client_list, MAX_FRIEND_CLIENTS,
-                                      &friend->bootstrap_times, 1);
+    uint32_t num = id - LCLIENT_LIST;
+
+    if (num < dht->num_friends && dht->friends_list[num].next_run == deadline) {
+        dht->friends_list[num].next_run = 0;
+        do_DHT_friend(dht, num);
+        do_NAT_friend(dht, num);
+        friend_updated(dht, num);
     }
 }
 
 /* Ping each client in the close nodes list every PING_INTERVAL seconds.
  * Send a get nodes request every GET_NODE_INTERVAL seconds to a random good node in the list.
+ *
+ * Pinging is done by the node's timers, the whole list is only looked at when
+ * a get nodes request is due or a node timed out.
  */
 static void do_Close(DHT *dht)
 {
@@ -1617,9 +2291,25 @@ static void do_Close(DHT *dht)
 
     dht->num_to_bootstrap = 0;
 
+    _Bool getnodes_due = dht->close_next_getnodes != 0 && dht->close_next_getnodes <= unix_time();
+
+    if (!getnodes_due && !dht->close_node_killed) {
+        return;
+    }
+
+    dht->close_node_killed = 0;
+
     uint8_t not_killed = do_ping_and_sendnode_requests(dht, &dht->close_lastgetnodes, dht->self_public_key,
                          dht->close_clientlist, LCLIENT_LIST, &dht->close_bootstrap_times, 0);
 
+    if (dht->close_lastgetnodes == unix_time()) {
+        dht->close_next_getnodes = dht->close_bootstrap_times < MAX_BOOTSTRAP_TIMES ? unix_time() + 1 :
+                                   dht->close_lastgetnodes + GET_NODE_INTERVAL;
+    } else if (getnodes_due) {
+        /* No good nodes left, close_node_updated() will bring this back. */
+        dht->close_next_getnodes = 0;
+    }
+
     if (!not_killed) {
         /* all existing nodes are at least KILL_NODE_TIMEOUT,
          * which means we are mute, as we only send packets to
@@ -1639,6 +2329,8 @@ static void do_Close(DHT *dht)
                     assoc->timestamp = badonly;
                 }
             }
+
+            schedule_timer(dht, &dht->close_next_run[i], i, client_next_run(client));
         }
     }
 }
@@ -1698,21 +2390,17 @@ int DHT_bootstrap_from_address(DHT *dht, const char *address, uint8_t ipv6enable
  */
 int route_packet(const DHT *dht, const uint8_t *public_key, const uint8_t *packet, uint16_t length)
 {
-    uint32_t i;
-
-    for (i = 0; i < LCLIENT_LIST; ++i) {
-        if (id_equal(public_key, dht->close_clientlist[i].public_key)) {
-            const Client_data *client = &dht->close_clientlist[i];
+    int index = close_list_index(dht, public_key);
 
-            if (ip_isset(&client->assoc6.ip_port.ip)) {
-                return sendpacket(dht->net, client->assoc6.ip_port, packet, length);
-            }
+    if (index != -1) {
+        const Client_data *client = &dht->close_clientlist[index];
 
-            if (ip_isset(&client->assoc4.ip_port.ip)) {
-                return sendpacket(dht->net, client->assoc4.ip_port, packet, length);
-            }
+        if (ip_isset(&client->assoc6.ip_port.ip)) {
+            return sendpacket(dht->net, client->assoc6.ip_port, packet, length);
+        }
 
-            break;
+        if (ip_isset(&client->assoc4.ip_port.ip)) {
+            return sendpacket(dht->net, client->assoc4.ip_port, packet, length);
         }
     }
 
@@ -1966,6 +2654,7 @@ static int handle_NATping(void *object, IP_Port source, const uint8_t *source_pu
         /* 1 is reply */
         send_NATping(dht, source_pubkey, ping_id, NAT_PING_RESPONSE);
         friend->nat.recvNATping_timestamp = unix_time();
+        friend_updated(dht, friendnumber);
         return 0;
     }
 
@@ -1973,6 +2662,7 @@ static int handle_NATping(void *object, IP_Port source, const uint8_t *source_pu
         if (friend->nat.NATping_id == ping_id) {
             friend->nat.NATping_id = random_64b();
             friend->nat.hole_punching = 1;
+            friend_updated(dht, friendnumber);
             return 0;
         }
     }
@@ -2085,43 +2775,91 @@ static void punch_holes(DHT *dht, IP ip, uint16_t *port_list, uint16_t numports,
     ++dht->friends_list[friend_num].nat.tries;
 }
 
-static void do_NAT(DHT *dht)
+static void do_NAT_friend(DHT *dht, uint32_t num)
 {
-    uint32_t i;
     uint64_t temp_time = unix_time();
+    DHT_Friend *friend = &dht->friends_list[num];
+    IP_Port ip_list[MAX_FRIEND_CLIENTS];
+    int num_ips = friend_iplist(dht, ip_list, num);
 
-    for (i = 0; i < dht->num_friends; ++i) {
-        IP_Port ip_list[MAX_FRIEND_CLIENTS];
-        int num = friend_iplist(dht, ip_list, i);
+    /* If already connected or friend is not online don't try to hole punch. */
+    if (num_ips < MAX_FRIEND_CLIENTS / 2) {
+        return;
+    }
 
-        /* If already connected or friend is not online don't try to hole punch. */
-        if (num < MAX_FRIEND_CLIENTS / 2) {
-            continue;
-        }
+    if (friend->nat.NATping_timestamp + PUNCH_INTERVAL < temp_time) {
+        send_NATping(dht, friend->public_key, friend->nat.NATping_id, NAT_PING_REQUEST);
+        friend->nat.NATping_timestamp = temp_time;
+    }
 
-        if (dht->friends_list[i].nat.NATping_timestamp + PUNCH_INTERVAL < temp_time) {
-            send_NATping(dht, dht->friends_list[i].public_key, dht->friends_list[i].nat.NATping_id, NAT_PING_REQUEST);
-            dht->friends_list[i].nat.NATping_timestamp = temp_time;
+    if (friend->nat.hole_punching == 1 &&
+            friend->nat.punching_timestamp + PUNCH_INTERVAL < temp_time &&
+            friend->nat.recvNATping_timestamp + PUNCH_INTERVAL * 2 >= temp_time) {
+
+        IP ip = NAT_commonip(ip_list, num_ips, MAX_FRIEND_CLIENTS / 2);
+
+        if (!ip_isset(&ip)) {
+            return;
         }
 
-        if (dht->friends_list[i].nat.hole_punching == 1 &&
-                dht->friends_list[i].nat.punching_timestamp + PUNCH_INTERVAL < temp_time &&
-                dht->friends_list[i].nat.recvNATping_timestamp + PUNCH_INTERVAL * 2 >= temp_time) {
+        uint16_t port_list[MAX_FRIEND_CLIENTS];
+        uint16_t numports = NAT_getports(port_list, ip_list, num_ips, ip);
+        punch_holes(dht, ip, port_list, numports, num);
 
-            IP ip = NAT_commonip(ip_list, num, MAX_FRIEND_CLIENTS / 2);
+        friend->nat.punching_timestamp = temp_time;
+        friend->nat.hole_punching = 0;
+    }
+}
 
-            if (!ip_isset(&ip)) {
-                continue;
+/* The first time do_NAT_friend() has something to do for friend_num.
+ *
+ * return 0 if not before returnedip_ports() or handle_NATping() change something.
+ */
+static uint64_t NAT_next_run(const DHT *dht, uint32_t friend_num)
+{
+    const DHT_Friend *friend = &dht->friends_list[friend_num];
+    IP_Port ip_list[MAX_FRIEND_CLIENTS];
+    int num = friend_iplist(dht, ip_list, friend_num);
+
+    if (num == 0) {
+        /* Directly connected: punching may start once the friend's own node goes bad. */
+        uint32_t i;
+
+        for (i = 0; i < MAX_FRIEND_CLIENTS; ++i) {
+            const Client_data *client = &friend->client_list[i];
+
+            if (id_equal(client->public_key, friend->public_key)) {
+                uint64_t timestamp = client->assoc4.timestamp > client->assoc6.timestamp ? client->assoc4.timestamp :
+                                     client->assoc6.timestamp;
+
+                if (!is_timeout(timestamp, BAD_NODE_TIMEOUT)) {
+                    return timestamp + BAD_NODE_TIMEOUT;
+                }
             }
+        }
+
+        return 0;
+    }
+
+    if (num < MAX_FRIEND_CLIENTS / 2) {
+        return 0;
+    }
+
+    uint64_t next_run = friend->nat.NATping_timestamp + PUNCH_INTERVAL + 1;
 
-            uint16_t port_list[MAX_FRIEND_CLIENTS];
-            uint16_t numports = NAT_getports(port_list, ip_list, num, ip);
-            punch_holes(dht, ip, port_list, numports, i);
+    if (friend->nat.hole_punching == 1) {
+        uint64_t punch_time = friend->nat.punching_timestamp + PUNCH_INTERVAL + 1;
 
-            dht->friends_list[i].nat.punching_timestamp = temp_time;
-            dht->friends_list[i].nat.hole_punching = 0;
+        if (punch_time < unix_time()) {
+            punch_time = unix_time();
+        }
+
+        if (punch_time < next_run && friend->nat.recvNATping_timestamp + PUNCH_INTERVAL * 2 >= punch_time) {
+            next_run = punch_time;
         }
     }
+
+    return next_run;
 }
 
 /*----------------------------------------------------------------------------------*/
@@ -2190,23 +2928,20 @@ static int send_hardening_getnode_res(const DHT *dht, const Node_format *sendto,
     return sendpacket(dht->net, sendto->ip_port, packet, len);
 }
 
-/* TODO: improve */
 static IPPTsPng *get_closelist_IPPTsPng(DHT *dht, const uint8_t *public_key, sa_family_t sa_family)
 {
-    uint32_t i;
+    int index = close_list_index(dht, public_key);
 
-    for (i = 0; i < LCLIENT_LIST; ++i) {
-        if (public_key_cmp(dht->close_clientlist[i].public_key, public_key) != 0) {
-            continue;
-        }
+    if (index == -1) {
+        return NULL;
+    }
 
-        if (sa_family == AF_INET) {
-            return &dht->close_clientlist[i].assoc4;
-        }
+    if (sa_family == AF_INET) {
+        return &dht->close_clientlist[index].assoc4;
+    }
 
-        if (sa_family == AF_INET6) {
-            return &dht->close_clientlist[i].assoc6;
-        }
+    if (sa_family == AF_INET6) {
+        return &dht->close_clientlist[index].assoc6;
     }
 
     return NULL;
@@ -2484,40 +3219,54 @@ void cryptopacket_registerhandler(DHT *dht, uint8_t byte, cryptopacket_handler_c
     dht->cryptopackethandlers[byte].object = object;
 }
 
-static int cryptopacket_handle(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+/* Decrypt callback of crypto packets. Requests for us are decrypted into
+ * plain as the sender's public key, the request id and the request's data.
+ * Others are left for cryptopacket_handle() to route (plain length 0).
+ */
+static int decrypt_cryptopacket(void *object, IP_Port source, const uint8_t *packet, uint16_t length, uint8_t *plain)
 {
-    DHT *dht = object;
+    const DHT *dht = object;
 
-    if (packet[0] == NET_PACKET_CRYPTO) {
-        if (length <= crypto_box_PUBLICKEYBYTES * 2 + crypto_box_NONCEBYTES + 1 + crypto_box_MACBYTES ||
-                length > MAX_CRYPTO_REQUEST_SIZE + crypto_box_MACBYTES) {
-            return 1;
-        }
+    if (length <= crypto_box_PUBLICKEYBYTES * 2 + crypto_box_NONCEBYTES + 1 + crypto_box_MACBYTES ||
+            length > MAX_CRYPTO_REQUEST_SIZE + crypto_box_MACBYTES) {
+        return -1;
+    }
 
-        if (public_key_cmp(packet + 1, dht->self_public_key) == 0) { // Check if request is for us.
-            uint8_t public_key[crypto_box_PUBLICKEYBYTES];
-            uint8_t data[MAX_CRYPTO_REQUEST_SIZE];
-            uint8_t number;
-            int len = handle_request(dht->self_public_key, dht->self_secret_key, public_key, data, &number, packet, length);
+    if (public_key_cmp(packet + 1, dht->self_public_key) != 0) {
+        return 0;
+    }
 
-            if (len == -1 || len == 0) {
-                return 1;
-            }
+    int len = handle_request(dht->self_public_key, dht->self_secret_key, plain, plain + crypto_box_PUBLICKEYBYTES + 1,
+                             plain + crypto_box_PUBLICKEYBYTES, packet, length);
 
-            if (!dht->cryptopackethandlers[number].function) {
-                return 1;
-            }
+    if (len == -1 || len == 0) {
+        return -1;
+    }
 
-            return dht->cryptopackethandlers[number].function(dht->cryptopackethandlers[number].object, source, public_key,
-                    data, len, userdata);
-        }
+    return crypto_box_PUBLICKEYBYTES + 1 + len;
+}
 
-        /* If request is not for us, try routing it. */
-        int retval = route_packet(dht, packet + 1, packet, length);
+static int cryptopacket_handle(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
+                               const uint8_t *plain, uint16_t plain_length, void *userdata)
+{
+    DHT *dht = object;
 
-        if ((unsigned int)retval == length) {
-            return 0;
+    if (plain_length != 0) { // Request for us.
+        uint8_t number = plain[crypto_box_PUBLICKEYBYTES];
+
+        if (!dht->cryptopackethandlers[number].function) {
+            return 1;
         }
+
+        return dht->cryptopackethandlers[number].function(dht->cryptopackethandlers[number].object, source, plain,
+                plain + crypto_box_PUBLICKEYBYTES + 1, plain_length - (crypto_box_PUBLICKEYBYTES + 1), userdata);
+    }
+
+    /* If request is not for us, try routing it. */
+    int retval = route_packet(dht, packet + 1, packet, length);
+
+    if ((unsigned int)retval == length) {
+        return 0;
     }
 
     return 1;
@@ -2543,15 +3292,20 @@ DHT *new_DHT(Logger *log, Networking_Core *net)
     dht->log = log;
     dht->net = net;
     dht->ping = new_ping(dht);
+    dht->timers = timer_wheel_new(unix_time());
+    dht->close_index_seed = random_64b();
+    dht->shared_keys_recv = new_shared_keys(SHARED_KEYS_DEFAULT_SIZE);
+    dht->shared_keys_sent = new_shared_keys(SHARED_KEYS_DEFAULT_SIZE);
 
-    if (dht->ping == NULL) {
+    if (dht->ping == NULL || dht->timers == NULL || dht->shared_keys_recv == NULL || dht->shared_keys_sent == NULL) {
         kill_DHT(dht);
         return NULL;
     }
 
-    networking_registerhandler(dht->net, NET_PACKET_GET_NODES, &handle_getnodes, dht);
-    networking_registerhandler(dht->net, NET_PACKET_SEND_NODES_IPV6, &handle_sendnodes_ipv6, dht);
-    networking_registerhandler(dht->net, NET_PACKET_CRYPTO, &cryptopacket_handle, dht);
+    networking_registerhandler_decrypt(dht->net, NET_PACKET_GET_NODES, &decrypt_getnodes, &handle_getnodes, dht);
+    networking_registerhandler_decrypt(dht->net, NET_PACKET_SEND_NODES_IPV6, &decrypt_sendnodes, &handle_sendnodes_ipv6,
+                                       dht);
+    networking_registerhandler_decrypt(dht->net, NET_PACKET_CRYPTO, &decrypt_cryptopacket, &cryptopacket_handle, dht);
     cryptopacket_registerhandler(dht, CRYPTO_PACKET_NAT_PING, &handle_NATping, dht);
     cryptopacket_registerhandler(dht, CRYPTO_PACKET_HARDENING, &handle_hardening, dht);
 
@@ -2591,9 +3345,9 @@ void do_DHT(DHT *dht)
         DHT_connect_after_load(dht);
     }
 
+    prefill_to_bootstrap(dht);
+    timer_wheel_run(dht->timers, unix_time(), &DHT_timer_fired, dht);
     do_Close(dht);
-    do_DHT_friends(dht);
-    do_NAT(dht);
     do_to_ping(dht->ping);
 #if DHT_HARDENING
     do_hardening(dht);
@@ -2606,6 +3360,30 @@ void do_DHT(DHT *dht)
 #endif
     dht->last_run = unix_time();
 }
+
+uint32_t DHT_run_interval(const DHT *dht)
+{
+    return timeout_remaining_ms(dht->last_run, 1);
+}
+
+int DHT_set_shared_keys_size(DHT *dht, uint32_t size)
+{
+    Shared_Keys *shared_keys_recv = new_shared_keys(size);
+    Shared_Keys *shared_keys_sent = new_shared_keys(size);
+
+    if (shared_keys_recv == NULL || shared_keys_sent == NULL) {
+        kill_shared_keys(shared_keys_recv);
+        kill_shared_keys(shared_keys_sent);
+        return -1;
+    }
+
+    kill_shared_keys(dht->shared_keys_recv);
+    kill_shared_keys(dht->shared_keys_sent);
+    dht->shared_keys_recv = shared_keys_recv;
+    dht->shared_keys_sent = shared_keys_sent;
+    return 0;
+}
+
 void kill_DHT(DHT *dht)
 {
 #ifdef ENABLE_ASSOC_DHT
@@ -2618,6 +3396,10 @@ void kill_DHT(DHT *dht)
     ping_array_free_all(&dht->dht_ping_array);
     ping_array_free_all(&dht->dht_harden_ping_array);
     kill_ping(dht->ping);
+    timer_wheel_kill(dht->timers);
+    key_index_free(&dht->close_ip_port_index);
+    kill_shared_keys(dht->shared_keys_recv);
+    kill_shared_keys(dht->shared_keys_sent);
     free(dht->friends_list);
     free(dht->loaded_nodes_list);
     free(dht);
@@ -2738,14 +3520,21 @@ int DHT_connect_after_load(DHT *dht)
         return 0;
     }
 
-    unsigned int i;
+    Node_format nodes[SAVE_BOOTSTAP_FREQUENCY];
+    unsigned int i, num = 0;
 
     for (i = 0; i < dht->loaded_num_nodes && i < SAVE_BOOTSTAP_FREQUENCY; ++i) {
-        unsigned int index = dht->loaded_nodes_index % dht->loaded_num_nodes;
-        DHT_bootstrap(dht, dht->loaded_nodes_list[index].ip_port, dht->loaded_nodes_list[index].public_key);
+        nodes[num] = dht->loaded_nodes_list[dht->loaded_nodes_index % dht->loaded_num_nodes];
+        ++num;
         ++dht->loaded_nodes_index;
     }
 
+    prefill_shared_keys_sent(dht, nodes, num);
+
+    for (i = 0; i < num; ++i) {
+        DHT_bootstrap(dht, nodes[i].ip_port, nodes[i].public_key);
+    }
+
     return 0;
 }
 
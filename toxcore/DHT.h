@@ -25,9 +25,11 @@
 #define DHT_H
 
 #include "crypto_core.h"
+#include "key_index.h"
 #include "logger.h"
 #include "network.h"
 #include "ping_array.h"
+#include "util.h"
 
 /* Maximum number of clients stored per friend. */
 #define MAX_FRIEND_CLIENTS 8
@@ -35,7 +37,13 @@
 #define LCLIENT_NODES (MAX_FRIEND_CLIENTS)
 #define LCLIENT_LENGTH 128
 
-/* A list of the clients mathematically closest to ours. */
+/* A list of the clients mathematically closest to ours.
+ *
+ * It is a routing table of LCLIENT_LENGTH buckets of LCLIENT_NODES entries
+ * each: a node goes in the bucket numbered by the length of the prefix its
+ * public key shares with ours (the last bucket takes all longer prefixes too).
+ * See close_list_bucket().
+ */
 #define LCLIENT_LIST (LCLIENT_LENGTH * LCLIENT_NODES)
 
 #define MAX_CLOSE_TO_BOOTSTRAP_NODES 8
@@ -156,6 +164,9 @@ typedef struct {
 
     Node_format to_bootstrap[MAX_SENT_NODES];
     unsigned int num_to_bootstrap;
+
+    /* Deadline of the friend's pending timer in the DHT's timer wheel, 0 if none. */
+    uint64_t    next_run;
 } DHT_Friend;
 
 /* Return packet size of packed node with ip_family on success.
@@ -182,18 +193,26 @@ int unpack_nodes(Node_format *nodes, uint16_t max_num_nodes, uint16_t *processed
 
 
 /*----------------------------------------------------------------------------------*/
-/* struct to store some shared keys so we don't have to regenerate them for each request. */
-#define MAX_KEYS_PER_SLOT 4
-#define KEYS_TIMEOUT 600
+/* Cache of shared keys so we don't have to regenerate them for each request.
+ *
+ * Keys are hashed (with a random seed, so peers can't pick keys that all
+ * land in the same place) into sets of SHARED_KEYS_WAYS entries, each entry
+ * one cache line. A full set evicts with the CLOCK algorithm: a key that was
+ * used since the clock hand last passed it gets another round.
+ *
+ * All functions taking a Shared_Keys can be called from several threads at
+ * once.
+ */
+#define SHARED_KEYS_WAYS 8
+#define SHARED_KEYS_DEFAULT_SIZE 2048
+
+typedef struct Shared_Keys Shared_Keys;
+
 typedef struct {
-    struct {
-        uint8_t public_key[crypto_box_PUBLICKEYBYTES];
-        uint8_t shared_key[crypto_box_BEFORENMBYTES];
-        uint32_t times_requested;
-        uint8_t  stored; /* 0 if not, 1 if is */
-        uint64_t time_last_requested;
-    } keys[256 * MAX_KEYS_PER_SLOT];
-} Shared_Keys;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions; /* misses that pushed another key out */
+} Shared_Keys_Stats;
 
 /*----------------------------------------------------------------------------------*/
 
@@ -213,6 +232,20 @@ typedef struct {
     uint64_t       close_lastgetnodes;
     uint32_t       close_bootstrap_times;
 
+    /* Only nodes (and friends) whose timer fired are looked at by do_DHT().
+     * Timer ids below LCLIENT_LIST are close list indices, friend numbers
+     * start at LCLIENT_LIST. */
+    Timer_Wheel   *timers;
+    uint64_t       close_next_run[LCLIENT_LIST];
+    /* When to scan the close list for a get nodes request next, 0 once no
+     * good nodes were left. */
+    uint64_t       close_next_getnodes;
+    _Bool          close_node_killed;
+    /* From the ip_ports of close list nodes to their index, to find a node
+     * that shows up with a new key without scanning the list. */
+    Key_Index      close_ip_port_index;
+    uint64_t       close_index_seed;
+
     /* Note: this key should not be/is not used to transmit any sensitive materials */
     uint8_t      secret_symmetric_key[crypto_box_KEYBYTES];
     /* DHT keypair */
@@ -226,8 +259,8 @@ typedef struct {
     uint32_t       loaded_num_nodes;
     unsigned int   loaded_nodes_index;
 
-    Shared_Keys shared_keys_recv;
-    Shared_Keys shared_keys_sent;
+    Shared_Keys  *shared_keys_recv;
+    Shared_Keys  *shared_keys_sent;
 
     struct PING   *ping;
     Ping_Array    dht_ping_array;
@@ -241,18 +274,44 @@ typedef struct {
 
     Node_format to_bootstrap[MAX_CLOSE_TO_BOOTSTRAP_NODES];
     unsigned int num_to_bootstrap;
+    /* Set when nodes went in this or a friend's to_bootstrap list since
+     * their shared keys were last prefilled. */
+    _Bool to_bootstrap_changed;
 } DHT;
 /*----------------------------------------------------------------------------------*/
 
+/* Create a shared key cache holding at least size keys
+ * (rounded up to a power of two number of sets).
+ *
+ * return NULL on failure.
+ */
+Shared_Keys *new_shared_keys(uint32_t size);
+
+void kill_shared_keys(Shared_Keys *shared_keys);
+
 /* Shared key generations are costly, it is therefor smart to store commonly used
  * ones so that they can re used later without being computed again.
  *
  * If shared key is already in shared_keys, copy it to shared_key.
  * else generate it into shared_key and copy it to shared_keys
+ *
+ * A cache must always be used with the same secret_key.
  */
 void get_shared_key(Shared_Keys *shared_keys, uint8_t *shared_key, const uint8_t *secret_key,
                     const uint8_t *public_key);
 
+/* Compute the shared keys for those of the num public keys (stored one after
+ * the other in public_keys) that are not in shared_keys yet, all in one
+ * encrypt_precompute_batch() call, and store them.
+ *
+ * Use this when a number of nodes are about to be sent packets at once.
+ */
+void shared_keys_prefill(Shared_Keys *shared_keys, const uint8_t *secret_key, const uint8_t *public_keys,
+                         uint32_t num);
+
+/* Copy the hit, miss and eviction counters of shared_keys into stats. */
+void shared_keys_get_stats(Shared_Keys *shared_keys, Shared_Keys_Stats *stats);
+
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
  * for packets that we receive.
  */
@@ -265,6 +324,28 @@ void DHT_get_shared_key_sent(DHT *dht, uint8_t *shared_key, const uint8_t *publi
 
 void DHT_getnodes(DHT *dht, const IP_Port *from_ipp, const uint8_t *from_id, const uint8_t *which_id);
 
+/* Copy the close list followed by the client lists of all friends, i.e. every
+ * node get_close_nodes() may pick from, into list of max_num entries.
+ *
+ * return number of entries copied.
+ */
+uint32_t DHT_copy_nodes(const DHT *dht, Client_data *list, uint32_t max_num);
+
+/* Answer a getnodes request like the DHT's own handler does, but picking the
+ * nodes from list (filled by DHT_copy_nodes()), getting the shared key from
+ * shared_keys and sending the response from net.
+ *
+ * Nothing in dht is written to, so as long as list and shared_keys are not
+ * shared this can run on another thread than the one running do_DHT().
+ * The caller is responsible for passing the sender on to add_to_ping() on the
+ * DHT's thread.
+ *
+ * return 0 if a response was sent.
+ * return -1 if the request was invalid or sending failed.
+ */
+int DHT_answer_getnodes(const DHT *dht, Networking_Core *net, Shared_Keys *shared_keys, const Client_data *list,
+                        uint32_t list_length, IP_Port source, const uint8_t *packet, uint16_t length);
+
 /* Add a new friend to the friends list.
  * public_key must be crypto_box_PUBLICKEYBYTES bytes long.
  *
@@ -314,6 +395,11 @@ int id_closest(const uint8_t *pk, const uint8_t *pk1, const uint8_t *pk2);
 _Bool add_to_list(Node_format *nodes_list, unsigned int length, const uint8_t *pk, IP_Port ip_port,
                   const uint8_t *cmp_pk);
 
+/* return the index in close_clientlist of the first entry of the bucket a node
+ * with public_key goes in.
+ */
+uint32_t close_list_bucket(const DHT *dht, const uint8_t *public_key);
+
 /* Return 1 if node can be added to close list, 0 if it can't.
  */
 _Bool node_addable_to_close_list(DHT *dht, const uint8_t *public_key, IP_Port ip_port);
@@ -347,6 +433,13 @@ uint16_t closelist_nodes(DHT *dht, Node_format *nodes, uint16_t max_num);
 /* Run this function at least a couple times per second (It's the main loop). */
 void do_DHT(DHT *dht);
 
+/* return the time in ms before do_DHT() has work to do again.
+ *
+ * Everything do_DHT() does (pinging nodes, getnodes requests, NAT punching)
+ * runs at most once per second, so this is at most 1000.
+ */
+uint32_t DHT_run_interval(const DHT *dht);
+
 /*
  *  Use these two functions to bootstrap the client.
  */
@@ -413,6 +506,15 @@ DHT *new_DHT(Logger *log, Networking_Core *net);
 
 void kill_DHT(DHT *dht);
 
+/* Replace the shared key caches of dht with empty ones holding at least size
+ * keys each (SHARED_KEYS_DEFAULT_SIZE by default). Busy bootstrap nodes talk
+ * to far more peers than that. Call it before other threads use dht.
+ *
+ * return -1 on failure, the old caches are kept.
+ * return 0 on success.
+ */
+int DHT_set_shared_keys_size(DHT *dht, uint32_t size);
+
 /*  return 0 if we are not connected to the DHT.
  *  return 1 if we are.
  */
@@ -467,6 +467,25 @@ int m_get_friend_connectionstatus(const Messenger *m, int32_t friendnumber)
     return CONNECTION_NONE;
 }
 
+int m_get_friend_connection_stats(const Messenger *m, int32_t friendnumber, Crypto_Connection_Stats *stats)
+{
+    if (friend_not_valid(m, friendnumber)) {
+        return -1;
+    }
+
+    if (m->friendlist[friendnumber].status == FRIEND_ONLINE) {
+        int crypt_conn_id = friend_connection_crypt_connection_id(m->fr_c, m->friendlist[friendnumber].friendcon_id);
+
+        if (crypto_connection_stats(m->net_crypto, crypt_conn_id, stats) == 0) {
+            return 0;
+        }
+    }
+
+    memset(stats, 0, sizeof(Crypto_Connection_Stats));
+    stats->time_since_congestion = UINT64_MAX;
+    return 0;
+}
+
 int m_friend_exists(const Messenger *m, int32_t friendnumber)
 {
     if (friend_not_valid(m, friendnumber)) {
@@ -885,6 +904,13 @@ void m_callback_core_connection(Messenger *m, void (*function)(Messenger *m, uns
     m->core_connection_change = function;
 }
 
+void m_callback_connection_stats(Messenger *m, void (*function)(Messenger *m, uint32_t,
+                                 const Crypto_Connection_Stats *, void *), void *userdata)
+{
+    m->connection_stats = function;
+    m->connection_stats_userdata = userdata;
+}
+
 void m_callback_connectionstatus_internal_av(Messenger *m, void (*function)(Messenger *m, uint32_t, uint8_t, void *),
         void *userdata)
 {
@@ -1942,6 +1968,17 @@ Messenger *new_messenger(Logger *log, Messenger_Options *options, unsigned int *
         return NULL;
     }
 
+    if (net_crypto_congestion_control(m->net_crypto, options->congestion_controller) == -1) {
+        kill_net_crypto(m->net_crypto);
+        kill_networking(m->net);
+        kill_DHT(m->dht);
+        free(m);
+        return NULL;
+    }
+
+    net_crypto_coalesce_packets(m->net_crypto, options->coalesce_packets);
+    packet_pool_use_hugepages(m->net_crypto->packet_pool, options->hugepages);
+
     m->onion = new_onion(m->dht);
     m->onion_a = new_onion_announce(m->dht);
     m->onion_c =  new_onion_client(m->net_crypto);
@@ -2427,6 +2464,34 @@ static void connection_status_cb(Messenger *m, void *userdata)
     }
 }
 
+static void connection_stats_cb(Messenger *m)
+{
+    if (!m->connection_stats) {
+        return;
+    }
+
+    uint64_t temp_time = current_time_monotonic();
+
+    if (m->last_connection_stats + CONNECTION_STATS_INTERVAL > temp_time) {
+        return;
+    }
+
+    m->last_connection_stats = temp_time;
+    uint32_t i;
+
+    for (i = 0; i < m->numfriends; ++i) {
+        if (m->friendlist[i].status != FRIEND_ONLINE) {
+            continue;
+        }
+
+        Crypto_Connection_Stats stats;
+
+        if (m_get_friend_connection_stats(m, i, &stats) == 0) {
+            m->connection_stats(m, i, &stats, m->connection_stats_userdata);
+        }
+    }
+}
+
 
 #define DUMPING_CLIENTS_FRIENDS_EVERY_N_SECONDS 60UL
 static time_t lastdump = 0;
@@ -2454,13 +2519,30 @@ static char *ID2String(const uint8_t *pk)
  */
 uint32_t messenger_run_interval(const Messenger *m)
 {
-    uint32_t crypto_interval = crypto_run_interval(m->net_crypto);
+    uint32_t interval = crypto_run_interval(m->net_crypto);
+    interval = MIN(interval, DHT_run_interval(m->dht));
+    interval = MIN(interval, onion_client_run_interval(m->onion_c));
 
-    if (crypto_interval > MIN_RUN_INTERVAL) {
+    if (m->tcp_server) {
+        interval = MIN(interval, TCP_server_run_interval(m->tcp_server));
+    }
+
+    if (interval > MIN_RUN_INTERVAL) {
         return MIN_RUN_INTERVAL;
     }
 
-    return crypto_interval;
+    return interval;
+}
+
+uint32_t messenger_get_socks(const Messenger *m, sock_t *socks, uint32_t max_socks)
+{
+    uint32_t num = crypto_get_socks(m->net_crypto, socks, max_socks);
+
+    if (m->tcp_server) {
+        num += TCP_server_get_socks(m->tcp_server, socks ? socks + num : NULL, max_socks - num);
+    }
+
+    return num;
 }
 
 /* The main loop that needs to be run at least 20 times per second. */
@@ -2502,6 +2584,9 @@ void do_messenger(Messenger *m, void *userdata)
     do_friend_connections(m->fr_c, userdata);
     do_friends(m, userdata);
     connection_status_cb(m, userdata);
+    connection_stats_cb(m);
+
+    networking_flush(m->net);
 
     if (unix_time() > lastdump + DUMPING_CLIENTS_FRIENDS_EVERY_N_SECONDS) {
 
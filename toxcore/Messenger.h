@@ -76,6 +76,9 @@ typedef struct {
     TCP_Proxy_Info proxy_info;
     uint16_t port_range[2];
     uint16_t tcp_server_port;
+    uint8_t congestion_controller; /* CRYPTO_CONGESTION_* */
+    uint8_t coalesce_packets;
+    uint8_t hugepages; /* For the packet pool, see packet_pool_use_hugepages(). */
 } Messenger_Options;
 
 
@@ -111,6 +114,9 @@ enum {
 /* Default start timeout in seconds between friend requests. */
 #define FRIENDREQUEST_TIMEOUT 5;
 
+/* Interval in ms between two calls of the connection stats callback. */
+#define CONNECTION_STATS_INTERVAL 1000
+
 enum {
     CONNECTION_NONE,
     CONNECTION_TCP,
@@ -274,6 +280,10 @@ struct Messenger {
     void (*core_connection_change)(struct Messenger *m, unsigned int, void *);
     unsigned int last_connection_status;
 
+    void (*connection_stats)(struct Messenger *m, uint32_t, const Crypto_Connection_Stats *, void *);
+    void *connection_stats_userdata;
+    uint64_t last_connection_stats;
+
     Messenger_Options options;
 };
 
@@ -344,6 +354,14 @@ int m_delfriend(Messenger *m, int32_t friendnumber);
  */
 int m_get_friend_connectionstatus(const Messenger *m, int32_t friendnumber);
 
+/* Fill stats with the transport statistics of the connection to the friend,
+ * all zero if the friend is offline.
+ *
+ *  return 0 on success.
+ *  return -1 on failure.
+ */
+int m_get_friend_connection_stats(const Messenger *m, int32_t friendnumber, Crypto_Connection_Stats *stats);
+
 /* Checks if there exists a friend with given friendnumber.
  *
  *  return 1 if friend exists.
@@ -538,6 +556,13 @@ void m_callback_connectionstatus_internal_av(Messenger *m, void (*function)(Mess
  */
 void m_callback_core_connection(Messenger *m, void (*function)(Messenger *m, unsigned int, void *));
 
+/* Set the callback called every CONNECTION_STATS_INTERVAL ms for each online
+ * friend with the transport statistics of the connection to them.
+ *  Function(Messenger *m, uint32_t friendnumber, const Crypto_Connection_Stats *stats, void *userdata)
+ */
+void m_callback_connection_stats(Messenger *m, void (*function)(Messenger *m, uint32_t,
+                                 const Crypto_Connection_Stats *, void *), void *userdata);
+
 /**********GROUP CHATS************/
 
 /* Set the callback for group invites.
@@ -752,6 +777,16 @@ void do_messenger(Messenger *m, void *userdata);
  */
 uint32_t messenger_run_interval(const Messenger *m);
 
+/* Put the sockets do_messenger() reads from in socks, so that instead of
+ * sleeping for messenger_run_interval() a client can wait on them with
+ * networking_wait() and run do_messenger() as soon as something arrives.
+ *
+ * If socks is NULL they are only counted.
+ *
+ * return the number of sockets put in socks (at most max_socks).
+ */
+uint32_t messenger_get_socks(const Messenger *m, sock_t *socks, uint32_t max_socks);
+
 /* SAVING AND LOADING FUNCTIONS: */
 
 /* return size of the messenger data (for saving). */
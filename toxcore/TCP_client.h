@@ -60,15 +60,11 @@ typedef struct  {
     uint8_t recv_nonce[crypto_box_NONCEBYTES]; /* Nonce of received packets. */
     uint8_t sent_nonce[crypto_box_NONCEBYTES]; /* Nonce of sent packets. */
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
-    uint16_t next_packet_length;
+    TCP_Input_Buffer input;
 
     uint8_t temp_secret_key[crypto_box_SECRETKEYBYTES];
 
-    uint8_t last_packet[2 + MAX_PACKET_SIZE];
-    uint16_t last_packet_length;
-    uint16_t last_packet_sent;
-
-    TCP_Priority_List *priority_queue_start, *priority_queue_end;
+    TCP_Output_Ring output;
 
     uint64_t kill_at;
 
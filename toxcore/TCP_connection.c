@@ -1427,6 +1427,27 @@ void do_tcp_connections(TCP_Connections *tcp_c, void *userdata)
     kill_nonused_tcp(tcp_c);
 }
 
+uint32_t tcp_connections_get_socks(const TCP_Connections *tcp_c, sock_t *socks, uint32_t max_socks)
+{
+    uint32_t i, num = 0;
+
+    for (i = 0; i < tcp_c->tcp_connections_length && num < max_socks; ++i) {
+        const TCP_con *tcp_con = &tcp_c->tcp_connections[i];
+
+        if (tcp_con->status == TCP_CONN_NONE || tcp_con->status == TCP_CONN_SLEEPING || !tcp_con->connection) {
+            continue;
+        }
+
+        if (socks) {
+            socks[num] = tcp_con->connection->sock;
+        }
+
+        ++num;
+    }
+
+    return num;
+}
+
 void kill_tcp_connections(TCP_Connections *tcp_c)
 {
     unsigned int i;
@@ -241,6 +241,15 @@ unsigned int tcp_copy_connected_relays(TCP_Connections *tcp_c, Node_format *tcp_
 TCP_Connections *new_tcp_connections(const uint8_t *secret_key, TCP_Proxy_Info *proxy_info);
 
 void do_tcp_connections(TCP_Connections *tcp_c, void *userdata);
+
+/* Put the sockets of the open TCP relay connections in socks, for waiting on
+ * them with networking_wait().
+ *
+ * If socks is NULL they are only counted.
+ *
+ * return the number of sockets put in socks (at most max_socks).
+ */
+uint32_t tcp_connections_get_socks(const TCP_Connections *tcp_c, sock_t *socks, uint32_t max_socks);
 void kill_tcp_connections(TCP_Connections *tcp_c);
 
 #endif
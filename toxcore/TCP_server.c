@@ -26,12 +26,158 @@
 
 #include "TCP_server.h"
 
+#include <pthread.h>
+#include <stddef.h>
+
 #if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
+#include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #endif
 
+#include "mailbox.h"
 #include "util.h"
 
+/* A server made by new_TCP_server_threaded() and what the others reach it
+ * with.
+ */
+typedef struct {
+    TCP_Server *server;
+    Mailbox *mailbox;
+    int wakeup[2]; /* A byte is written to wakeup[1] when the mailbox stops being empty. */
+    uint32_t forced_posts; /* Forced messages this shard posted that weren't taken yet. */
+    pthread_t thread;
+    _Bool running;
+} TCP_Server_Shard;
+
+struct TCP_Server_Threads {
+    TCP_Server *main; /* The server returned, which passes onion packets. */
+    TCP_Server_Shard main_shard;
+    TCP_Server_Shard *shards;
+    uint16_t num_shards;
+    uint8_t stop;
+};
+
+/* Messages the servers of a threaded TCP server send each other. */
+enum {
+    TCP_SHARD_ROUTING_REQUEST, /* public_key asked to be connected to other_public_key. */
+    TCP_SHARD_LINKED,          /* The connection asked for by a routing request was made. */
+    TCP_SHARD_UNLINK,          /* The other side of connection c_id went away. */
+    TCP_SHARD_DATA,            /* Packet for connection c_id of accepted connection index. */
+    TCP_SHARD_OOB,             /* OOB packet for other_public_key. */
+    TCP_SHARD_ACCEPTED,        /* public_key connected, kill older connections with it. */
+    TCP_SHARD_ONION_REQUEST,   /* To the main server, for onion_send_1(). */
+    TCP_SHARD_ONION_RESPONSE,  /* For accepted connection index if it still has identifier. */
+};
+
+typedef struct {
+    uint8_t type;
+    uint8_t forced; /* Posted past TCP_SHARD_MAILBOX_SIZE, counted in forced_posts of from_shard. */
+    uint8_t c_id, from_c_id;
+    uint16_t from_shard;
+    uint32_t index, from_index;
+    uint64_t identifier;
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t other_public_key[crypto_box_PUBLICKEYBYTES];
+    uint16_t length;
+    uint8_t data[MAX_PACKET_SIZE];
+} TCP_Shard_Message;
+
+/* Most messages handled in one run of do_TCP_server(), the rest wait for the next. */
+#define MAX_SHARD_MESSAGES_PER_RUN 1024
+
+/* Size of the buffer of a TCP_Input_Buffer: a few packets, and always room
+ * for a whole one after what is left of the previous read. */
+#define TCP_INPUT_SIZE (2 * (sizeof(uint16_t) + MAX_PACKET_SIZE))
+
+static TCP_Server_Shard *own_shard(const TCP_Server *TCP_server)
+{
+    if (TCP_server == TCP_server->threads->main) {
+        return &TCP_server->threads->main_shard;
+    }
+
+    return &TCP_server->threads->shards[TCP_server->shard_number];
+}
+
+static void init_shard_message(TCP_Shard_Message *msg, uint8_t type, const TCP_Server *TCP_server)
+{
+    memset(msg, 0, offsetof(TCP_Shard_Message, data));
+    msg->type = type;
+    msg->from_shard = TCP_server->shard_number;
+}
+
+static void wake_shard(TCP_Server_Shard *shard)
+{
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
+    uint8_t byte = 0;
+
+    if (write(shard->wakeup[1], &byte, 1) != 1) {
+        /* The pipe being full means the thread is awake anyway. */
+    }
+
+#endif
+}
+
+/* Messages that must not be lost are forced past TCP_SHARD_MAILBOX_SIZE.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int post_to_shard(const TCP_Server *TCP_server, TCP_Server_Shard *shard, TCP_Shard_Message *msg, _Bool force)
+{
+    msg->forced = force;
+
+    if (force) {
+        __atomic_add_fetch(&own_shard(TCP_server)->forced_posts, 1, __ATOMIC_RELAXED);
+    }
+
+    int ret = mailbox_post(shard->mailbox, (const uint8_t *)msg, offsetof(TCP_Shard_Message, data) + msg->length, force);
+
+    if (ret == -1) {
+        if (force) {
+            __atomic_sub_fetch(&own_shard(TCP_server)->forced_posts, 1, __ATOMIC_RELAXED);
+        }
+
+        return -1;
+    }
+
+    if (ret == 1) {
+        wake_shard(shard);
+    }
+
+    return 0;
+}
+
+/* Post msg to every other shard. */
+static void broadcast_to_shards(const TCP_Server *TCP_server, TCP_Shard_Message *msg, _Bool force)
+{
+    uint32_t i;
+
+    for (i = 0; i < TCP_server->threads->num_shards; ++i) {
+        if (i != TCP_server->shard_number) {
+            post_to_shard(TCP_server, &TCP_server->threads->shards[i], msg, force);
+        }
+    }
+}
+
+/* Forced messages aren't limited by the mailboxes, so a client making
+ * connections or routing requests faster than the other shards take them
+ * would grow them without bound: past TCP_SHARD_MAX_FORCED_POSTS pending ones
+ * a shard refuses what would post more.
+ *
+ * return 1 if the forced messages this shard posted are over the limit.
+ * return 0 if not.
+ */
+static _Bool shard_forced_posts_full(const TCP_Server *TCP_server)
+{
+    if (TCP_server->threads == NULL) {
+        return 0;
+    }
+
+    return __atomic_load_n(&own_shard(TCP_server)->forced_posts, __ATOMIC_RELAXED) >= TCP_SHARD_MAX_FORCED_POSTS;
+}
+
 /* return 1 on success
  * return 0 on failure
  */
@@ -59,7 +205,42 @@ static int bind_to_port(sock_t sock, int family, uint16_t port)
     return (bind(sock, (struct sockaddr *)&addr, addrsize) == 0);
 }
 
-/* Set the size of the connection list to numfriends.
+/* Next size of a connection list that is full: grown by a quarter so adding
+ * stays O(1) on average. */
+static uint32_t grown_list_size(uint32_t size)
+{
+    return size < 16 ? size + 4 : size + size / 4;
+}
+
+/* Make room for num entries in the stack of free entries of a connection
+ * list of old_size entries, then push the new ones.
+ *
+ *  return -1 if realloc fails.
+ *  return 0 if it succeeds.
+ */
+static int grow_free_list(uint32_t **free_list, uint32_t *num_free, uint32_t old_size, uint32_t num)
+{
+    uint32_t *new_free_list = realloc(*free_list, num * sizeof(uint32_t));
+
+    if (new_free_list == NULL) {
+        return -1;
+    }
+
+    *free_list = new_free_list;
+
+    /* Pushed from the last so the first new entry is used first. */
+    uint32_t i;
+
+    for (i = num; i > old_size; --i) {
+        new_free_list[*num_free] = i - 1;
+        ++*num_free;
+    }
+
+    return 0;
+}
+
+/* Set the size of the connection list to num, which must be 0 or more than
+ * its current size. The new entries are added to the free ones.
  *
  *  return -1 if realloc fails.
  *  return 0 if it succeeds.
@@ -70,10 +251,13 @@ static int realloc_connection(TCP_Server *TCP_server, uint32_t num)
         free(TCP_server->accepted_connection_array);
         TCP_server->accepted_connection_array = NULL;
         TCP_server->size_accepted_connections = 0;
+        free(TCP_server->free_accepted);
+        TCP_server->free_accepted = NULL;
+        TCP_server->num_free_accepted = 0;
         return 0;
     }
 
-    if (num == TCP_server->size_accepted_connections) {
+    if (num <= TCP_server->size_accepted_connections) {
         return 0;
     }
 
@@ -84,35 +268,94 @@ static int realloc_connection(TCP_Server *TCP_server, uint32_t num)
         return -1;
     }
 
-    if (num > TCP_server->size_accepted_connections) {
-        uint32_t old_size = TCP_server->size_accepted_connections;
-        uint32_t size_new_entries = (num - old_size) * sizeof(TCP_Secure_Connection);
-        memset(new_connections + old_size, 0, size_new_entries);
+    uint32_t old_size = TCP_server->size_accepted_connections;
+    uint32_t size_new_entries = (num - old_size) * sizeof(TCP_Secure_Connection);
+    memset(new_connections + old_size, 0, size_new_entries);
+    TCP_server->accepted_connection_array = new_connections;
+
+    if (grow_free_list(&TCP_server->free_accepted, &TCP_server->num_free_accepted, old_size, num) == -1) {
+        return -1;
     }
 
-    TCP_server->accepted_connection_array = new_connections;
     TCP_server->size_accepted_connections = num;
     return 0;
 }
 
+/* Same as realloc_connection() for the list of connections doing their
+ * handshake.
+ */
+static int realloc_incoming(TCP_Server *TCP_server, uint32_t num)
+{
+    if (num == 0) {
+        free(TCP_server->incoming_connection_array);
+        TCP_server->incoming_connection_array = NULL;
+        TCP_server->size_incoming_connections = 0;
+        free(TCP_server->free_incoming);
+        TCP_server->free_incoming = NULL;
+        TCP_server->num_free_incoming = 0;
+        return 0;
+    }
+
+    if (num <= TCP_server->size_incoming_connections) {
+        return 0;
+    }
+
+    TCP_Handshake_Connection *new_connections = realloc(TCP_server->incoming_connection_array,
+            num * sizeof(TCP_Handshake_Connection));
+
+    if (new_connections == NULL) {
+        return -1;
+    }
+
+    uint32_t old_size = TCP_server->size_incoming_connections;
+    memset(new_connections + old_size, 0, (num - old_size) * sizeof(TCP_Handshake_Connection));
+    TCP_server->incoming_connection_array = new_connections;
+
+    if (grow_free_list(&TCP_server->free_incoming, &TCP_server->num_free_incoming, old_size, num) == -1) {
+        return -1;
+    }
+
+    TCP_server->size_incoming_connections = num;
+    return 0;
+}
+
+/* Keys picked by clients are hashed with a random seed so they can't pick
+ * ones that end up in the same slots. */
+static uint32_t public_key_hash(const TCP_Server *TCP_server, const uint8_t *public_key)
+{
+    return key_index_hash(TCP_server->key_index_seed, public_key, crypto_box_PUBLICKEYBYTES);
+}
+
+static _Bool public_key_match(const void *object, uint32_t index, const void *key)
+{
+    const TCP_Server *TCP_server = object;
+    return public_key_cmp(TCP_server->accepted_connection_array[index].public_key, key) == 0;
+}
+
 /* return index corresponding to connection with peer on success
  * return -1 on failure.
  */
 static int get_TCP_connection_index(const TCP_Server *TCP_server, const uint8_t *public_key)
 {
-    return bs_list_find(&TCP_server->accepted_key_list, public_key);
+    return key_index_find(&TCP_server->accepted_key_index, public_key_hash(TCP_server, public_key), &public_key_match,
+                          TCP_server, public_key);
 }
 
 
 static int kill_accepted(TCP_Server *TCP_server, int index);
 
-/* Add accepted TCP connection to the list.
+/* Add the connection that finished its handshake to the accepted ones. Its
+ * input buffer is moved there.
  *
  * return index on success
  * return -1 on failure
  */
-static int add_accepted(TCP_Server *TCP_server, const TCP_Secure_Connection *con)
+static int add_accepted(TCP_Server *TCP_server, const TCP_Handshake_Connection *con)
 {
+    if (shard_forced_posts_full(TCP_server)) {
+        return -1;
+    }
+
     int index = get_TCP_connection_index(TCP_server, con->public_key);
 
     if (index != -1) { /* If an old connection to the same public key exists, kill it. */
@@ -120,38 +363,37 @@ static int add_accepted(TCP_Server *TCP_server, const TCP_Secure_Connection *con
         index = -1;
     }
 
-    if (TCP_server->size_accepted_connections == TCP_server->num_accepted_connections) {
-        if (realloc_connection(TCP_server, TCP_server->size_accepted_connections + 4) == -1) {
-            return -1;
-        }
-
-        index = TCP_server->num_accepted_connections;
-    } else {
-        uint32_t i;
-
-        for (i = TCP_server->size_accepted_connections; i != 0; --i) {
-            if (TCP_server->accepted_connection_array[i - 1].status == TCP_STATUS_NO_STATUS) {
-                index = i - 1;
-                break;
-            }
-        }
-    }
-
-    if (index == -1) {
-        fprintf(stderr, "FAIL index is -1\n");
+    if (TCP_server->num_free_accepted == 0
+            && realloc_connection(TCP_server, grown_list_size(TCP_server->size_accepted_connections)) == -1) {
         return -1;
     }
 
-    if (!bs_list_add(&TCP_server->accepted_key_list, con->public_key, index)) {
+    index = TCP_server->free_accepted[TCP_server->num_free_accepted - 1];
+
+    if (key_index_add(&TCP_server->accepted_key_index, public_key_hash(TCP_server, con->public_key), index) != 0) {
         return -1;
     }
 
-    memcpy(&TCP_server->accepted_connection_array[index], con, sizeof(TCP_Secure_Connection));
-    TCP_server->accepted_connection_array[index].status = TCP_STATUS_CONFIRMED;
+    --TCP_server->num_free_accepted;
+    TCP_Secure_Connection *accepted = &TCP_server->accepted_connection_array[index];
+    accepted->sock = con->sock;
+    memcpy(accepted->public_key, con->public_key, crypto_box_PUBLICKEYBYTES);
+    memcpy(accepted->recv_nonce, con->recv_nonce, crypto_box_NONCEBYTES);
+    memcpy(accepted->sent_nonce, con->sent_nonce, crypto_box_NONCEBYTES);
+    memcpy(accepted->shared_key, con->shared_key, crypto_box_BEFORENMBYTES);
+    accepted->input = con->input;
+    accepted->status = TCP_STATUS_CONFIRMED;
     ++TCP_server->num_accepted_connections;
-    TCP_server->accepted_connection_array[index].identifier = ++TCP_server->counter;
-    TCP_server->accepted_connection_array[index].last_pinged = unix_time();
-    TCP_server->accepted_connection_array[index].ping_id = 0;
+    accepted->identifier = ++TCP_server->counter;
+    accepted->last_pinged = unix_time();
+    accepted->ping_id = 0;
+
+    if (TCP_server->threads) {
+        TCP_Shard_Message msg;
+        init_shard_message(&msg, TCP_SHARD_ACCEPTED, TCP_server);
+        memcpy(msg.public_key, con->public_key, crypto_box_PUBLICKEYBYTES);
+        broadcast_to_shards(TCP_server, &msg, 1);
+    }
 
     return index;
 }
@@ -171,12 +413,22 @@ static int del_accepted(TCP_Server *TCP_server, int index)
         return -1;
     }
 
-    if (!bs_list_remove(&TCP_server->accepted_key_list, TCP_server->accepted_connection_array[index].public_key, index)) {
+    uint32_t hash = public_key_hash(TCP_server, TCP_server->accepted_connection_array[index].public_key);
+
+    if (key_index_remove(&TCP_server->accepted_key_index, hash, index) != 0) {
         return -1;
     }
 
+    TCP_Output_Ring *output = &TCP_server->accepted_connection_array[index].output;
+    TCP_server->output_bytes_queued += output->bytes_queued;
+    TCP_server->output_flushes += output->flushes;
+    TCP_output_free(output);
+    TCP_input_free(&TCP_server->accepted_connection_array[index].input);
+
     sodium_memzero(&TCP_server->accepted_connection_array[index], sizeof(TCP_Secure_Connection));
     --TCP_server->num_accepted_connections;
+    TCP_server->free_accepted[TCP_server->num_free_accepted] = index;
+    ++TCP_server->num_free_accepted;
 
     if (TCP_server->num_accepted_connections == 0) {
         realloc_connection(TCP_server, 0);
@@ -185,6 +437,129 @@ static int del_accepted(TCP_Server *TCP_server, int index)
     return 0;
 }
 
+/* Delete connection index from the ones doing their handshake, leaving its
+ * socket and input buffer alone.
+ */
+static void del_incoming(TCP_Server *TCP_server, uint32_t index)
+{
+    sodium_memzero(&TCP_server->incoming_connection_array[index], sizeof(TCP_Handshake_Connection));
+    --TCP_server->num_incoming_connections;
+    TCP_server->free_incoming[TCP_server->num_free_incoming] = index;
+    ++TCP_server->num_free_incoming;
+
+    if (TCP_server->num_incoming_connections == 0) {
+        realloc_incoming(TCP_server, 0);
+    }
+}
+
+/* Close connection index of the ones doing their handshake. */
+static void kill_incoming(TCP_Server *TCP_server, uint32_t index)
+{
+    TCP_Handshake_Connection *con = &TCP_server->incoming_connection_array[index];
+    TCP_input_free(&con->input);
+    kill_sock(con->sock);
+    del_incoming(TCP_server, index);
+}
+
+/* Sources are IP addresses, hashed like net_crypto's. */
+static uint32_t source_hash(const TCP_Server *TCP_server, const struct sockaddr_storage *addr)
+{
+    IP ip;
+    ip_reset(&ip);
+
+    if (addr->ss_family == AF_INET) {
+        ip.family = AF_INET;
+        memcpy(&ip.ip4, &((const struct sockaddr_in *)addr)->sin_addr, sizeof(ip.ip4));
+    } else if (addr->ss_family == AF_INET6) {
+        ip.family = AF_INET6;
+        memcpy(ip.ip6.uint8, &((const struct sockaddr_in6 *)addr)->sin6_addr, sizeof(ip.ip6.uint8));
+    }
+
+    return key_index_hash_source(TCP_server->handshake_seed, &ip);
+}
+
+/* Take a connection from the token buckets of the source at addr.
+ *
+ * return 0 if the source connected too often.
+ * return 1 if it can start a handshake on this one.
+ */
+static _Bool handshake_source_allowed(TCP_Server *TCP_server, const struct sockaddr_storage *addr)
+{
+    uint32_t rate = __atomic_load_n(&TCP_server->handshake_rate, __ATOMIC_RELAXED);
+    uint32_t burst = __atomic_load_n(&TCP_server->handshake_burst, __ATOMIC_RELAXED);
+
+    if (rate == 0) {
+        return 1;
+    }
+
+    return key_index_sketch_take(&TCP_server->handshake_sketch, source_hash(TCP_server, addr),
+                                 current_time_monotonic() * 1000, 1000000 / rate, burst);
+}
+
+/* Add sock, just accepted, to the connections doing their handshake.
+ *
+ * When MAX_INCOMMING_CONNECTIONS already are, a random one of them is closed
+ * to make room. Connections that never send anything hold most of the
+ * entries then, clients that do their handshake right away are unlikely to
+ * be picked before they are done.
+ *
+ * return index on success.
+ * return -1 on failure.
+ */
+static int add_incoming(TCP_Server *TCP_server, sock_t sock)
+{
+    if (TCP_server->num_free_incoming == 0) {
+        uint32_t size = TCP_server->size_incoming_connections;
+
+        if (size < MAX_INCOMMING_CONNECTIONS) {
+            if (realloc_incoming(TCP_server, MIN(grown_list_size(size), MAX_INCOMMING_CONNECTIONS)) == -1) {
+                return -1;
+            }
+        } else {
+            kill_incoming(TCP_server, random_int() % size);
+            ++TCP_server->handshake_stats.evicted;
+        }
+    }
+
+    uint32_t index = TCP_server->free_incoming[TCP_server->num_free_incoming - 1];
+    uint64_t now = unix_time();
+
+    if (timer_wheel_add(TCP_server->handshake_timers, now + TCP_HANDSHAKE_TIMEOUT, index) == 0) {
+        return -1;
+    }
+
+    --TCP_server->num_free_incoming;
+    TCP_Handshake_Connection *con = &TCP_server->incoming_connection_array[index];
+    con->sock = sock;
+    con->status = TCP_STATUS_CONNECTED;
+    con->accepted_time = now;
+#ifdef TCP_SERVER_USE_EPOLL
+    con->generation = ++TCP_server->incoming_generation;
+#endif
+    ++TCP_server->num_incoming_connections;
+    ++TCP_server->handshake_stats.accepted;
+    return index;
+}
+
+static void handshake_timer_fired(void *object, uint32_t id, uint64_t deadline)
+{
+    TCP_Server *TCP_server = object;
+
+    if (id >= TCP_server->size_incoming_connections) {
+        return;
+    }
+
+    /* The entry may have been reused since, by a connection with time left. */
+    const TCP_Handshake_Connection *con = &TCP_server->incoming_connection_array[id];
+
+    if (con->status == TCP_STATUS_NO_STATUS || con->accepted_time + TCP_HANDSHAKE_TIMEOUT > deadline) {
+        return;
+    }
+
+    kill_incoming(TCP_server, id);
+    ++TCP_server->handshake_stats.timed_out;
+}
+
 /* return the amount of data in the tcp recv buffer.
  * return 0 on failure.
  */
@@ -256,44 +631,96 @@ int read_TCP_packet(sock_t sock, uint8_t *data, uint16_t length)
     return -1;
 }
 
-/* return length of received packet on success.
- * return 0 if could not read any packet.
- * return -1 on failure (connection must be killed).
+/* return length of the next packet in input if all of it was received.
+ * return 0 if it wasn't.
+ * return -1 if its length is invalid.
  */
-int read_packet_TCP_secure_connection(sock_t sock, uint16_t *next_packet_length, const uint8_t *shared_key,
-                                      uint8_t *recv_nonce, uint8_t *data, uint16_t max_len)
+static int input_next_packet(const TCP_Input_Buffer *input)
+{
+    if (input->length < sizeof(uint16_t)) {
+        return 0;
+    }
+
+    uint16_t length;
+    memcpy(&length, input->data + input->start, sizeof(uint16_t));
+    length = ntohs(length);
+
+    if (length == 0 || length > MAX_PACKET_SIZE) {
+        return -1;
+    }
+
+    if (input->length < sizeof(uint16_t) + length) {
+        return 0;
+    }
+
+    return length;
+}
+
+/* Read as much as fits in input from sock, in one recv().
+ *
+ * return number of bytes read.
+ * return -1 on failure (out of memory).
+ */
+static int input_recv(TCP_Input_Buffer *input, sock_t sock)
 {
-    if (*next_packet_length == 0) {
-        uint16_t len = read_TCP_length(sock);
+    if (input->data == NULL) {
+        input->data = malloc(TCP_INPUT_SIZE);
 
-        if (len == (uint16_t)~0) {
+        if (input->data == NULL) {
             return -1;
         }
+    }
 
-        if (len == 0) {
-            return 0;
+    /* What is left is less than a packet: move it to the start. */
+    if (input->start != 0) {
+        memmove(input->data, input->data + input->start, input->length);
+        input->start = 0;
+    }
+
+    int len = recv(sock, input->data + input->length, TCP_INPUT_SIZE - input->length, MSG_NOSIGNAL);
+
+    if (len <= 0) {
+        return 0;
+    }
+
+    input->length += len;
+    return len;
+}
+
+int read_packet_TCP_secure_connection(sock_t sock, TCP_Input_Buffer *input, const uint8_t *shared_key,
+                                      uint8_t *recv_nonce, uint8_t *data, uint16_t max_len)
+{
+    int length = input_next_packet(input);
+
+    if (length == 0) {
+        int len = input_recv(input, sock);
+
+        if (len <= 0) {
+            return len;
         }
 
-        *next_packet_length = len;
+        length = input_next_packet(input);
     }
 
-    if (max_len + crypto_box_MACBYTES < *next_packet_length) {
+    if (length <= 0) {
+        return length;
+    }
+
+    if (max_len + crypto_box_MACBYTES < length) {
         return -1;
     }
 
-    uint8_t data_encrypted[*next_packet_length];
-    int len_packet = read_TCP_packet(sock, data_encrypted, *next_packet_length);
+    int len = decrypt_data_symmetric(shared_key, recv_nonce, input->data + input->start + sizeof(uint16_t), length, data);
 
-    if (len_packet != *next_packet_length) {
-        return 0;
+    if (len + crypto_box_MACBYTES != length) {
+        return -1;
     }
 
-    *next_packet_length = 0;
-
-    int len = decrypt_data_symmetric(shared_key, recv_nonce, data_encrypted, len_packet, data);
+    input->start += sizeof(uint16_t) + length;
+    input->length -= sizeof(uint16_t) + length;
 
-    if (len + crypto_box_MACBYTES != len_packet) {
-        return -1;
+    if (input->length == 0) {
+        input->start = 0;
     }
 
     increment_nonce(recv_nonce);
@@ -301,96 +728,157 @@ int read_packet_TCP_secure_connection(sock_t sock, uint16_t *next_packet_length,
     return len;
 }
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
+void TCP_input_free(TCP_Input_Buffer *input)
+{
+    free(input->data);
+    input->data = NULL;
+    input->start = 0;
+    input->length = 0;
+}
+
+/* Make room in output for length more bytes, moving what is waiting to the
+ * start of a bigger buffer if needed.
+ *
+ * return 1 on success.
+ * return 0 on failure.
  */
-static int send_pending_data_nonpriority(TCP_Secure_Connection *con)
+static _Bool output_reserve(TCP_Output_Ring *output, uint32_t length)
 {
-    if (con->last_packet_length == 0) {
+    uint32_t needed = output->length + length;
+
+    if (needed <= output->size) {
+        return 1;
+    }
+
+    if (needed > TCP_MAX_OUTPUT_SIZE) {
         return 0;
     }
 
-    uint16_t left = con->last_packet_length - con->last_packet_sent;
-    int len = send(con->sock, con->last_packet + con->last_packet_sent, left, MSG_NOSIGNAL);
+    uint32_t size = output->size ? output->size * 2 : TCP_OUTPUT_MIN_SIZE;
 
-    if (len <= 0) {
-        return -1;
+    while (size < needed) {
+        size *= 2;
     }
 
-    if (len == left) {
-        con->last_packet_length = 0;
-        con->last_packet_sent = 0;
+    uint8_t *data = malloc(size);
+
+    if (data == NULL) {
         return 0;
     }
 
-    con->last_packet_sent += len;
-    return -1;
+    if (output->length != 0) {
+        uint32_t first = MIN(output->length, output->size - output->start);
+        memcpy(data, output->data + output->start, first);
+        memcpy(data + first, output->data, output->length - first);
+    }
+
+    free(output->data);
+    output->data = data;
+    output->size = size;
+    output->start = 0;
+    return 1;
 }
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
- */
-static int send_pending_data(TCP_Secure_Connection *con)
+int TCP_output_queue(TCP_Output_Ring *output, const uint8_t *data, uint32_t length)
 {
-    /* finish sending current non-priority packet */
-    if (send_pending_data_nonpriority(con) == -1) {
-        return -1;
+    if (length == 0) {
+        return 1;
     }
 
-    TCP_Priority_List *p = con->priority_queue_start;
+    if (!output_reserve(output, length)) {
+        return 0;
+    }
 
-    while (p) {
-        uint16_t left = p->size - p->sent;
-        int len = send(con->sock, p->data + p->sent, left, MSG_NOSIGNAL);
+    uint32_t end = (output->start + output->length) % output->size;
+    uint32_t first = MIN(length, output->size - end);
+    memcpy(output->data + end, data, first);
+    memcpy(output->data, data + first, length - first);
+    output->length += length;
+    output->bytes_queued += length;
+    return 1;
+}
 
-        if (len != left) {
-            if (len > 0) {
-                p->sent += len;
-            }
+int TCP_output_write(TCP_Output_Ring *output, sock_t sock, const uint8_t *data, uint16_t length)
+{
+    int len = 0;
 
-            break;
+    if (output->length == 0) {
+        len = send(sock, data, length, MSG_NOSIGNAL);
+
+        if (len == length) {
+            return 1;
         }
 
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
+        if (len < 0) {
+            len = 0;
+        }
     }
 
-    con->priority_queue_start = p;
+    return TCP_output_queue(output, data + len, length - len);
+}
 
-    if (!p) {
-        con->priority_queue_end = NULL;
+int TCP_output_flush(TCP_Output_Ring *output, sock_t sock)
+{
+    if (output->length == 0) {
         return 0;
     }
 
-    return -1;
-}
+    uint32_t first = MIN(output->length, output->size - output->start);
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+    /* The part that wrapped around is sent by the next call. */
+    int len = send(sock, output->data + output->start, first, MSG_NOSIGNAL);
+#else
+    struct iovec iov[2];
+    iov[0].iov_base = output->data + output->start;
+    iov[0].iov_len = first;
+    iov[1].iov_base = output->data;
+    iov[1].iov_len = output->length - first;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (first == output->length) ? 1 : 2;
+    int len = sendmsg(sock, &msg, MSG_NOSIGNAL);
+#endif
+    ++output->flushes;
 
-/* return 0 on failure (only if malloc fails)
- * return 1 on success
- */
-static _Bool add_priority(TCP_Secure_Connection *con, const uint8_t *packet, uint16_t size, uint16_t sent)
-{
-    TCP_Priority_List *p = con->priority_queue_end, *new;
-    new = malloc(sizeof(TCP_Priority_List) + size);
+    if (len <= 0) {
+        return -1;
+    }
+
+    output->length -= len;
+
+    if (output->length == 0) {
+        output->start = 0;
+
+        /* Don't keep what a burst made it grow to for the life of the
+         * connection, it is allocated again if data has to wait. */
+        if (output->size > TCP_OUTPUT_MIN_SIZE) {
+            TCP_output_free(output);
+        }
 
-    if (!new) {
         return 0;
     }
 
-    new->next = NULL;
-    new->size = size;
-    new->sent = sent;
-    memcpy(new->data, packet, size);
+    output->start = (output->start + len) % output->size;
+    return -1;
+}
 
-    if (p) {
-        p->next = new;
-    } else {
-        con->priority_queue_start = new;
-    }
+void TCP_output_free(TCP_Output_Ring *output)
+{
+    free(output->data);
+    output->data = NULL;
+    output->size = 0;
+    output->start = 0;
+    output->length = 0;
+}
 
-    con->priority_queue_end = new;
-    return 1;
+/* return 0 if pending data was sent completely
+ * return -1 if it wasn't
+ */
+static int send_pending_data(TCP_Secure_Connection *con)
+{
+    return TCP_output_flush(&con->output, con->sock);
 }
 
 /* return 1 on success.
@@ -404,14 +892,10 @@ static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const
         return -1;
     }
 
-    _Bool sendpriority = 1;
-
-    if (send_pending_data(con) == -1) {
-        if (priority) {
-            sendpriority = 0;
-        } else {
-            return 0;
-        }
+    /* Priority packets are queued behind whatever is still waiting, the others
+     * are only written once it was all sent. */
+    if (send_pending_data(con) == -1 && !priority) {
+        return 0;
     }
 
     uint8_t packet[sizeof(uint16_t) + length + crypto_box_MACBYTES];
@@ -424,37 +908,11 @@ static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const
         return -1;
     }
 
-    if (priority) {
-        len = sendpriority ? send(con->sock, packet, sizeof(packet), MSG_NOSIGNAL) : 0;
-
-        if (len <= 0) {
-            len = 0;
-        }
-
-        increment_nonce(con->sent_nonce);
-
-        if ((unsigned int)len == sizeof(packet)) {
-            return 1;
-        }
-
-        return add_priority(con, packet, sizeof(packet), len);
-    }
-
-    len = send(con->sock, packet, sizeof(packet), MSG_NOSIGNAL);
-
-    if (len <= 0) {
+    if (!TCP_output_write(&con->output, con->sock, packet, sizeof(packet))) {
         return 0;
     }
 
     increment_nonce(con->sent_nonce);
-
-    if ((unsigned int)len == sizeof(packet)) {
-        return 1;
-    }
-
-    memcpy(con->last_packet, packet, sizeof(packet));
-    con->last_packet_length = sizeof(packet);
-    con->last_packet_sent = len;
     return 1;
 }
 
@@ -462,6 +920,8 @@ static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const
  */
 static void kill_TCP_connection(TCP_Secure_Connection *con)
 {
+    TCP_input_free(&con->input);
+    TCP_output_free(&con->output);
     kill_sock(con->sock);
     sodium_memzero(con, sizeof(TCP_Secure_Connection));
 }
@@ -498,7 +958,7 @@ static int kill_accepted(TCP_Server *TCP_server, int index)
 /* return 1 if everything went well.
  * return -1 if the connection must be killed.
  */
-static int handle_TCP_handshake(TCP_Secure_Connection *con, const uint8_t *data, uint16_t length,
+static int handle_TCP_handshake(TCP_Handshake_Connection *con, const uint8_t *data, uint16_t length,
                                 const uint8_t *self_secret_key)
 {
     if (length != TCP_CLIENT_HANDSHAKE_SIZE) {
@@ -550,7 +1010,7 @@ static int handle_TCP_handshake(TCP_Secure_Connection *con, const uint8_t *data,
  * return 0 if we didn't get it yet.
  * return -1 if the connection must be killed.
  */
-static int read_connection_handshake(TCP_Secure_Connection *con, const uint8_t *self_secret_key)
+static int read_connection_handshake(TCP_Handshake_Connection *con, const uint8_t *self_secret_key)
 {
     uint8_t data[TCP_CLIENT_HANDSHAKE_SIZE];
     int len = 0;
@@ -628,7 +1088,8 @@ static int handle_TCP_routing_req(TCP_Server *TCP_server, uint32_t con_id, const
         }
     }
 
-    if (index == (uint32_t)~0) {
+    /* A new slot may be broadcast to the other shards. */
+    if (index == (uint32_t)~0 || shard_forced_posts_full(TCP_server)) {
         if (send_routing_response(con, 0, public_key) == -1) {
             return -1;
         }
@@ -666,13 +1127,24 @@ static int handle_TCP_routing_req(TCP_Server *TCP_server, uint32_t con_id, const
             con->connections[index].status = 2;
             con->connections[index].index = other_index;
             con->connections[index].other_id = other_id;
+            con->connections[index].shard = TCP_server->shard_number;
             other_conn->connections[other_id].status = 2;
             other_conn->connections[other_id].index = con_id;
             other_conn->connections[other_id].other_id = index;
+            other_conn->connections[other_id].shard = TCP_server->shard_number;
             //TODO: return values?
             send_connect_notification(con, index);
             send_connect_notification(other_conn, other_id);
         }
+    } else if (TCP_server->threads) {
+        /* The other may be connected to another shard. */
+        TCP_Shard_Message msg;
+        init_shard_message(&msg, TCP_SHARD_ROUTING_REQUEST, TCP_server);
+        msg.from_index = con_id;
+        msg.from_c_id = index;
+        memcpy(msg.public_key, con->public_key, crypto_box_PUBLICKEYBYTES);
+        memcpy(msg.other_public_key, public_key, crypto_box_PUBLICKEYBYTES);
+        broadcast_to_shards(TCP_server, &msg, 1);
     }
 
     return 0;
@@ -699,6 +1171,15 @@ static int handle_TCP_oob_send(TCP_Server *TCP_server, uint32_t con_id, const ui
         memcpy(resp_packet + 1 + crypto_box_PUBLICKEYBYTES, data, length);
         write_packet_TCP_secure_connection(&TCP_server->accepted_connection_array[other_index], resp_packet,
                                            sizeof(resp_packet), 0);
+    } else if (TCP_server->threads) {
+        TCP_Shard_Message msg;
+        init_shard_message(&msg, TCP_SHARD_OOB, TCP_server);
+        memcpy(msg.other_public_key, public_key, crypto_box_PUBLICKEYBYTES);
+        msg.data[0] = TCP_PACKET_OOB_RECV;
+        memcpy(msg.data + 1, con->public_key, crypto_box_PUBLICKEYBYTES);
+        memcpy(msg.data + 1 + crypto_box_PUBLICKEYBYTES, data, length);
+        msg.length = 1 + crypto_box_PUBLICKEYBYTES + length;
+        broadcast_to_shards(TCP_server, &msg, 0);
     }
 
     return 0;
@@ -719,7 +1200,15 @@ static int rm_connection_index(TCP_Server *TCP_server, TCP_Secure_Connection *co
         uint32_t index = con->connections[con_number].index;
         uint8_t other_id = con->connections[con_number].other_id;
 
-        if (con->connections[con_number].status == 2) {
+        if (con->connections[con_number].status == 2 && con->connections[con_number].shard != TCP_server->shard_number) {
+            TCP_Shard_Message msg;
+            init_shard_message(&msg, TCP_SHARD_UNLINK, TCP_server);
+            msg.index = index;
+            msg.c_id = other_id;
+            msg.from_index = con - TCP_server->accepted_connection_array;
+            msg.from_c_id = con_number;
+            post_to_shard(TCP_server, &TCP_server->threads->shards[con->connections[con_number].shard], &msg, 1);
+        } else if (con->connections[con_number].status == 2) {
 
             if (index >= TCP_server->size_accepted_connections) {
                 return -1;
@@ -734,6 +1223,7 @@ static int rm_connection_index(TCP_Server *TCP_server, TCP_Secure_Connection *co
 
         con->connections[con_number].index = 0;
         con->connections[con_number].other_id = 0;
+        con->connections[con_number].shard = 0;
         con->connections[con_number].status = 0;
         return 0;
     }
@@ -741,18 +1231,19 @@ static int rm_connection_index(TCP_Server *TCP_server, TCP_Secure_Connection *co
     return -1;
 }
 
-static int handle_onion_recv_1(void *object, IP_Port dest, const uint8_t *data, uint16_t length)
+/* return 0 on success.
+ * return 1 on failure.
+ */
+static int send_onion_response_TCP(TCP_Server *TCP_server, uint32_t index, uint64_t identifier, const uint8_t *data,
+                                   uint16_t length)
 {
-    TCP_Server *TCP_server = object;
-    uint32_t index = dest.ip.ip6.uint32[0];
-
     if (index >= TCP_server->size_accepted_connections) {
         return 1;
     }
 
     TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[index];
 
-    if (con->identifier != dest.ip.ip6.uint64[1]) {
+    if (con->identifier != identifier) {
         return 1;
     }
 
@@ -767,6 +1258,30 @@ static int handle_onion_recv_1(void *object, IP_Port dest, const uint8_t *data,
     return 0;
 }
 
+static int handle_onion_recv_1(void *object, IP_Port dest, const uint8_t *data, uint16_t length)
+{
+    TCP_Server *TCP_server = object;
+
+    if (TCP_server->threads) {
+        /* The connection is on the shard the request came from. */
+        uint32_t shard = dest.ip.ip6.uint32[1];
+
+        if (shard >= TCP_server->threads->num_shards || length > MAX_PACKET_SIZE) {
+            return 1;
+        }
+
+        TCP_Shard_Message msg;
+        init_shard_message(&msg, TCP_SHARD_ONION_RESPONSE, TCP_server);
+        msg.index = dest.ip.ip6.uint32[0];
+        msg.identifier = dest.ip.ip6.uint64[1];
+        memcpy(msg.data, data, length);
+        msg.length = length;
+        return post_to_shard(TCP_server, &TCP_server->threads->shards[shard], &msg, 0) == 0 ? 0 : 1;
+    }
+
+    return send_onion_response_TCP(TCP_server, dest.ip.ip6.uint32[0], dest.ip.ip6.uint64[1], data, length);
+}
+
 /* return 0 on success
  * return -1 on failure
  */
@@ -857,6 +1372,18 @@ static int handle_TCP_packet(TCP_Server *TCP_server, uint32_t con_id, const uint
                 source.ip.ip6.uint64[1] = con->identifier;
                 onion_send_1(TCP_server->onion, data + 1 + crypto_box_NONCEBYTES, length - (1 + crypto_box_NONCEBYTES), source,
                              data + 1);
+            } else if (TCP_server->threads && TCP_server->threads->main->onion) {
+                if (length <= 1 + crypto_box_NONCEBYTES + ONION_SEND_BASE * 2) {
+                    return -1;
+                }
+
+                TCP_Shard_Message msg;
+                init_shard_message(&msg, TCP_SHARD_ONION_REQUEST, TCP_server);
+                msg.from_index = con_id;
+                msg.identifier = con->identifier;
+                memcpy(msg.data, data + 1, length - 1);
+                msg.length = length - 1;
+                post_to_shard(TCP_server, &TCP_server->threads->main_shard, &msg, 0);
             }
 
             return 0;
@@ -887,6 +1414,21 @@ static int handle_TCP_packet(TCP_Server *TCP_server, uint32_t con_id, const uint
 
             uint32_t index = con->connections[c_id].index;
             uint8_t other_c_id = con->connections[c_id].other_id + NUM_RESERVED_PORTS;
+
+            if (con->connections[c_id].shard != TCP_server->shard_number) {
+                TCP_Shard_Message msg;
+                init_shard_message(&msg, TCP_SHARD_DATA, TCP_server);
+                msg.index = index;
+                msg.c_id = con->connections[c_id].other_id;
+                msg.from_index = con_id;
+                msg.from_c_id = c_id;
+                memcpy(msg.data, data, length);
+                msg.data[0] = other_c_id;
+                msg.length = length;
+                post_to_shard(TCP_server, &TCP_server->threads->shards[con->connections[c_id].shard], &msg, 0);
+                return 0;
+            }
+
             uint8_t new_data[length];
             memcpy(new_data, data, length);
             new_data[0] = other_c_id;
@@ -904,17 +1446,22 @@ static int handle_TCP_packet(TCP_Server *TCP_server, uint32_t con_id, const uint
 }
 
 
-static int confirm_TCP_connection(TCP_Server *TCP_server, TCP_Secure_Connection *con, const uint8_t *data,
-                                  uint16_t length)
+/* Make incoming connection i, which sent its first packet, an accepted one.
+ *
+ * return index in accepted_connection_array on success.
+ * return -1 on failure.
+ */
+static int confirm_TCP_connection(TCP_Server *TCP_server, uint32_t i, const uint8_t *data, uint16_t length)
 {
-    int index = add_accepted(TCP_server, con);
+    int index = add_accepted(TCP_server, &TCP_server->incoming_connection_array[i]);
 
     if (index == -1) {
-        kill_TCP_connection(con);
+        kill_incoming(TCP_server, i);
         return -1;
     }
 
-    sodium_memzero(con, sizeof(TCP_Secure_Connection));
+    del_incoming(TCP_server, i);
+    ++TCP_server->handshake_stats.confirmed;
 
     if (handle_TCP_packet(TCP_server, index, data, length) == -1) {
         kill_accepted(TCP_server, index);
@@ -924,12 +1471,16 @@ static int confirm_TCP_connection(TCP_Server *TCP_server, TCP_Secure_Connection
     return index;
 }
 
-/* return index on success
- * return -1 on failure
+/* Take in sock, accepted from addr, for its handshake.
+ *
+ * return index in incoming_connection_array on success
+ * return -1 on failure (sock is closed)
  */
-static int accept_connection(TCP_Server *TCP_server, sock_t sock)
+static int accept_connection(TCP_Server *TCP_server, sock_t sock, const struct sockaddr_storage *addr)
 {
-    if (!sock_valid(sock)) {
+    if (!handshake_source_allowed(TCP_server, addr)) {
+        ++TCP_server->handshake_stats.rate_limited;
+        kill_sock(sock);
         return -1;
     }
 
@@ -943,23 +1494,17 @@ static int accept_connection(TCP_Server *TCP_server, sock_t sock)
         return -1;
     }
 
-    uint16_t index = TCP_server->incomming_connection_queue_index % MAX_INCOMMING_CONNECTIONS;
+    int index = add_incoming(TCP_server, sock);
 
-    TCP_Secure_Connection *conn = &TCP_server->incomming_connection_queue[index];
-
-    if (conn->status != TCP_STATUS_NO_STATUS) {
-        kill_TCP_connection(conn);
+    if (index == -1) {
+        kill_sock(sock);
+        return -1;
     }
 
-    conn->status = TCP_STATUS_CONNECTED;
-    conn->sock = sock;
-    conn->next_packet_length = 0;
-
-    ++TCP_server->incomming_connection_queue_index;
     return index;
 }
 
-static sock_t new_listening_TCP_socket(int family, uint16_t port)
+static sock_t new_listening_TCP_socket(int family, uint16_t port, _Bool reuseport)
 {
     sock_t sock = socket(family, SOCK_STREAM, IPPROTO_TCP);
 
@@ -977,6 +1522,10 @@ static sock_t new_listening_TCP_socket(int family, uint16_t port)
         ok = set_socket_reuseaddr(sock);
     }
 
+    if (ok && reuseport) {
+        ok = set_socket_reuseport(sock);
+    }
+
     ok = ok && bind_to_port(sock, family, port) && (listen(sock, TCP_MAX_BACKLOG) == 0);
 
     if (!ok) {
@@ -987,8 +1536,10 @@ static sock_t new_listening_TCP_socket(int family, uint16_t port)
     return sock;
 }
 
-TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
-                           Onion *onion)
+/* Create a server listening on ports, with SO_REUSEPORT if reuseport is set.
+ */
+static TCP_Server *create_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports,
+                                     const uint8_t *secret_key, _Bool reuseport)
 {
     if (num_sockets == 0 || ports == NULL) {
         return NULL;
@@ -1005,8 +1556,11 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
     }
 
     temp->socks_listening = calloc(num_sockets, sizeof(sock_t));
+    temp->handshake_timers = timer_wheel_new(unix_time());
 
-    if (temp->socks_listening == NULL) {
+    if (temp->socks_listening == NULL || temp->handshake_timers == NULL) {
+        timer_wheel_kill(temp->handshake_timers);
+        free(temp->socks_listening);
         free(temp);
         return NULL;
     }
@@ -1015,6 +1569,7 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
     temp->efd = epoll_create(8);
 
     if (temp->efd == -1) {
+        timer_wheel_kill(temp->handshake_timers);
         free(temp->socks_listening);
         free(temp);
         return NULL;
@@ -1036,7 +1591,7 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
 #endif
 
     for (i = 0; i < num_sockets; ++i) {
-        sock_t sock = new_listening_TCP_socket(family, ports[i]);
+        sock_t sock = new_listening_TCP_socket(family, ports[i], reuseport);
 
         if (sock_valid(sock)) {
 #ifdef TCP_SERVER_USE_EPOLL
@@ -1055,22 +1610,227 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
     }
 
     if (temp->num_listening_socks == 0) {
+#ifdef TCP_SERVER_USE_EPOLL
+        close(temp->efd);
+#endif
+        timer_wheel_kill(temp->handshake_timers);
         free(temp->socks_listening);
         free(temp);
         return NULL;
     }
 
+    memcpy(temp->secret_key, secret_key, crypto_box_SECRETKEYBYTES);
+    crypto_scalarmult_curve25519_base(temp->public_key, temp->secret_key);
+
+    temp->key_index_seed = random_64b();
+    temp->handshake_seed = random_64b();
+    temp->handshake_rate = TCP_HANDSHAKE_RATE;
+    temp->handshake_burst = TCP_HANDSHAKE_BURST;
+
+    return temp;
+}
+
+TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
+                           Onion *onion)
+{
+    TCP_Server *temp = create_TCP_server(ipv6_enabled, num_sockets, ports, secret_key, 0);
+
+    if (temp == NULL) {
+        return NULL;
+    }
+
+    if (onion) {
+        temp->onion = onion;
+        set_callback_handle_recv_1(onion, &handle_onion_recv_1, temp);
+    }
+
+    return temp;
+}
+
+/* Stop the threads of a threaded server and free everything but the main server.
+ */
+static void kill_TCP_server_threads(TCP_Server_Threads *threads)
+{
+    uint32_t i;
+
+    __atomic_store_n(&threads->stop, 1, __ATOMIC_RELEASE);
+
+    for (i = 0; i < threads->num_shards; ++i) {
+        if (threads->shards[i].running) {
+            wake_shard(&threads->shards[i]);
+            pthread_join(threads->shards[i].thread, NULL);
+        }
+    }
+
+    for (i = 0; i <= threads->num_shards; ++i) {
+        TCP_Server_Shard *shard = i < threads->num_shards ? &threads->shards[i] : &threads->main_shard;
+
+        if (shard->server && shard->server != threads->main) {
+            kill_TCP_server(shard->server);
+        }
+
+        kill_mailbox(shard->mailbox);
+
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
+
+        if (shard->wakeup[0] != -1) {
+            close(shard->wakeup[0]);
+            close(shard->wakeup[1]);
+        }
+
+#endif
+    }
+
+    free(threads->shards);
+    free(threads);
+}
+
+/* return 0 on success.
+ * return -1 on failure.
+ */
+static int init_TCP_server_shard(TCP_Server_Shard *shard, TCP_Server *TCP_server)
+{
+    shard->server = TCP_server;
+    shard->wakeup[0] = shard->wakeup[1] = -1;
+    shard->mailbox = new_mailbox(TCP_SHARD_MAILBOX_SIZE);
+
+    if (shard->mailbox == NULL) {
+        return -1;
+    }
+
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
+
+    if (pipe(shard->wakeup) != 0) {
+        shard->wakeup[0] = shard->wakeup[1] = -1;
+        return -1;
+    }
+
+    fcntl(shard->wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(shard->wakeup[1], F_SETFL, O_NONBLOCK);
+#endif
+
+    return 0;
+}
+
+static void *run_TCP_server_shard(void *arg)
+{
+    TCP_Server *TCP_server = arg;
+    sock_t *socks = NULL;
+    uint32_t size_socks = 0;
+    struct pollfd *fds = NULL;
+    uint32_t size_fds = 0;
+
+    while (!__atomic_load_n(&TCP_server->threads->stop, __ATOMIC_ACQUIRE)) {
+        do_TCP_server(TCP_server);
+
+        uint32_t num_socks = TCP_server_get_socks(TCP_server, NULL, UINT32_MAX);
+
+        if (num_socks > size_socks) {
+            sock_t *new_socks = realloc(socks, num_socks * sizeof(sock_t));
+
+            if (new_socks != NULL) {
+                socks = new_socks;
+                size_socks = num_socks;
+            }
+        }
+
+        num_socks = TCP_server_get_socks(TCP_server, socks, size_socks);
+        networking_wait_fds(&fds, &size_fds, socks, num_socks, TCP_server_run_interval(TCP_server));
+    }
+
+    free(fds);
+    free(socks);
+    return NULL;
+}
+
+TCP_Server *new_TCP_server_threaded(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports,
+                                    const uint8_t *secret_key, Onion *onion, uint16_t num_threads)
+{
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32) || !defined(SO_REUSEPORT)
+    return NULL;
+#else
+
+    if (num_threads == 0 || num_sockets == 0 || ports == NULL) {
+        return NULL;
+    }
+
+    if (networking_at_startup() != 0) {
+        return NULL;
+    }
+
+    TCP_Server *temp = calloc(1, sizeof(TCP_Server));
+
+    if (temp == NULL) {
+        return NULL;
+    }
+
+    TCP_Server_Threads *threads = calloc(1, sizeof(TCP_Server_Threads));
+
+    if (threads == NULL) {
+        free(temp);
+        return NULL;
+    }
+
+    threads->shards = calloc(num_threads, sizeof(TCP_Server_Shard));
+
+    if (threads->shards == NULL) {
+        free(threads);
+        free(temp);
+        return NULL;
+    }
+
+    threads->main = temp;
+    temp->threads = threads;
+    memcpy(temp->secret_key, secret_key, crypto_box_SECRETKEYBYTES);
+    crypto_scalarmult_curve25519_base(temp->public_key, temp->secret_key);
+
+    if (init_TCP_server_shard(&threads->main_shard, temp) == -1) {
+        kill_TCP_server_threads(threads);
+        free(temp);
+        return NULL;
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < num_threads; ++i) {
+        TCP_Server *shard = create_TCP_server(ipv6_enabled, num_sockets, ports, secret_key, 1);
+
+        if (shard == NULL) {
+            break;
+        }
+
+        shard->threads = threads;
+        shard->shard_number = i;
+        threads->num_shards = i + 1;
+
+        if (init_TCP_server_shard(&threads->shards[i], shard) == -1) {
+            break;
+        }
+    }
+
+    if (i != num_threads) {
+        kill_TCP_server_threads(threads);
+        free(temp);
+        return NULL;
+    }
+
+    for (i = 0; i < num_threads; ++i) {
+        if (pthread_create(&threads->shards[i].thread, NULL, &run_TCP_server_shard, threads->shards[i].server) != 0) {
+            kill_TCP_server_threads(threads);
+            free(temp);
+            return NULL;
+        }
+
+        threads->shards[i].running = 1;
+    }
+
     if (onion) {
         temp->onion = onion;
         set_callback_handle_recv_1(onion, &handle_onion_recv_1, temp);
     }
 
-    memcpy(temp->secret_key, secret_key, crypto_box_SECRETKEYBYTES);
-    crypto_scalarmult_curve25519_base(temp->public_key, temp->secret_key);
-
-    bs_list_init(&temp->accepted_key_list, crypto_box_PUBLICKEYBYTES, 8);
-
     return temp;
+#endif
 }
 
 static void do_TCP_accept_new(TCP_Server *TCP_server)
@@ -1078,55 +1838,48 @@ static void do_TCP_accept_new(TCP_Server *TCP_server)
     uint32_t i;
 
     for (i = 0; i < TCP_server->num_listening_socks; ++i) {
-        struct sockaddr_storage addr;
-        unsigned int addrlen = sizeof(addr);
-        sock_t sock;
+        while (1) {
+            struct sockaddr_storage addr;
+            unsigned int addrlen = sizeof(addr);
+            sock_t sock = accept(TCP_server->socks_listening[i], (struct sockaddr *)&addr, &addrlen);
+
+            if (!sock_valid(sock)) {
+                break;
+            }
 
-        do {
-            sock = accept(TCP_server->socks_listening[i], (struct sockaddr *)&addr, &addrlen);
-        } while (accept_connection(TCP_server, sock) != -1);
+            accept_connection(TCP_server, sock, &addr);
+        }
     }
 }
 
-static int do_incoming(TCP_Server *TCP_server, uint32_t i)
+/* Read the handshake packet of incoming connection i if it is waiting for it. */
+static void do_incoming(TCP_Server *TCP_server, uint32_t i)
 {
-    if (TCP_server->incomming_connection_queue[i].status != TCP_STATUS_CONNECTED) {
-        return -1;
+    if (TCP_server->incoming_connection_array[i].status != TCP_STATUS_CONNECTED) {
+        return;
     }
 
-    int ret = read_connection_handshake(&TCP_server->incomming_connection_queue[i], TCP_server->secret_key);
-
-    if (ret == -1) {
-        kill_TCP_connection(&TCP_server->incomming_connection_queue[i]);
-    } else if (ret == 1) {
-        int index_new = TCP_server->unconfirmed_connection_queue_index % MAX_INCOMMING_CONNECTIONS;
-        TCP_Secure_Connection *conn_old = &TCP_server->incomming_connection_queue[i];
-        TCP_Secure_Connection *conn_new = &TCP_server->unconfirmed_connection_queue[index_new];
-
-        if (conn_new->status != TCP_STATUS_NO_STATUS) {
-            kill_TCP_connection(conn_new);
-        }
-
-        memcpy(conn_new, conn_old, sizeof(TCP_Secure_Connection));
-        sodium_memzero(conn_old, sizeof(TCP_Secure_Connection));
-        ++TCP_server->unconfirmed_connection_queue_index;
-
-        return index_new;
+    if (read_connection_handshake(&TCP_server->incoming_connection_array[i], TCP_server->secret_key) == -1) {
+        kill_incoming(TCP_server, i);
     }
-
-    return -1;
 }
 
+/* Read the first packet of incoming connection i if its handshake was
+ * answered.
+ *
+ * return index in accepted_connection_array if that confirmed it.
+ * return -1 otherwise.
+ */
 static int do_unconfirmed(TCP_Server *TCP_server, uint32_t i)
 {
-    TCP_Secure_Connection *conn = &TCP_server->unconfirmed_connection_queue[i];
+    TCP_Handshake_Connection *conn = &TCP_server->incoming_connection_array[i];
 
     if (conn->status != TCP_STATUS_UNCONFIRMED) {
         return -1;
     }
 
     uint8_t packet[MAX_PACKET_SIZE];
-    int len = read_packet_TCP_secure_connection(conn->sock, &conn->next_packet_length, conn->shared_key, conn->recv_nonce,
+    int len = read_packet_TCP_secure_connection(conn->sock, &conn->input, conn->shared_key, conn->recv_nonce,
               packet, sizeof(packet));
 
     if (len == 0) {
@@ -1134,11 +1887,11 @@ static int do_unconfirmed(TCP_Server *TCP_server, uint32_t i)
     }
 
     if (len == -1) {
-        kill_TCP_connection(conn);
+        kill_incoming(TCP_server, i);
         return -1;
     }
 
-    return confirm_TCP_connection(TCP_server, conn, packet, len);
+    return confirm_TCP_connection(TCP_server, i, packet, len);
 }
 
 static void do_confirmed_recv(TCP_Server *TCP_server, uint32_t i)
@@ -1148,7 +1901,7 @@ static void do_confirmed_recv(TCP_Server *TCP_server, uint32_t i)
     uint8_t packet[MAX_PACKET_SIZE];
     int len;
 
-    while ((len = read_packet_TCP_secure_connection(conn->sock, &conn->next_packet_length, conn->shared_key,
+    while ((len = read_packet_TCP_secure_connection(conn->sock, &conn->input, conn->shared_key,
                   conn->recv_nonce, packet, sizeof(packet)))) {
         if (len == -1) {
             kill_accepted(TCP_server, i);
@@ -1166,17 +1919,13 @@ static void do_TCP_incomming(TCP_Server *TCP_server)
 {
     uint32_t i;
 
-    for (i = 0; i < MAX_INCOMMING_CONNECTIONS; ++i) {
+    /* Connections killed on the way may free the array. */
+    for (i = 0; i < TCP_server->size_incoming_connections; ++i) {
         do_incoming(TCP_server, i);
-    }
-}
 
-static void do_TCP_unconfirmed(TCP_Server *TCP_server)
-{
-    uint32_t i;
-
-    for (i = 0; i < MAX_INCOMMING_CONNECTIONS; ++i) {
-        do_unconfirmed(TCP_server, i);
+        if (i < TCP_server->size_incoming_connections) {
+            do_unconfirmed(TCP_server, i);
+        }
     }
 }
 
@@ -1237,6 +1986,19 @@ static void do_TCP_confirmed(TCP_Server *TCP_server)
 }
 
 #ifdef TCP_SERVER_USE_EPOLL
+/* Events read in the same batch as the one whose connection killed incoming
+ * connection index, or evicted it for another, are for a connection that is
+ * gone, even if the new one at index got the same socket number.
+ *
+ * return 1 if the event for generation is still for incoming connection index.
+ */
+static _Bool incoming_event_valid(const TCP_Server *TCP_server, uint32_t index, uint32_t generation)
+{
+    return index < TCP_server->size_incoming_connections
+           && TCP_server->incoming_connection_array[index].status != TCP_STATUS_NO_STATUS
+           && TCP_server->incoming_connection_array[index].generation == generation;
+}
+
 static void do_TCP_epoll(TCP_Server *TCP_server)
 {
 #define MAX_EVENTS 16
@@ -1247,7 +2009,8 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
         int n;
 
         for (n = 0; n < nfds; ++n) {
-            sock_t sock = events[n].data.u64 & 0xFFFFFFFF;
+            /* The socket, or the generation of incoming connections. */
+            uint32_t id = events[n].data.u64 & 0xFFFFFFFF;
             int status = (events[n].data.u64 >> 32) & 0xFF, index = (events[n].data.u64 >> 40);
 
             if ((events[n].events & EPOLLERR) || (events[n].events & EPOLLHUP) || (events[n].events & EPOLLRDHUP)) {
@@ -1258,12 +2021,10 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
                     }
 
                     case TCP_SOCKET_INCOMING: {
-                        kill_TCP_connection(&TCP_server->incomming_connection_queue[index]);
-                        break;
-                    }
+                        if (incoming_event_valid(TCP_server, index, id)) {
+                            kill_incoming(TCP_server, index);
+                        }
 
-                    case TCP_SOCKET_UNCONFIRMED: {
-                        kill_TCP_connection(&TCP_server->unconfirmed_connection_queue[index]);
                         break;
                     }
 
@@ -1284,17 +2045,16 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
             switch (status) {
                 case TCP_SOCKET_LISTENING: {
                     //socket is from socks_listening, accept connection
-                    struct sockaddr_storage addr;
-                    unsigned int addrlen = sizeof(addr);
-
                     while (1) {
-                        sock_t sock_new = accept(sock, (struct sockaddr *)&addr, &addrlen);
+                        struct sockaddr_storage addr;
+                        unsigned int addrlen = sizeof(addr);
+                        sock_t sock_new = accept(id, (struct sockaddr *)&addr, &addrlen);
 
                         if (!sock_valid(sock_new)) {
                             break;
                         }
 
-                        int index_new = accept_connection(TCP_server, sock_new);
+                        int index_new = accept_connection(TCP_server, sock_new, &addr);
 
                         if (index_new == -1) {
                             continue;
@@ -1302,11 +2062,12 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
 
                         struct epoll_event ev = {
                             .events = EPOLLIN | EPOLLET | EPOLLRDHUP,
-                            .data.u64 = sock_new | ((uint64_t)TCP_SOCKET_INCOMING << 32) | ((uint64_t)index_new << 40)
+                            .data.u64 = TCP_server->incoming_connection_array[index_new].generation
+                            | ((uint64_t)TCP_SOCKET_INCOMING << 32) | ((uint64_t)index_new << 40)
                         };
 
                         if (epoll_ctl(TCP_server->efd, EPOLL_CTL_ADD, sock_new, &ev) == -1) {
-                            kill_TCP_connection(&TCP_server->incomming_connection_queue[index_new]);
+                            kill_incoming(TCP_server, index_new);
                             continue;
                         }
                     }
@@ -1315,22 +2076,19 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
                 }
 
                 case TCP_SOCKET_INCOMING: {
-                    int index_new;
+                    if (!incoming_event_valid(TCP_server, index, id)) {
+                        break;
+                    }
 
-                    if ((index_new = do_incoming(TCP_server, index)) != -1) {
-                        events[n].events = EPOLLIN | EPOLLET | EPOLLRDHUP;
-                        events[n].data.u64 = sock | ((uint64_t)TCP_SOCKET_UNCONFIRMED << 32) | ((uint64_t)index_new << 40);
+                    sock_t sock = TCP_server->incoming_connection_array[index].sock;
 
-                        if (epoll_ctl(TCP_server->efd, EPOLL_CTL_MOD, sock, &events[n]) == -1) {
-                            kill_TCP_connection(&TCP_server->unconfirmed_connection_queue[index_new]);
-                            break;
-                        }
+                    /* A client can't send its first packet before it got the
+                     * answer to its handshake, which takes another event. */
+                    if (TCP_server->incoming_connection_array[index].status == TCP_STATUS_CONNECTED) {
+                        do_incoming(TCP_server, index);
+                        break;
                     }
 
-                    break;
-                }
-
-                case TCP_SOCKET_UNCONFIRMED: {
                     int index_new;
 
                     if ((index_new = do_unconfirmed(TCP_server, index)) != -1) {
@@ -1342,6 +2100,9 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
                             kill_accepted(TCP_server, index_new);
                             break;
                         }
+
+                        /* The packets read with the first one won't make the socket readable again. */
+                        do_confirmed_recv(TCP_server, index_new);
                     }
 
                     break;
@@ -1359,24 +2120,394 @@ static void do_TCP_epoll(TCP_Server *TCP_server)
 }
 #endif
 
+/* return connection c_id of accepted connection index if it is linked to
+ * connection from_c_id of accepted connection from_index of shard from_shard.
+ * return NULL if it isn't (anymore).
+ */
+static TCP_Secure_Connection *get_shard_link(TCP_Server *TCP_server, const TCP_Shard_Message *msg)
+{
+    if (msg->index >= TCP_server->size_accepted_connections || msg->c_id >= NUM_CLIENT_CONNECTIONS) {
+        return NULL;
+    }
+
+    TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[msg->index];
+
+    if (con->status != TCP_STATUS_CONFIRMED || con->connections[msg->c_id].status != 2
+            || con->connections[msg->c_id].shard != msg->from_shard || con->connections[msg->c_id].index != msg->from_index
+            || con->connections[msg->c_id].other_id != msg->from_c_id) {
+        return NULL;
+    }
+
+    return con;
+}
+
+static void shard_routing_req(TCP_Server *TCP_server, const TCP_Shard_Message *msg)
+{
+    int index = get_TCP_connection_index(TCP_server, msg->other_public_key);
+
+    if (index == -1) {
+        return;
+    }
+
+    TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[index];
+    uint32_t i;
+
+    for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
+        if (con->connections[i].status == 0 || public_key_cmp(con->connections[i].public_key, msg->public_key) != 0) {
+            continue;
+        }
+
+        /* If it is linked to another shard already, that is an older
+         * connection with the same key being killed there. */
+        if (con->connections[i].status == 2 && (con->connections[i].shard == TCP_server->shard_number
+                || (con->connections[i].shard == msg->from_shard && con->connections[i].index == msg->from_index
+                    && con->connections[i].other_id == msg->from_c_id))) {
+            return;
+        }
+
+        con->connections[i].status = 2;
+        con->connections[i].index = msg->from_index;
+        con->connections[i].other_id = msg->from_c_id;
+        con->connections[i].shard = msg->from_shard;
+        send_connect_notification(con, i);
+
+        TCP_Shard_Message reply;
+        init_shard_message(&reply, TCP_SHARD_LINKED, TCP_server);
+        reply.index = msg->from_index;
+        reply.c_id = msg->from_c_id;
+        reply.from_index = index;
+        reply.from_c_id = i;
+        memcpy(reply.public_key, con->public_key, crypto_box_PUBLICKEYBYTES);
+        memcpy(reply.other_public_key, msg->public_key, crypto_box_PUBLICKEYBYTES);
+        post_to_shard(TCP_server, &TCP_server->threads->shards[msg->from_shard], &reply, 1);
+        return;
+    }
+}
+
+static void shard_linked(TCP_Server *TCP_server, const TCP_Shard_Message *msg)
+{
+    if (get_shard_link(TCP_server, msg)) {
+        /* Both asked for it at the same time. */
+        return;
+    }
+
+    if (msg->index < TCP_server->size_accepted_connections && msg->c_id < NUM_CLIENT_CONNECTIONS) {
+        TCP_Secure_Connection *con = &TCP_server->accepted_connection_array[msg->index];
+
+        if (con->status == TCP_STATUS_CONFIRMED && con->connections[msg->c_id].status == 1
+                && public_key_cmp(con->public_key, msg->other_public_key) == 0
+                && public_key_cmp(con->connections[msg->c_id].public_key, msg->public_key) == 0) {
+            con->connections[msg->c_id].status = 2;
+            con->connections[msg->c_id].index = msg->from_index;
+            con->connections[msg->c_id].other_id = msg->from_c_id;
+            con->connections[msg->c_id].shard = msg->from_shard;
+            send_connect_notification(con, msg->c_id);
+            return;
+        }
+    }
+
+    /* The connection that asked for it is gone, undo the other side. */
+    TCP_Shard_Message reply;
+    init_shard_message(&reply, TCP_SHARD_UNLINK, TCP_server);
+    reply.index = msg->from_index;
+    reply.c_id = msg->from_c_id;
+    reply.from_index = msg->index;
+    reply.from_c_id = msg->c_id;
+    post_to_shard(TCP_server, &TCP_server->threads->shards[msg->from_shard], &reply, 1);
+}
+
+static void shard_unlink(TCP_Server *TCP_server, const TCP_Shard_Message *msg)
+{
+    TCP_Secure_Connection *con = get_shard_link(TCP_server, msg);
+
+    if (con == NULL) {
+        return;
+    }
+
+    con->connections[msg->c_id].status = 1;
+    con->connections[msg->c_id].index = 0;
+    con->connections[msg->c_id].other_id = 0;
+    con->connections[msg->c_id].shard = 0;
+    send_disconnect_notification(con, msg->c_id);
+}
+
+static void handle_shard_message(TCP_Server *TCP_server, const TCP_Shard_Message *msg)
+{
+    switch (msg->type) {
+        case TCP_SHARD_ROUTING_REQUEST: {
+            shard_routing_req(TCP_server, msg);
+            break;
+        }
+
+        case TCP_SHARD_LINKED: {
+            shard_linked(TCP_server, msg);
+            break;
+        }
+
+        case TCP_SHARD_UNLINK: {
+            shard_unlink(TCP_server, msg);
+            break;
+        }
+
+        case TCP_SHARD_DATA: {
+            TCP_Secure_Connection *con = get_shard_link(TCP_server, msg);
+
+            if (con) {
+                write_packet_TCP_secure_connection(con, msg->data, msg->length, 0);
+            }
+
+            break;
+        }
+
+        case TCP_SHARD_OOB: {
+            int index = get_TCP_connection_index(TCP_server, msg->other_public_key);
+
+            if (index != -1) {
+                write_packet_TCP_secure_connection(&TCP_server->accepted_connection_array[index], msg->data, msg->length, 0);
+            }
+
+            break;
+        }
+
+        case TCP_SHARD_ACCEPTED: {
+            int index = get_TCP_connection_index(TCP_server, msg->public_key);
+
+            if (index != -1) {
+                kill_accepted(TCP_server, index);
+            }
+
+            break;
+        }
+
+        case TCP_SHARD_ONION_REQUEST: {
+            if (TCP_server->onion == NULL || msg->length <= crypto_box_NONCEBYTES) {
+                break;
+            }
+
+            IP_Port source;
+            source.port = 0;  // dummy initialise
+            source.ip.family = TCP_ONION_FAMILY;
+            source.ip.ip6.uint32[0] = msg->from_index;
+            source.ip.ip6.uint32[1] = msg->from_shard;
+            source.ip.ip6.uint64[1] = msg->identifier;
+            onion_send_1(TCP_server->onion, msg->data + crypto_box_NONCEBYTES, msg->length - crypto_box_NONCEBYTES, source,
+                         msg->data);
+            break;
+        }
+
+        case TCP_SHARD_ONION_RESPONSE: {
+            send_onion_response_TCP(TCP_server, msg->index, msg->identifier, msg->data, msg->length);
+            break;
+        }
+    }
+}
+
+static void do_TCP_shard_messages(TCP_Server *TCP_server)
+{
+    TCP_Server_Shard *shard = own_shard(TCP_server);
+
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
+    uint8_t buf[64];
+
+    while (read(shard->wakeup[0], buf, sizeof(buf)) > 0) {
+        /* Drain the pipe, the mailbox is checked below anyway. */
+    }
+
+#endif
+
+    TCP_Shard_Message msg;
+    uint32_t i;
+
+    for (i = 0; i < MAX_SHARD_MESSAGES_PER_RUN; ++i) {
+        int len = mailbox_take(shard->mailbox, (uint8_t *)&msg, sizeof(msg));
+
+        if (len == -1) {
+            break;
+        }
+
+        if ((size_t)len < offsetof(TCP_Shard_Message, data)) {
+            continue;
+        }
+
+        if (msg.forced && msg.from_shard < TCP_server->threads->num_shards) {
+            __atomic_sub_fetch(&TCP_server->threads->shards[msg.from_shard].forced_posts, 1, __ATOMIC_RELAXED);
+        }
+
+        if (len != offsetof(TCP_Shard_Message, data) + msg.length) {
+            continue;
+        }
+
+        handle_shard_message(TCP_server, &msg);
+    }
+}
+
 void do_TCP_server(TCP_Server *TCP_server)
 {
     unix_time_update();
 
+    if (TCP_server->threads) {
+        do_TCP_shard_messages(TCP_server);
+
+        if (TCP_server == TCP_server->threads->main) {
+            return;
+        }
+    }
+
+    timer_wheel_run(TCP_server->handshake_timers, unix_time(), &handshake_timer_fired, TCP_server);
+
 #ifdef TCP_SERVER_USE_EPOLL
     do_TCP_epoll(TCP_server);
 
 #else
     do_TCP_accept_new(TCP_server);
     do_TCP_incomming(TCP_server);
-    do_TCP_unconfirmed(TCP_server);
 #endif
 
     do_TCP_confirmed(TCP_server);
 }
 
+static void add_sock(sock_t *socks, uint32_t *num, sock_t sock)
+{
+    if (socks) {
+        socks[*num] = sock;
+    }
+
+    ++*num;
+}
+
+uint32_t TCP_server_get_socks(const TCP_Server *TCP_server, sock_t *socks, uint32_t max_socks)
+{
+    if (max_socks == 0) {
+        return 0;
+    }
+
+    uint32_t num = 0;
+
+    if (TCP_server->threads) {
+        add_sock(socks, &num, own_shard(TCP_server)->wakeup[0]);
+
+        if (TCP_server == TCP_server->threads->main || num == max_socks) {
+            return num;
+        }
+    }
+
+#ifdef TCP_SERVER_USE_EPOLL
+    add_sock(socks, &num, TCP_server->efd);
+    return num;
+#else
+    uint32_t i;
+
+    for (i = 0; i < TCP_server->num_listening_socks && num < max_socks; ++i) {
+        add_sock(socks, &num, TCP_server->socks_listening[i]);
+    }
+
+    for (i = 0; i < TCP_server->size_incoming_connections && num < max_socks; ++i) {
+        if (TCP_server->incoming_connection_array[i].status != TCP_STATUS_NO_STATUS) {
+            add_sock(socks, &num, TCP_server->incoming_connection_array[i].sock);
+        }
+    }
+
+    for (i = 0; i < TCP_server->size_accepted_connections && num < max_socks; ++i) {
+        if (TCP_server->accepted_connection_array[i].status != TCP_STATUS_NO_STATUS) {
+            add_sock(socks, &num, TCP_server->accepted_connection_array[i].sock);
+        }
+    }
+
+    return num;
+#endif
+}
+
+uint32_t TCP_server_run_interval(const TCP_Server *TCP_server)
+{
+    if (TCP_server->threads) {
+        if (mailbox_size(own_shard(TCP_server)->mailbox) != 0) {
+            return 0;
+        }
+
+        if (TCP_server == TCP_server->threads->main) {
+            return UINT32_MAX;
+        }
+    }
+
+#ifdef TCP_SERVER_USE_EPOLL
+    return timeout_remaining_ms(TCP_server->last_run_pinged, 1);
+#else
+    uint32_t i;
+
+    for (i = 0; i < TCP_server->size_accepted_connections; ++i) {
+        const TCP_Secure_Connection *conn = &TCP_server->accepted_connection_array[i];
+
+        if (conn->status == TCP_STATUS_CONFIRMED
+                && conn->output.length != 0) {
+            return TCP_SERVER_SEND_RETRY_INTERVAL;
+        }
+    }
+
+    return timeout_remaining_ms(unix_time(), 1);
+#endif
+}
+
+int TCP_server_output_stats(const TCP_Server *TCP_server, uint64_t *bytes_queued, uint64_t *flushes)
+{
+    if (TCP_server->threads && TCP_server == TCP_server->threads->main) {
+        return -1;
+    }
+
+    *bytes_queued = TCP_server->output_bytes_queued;
+    *flushes = TCP_server->output_flushes;
+
+    uint32_t i;
+
+    for (i = 0; i < TCP_server->size_accepted_connections; ++i) {
+        const TCP_Secure_Connection *conn = &TCP_server->accepted_connection_array[i];
+        *bytes_queued += conn->output.bytes_queued;
+        *flushes += conn->output.flushes;
+    }
+
+    return 0;
+}
+
+void TCP_server_set_handshake_limit(TCP_Server *TCP_server, uint32_t rate, uint32_t burst)
+{
+    if (TCP_server->threads && TCP_server == TCP_server->threads->main) {
+        uint32_t i;
+
+        /* The shards are already running. */
+        for (i = 0; i < TCP_server->threads->num_shards; ++i) {
+            TCP_Server *shard = TCP_server->threads->shards[i].server;
+            __atomic_store_n(&shard->handshake_burst, burst, __ATOMIC_RELAXED);
+            __atomic_store_n(&shard->handshake_rate, rate, __ATOMIC_RELAXED);
+        }
+
+        return;
+    }
+
+    __atomic_store_n(&TCP_server->handshake_burst, burst, __ATOMIC_RELAXED);
+    __atomic_store_n(&TCP_server->handshake_rate, rate, __ATOMIC_RELAXED);
+}
+
+int TCP_server_handshake_stats(const TCP_Server *TCP_server, TCP_Handshake_Stats *stats)
+{
+    if (TCP_server->threads && TCP_server == TCP_server->threads->main) {
+        return -1;
+    }
+
+    *stats = TCP_server->handshake_stats;
+    return 0;
+}
+
 void kill_TCP_server(TCP_Server *TCP_server)
 {
+    if (TCP_server->threads && TCP_server == TCP_server->threads->main) {
+        if (TCP_server->onion) {
+            set_callback_handle_recv_1(TCP_server->onion, NULL, NULL);
+        }
+
+        kill_TCP_server_threads(TCP_server->threads);
+        free(TCP_server);
+        return;
+    }
+
     uint32_t i;
 
     for (i = 0; i < TCP_server->num_listening_socks; ++i) {
@@ -1387,13 +2518,30 @@ void kill_TCP_server(TCP_Server *TCP_server)
         set_callback_handle_recv_1(TCP_server->onion, NULL, NULL);
     }
 
-    bs_list_free(&TCP_server->accepted_key_list);
+    key_index_free(&TCP_server->accepted_key_index);
+
+    for (i = 0; i < TCP_server->size_incoming_connections; ++i) {
+        if (TCP_server->incoming_connection_array[i].status != TCP_STATUS_NO_STATUS) {
+            TCP_input_free(&TCP_server->incoming_connection_array[i].input);
+            kill_sock(TCP_server->incoming_connection_array[i].sock);
+        }
+    }
+
+    for (i = 0; i < TCP_server->size_accepted_connections; ++i) {
+        if (TCP_server->accepted_connection_array[i].status != TCP_STATUS_NO_STATUS) {
+            kill_TCP_connection(&TCP_server->accepted_connection_array[i]);
+        }
+    }
 
 #ifdef TCP_SERVER_USE_EPOLL
     close(TCP_server->efd);
 #endif
 
+    timer_wheel_kill(TCP_server->handshake_timers);
     free(TCP_server->socks_listening);
+    free(TCP_server->incoming_connection_array);
+    free(TCP_server->free_incoming);
     free(TCP_server->accepted_connection_array);
+    free(TCP_server->free_accepted);
     free(TCP_server);
 }
@@ -24,7 +24,7 @@
 #define TCP_SERVER_H
 
 #include "crypto_core.h"
-#include "list.h"
+#include "key_index.h"
 #include "onion.h"
 
 #ifdef TCP_SERVER_USE_EPOLL
@@ -35,9 +35,19 @@
 #define MSG_NOSIGNAL 0
 #endif
 
-#define MAX_INCOMMING_CONNECTIONS 256
+/* Most connections doing their handshake at once, past that a random one of
+ * them is closed for each new one. */
+#define MAX_INCOMMING_CONNECTIONS 8192
 
-#define TCP_MAX_BACKLOG MAX_INCOMMING_CONNECTIONS
+#define TCP_MAX_BACKLOG 1024
+
+/* Seconds a connection has to do its handshake and send its first packet. */
+#define TCP_HANDSHAKE_TIMEOUT 10
+
+/* Default of TCP_server_set_handshake_limit(): connections per second each
+ * source IP can start handshakes on, in bursts of up to TCP_HANDSHAKE_BURST. */
+#define TCP_HANDSHAKE_RATE 16
+#define TCP_HANDSHAKE_BURST 64
 
 #define MAX_PACKET_SIZE 2048
 
@@ -66,11 +76,32 @@
 #define TCP_PING_FREQUENCY 30
 #define TCP_PING_TIMEOUT 10
 
+/* Most data waiting to be sent on a connection. */
+#define TCP_MAX_OUTPUT_SIZE (1024 * 1024)
+
+/* Size of the buffer of a TCP_Output_Ring when it is first needed. */
+#define TCP_OUTPUT_MIN_SIZE 4096
+
+/* How often sending data that didn't fit in a socket's buffer is retried, in ms. */
+#define TCP_SERVER_SEND_RETRY_INTERVAL 50
+
+/* Most messages (relayed packets, onion packets) a shard of a threaded server
+ * queues for another one, past that they are dropped. */
+#define TCP_SHARD_MAILBOX_SIZE 4096
+
+/* Most messages that must not be lost (new connections, routing requests) a
+ * shard of a threaded server has waiting in the others' mailboxes, past that
+ * it refuses new connections and routing requests. */
+#define TCP_SHARD_MAX_FORCED_POSTS 4096
+
 #ifdef TCP_SERVER_USE_EPOLL
+/* The kind of socket an epoll event is for, in bits 32 to 39 of its data.
+ * Bits 40 to 63 are its index in incoming_connection_array or
+ * accepted_connection_array, the low 32 bits the socket or, for incoming
+ * connections, the generation of the connection. */
 #define TCP_SOCKET_LISTENING 0
-#define TCP_SOCKET_INCOMING 1
-#define TCP_SOCKET_UNCONFIRMED 2
-#define TCP_SOCKET_CONFIRMED 3
+#define TCP_SOCKET_INCOMING 1 /* In incoming_connection_array, both before and after the handshake packet. */
+#define TCP_SOCKET_CONFIRMED 2
 #endif
 
 enum {
@@ -80,13 +111,31 @@ enum {
     TCP_STATUS_CONFIRMED,
 };
 
-typedef struct TCP_Priority_List TCP_Priority_List;
-
-struct TCP_Priority_List {
-    TCP_Priority_List *next;
-    uint16_t size, sent;
-    uint8_t data[];
-};
+/* Data written to a TCP connection that didn't fit in its socket's buffer
+ * yet, in the order it was written. The buffer is only allocated once
+ * something has to wait in it and grows (up to TCP_MAX_OUTPUT_SIZE) as
+ * needed, it is sent with one sendmsg() however the data wraps around. A
+ * buffer that grew past TCP_OUTPUT_MIN_SIZE is freed once it is emptied.
+ */
+typedef struct {
+    uint8_t *data;
+    uint32_t size;
+    uint32_t start;
+    uint32_t length;
+
+    uint64_t bytes_queued; /* Total bytes that had to wait in the ring. */
+    uint64_t flushes; /* Total send calls made to send them. */
+} TCP_Output_Ring;
+
+/* Data received on a TCP connection that wasn't handled yet: one recv()
+ * reads as much as fits, then the packets are taken out of it one by one.
+ * The buffer is allocated on the first read.
+ */
+typedef struct {
+    uint8_t *data;
+    uint16_t start;
+    uint16_t length;
+} TCP_Input_Buffer;
 
 typedef struct TCP_Secure_Connection {
     sock_t  sock;
@@ -94,19 +143,17 @@ typedef struct TCP_Secure_Connection {
     uint8_t recv_nonce[crypto_box_NONCEBYTES]; /* Nonce of received packets. */
     uint8_t sent_nonce[crypto_box_NONCEBYTES]; /* Nonce of sent packets. */
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
-    uint16_t next_packet_length;
+    TCP_Input_Buffer input;
     struct {
         uint8_t public_key[crypto_box_PUBLICKEYBYTES];
         uint32_t index;
         uint8_t status; /* 0 if not used, 1 if other is offline, 2 if other is online. */
         uint8_t other_id;
+        uint16_t shard; /* shard_number of the server the other is connected to. */
     } connections[NUM_CLIENT_CONNECTIONS];
-    uint8_t last_packet[2 + MAX_PACKET_SIZE];
     uint8_t status;
-    uint16_t last_packet_length;
-    uint16_t last_packet_sent;
 
-    TCP_Priority_List *priority_queue_start, *priority_queue_end;
+    TCP_Output_Ring output;
 
     uint64_t identifier;
 
@@ -114,31 +161,90 @@ typedef struct TCP_Secure_Connection {
     uint64_t ping_id;
 } TCP_Secure_Connection;
 
+/* A connection doing its handshake: TCP_STATUS_CONNECTED until its handshake
+ * packet is answered, then TCP_STATUS_UNCONFIRMED until its first encrypted
+ * packet makes it an accepted TCP_Secure_Connection.
+ */
+typedef struct {
+    sock_t  sock;
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t recv_nonce[crypto_box_NONCEBYTES];
+    uint8_t sent_nonce[crypto_box_NONCEBYTES];
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    TCP_Input_Buffer input;
+    uint8_t status;
+
+    uint64_t accepted_time; /* unix_time() it was accepted at. */
+#ifdef TCP_SERVER_USE_EPOLL
+    uint32_t generation; /* Tells it apart from the previous connections at its index in epoll events. */
+#endif
+} TCP_Handshake_Connection;
 
 typedef struct {
+    uint64_t accepted; /* Connections that started a handshake. */
+    uint64_t confirmed; /* Of those, the ones that became accepted connections. */
+    uint64_t rate_limited; /* Closed right away, their source connected too often. */
+    uint64_t evicted; /* Closed to make room, MAX_INCOMMING_CONNECTIONS were doing theirs. */
+    uint64_t timed_out; /* Closed after TCP_HANDSHAKE_TIMEOUT. */
+} TCP_Handshake_Stats;
+
+typedef struct TCP_Server_Threads TCP_Server_Threads;
+
+typedef struct TCP_Server {
     Onion *onion;
 
 #ifdef TCP_SERVER_USE_EPOLL
     int efd;
     uint64_t last_run_pinged;
+    uint32_t incoming_generation; /* Of the last incoming connection. */
 #endif
     sock_t *socks_listening;
     unsigned int num_listening_socks;
 
     uint8_t public_key[crypto_box_PUBLICKEYBYTES];
     uint8_t secret_key[crypto_box_SECRETKEYBYTES];
-    TCP_Secure_Connection incomming_connection_queue[MAX_INCOMMING_CONNECTIONS];
-    uint16_t incomming_connection_queue_index;
-    TCP_Secure_Connection unconfirmed_connection_queue[MAX_INCOMMING_CONNECTIONS];
-    uint16_t unconfirmed_connection_queue_index;
+
+    /* Connections doing their handshake, their indexes stay the same until
+     * they are done. */
+    TCP_Handshake_Connection *incoming_connection_array;
+    uint32_t size_incoming_connections;
+    uint32_t num_incoming_connections;
+    uint32_t *free_incoming;
+    uint32_t num_free_incoming;
+
+    /* One timer per incoming connection, TCP_HANDSHAKE_TIMEOUT seconds after
+     * it was accepted. */
+    Timer_Wheel *handshake_timers;
+
+    uint32_t handshake_rate, handshake_burst;
+    Key_Index_Sketch handshake_sketch;
+    uint64_t handshake_seed;
+    TCP_Handshake_Stats handshake_stats;
 
     TCP_Secure_Connection *accepted_connection_array;
     uint32_t size_accepted_connections;
     uint32_t num_accepted_connections;
 
+    /* Indexes of the unused entries of accepted_connection_array. */
+    uint32_t *free_accepted;
+    uint32_t num_free_accepted;
+
     uint64_t counter;
 
-    BS_LIST accepted_key_list;
+    /* From the public key of accepted connections to their index in
+     * accepted_connection_array. */
+    Key_Index accepted_key_index;
+    uint64_t key_index_seed;
+
+    /* Totals of TCP_Output_Ring.bytes_queued and .flushes of the killed
+     * connections. */
+    uint64_t output_bytes_queued;
+    uint64_t output_flushes;
+
+    /* Set on the servers made by new_TCP_server_threaded(): the one it
+     * returns and its shards, each run by a thread of its own. */
+    TCP_Server_Threads *threads;
+    uint16_t shard_number;
 } TCP_Server;
 
 /* Create new TCP server instance.
@@ -146,10 +252,68 @@ typedef struct {
 TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
                            Onion *onion);
 
+/* Create a TCP server run by num_threads reactor threads instead.
+ *
+ * Each thread runs a shard: a server with listening sockets of its own on
+ * all the ports (SO_REUSEPORT makes the kernel spread new connections over
+ * them), its own epoll instance and its own array of connections. Packets
+ * between clients connected to different shards, and onion packets, are
+ * passed between the threads through lock-free mailboxes.
+ *
+ * do_TCP_server() on the returned server only passes the onion packets
+ * between onion and the shards, it must be run by the thread running onion.
+ *
+ * return NULL on failure (or if the platform doesn't have SO_REUSEPORT).
+ */
+TCP_Server *new_TCP_server_threaded(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports,
+                                    const uint8_t *secret_key, Onion *onion, uint16_t num_threads);
+
 /* Run the TCP_server
  */
 void do_TCP_server(TCP_Server *TCP_server);
 
+/* Put the sockets do_TCP_server() reads from in socks: the epoll fd when built
+ * with TCP_SERVER_USE_EPOLL, otherwise the listening sockets followed by those
+ * of all open connections. The servers of new_TCP_server_threaded() put the
+ * fd their mailbox wakes them with first.
+ *
+ * If socks is NULL they are only counted.
+ *
+ * return the number of sockets put in socks (at most max_socks).
+ */
+uint32_t TCP_server_get_socks(const TCP_Server *TCP_server, sock_t *socks, uint32_t max_socks);
+
+/* return the time in ms before do_TCP_server() should be run again if none of
+ * its sockets become readable before that. */
+uint32_t TCP_server_run_interval(const TCP_Server *TCP_server);
+
+/* Put in bytes_queued and flushes the totals of TCP_Output_Ring.bytes_queued
+ * and .flushes over all the connections the server had.
+ *
+ * return -1 for the server returned by new_TCP_server_threaded() (the
+ * connections are its shards', run by other threads).
+ * return 0 on success.
+ */
+int TCP_server_output_stats(const TCP_Server *TCP_server, uint64_t *bytes_queued, uint64_t *flushes);
+
+/* Let each source IP (IPv6 ones by /64) start handshakes on at most rate
+ * connections per second, in bursts of up to burst. The others are closed as
+ * soon as they are accepted, before any public key crypto is done for them.
+ * A rate of 0 lifts the limit.
+ *
+ * Each thread of a server made by new_TCP_server_threaded() keeps its own
+ * limits, and the kernel spreads the connections of a source over them.
+ */
+void TCP_server_set_handshake_limit(TCP_Server *TCP_server, uint32_t rate, uint32_t burst);
+
+/* Put in stats how many connections started a handshake and what became of
+ * them.
+ *
+ * return -1 for the server returned by new_TCP_server_threaded().
+ * return 0 on success.
+ */
+int TCP_server_handshake_stats(const TCP_Server *TCP_server, TCP_Handshake_Stats *stats);
+
 /* Kill the TCP server
  */
 void kill_TCP_server(TCP_Server *TCP_server);
@@ -175,12 +339,44 @@ uint16_t read_TCP_length(sock_t sock);
  */
 int read_TCP_packet(sock_t sock, uint8_t *data, uint16_t length);
 
-/* return length of received packet on success.
+/* Put the next packet received on sock in data: the next one in input, or if
+ * all of it wasn't received yet, the next one after reading from sock once.
+ *
+ * return length of received packet on success.
  * return 0 if could not read any packet.
  * return -1 on failure (connection must be killed).
  */
-int read_packet_TCP_secure_connection(sock_t sock, uint16_t *next_packet_length, const uint8_t *shared_key,
+int read_packet_TCP_secure_connection(sock_t sock, TCP_Input_Buffer *input, const uint8_t *shared_key,
                                       uint8_t *recv_nonce, uint8_t *data, uint16_t max_len);
 
+/* Free the buffer of input, dropping the data in it. */
+void TCP_input_free(TCP_Input_Buffer *input);
+
+/* Add length bytes of data at the end of output without trying to send them.
+ *
+ * return 1 on success.
+ * return 0 on failure (out of memory or TCP_MAX_OUTPUT_SIZE reached).
+ */
+int TCP_output_queue(TCP_Output_Ring *output, const uint8_t *data, uint32_t length);
+
+/* Send length bytes of data on sock after what is waiting in output: if
+ * nothing is, as much as the socket takes is sent right away, the rest is
+ * queued.
+ *
+ * return 1 on success.
+ * return 0 if it could not be queued (see TCP_output_queue()).
+ */
+int TCP_output_write(TCP_Output_Ring *output, sock_t sock, const uint8_t *data, uint16_t length);
+
+/* Send as much of the data waiting in output on sock as it takes, in one call.
+ *
+ * return 0 if all of it was sent (or there was none).
+ * return -1 if some is still waiting.
+ */
+int TCP_output_flush(TCP_Output_Ring *output, sock_t sock);
+
+/* Free the buffer of output, dropping the data waiting in it. */
+void TCP_output_free(TCP_Output_Ring *output);
+
 
 #endif
@@ -29,6 +29,12 @@
 
 #include "crypto_core.h"
 
+#include <pthread.h>
+
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
+#include <unistd.h>
+#endif
+
 #if crypto_box_PUBLICKEYBYTES != 32
 #error crypto_box_PUBLICKEYBYTES is required to be 32 bytes for public_key_cmp to work,
 #endif
@@ -82,6 +88,167 @@ int encrypt_precompute(const uint8_t *public_key, const uint8_t *secret_key, uin
     return crypto_box_beforenm(enc_key, public_key, secret_key);
 }
 
+typedef struct {
+    const uint8_t *public_keys;
+    const uint8_t *secret_key;
+    uint8_t *enc_keys;
+    uint32_t num;
+    int ret;
+} Precompute_Job;
+
+static void *precompute_job(void *arg)
+{
+    Precompute_Job *job = arg;
+    uint32_t i;
+
+    job->ret = 0;
+
+    for (i = 0; i < job->num; ++i) {
+        if (encrypt_precompute(job->public_keys + i * crypto_box_PUBLICKEYBYTES, job->secret_key,
+                               job->enc_keys + i * crypto_box_BEFORENMBYTES) != 0) {
+            job->ret = -1;
+        }
+    }
+
+    return NULL;
+}
+
+static unsigned int online_cpus(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus > 0) {
+        return cpus;
+    }
+
+#endif
+    return 1;
+}
+
+int encrypt_precompute_batch(const uint8_t *public_keys, const uint8_t *secret_key, uint8_t *enc_keys, uint32_t num,
+                             unsigned int num_threads)
+{
+    if (num == 0) {
+        return 0;
+    }
+
+    if (num_threads == 0) {
+        num_threads = online_cpus();
+    }
+
+    if (num_threads > MAX_PRECOMPUTE_THREADS) {
+        num_threads = MAX_PRECOMPUTE_THREADS;
+    }
+
+    /* Starting a thread costs about as much as one key, make it worth it. */
+    if (num_threads > num / PRECOMPUTE_KEYS_PER_THREAD) {
+        num_threads = num / PRECOMPUTE_KEYS_PER_THREAD;
+    }
+
+    if (num_threads <= 1) {
+        Precompute_Job job = {public_keys, secret_key, enc_keys, num, 0};
+        precompute_job(&job);
+        return job.ret;
+    }
+
+    Precompute_Job jobs[MAX_PRECOMPUTE_THREADS];
+    pthread_t threads[MAX_PRECOMPUTE_THREADS];
+    _Bool started[MAX_PRECOMPUTE_THREADS];
+    uint32_t done = 0;
+    unsigned int i;
+
+    for (i = 0; i < num_threads; ++i) {
+        uint32_t count = (num - done) / (num_threads - i);
+
+        jobs[i].public_keys = public_keys + done * crypto_box_PUBLICKEYBYTES;
+        jobs[i].secret_key = secret_key;
+        jobs[i].enc_keys = enc_keys + done * crypto_box_BEFORENMBYTES;
+        jobs[i].num = count;
+        done += count;
+
+        /* The calling thread takes the last share itself. */
+        started[i] = i + 1 < num_threads && pthread_create(&threads[i], NULL, &precompute_job, &jobs[i]) == 0;
+    }
+
+    int ret = 0;
+
+    for (i = 0; i < num_threads; ++i) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            precompute_job(&jobs[i]);
+        }
+
+        if (jobs[i].ret != 0) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+#ifndef VANILLA_NACL
+
+int encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce, const uint8_t *plain, uint32_t length,
+                           uint8_t *encrypted)
+{
+    if (length == 0 || !secret_key || !nonce || !plain || !encrypted) {
+        return -1;
+    }
+
+    if (crypto_box_easy_afternm(encrypted, plain, length, nonce, secret_key) != 0) {
+        return -1;
+    }
+
+    return length + crypto_box_MACBYTES;
+}
+
+int decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce, const uint8_t *encrypted, uint32_t length,
+                           uint8_t *plain)
+{
+    if (length <= crypto_box_MACBYTES || !secret_key || !nonce || !encrypted || !plain) {
+        return -1;
+    }
+
+    if (crypto_box_open_easy_afternm(plain, encrypted, length, nonce, secret_key) != 0) {
+        return -1;
+    }
+
+    return length - crypto_box_MACBYTES;
+}
+
+int encrypt_data_symmetric_detached(const uint8_t *secret_key, const uint8_t *nonce, const uint8_t *plain,
+                                    uint32_t length, uint8_t *encrypted, uint8_t *mac)
+{
+    if (length == 0 || !secret_key || !nonce || !plain || !encrypted || !mac) {
+        return -1;
+    }
+
+    if (crypto_box_detached_afternm(encrypted, mac, plain, length, nonce, secret_key) != 0) {
+        return -1;
+    }
+
+    return length;
+}
+
+int decrypt_data_symmetric_detached(const uint8_t *secret_key, const uint8_t *nonce, const uint8_t *encrypted,
+                                    uint32_t length, const uint8_t *mac, uint8_t *plain)
+{
+    if (length == 0 || !secret_key || !nonce || !encrypted || !mac || !plain) {
+        return -1;
+    }
+
+    if (crypto_box_open_detached_afternm(plain, encrypted, mac, length, nonce, secret_key) != 0) {
+        return -1;
+    }
+
+    return length;
+}
+
+#else
+
+/* NaCl only has the padded interface. */
 int encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce, const uint8_t *plain, uint32_t length,
                            uint8_t *encrypted)
 {
@@ -125,6 +292,74 @@ int decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce, cons
     return length - crypto_box_MACBYTES;
 }
 
+int encrypt_data_symmetric_detached(const uint8_t *secret_key, const uint8_t *nonce, const uint8_t *plain,
+                                    uint32_t length, uint8_t *encrypted, uint8_t *mac)
+{
+    if (length == 0 || !encrypted || !mac) {
+        return -1;
+    }
+
+    uint8_t temp[length + crypto_box_MACBYTES];
+
+    if (encrypt_data_symmetric(secret_key, nonce, plain, length, temp) == -1) {
+        return -1;
+    }
+
+    memcpy(mac, temp, crypto_box_MACBYTES);
+    memcpy(encrypted, temp + crypto_box_MACBYTES, length);
+    return length;
+}
+
+int decrypt_data_symmetric_detached(const uint8_t *secret_key, const uint8_t *nonce, const uint8_t *encrypted,
+                                    uint32_t length, const uint8_t *mac, uint8_t *plain)
+{
+    if (length == 0 || !encrypted || !mac) {
+        return -1;
+    }
+
+    uint8_t temp[length + crypto_box_MACBYTES];
+    memcpy(temp, mac, crypto_box_MACBYTES);
+    memcpy(temp + crypto_box_MACBYTES, encrypted, length);
+
+    if (decrypt_data_symmetric(secret_key, nonce, temp, sizeof(temp), plain) == -1) {
+        return -1;
+    }
+
+    return length;
+}
+
+#endif
+
+int encrypt_data_symmetric_inplace(const uint8_t *secret_key, const uint8_t *nonce, uint8_t *data, uint32_t length)
+{
+    if (!data) {
+        return -1;
+    }
+
+    uint8_t *text = data + crypto_box_MACBYTES;
+
+    if (encrypt_data_symmetric_detached(secret_key, nonce, text, length, text, data) == -1) {
+        return -1;
+    }
+
+    return length + crypto_box_MACBYTES;
+}
+
+int decrypt_data_symmetric_inplace(const uint8_t *secret_key, const uint8_t *nonce, uint8_t *data, uint32_t length)
+{
+    if (!data || length <= crypto_box_MACBYTES) {
+        return -1;
+    }
+
+    uint8_t *text = data + crypto_box_MACBYTES;
+
+    if (decrypt_data_symmetric_detached(secret_key, nonce, text, length - crypto_box_MACBYTES, data, text) == -1) {
+        return -1;
+    }
+
+    return length - crypto_box_MACBYTES;
+}
+
 int encrypt_data(const uint8_t *public_key, const uint8_t *secret_key, const uint8_t *nonce,
                  const uint8_t *plain, uint32_t length, uint8_t *encrypted)
 {
@@ -89,6 +89,25 @@ int decrypt_data(const uint8_t *public_key, const uint8_t *secret_key, const uin
    to be preformed on every encrypt/decrypt. */
 int encrypt_precompute(const uint8_t *public_key, const uint8_t *secret_key, uint8_t *enc_key);
 
+#define MAX_PRECOMPUTE_THREADS 32
+
+/* Minimum number of keys each thread of encrypt_precompute_batch() gets. */
+#define PRECOMPUTE_KEYS_PER_THREAD 4
+
+/* Does encrypt_precompute() for num public keys (stored one after the other in
+ * public_keys) with secret_key, putting the shared keys one after the other in
+ * enc_keys (num * crypto_box_BEFORENMBYTES bytes).
+ *
+ * The keys are split between up to num_threads threads, the calling thread
+ * being one of them. num_threads 0 means one per online CPU. Small batches use
+ * fewer threads, down to only the calling one.
+ *
+ *  return -1 if encrypt_precompute() failed for any of the keys.
+ *  return 0 if it worked for all of them.
+ */
+int encrypt_precompute_batch(const uint8_t *public_keys, const uint8_t *secret_key, uint8_t *enc_keys, uint32_t num,
+                             unsigned int num_threads);
+
 /* Encrypts plain of length length to encrypted of length + 16 using a
  * secret key crypto_box_KEYBYTES big and a 24 byte nonce.
  *
@@ -107,6 +126,43 @@ int encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce, cons
 int decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce, const uint8_t *encrypted, uint32_t length,
                            uint8_t *plain);
 
+/* Same as above with the MAC kept apart from the data: encrypts plain of
+ * length length to encrypted of the same length and puts the 16 byte MAC in mac.
+ * plain and encrypted may be the same buffer.
+ *
+ *  return -1 if there was a problem.
+ *  return length of encrypted data if everything was fine.
+ */
+int encrypt_data_symmetric_detached(const uint8_t *secret_key, const uint8_t *nonce, const uint8_t *plain,
+                                    uint32_t length, uint8_t *encrypted, uint8_t *mac);
+
+/* Decrypts encrypted of length length to plain of the same length if mac is
+ * its MAC. encrypted and plain may be the same buffer.
+ *
+ *  return -1 if there was a problem (decryption failed).
+ *  return length of plain data if everything was fine.
+ */
+int decrypt_data_symmetric_detached(const uint8_t *secret_key, const uint8_t *nonce, const uint8_t *encrypted,
+                                    uint32_t length, const uint8_t *mac, uint8_t *plain);
+
+/* Encrypts in place, so packets can be built with the plain text right where
+ * the encrypted text goes: data holds length bytes of plain text starting
+ * crypto_box_MACBYTES bytes in, and ends up holding what encrypt_data_symmetric()
+ * would have put in encrypted (length + 16 bytes).
+ *
+ *  return -1 if there was a problem.
+ *  return length of encrypted data if everything was fine.
+ */
+int encrypt_data_symmetric_inplace(const uint8_t *secret_key, const uint8_t *nonce, uint8_t *data, uint32_t length);
+
+/* Decrypts the length bytes encrypt_data_symmetric() output in data in place,
+ * leaving the plain text (length - 16 bytes) crypto_box_MACBYTES bytes into data.
+ *
+ *  return -1 if there was a problem (decryption failed).
+ *  return length of plain data if everything was fine.
+ */
+int decrypt_data_symmetric_inplace(const uint8_t *secret_key, const uint8_t *nonce, uint8_t *data, uint32_t length);
+
 /* Increment the given nonce by 1. */
 void increment_nonce(uint8_t *nonce);
 
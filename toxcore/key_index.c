@@ -0,0 +1,267 @@
+/* key_index.c
+ *
+ * Open addressing hash table from keys (public keys, ip_ports) to indices in
+ * an array of the caller's.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "key_index.h"
+
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define KEY_INDEX_MIN_SIZE 16
+
+/* Finalizer of MurmurHash3: every bit of value affects every bit of the result. */
+static uint64_t key_index_mix(uint64_t value)
+{
+    value ^= value >> 33;
+    value *= 0xFF51AFD7ED558CCDULL;
+    value ^= value >> 33;
+    value *= 0xC4CEB9FE1A85EC53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+uint32_t key_index_hash(uint64_t seed, const uint8_t *key, uint32_t length)
+{
+    uint64_t hash = key_index_mix(seed ^ length);
+    uint32_t i;
+
+    for (i = 0; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, key + i, sizeof(word));
+        hash = key_index_mix(hash ^ word);
+    }
+
+    if (i < length) {
+        uint64_t word = 0;
+        memcpy(&word, key + i, length - i);
+        hash = key_index_mix(hash ^ word);
+    }
+
+    return hash >> 32;
+}
+
+uint32_t key_index_hash_ip_port(uint64_t seed, const IP_Port *ip_port)
+{
+    uint8_t data[1 + sizeof(ip_port->ip.ip6) + sizeof(ip_port->port)];
+    uint32_t length = 0;
+
+    data[length++] = ip_port->ip.family;
+
+    if (ip_port->ip.family == AF_INET6) {
+        memcpy(data + length, &ip_port->ip.ip6, sizeof(ip_port->ip.ip6));
+        length += sizeof(ip_port->ip.ip6);
+    } else {
+        memcpy(data + length, &ip_port->ip.ip4, sizeof(ip_port->ip.ip4));
+        length += sizeof(ip_port->ip.ip4);
+    }
+
+    memcpy(data + length, &ip_port->port, sizeof(ip_port->port));
+    length += sizeof(ip_port->port);
+
+    return key_index_hash(seed, data, length);
+}
+
+uint32_t key_index_hash_source(uint64_t seed, const IP *ip)
+{
+    uint8_t data[1 + sizeof(uint64_t)];
+    uint32_t length = 0;
+
+    if (ip->family == AF_INET6 && !IPV6_IPV4_IN_V6(ip->ip6)) {
+        data[length++] = AF_INET6;
+        memcpy(data + length, &ip->ip6.uint64[0], sizeof(uint64_t));
+        length += sizeof(uint64_t);
+    } else {
+        data[length++] = AF_INET;
+
+        if (ip->family == AF_INET6) {
+            memcpy(data + length, &ip->ip6.uint32[3], sizeof(uint32_t));
+        } else {
+            memcpy(data + length, &ip->ip4, sizeof(uint32_t));
+        }
+
+        length += sizeof(uint32_t);
+    }
+
+    return key_index_hash(seed, data, length);
+}
+
+_Bool key_index_sketch_take(Key_Index_Sketch *sketch, uint32_t hash, uint64_t now, uint64_t interval,
+                            uint32_t burst)
+{
+    uint64_t *buckets[KEY_INDEX_SKETCH_DEPTH];
+    uint64_t full_time = ~0;
+    uint32_t i;
+
+    /* Other sources hashing to a bucket only take tokens from it too, so the
+     * fullest of the source's buckets is the closest to its own. */
+    for (i = 0; i < KEY_INDEX_SKETCH_DEPTH; ++i) {
+        buckets[i] = &sketch->buckets[i][(hash >> (i * 16)) % KEY_INDEX_SKETCH_WIDTH];
+
+        if (*buckets[i] < full_time) {
+            full_time = *buckets[i];
+        }
+    }
+
+    if (!take_token(&full_time, now, interval, burst)) {
+        return 0;
+    }
+
+    for (i = 0; i < KEY_INDEX_SKETCH_DEPTH; ++i) {
+        if (*buckets[i] < full_time) {
+            *buckets[i] = full_time;
+        }
+    }
+
+    return 1;
+}
+
+int32_t key_index_find(const Key_Index *key_index, uint32_t hash,
+                       _Bool (*match)(const void *object, uint32_t index, const void *key), const void *object,
+                       const void *key)
+{
+    if (key_index->size == 0) {
+        return -1;
+    }
+
+    uint32_t mask = key_index->size - 1;
+    uint32_t i = hash & mask;
+
+    while (key_index->slots[i].index != KEY_INDEX_EMPTY) {
+        const Key_Index_Slot *slot = &key_index->slots[i];
+
+        if (slot->index >= 0 && slot->hash == hash && match(object, slot->index, key)) {
+            return slot->index;
+        }
+
+        i = (i + 1) & mask;
+    }
+
+    return -1;
+}
+
+/* Put the slots of key_index in a new table of size slots, dropping the deleted ones.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int key_index_resize(Key_Index *key_index, uint32_t size)
+{
+    Key_Index_Slot *slots = malloc(size * sizeof(Key_Index_Slot));
+
+    if (slots == NULL) {
+        return -1;
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < size; ++i) {
+        slots[i].index = KEY_INDEX_EMPTY;
+    }
+
+    for (i = 0; i < key_index->size; ++i) {
+        if (key_index->slots[i].index < 0) {
+            continue;
+        }
+
+        uint32_t j = key_index->slots[i].hash & (size - 1);
+
+        while (slots[j].index != KEY_INDEX_EMPTY) {
+            j = (j + 1) & (size - 1);
+        }
+
+        slots[j] = key_index->slots[i];
+    }
+
+    free(key_index->slots);
+    key_index->slots = slots;
+    key_index->size = size;
+    key_index->used = key_index->count;
+    return 0;
+}
+
+int key_index_add(Key_Index *key_index, uint32_t hash, uint32_t index)
+{
+    /* Keep at least a quarter of the slots empty so that lookups of keys
+     * that aren't there stop early. */
+    if ((key_index->used + 1) * 4 > key_index->size * 3) {
+        uint32_t size = KEY_INDEX_MIN_SIZE;
+
+        while ((key_index->count + 1) * 2 > size) {
+            size *= 2;
+        }
+
+        if (key_index_resize(key_index, size) != 0) {
+            return -1;
+        }
+    }
+
+    uint32_t mask = key_index->size - 1;
+    uint32_t i = hash & mask;
+
+    while (key_index->slots[i].index >= 0) {
+        i = (i + 1) & mask;
+    }
+
+    if (key_index->slots[i].index == KEY_INDEX_EMPTY) {
+        ++key_index->used;
+    }
+
+    key_index->slots[i].hash = hash;
+    key_index->slots[i].index = index;
+    ++key_index->count;
+    return 0;
+}
+
+int key_index_remove(Key_Index *key_index, uint32_t hash, uint32_t index)
+{
+    if (key_index->size == 0) {
+        return -1;
+    }
+
+    uint32_t mask = key_index->size - 1;
+    uint32_t i = hash & mask;
+
+    while (key_index->slots[i].index != KEY_INDEX_EMPTY) {
+        if (key_index->slots[i].index == (int32_t)index && key_index->slots[i].hash == hash) {
+            key_index->slots[i].index = KEY_INDEX_DELETED;
+            --key_index->count;
+            return 0;
+        }
+
+        i = (i + 1) & mask;
+    }
+
+    return -1;
+}
+
+void key_index_free(Key_Index *key_index)
+{
+    free(key_index->slots);
+    memset(key_index, 0, sizeof(Key_Index));
+}
@@ -0,0 +1,115 @@
+/* key_index.h
+ *
+ * Open addressing hash table from keys (public keys, ip_ports) to indices in
+ * an array of the caller's.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef KEY_INDEX_H
+#define KEY_INDEX_H
+
+#include "network.h"
+
+/* Slots of a Key_Index that hold no index. */
+#define KEY_INDEX_EMPTY -1
+#define KEY_INDEX_DELETED -2
+
+typedef struct {
+    uint32_t hash;
+    int32_t index; /* index in the caller's array, KEY_INDEX_EMPTY or KEY_INDEX_DELETED */
+} Key_Index_Slot;
+
+/* Only the hashes of the keys are stored: the caller's match function
+ * compares the key looked up with the one of the entry at an index. Several
+ * entries may have the same key, key_index_find() returns one of them.
+ *
+ * A zeroed Key_Index is empty.
+ */
+typedef struct {
+    Key_Index_Slot *slots;
+    uint32_t size; /* 0 or a power of 2 */
+    uint32_t used; /* slots that are not KEY_INDEX_EMPTY */
+    uint32_t count; /* slots holding an index */
+} Key_Index;
+
+/* Hash length bytes of key, all of them.
+ *
+ * Keys picked by peers must be hashed with a random seed (e.g. from
+ * random_64b()) kept for the life of the table, so they can't pick ones that
+ * end up in the same slots.
+ */
+uint32_t key_index_hash(uint64_t seed, const uint8_t *key, uint32_t length);
+
+/* Hash the family, ip and port of ip_port. */
+uint32_t key_index_hash_ip_port(uint64_t seed, const IP_Port *ip_port);
+
+/* Hash ip as the source of packets: IPv4 addresses whole, also when mapped in
+ * IPv6 ones, and IPv6 addresses by their /64, which is what one host usually
+ * gets.
+ */
+uint32_t key_index_hash_source(uint64_t seed, const IP *ip);
+
+/* Token buckets limiting how often each source (IP, public key) can do
+ * something without keeping anything per source: KEY_INDEX_SKETCH_DEPTH rows
+ * of KEY_INDEX_SKETCH_WIDTH buckets, sources share the buckets their hash
+ * picks in each row and are limited by the fullest of theirs.
+ */
+#define KEY_INDEX_SKETCH_WIDTH 1024 /* At most 65536 */
+#define KEY_INDEX_SKETCH_DEPTH 2
+
+/* A zeroed Key_Index_Sketch has all its buckets full. */
+typedef struct {
+    uint64_t buckets[KEY_INDEX_SKETCH_DEPTH][KEY_INDEX_SKETCH_WIDTH]; /* Time in us at which each is full again. */
+} Key_Index_Sketch;
+
+/* Take a token from the buckets of the source with hash (from a seeded
+ * key_index_hash*()), which hold at most burst tokens of one per interval us.
+ *
+ * return 0 if the source is over its rate.
+ * return 1 if a token was taken.
+ */
+_Bool key_index_sketch_take(Key_Index_Sketch *sketch, uint32_t hash, uint64_t now, uint64_t interval,
+                            uint32_t burst);
+
+/* return the index in key_index with hash for which match(object, index, key)
+ * is true.
+ * return -1 if there is none.
+ */
+int32_t key_index_find(const Key_Index *key_index, uint32_t hash,
+                       _Bool (*match)(const void *object, uint32_t index, const void *key), const void *object,
+                       const void *key);
+
+/* Add index with hash to key_index.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int key_index_add(Key_Index *key_index, uint32_t hash, uint32_t index);
+
+/* Remove index with hash from key_index.
+ *
+ * return -1 if it wasn't there.
+ * return 0 on success.
+ */
+int key_index_remove(Key_Index *key_index, uint32_t hash, uint32_t index);
+
+/* Free the slots of key_index, leaving it empty. */
+void key_index_free(Key_Index *key_index);
+
+#endif
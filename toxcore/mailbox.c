@@ -0,0 +1,223 @@
+/* mailbox.c
+ *
+ * Lock-free multi producer, single consumer queue of messages between threads.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "mailbox.h"
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The mailbox is a singly linked list of items (Dmitry Vyukov's MPSC queue),
+ * also used by send_queue.c. Posting swaps the new item in as the head with
+ * one atomic exchange and then links the previous head to it. The tail is
+ * always an item that was already taken (or the first, empty one); the one
+ * after it is the next to take.
+ *
+ * size counts the messages posted and not taken yet, including the ones
+ * being linked in, so the thread raising it from 0 is the one that has to
+ * wake the taking thread. Uses the GCC/clang __atomic builtins.
+ */
+struct Mailbox_Item {
+    Mailbox_Item *next;
+    uint16_t length;
+    uint8_t data[];
+};
+
+struct Mailbox {
+    Mailbox_Item *head; /* last posted, written by posting threads */
+    Mailbox_Item *tail; /* only touched by the taking thread */
+    uint32_t size;
+    uint32_t max_size;
+};
+
+Mailbox *new_mailbox(uint32_t max_size)
+{
+    if (max_size == 0) {
+        return NULL;
+    }
+
+    Mailbox *mailbox = calloc(1, sizeof(Mailbox));
+
+    if (mailbox == NULL) {
+        return NULL;
+    }
+
+    Mailbox_Item *first = calloc(1, sizeof(Mailbox_Item));
+
+    if (first == NULL) {
+        free(mailbox);
+        return NULL;
+    }
+
+    mailbox->head = first;
+    mailbox->tail = first;
+    mailbox->max_size = max_size;
+    return mailbox;
+}
+
+void kill_mailbox(Mailbox *mailbox)
+{
+    if (mailbox == NULL) {
+        return;
+    }
+
+    Mailbox_Item *item = mailbox->tail;
+
+    while (item) {
+        Mailbox_Item *next = item->next;
+        free(item);
+        item = next;
+    }
+
+    free(mailbox);
+}
+
+void mailbox_clear(Mailbox *mailbox)
+{
+    Mailbox_Item *item = mailbox->tail;
+
+    while (item->next) {
+        Mailbox_Item *next = item->next;
+        free(item);
+        item = next;
+    }
+
+    mailbox->tail = item;
+    mailbox->size = 0;
+}
+
+/* Like mailbox_reserve(), putting in size the number of messages in the
+ * mailbox before this one. */
+static Mailbox_Item *reserve_item(Mailbox *mailbox, const uint8_t *data, uint16_t length, _Bool force,
+                                  uint32_t *size)
+{
+    /* Counted before it is linked in, the taking thread waits for it then. */
+    *size = __atomic_fetch_add(&mailbox->size, 1, __ATOMIC_ACQ_REL);
+
+    if (!force && *size >= mailbox->max_size) {
+        __atomic_sub_fetch(&mailbox->size, 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    Mailbox_Item *item = malloc(sizeof(Mailbox_Item) + length);
+
+    if (item == NULL) {
+        __atomic_sub_fetch(&mailbox->size, 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    item->next = NULL;
+    item->length = length;
+    memcpy(item->data, data, length);
+    return item;
+}
+
+Mailbox_Item *mailbox_reserve(Mailbox *mailbox, const uint8_t *data, uint16_t length, _Bool force)
+{
+    uint32_t size;
+    return reserve_item(mailbox, data, length, force, &size);
+}
+
+void mailbox_commit(Mailbox *mailbox, Mailbox_Item *item)
+{
+    Mailbox_Item *prev = __atomic_exchange_n(&mailbox->head, item, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, item, __ATOMIC_RELEASE);
+}
+
+int mailbox_post(Mailbox *mailbox, const uint8_t *data, uint16_t length, _Bool force)
+{
+    uint32_t size;
+    Mailbox_Item *item = reserve_item(mailbox, data, length, force, &size);
+
+    if (item == NULL) {
+        return -1;
+    }
+
+    mailbox_commit(mailbox, item);
+    return size == 0;
+}
+
+/* Make the next item the tail, freeing the previous one.
+ *
+ * return the item holding the message taken, valid until the next one is.
+ * return NULL if none is linked in.
+ */
+static Mailbox_Item *mailbox_next(Mailbox *mailbox)
+{
+    Mailbox_Item *tail = mailbox->tail;
+    Mailbox_Item *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (next == NULL) {
+        return NULL;
+    }
+
+    mailbox->tail = next;
+    free(tail);
+    __atomic_sub_fetch(&mailbox->size, 1, __ATOMIC_RELEASE);
+    return next;
+}
+
+int mailbox_take(Mailbox *mailbox, uint8_t *data, uint16_t max_length)
+{
+    while (__atomic_load_n(&mailbox->size, __ATOMIC_ACQUIRE) != 0) {
+        Mailbox_Item *next = mailbox_next(mailbox);
+
+        if (next == NULL) {
+            /* A message is counted but the thread posting it hasn't linked it
+             * in yet. It is just about to, unless it got preempted right
+             * before: let it run. */
+            sched_yield();
+            continue;
+        }
+
+        if (next->length > max_length) {
+            continue;
+        }
+
+        memcpy(data, next->data, next->length);
+        return next->length;
+    }
+
+    return -1;
+}
+
+int mailbox_take_with(Mailbox *mailbox, mailbox_cb *function, void *object)
+{
+    Mailbox_Item *next = mailbox_next(mailbox);
+
+    if (next == NULL) {
+        return -1;
+    }
+
+    function(object, next->data, next->length);
+    return 0;
+}
+
+uint32_t mailbox_size(const Mailbox *mailbox)
+{
+    return __atomic_load_n(&mailbox->size, __ATOMIC_ACQUIRE);
+}
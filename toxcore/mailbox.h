@@ -0,0 +1,106 @@
+/* mailbox.h
+ *
+ * Lock-free multi producer, single consumer queue of messages between threads.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stdint.h>
+
+/* Any number of threads can post messages to a Mailbox at the same time
+ * without ever waiting on each other, one thread takes them out in the order
+ * each thread posted them.
+ *
+ * The mailbox doesn't wake the thread taking the messages itself: the thread
+ * posting a message to an empty mailbox is told to do it.
+ */
+typedef struct Mailbox Mailbox;
+
+typedef void mailbox_cb(void *object, const uint8_t *data, uint16_t length);
+
+/* Create a mailbox holding at most max_size messages (not counting the forced
+ * ones, see mailbox_post()).
+ *
+ * return NULL on failure.
+ */
+Mailbox *new_mailbox(uint32_t max_size);
+
+/* Free the mailbox and the messages still in it.
+ * No other thread may be using it.
+ */
+void kill_mailbox(Mailbox *mailbox);
+
+/* Drop the messages in the mailbox.
+ * No other thread may be using it.
+ */
+void mailbox_clear(Mailbox *mailbox);
+
+/* Add a copy of data to the mailbox. Safe to call from any thread.
+ *
+ * If force is set the message is added even when the mailbox is full, for
+ * messages that must not be lost.
+ *
+ * return -1 if the mailbox is full or out of memory.
+ * return 1 if the mailbox was empty: the thread taking the messages must be woken.
+ * return 0 on success otherwise.
+ */
+int mailbox_post(Mailbox *mailbox, const uint8_t *data, uint16_t length, _Bool force);
+
+/* Posting in two steps, for callers counting the messages themselves in
+ * between (see send_queue.c): once mailbox_reserve() succeeded the message is
+ * sure to be added, the thread taking the messages sees it after
+ * mailbox_commit().
+ */
+typedef struct Mailbox_Item Mailbox_Item;
+
+/* Copy data into a new message counted in the mailbox, like mailbox_post().
+ *
+ * return NULL if the mailbox is full or out of memory.
+ */
+Mailbox_Item *mailbox_reserve(Mailbox *mailbox, const uint8_t *data, uint16_t length, _Bool force);
+
+/* Add item, returned by mailbox_reserve(), to the mailbox. */
+void mailbox_commit(Mailbox *mailbox, Mailbox_Item *item);
+
+/* Take the oldest message out of the mailbox. Only one thread may call this.
+ * Messages longer than max_length are dropped.
+ *
+ * return -1 if the mailbox is empty.
+ * return length of the message otherwise.
+ */
+int mailbox_take(Mailbox *mailbox, uint8_t *data, uint16_t max_length);
+
+/* Take the oldest message out of the mailbox and call function with object
+ * and the message, which is only valid until it returns. Only the thread
+ * taking the messages may call this.
+ *
+ * Unlike mailbox_take(), doesn't wait for a message counted in the mailbox
+ * to be linked in by the thread posting it.
+ *
+ * return -1 if no message is ready to be taken.
+ * return 0 otherwise.
+ */
+int mailbox_take_with(Mailbox *mailbox, mailbox_cb *function, void *object);
+
+/* return number of messages in the mailbox. */
+uint32_t mailbox_size(const Mailbox *mailbox);
+
+#endif
@@ -201,10 +201,8 @@ static int handle_cookie_request(const Net_Crypto *c, uint8_t *request_plain, ui
 
 /* Handle the cookie request packet (for raw UDP)
  */
-static int udp_handle_cookie_request(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
-                                     void *userdata)
+static int send_udp_cookie_response(Net_Crypto *c, IP_Port source, const uint8_t *packet, uint16_t length)
 {
-    Net_Crypto *c = object;
     uint8_t request_plain[COOKIE_REQUEST_PLAIN_LENGTH];
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
     uint8_t dht_public_key[crypto_box_PUBLICKEYBYTES];
@@ -414,6 +412,122 @@ static Crypto_Connection *get_crypto_connection(const Net_Crypto *c, int crypt_c
     return &c->crypto_connections[crypt_connection_id];
 }
 
+/* Keys picked by peers are hashed with a random seed so they can't pick
+ * ones that end up in the same slots. */
+static uint32_t public_key_hash(const Net_Crypto *c, const uint8_t *public_key)
+{
+    return key_index_hash(c->index_seed, public_key, crypto_box_PUBLICKEYBYTES);
+}
+
+static uint32_t ip_port_hash(const Net_Crypto *c, const IP_Port *ip_port)
+{
+    return key_index_hash_ip_port(c->index_seed, ip_port);
+}
+
+static _Bool public_key_match(const void *object, uint32_t index, const void *key)
+{
+    const Net_Crypto *c = object;
+    return public_key_cmp(c->crypto_connections[index].public_key, key) == 0;
+}
+
+static _Bool ip_port_match(const void *object, uint32_t index, const void *key)
+{
+    const Net_Crypto *c = object;
+    const Crypto_Connection *conn = &c->crypto_connections[index];
+    return ipport_equal(&conn->ip_portv4, key) || ipport_equal(&conn->ip_portv6, key);
+}
+
+/** START: Handshake rate limiting **/
+
+struct Handshake_Request {
+    IP_Port source;
+    uint16_t length;
+    uint8_t data[HANDSHAKE_PACKET_LENGTH];
+};
+
+#define HANDSHAKE_SOURCE_INTERVAL (1000000 / CRYPTO_HANDSHAKE_RATE)
+#define HANDSHAKE_WORK_INTERVAL (1000000 / CRYPTO_HANDSHAKE_WORK_RATE)
+
+/* Take a packet from the token buckets of the source whose hash is hash.
+ *
+ * return 0 if the source sent too many cookie requests and handshakes.
+ * return 1 if it can send this one.
+ */
+static _Bool handshake_source_allowed(Net_Crypto *c, uint32_t hash)
+{
+    return key_index_sketch_take(&c->handshake_sketch, hash, current_time_monotonic() * 1000,
+                                 HANDSHAKE_SOURCE_INTERVAL, CRYPTO_HANDSHAKE_BURST);
+}
+
+/* Queue a UDP cookie request or handshake from a source we have no connection
+ * with, for do_handshake_queue().
+ *
+ * Everything that can be checked without public key crypto is checked
+ * first, so floods of them cost little more than receiving them.
+ *
+ * return -1 if it was dropped.
+ * return 0 if it was queued.
+ */
+static int queue_handshake_request(Net_Crypto *c, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    if (length != (packet[0] == NET_PACKET_COOKIE_REQUEST ? COOKIE_REQUEST_LENGTH : HANDSHAKE_PACKET_LENGTH)) {
+        return -1;
+    }
+
+    /* Keyed by IP, not ip_port: one host can send from as many ports as it
+     * likes. */
+    if (!handshake_source_allowed(c, key_index_hash_source(c->index_seed, &source.ip))) {
+        ++c->handshake_stats.rate_limited;
+        return -1;
+    }
+
+    if (packet[0] == NET_PACKET_CRYPTO_HS) {
+        /* Handshakes must carry a cookie we gave out, which only takes a
+         * symmetric decryption to check. */
+        uint8_t cookie_plain[COOKIE_DATA_LENGTH];
+
+        if (open_cookie(cookie_plain, packet + 1, c->secret_symmetric_key) != 0) {
+            ++c->handshake_stats.invalid;
+            return -1;
+        }
+    }
+
+    if (c->handshake_queue_length == CRYPTO_HANDSHAKE_QUEUE_SIZE) {
+        ++c->handshake_stats.dropped;
+        return -1;
+    }
+
+    Handshake_Request *request = &c->handshake_queue[(c->handshake_queue_start + c->handshake_queue_length)
+                                 % CRYPTO_HANDSHAKE_QUEUE_SIZE];
+    request->source = source;
+    request->length = length;
+    memcpy(request->data, packet, length);
+    ++c->handshake_queue_length;
+    ++c->handshake_stats.queued;
+    return 0;
+}
+
+/* Handle the cookie request packet (for raw UDP)
+ */
+static int udp_handle_cookie_request(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
+                                     void *userdata)
+{
+    Net_Crypto *c = object;
+
+    if (queue_handshake_request(c, source, packet, length) != 0) {
+        return 1;
+    }
+
+    return 0;
+}
+
+void net_crypto_get_handshake_stats(const Net_Crypto *c, Crypto_Handshake_Stats *stats)
+{
+    *stats = c->handshake_stats;
+}
+
+/** END: Handshake rate limiting **/
+
 
 /* Associate an ip_port to a connection.
  *
@@ -428,23 +542,28 @@ static int add_ip_port_connection(Net_Crypto *c, int crypt_connection_id, IP_Por
         return -1;
     }
 
+    /* An ip_port belongs to one connection at most. */
+    if (key_index_find(&c->ip_port_index, ip_port_hash(c, &ip_port), &ip_port_match, c, &ip_port) != -1) {
+        return -1;
+    }
+
     if (ip_port.ip.family == AF_INET) {
         if (!ipport_equal(&ip_port, &conn->ip_portv4) && LAN_ip(conn->ip_portv4.ip) != 0) {
-            if (!bs_list_add(&c->ip_port_list, (uint8_t *)&ip_port, crypt_connection_id)) {
+            if (key_index_add(&c->ip_port_index, ip_port_hash(c, &ip_port), crypt_connection_id) != 0) {
                 return -1;
             }
 
-            bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv4, crypt_connection_id);
+            key_index_remove(&c->ip_port_index, ip_port_hash(c, &conn->ip_portv4), crypt_connection_id);
             conn->ip_portv4 = ip_port;
             return 0;
         }
     } else if (ip_port.ip.family == AF_INET6) {
         if (!ipport_equal(&ip_port, &conn->ip_portv6)) {
-            if (!bs_list_add(&c->ip_port_list, (uint8_t *)&ip_port, crypt_connection_id)) {
+            if (key_index_add(&c->ip_port_index, ip_port_hash(c, &ip_port), crypt_connection_id) != 0) {
                 return -1;
             }
 
-            bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv6, crypt_connection_id);
+            key_index_remove(&c->ip_port_index, ip_port_hash(c, &conn->ip_portv6), crypt_connection_id);
             conn->ip_portv6 = ip_port;
             return 0;
         }
@@ -564,6 +683,25 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
 /** START: Array Related functions **/
 
 
+/* Set the sent_time of dt, a packet in array, to temp_time. */
+static void set_sent_time(Packets_Array *array, Packet_Data *dt, uint64_t temp_time)
+{
+    dt->sent_time = temp_time;
+
+    if (array->oldest_sent_time == 0 || temp_time < array->oldest_sent_time) {
+        array->oldest_sent_time = temp_time;
+    }
+}
+
+/* Copy the used part of src to dest. */
+static void copy_packet_data(Packet_Data *dest, const Packet_Data *src)
+{
+    dest->sent_time = src->sent_time;
+    dest->length = src->length;
+    dest->resent = src->resent;
+    memcpy(dest->data, src->data, src->length);
+}
+
 /* Return number of packets in array
  * Note that holes are counted too.
  */
@@ -572,31 +710,102 @@ static uint32_t num_packets_array(const Packets_Array *array)
     return array->buffer_end - array->buffer_start;
 }
 
+/* return the slot of packet number in array.
+ * The array must have room for at least one packet.
+ */
+static uint32_t packets_array_index(const Packets_Array *array, uint32_t number)
+{
+    return number & (array->capacity - 1);
+}
+
+/* Move the packets in array to a buffer with room for capacity packets.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int packets_array_resize(Packets_Array *array, uint32_t capacity)
+{
+    Packet_Data **buffer = calloc(capacity, sizeof(Packet_Data *));
+
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    uint32_t i;
+
+    for (i = array->buffer_start; i != array->buffer_end; ++i) {
+        buffer[i & (capacity - 1)] = array->buffer[packets_array_index(array, i)];
+    }
+
+    free(array->buffer);
+    array->buffer = buffer;
+    array->capacity = capacity;
+    return 0;
+}
+
+/* Make sure there is room for num packets in array, doubling its size as
+ * many times as needed.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int packets_array_reserve(Packets_Array *array, uint32_t num)
+{
+    if (num <= array->capacity) {
+        return 0;
+    }
+
+    if (num > CRYPTO_PACKET_BUFFER_SIZE) {
+        return -1;
+    }
+
+    uint32_t capacity = array->capacity ? array->capacity : CRYPTO_MIN_PACKET_BUFFER_SIZE;
+
+    while (capacity < num) {
+        capacity *= 2;
+    }
+
+    return packets_array_resize(array, capacity);
+}
+
+/* Halve the size of array if it is mostly empty. */
+static void packets_array_shrink(Packets_Array *array)
+{
+    if (array->capacity > CRYPTO_MIN_PACKET_BUFFER_SIZE && num_packets_array(array) <= array->capacity / 8) {
+        packets_array_resize(array, array->capacity / 2);
+    }
+}
+
 /* Add data with packet number to array.
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int add_data_to_buffer(Packets_Array *array, uint32_t number, const Packet_Data *data)
+static int add_data_to_buffer(Packet_Pool *pool, Packets_Array *array, uint32_t number, const Packet_Data *data)
 {
     if (number - array->buffer_start > CRYPTO_PACKET_BUFFER_SIZE) {
         return -1;
     }
 
-    uint32_t num = number % CRYPTO_PACKET_BUFFER_SIZE;
+    if (packets_array_reserve(array, number - array->buffer_start + 1) != 0) {
+        return -1;
+    }
+
+    uint32_t num = packets_array_index(array, number);
 
     if (array->buffer[num]) {
         return -1;
     }
 
-    Packet_Data *new_d = malloc(sizeof(Packet_Data));
+    Packet_Data *new_d = packet_pool_alloc(pool);
 
     if (new_d == NULL) {
         return -1;
     }
 
-    memcpy(new_d, data, sizeof(Packet_Data));
+    copy_packet_data(new_d, data);
     array->buffer[num] = new_d;
+    ++array->num_stored;
 
     if ((number - array->buffer_start) >= (array->buffer_end - array->buffer_start)) {
         array->buffer_end = number + 1;
@@ -619,7 +828,7 @@ static int get_data_pointer(const Packets_Array *array, Packet_Data **data, uint
         return -1;
     }
 
-    uint32_t num = number % CRYPTO_PACKET_BUFFER_SIZE;
+    uint32_t num = packets_array_index(array, number);
 
     if (!array->buffer[num]) {
         return 0;
@@ -634,22 +843,23 @@ static int get_data_pointer(const Packets_Array *array, Packet_Data **data, uint
  * return -1 on failure.
  * return packet number on success.
  */
-static int64_t add_data_end_of_buffer(Packets_Array *array, const Packet_Data *data)
+static int64_t add_data_end_of_buffer(Packet_Pool *pool, Packets_Array *array, const Packet_Data *data)
 {
-    if (num_packets_array(array) >= CRYPTO_PACKET_BUFFER_SIZE) {
+    if (packets_array_reserve(array, num_packets_array(array) + 1) != 0) {
         return -1;
     }
 
-    Packet_Data *new_d = malloc(sizeof(Packet_Data));
+    Packet_Data *new_d = packet_pool_alloc(pool);
 
     if (new_d == NULL) {
         return -1;
     }
 
-    memcpy(new_d, data, sizeof(Packet_Data));
+    copy_packet_data(new_d, data);
     uint32_t id = array->buffer_end;
-    array->buffer[id % CRYPTO_PACKET_BUFFER_SIZE] = new_d;
+    array->buffer[packets_array_index(array, id)] = new_d;
     ++array->buffer_end;
+    ++array->num_stored;
     return id;
 }
 
@@ -658,23 +868,25 @@ static int64_t add_data_end_of_buffer(Packets_Array *array, const Packet_Data *d
  * return -1 on failure.
  * return packet number on success.
  */
-static int64_t read_data_beg_buffer(Packets_Array *array, Packet_Data *data)
+static int64_t read_data_beg_buffer(Packet_Pool *pool, Packets_Array *array, Packet_Data *data)
 {
     if (array->buffer_end == array->buffer_start) {
         return -1;
     }
 
-    uint32_t num = array->buffer_start % CRYPTO_PACKET_BUFFER_SIZE;
+    uint32_t num = packets_array_index(array, array->buffer_start);
 
     if (!array->buffer[num]) {
         return -1;
     }
 
-    memcpy(data, array->buffer[num], sizeof(Packet_Data));
+    copy_packet_data(data, array->buffer[num]);
     uint32_t id = array->buffer_start;
     ++array->buffer_start;
-    free(array->buffer[num]);
+    packet_pool_free(pool, array->buffer[num]);
     array->buffer[num] = NULL;
+    --array->num_stored;
+    packets_array_shrink(array);
     return id;
 }
 
@@ -683,7 +895,7 @@ static int64_t read_data_beg_buffer(Packets_Array *array, Packet_Data *data)
  * return -1 on failure.
  * return 0 on success
  */
-static int clear_buffer_until(Packets_Array *array, uint32_t number)
+static int clear_buffer_until(Packet_Pool *pool, Packets_Array *array, uint32_t number)
 {
     uint32_t num_spots = array->buffer_end - array->buffer_start;
 
@@ -694,32 +906,38 @@ static int clear_buffer_until(Packets_Array *array, uint32_t number)
     uint32_t i;
 
     for (i = array->buffer_start; i != number; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        uint32_t num = packets_array_index(array, i);
 
         if (array->buffer[num]) {
-            free(array->buffer[num]);
+            packet_pool_free(pool, array->buffer[num]);
             array->buffer[num] = NULL;
+            --array->num_stored;
         }
     }
 
     array->buffer_start = i;
+    packets_array_shrink(array);
     return 0;
 }
 
-static int clear_buffer(Packets_Array *array)
+static int clear_buffer(Packet_Pool *pool, Packets_Array *array)
 {
     uint32_t i;
 
     for (i = array->buffer_start; i != array->buffer_end; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        uint32_t num = packets_array_index(array, i);
 
         if (array->buffer[num]) {
-            free(array->buffer[num]);
+            packet_pool_free(pool, array->buffer[num]);
             array->buffer[num] = NULL;
+            --array->num_stored;
         }
     }
 
     array->buffer_start = i;
+    free(array->buffer);
+    array->buffer = NULL;
+    array->capacity = 0;
     return 0;
 }
 
@@ -738,6 +956,10 @@ static int set_buffer_end(Packets_Array *array, uint32_t number)
         return -1;
     }
 
+    if (packets_array_reserve(array, number - array->buffer_start) != 0) {
+        return -1;
+    }
+
     array->buffer_end = number;
     return 0;
 }
@@ -769,7 +991,7 @@ static int generate_request_packet(uint8_t *data, uint16_t length, const Packets
     uint32_t i, n = 1;
 
     for (i = recv_array->buffer_start; i != recv_array->buffer_end; ++i) {
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        uint32_t num = packets_array_index(recv_array, i);
 
         if (!recv_array->buffer[num]) {
             data[cur_len] = n;
@@ -801,7 +1023,7 @@ static int generate_request_packet(uint8_t *data, uint16_t length, const Packets
  * return -1 on failure.
  * return number of requested packets on success.
  */
-static int handle_request_packet(Packets_Array *send_array, const uint8_t *data, uint16_t length,
+static int handle_request_packet(Packet_Pool *pool, Packets_Array *send_array, const uint8_t *data, uint16_t length,
                                  uint64_t *latest_send_time, uint64_t rtt_time)
 {
     if (length < 1) {
@@ -830,7 +1052,7 @@ static int handle_request_packet(Packets_Array *send_array, const uint8_t *data,
             break;
         }
 
-        uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
+        uint32_t num = packets_array_index(send_array, i);
 
         if (n == data[0]) {
             if (send_array->buffer[num]) {
@@ -838,6 +1060,7 @@ static int handle_request_packet(Packets_Array *send_array, const uint8_t *data,
 
                 if ((sent_time + rtt_time) < temp_time) {
                     send_array->buffer[num]->sent_time = 0;
+                    send_array->buffer[num]->resent = 1;
                 }
             }
 
@@ -853,8 +1076,9 @@ static int handle_request_packet(Packets_Array *send_array, const uint8_t *data,
                     l_sent_time = sent_time;
                 }
 
-                free(send_array->buffer[num]);
+                packet_pool_free(pool, send_array->buffer[num]);
                 send_array->buffer[num] = NULL;
+                --send_array->num_stored;
             }
         }
 
@@ -879,18 +1103,195 @@ static int handle_request_packet(Packets_Array *send_array, const uint8_t *data,
     return requested;
 }
 
+/* Create a SACK packet from recv_array into data of length.
+ *
+ * The packet id is followed by the number of packets n the bitmap after it
+ * covers, as a 2 byte big endian number. Bit i (least significant first) of
+ * the bitmap is set if packet number buffer_start + i was received,
+ * buffer_start being the one the data packet that carries it is sent with.
+ *
+ * return -1 on failure.
+ * return length of packet on success.
+ */
+static int generate_sack_packet(uint8_t *data, uint16_t length, const Packets_Array *recv_array)
+{
+    if (length < 1 + sizeof(uint16_t)) {
+        return -1;
+    }
+
+    data[0] = PACKET_ID_SACK;
+
+    uint32_t num = num_packets_array(recv_array);
+    uint32_t max_num = (uint32_t)(length - (1 + sizeof(uint16_t))) * 8;
+
+    if (num > max_num) {
+        num = max_num;
+    }
+
+    uint16_t net_num = htons(num);
+    memcpy(data + 1, &net_num, sizeof(uint16_t));
+
+    uint8_t *bitmap = data + 1 + sizeof(uint16_t);
+    uint16_t cur_len = 1 + sizeof(uint16_t) + (num + 7) / 8;
+    memset(bitmap, 0, (num + 7) / 8);
+
+    uint32_t i;
+
+    for (i = 0; i < num; ++i) {
+        if (recv_array->buffer[packets_array_index(recv_array, recv_array->buffer_start + i)]) {
+            bitmap[i / 8] |= 1 << (i % 8);
+        }
+    }
+
+    return cur_len;
+}
+
+/* Handle a SACK packet.
+ * Remove all the packets the other received from the array and mark the ones
+ * it is missing to be sent again if it received at least
+ * CRYPTO_FAST_RETRANSMIT_THRESHOLD packets after them and they were sent only
+ * once more than rtt_time ago, or if they were sent more than reorder_time ago.
+ *
+ * latest_send_time is set to the latest time a packet that was only sent once
+ * and is now acked was sent, if it is later.
+ *
+ * return -1 on failure.
+ * return number of packets to send again on success.
+ */
+static int handle_sack_packet(Packet_Pool *pool, Packets_Array *send_array, const uint8_t *data, uint16_t length,
+                              uint64_t *latest_send_time, uint64_t rtt_time, uint64_t reorder_time)
+{
+    if (length < 1 + sizeof(uint16_t) || data[0] != PACKET_ID_SACK) {
+        return -1;
+    }
+
+    uint16_t sack_num;
+    memcpy(&sack_num, data + 1, sizeof(uint16_t));
+    sack_num = ntohs(sack_num);
+    data += 1 + sizeof(uint16_t);
+    length -= 1 + sizeof(uint16_t);
+
+    if (sack_num > (uint32_t)length * 8) {
+        return -1;
+    }
+
+    uint32_t num = num_packets_array(send_array);
+
+    if (num > sack_num) {
+        num = sack_num;
+    }
+
+    uint32_t i, acked_after = 0;
+
+    for (i = 0; i < num; ++i) {
+        if (data[i / 8] & (1 << (i % 8))) {
+            ++acked_after;
+        }
+    }
+
+    uint64_t temp_time = current_time_monotonic();
+    uint64_t l_sent_time = 0;
+    int requested = 0;
+
+    for (i = 0; i < num; ++i) {
+        Packet_Data *dt = send_array->buffer[packets_array_index(send_array, send_array->buffer_start + i)];
+
+        if (data[i / 8] & (1 << (i % 8))) {
+            --acked_after;
+
+            if (dt) {
+                if (!dt->resent && l_sent_time < dt->sent_time) {
+                    l_sent_time = dt->sent_time;
+                }
+
+                packet_pool_free(pool, dt);
+                send_array->buffer[packets_array_index(send_array, send_array->buffer_start + i)] = NULL;
+                --send_array->num_stored;
+            }
+        } else if (dt && dt->sent_time != 0) {
+            _Bool fast_retransmit = acked_after >= CRYPTO_FAST_RETRANSMIT_THRESHOLD && !dt->resent
+                                    && dt->sent_time + rtt_time < temp_time;
+
+            if (fast_retransmit || dt->sent_time + reorder_time < temp_time) {
+                dt->sent_time = 0;
+                dt->resent = 1;
+                ++requested;
+            }
+        }
+    }
+
+    if (*latest_send_time < l_sent_time) {
+        *latest_send_time = l_sent_time;
+    }
+
+    return requested;
+}
+
+/* Mark the packets in send_array that were sent more than rto ms ago to be
+ * sent again, without looking at them if the oldest was sent since.
+ *
+ * return number of packets to send again.
+ */
+static uint32_t retransmit_timed_out_packets(Packets_Array *send_array, uint64_t rto, uint64_t temp_time)
+{
+    uint32_t i, requested = 0;
+    uint64_t oldest_sent_time = 0;
+
+    if (send_array->num_stored == 0 || send_array->oldest_sent_time == 0
+            || send_array->oldest_sent_time + rto >= temp_time) {
+        return 0;
+    }
+
+    for (i = send_array->buffer_start; i != send_array->buffer_end; ++i) {
+        Packet_Data *dt = send_array->buffer[packets_array_index(send_array, i)];
+
+        if (!dt || dt->sent_time == 0) {
+            continue;
+        }
+
+        if (dt->sent_time + rto < temp_time) {
+            dt->sent_time = 0;
+            dt->resent = 1;
+            ++requested;
+        } else if (oldest_sent_time == 0 || dt->sent_time < oldest_sent_time) {
+            oldest_sent_time = dt->sent_time;
+        }
+    }
+
+    send_array->oldest_sent_time = oldest_sent_time;
+    return requested;
+}
+
 /** END: Array Related functions **/
 
 #define MAX_DATA_DATA_PACKET_SIZE (MAX_CRYPTO_PACKET_SIZE - (1 + sizeof(uint16_t) + crypto_box_MACBYTES))
 
-/* Creates and sends a data packet to the peer using the fastest route.
+/* Offset of the plain text in the packet buffer passed to send_data_packet(). */
+#define DATA_PACKET_PLAIN_OFFSET (1 + sizeof(uint16_t) + crypto_box_MACBYTES)
+
+/* Copy the nonce of the next data packet sent on conn to nonce and move
+ * conn past it. conn->mutex must be held.
+ */
+static void take_sent_nonce(Crypto_Connection *conn, uint8_t *nonce)
+{
+    memcpy(nonce, conn->sent_nonce, crypto_box_NONCEBYTES);
+    increment_nonce(conn->sent_nonce);
+}
+
+/* Encrypts with nonce, taken with take_sent_nonce(), and sends a data packet
+ * to the peer using the fastest route.
+ *
+ * packet holds length bytes of plain text starting DATA_PACKET_PLAIN_OFFSET
+ * bytes in, which is encrypted in place. Only the nonce needs conn->mutex, so
+ * threads sending at the same time encrypt without waiting on each other.
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
+static int send_data_packet_nonce(Net_Crypto *c, int crypt_connection_id, const uint8_t *nonce, uint8_t *packet,
+                                  uint16_t length)
 {
-    if (length == 0 || length + (1 + sizeof(uint16_t) + crypto_box_MACBYTES) > MAX_CRYPTO_PACKET_SIZE) {
+    if (length == 0 || length + DATA_PACKET_PLAIN_OFFSET > MAX_CRYPTO_PACKET_SIZE) {
         return -1;
     }
 
@@ -900,21 +1301,58 @@ static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_
         return -1;
     }
 
-    pthread_mutex_lock(&conn->mutex);
-    uint8_t packet[1 + sizeof(uint16_t) + length + crypto_box_MACBYTES];
     packet[0] = NET_PACKET_CRYPTO_DATA;
-    memcpy(packet + 1, conn->sent_nonce + (crypto_box_NONCEBYTES - sizeof(uint16_t)), sizeof(uint16_t));
-    int len = encrypt_data_symmetric(conn->shared_key, conn->sent_nonce, data, length, packet + 1 + sizeof(uint16_t));
+    memcpy(packet + 1, nonce + (crypto_box_NONCEBYTES - sizeof(uint16_t)), sizeof(uint16_t));
+    int len = encrypt_data_symmetric_inplace(conn->shared_key, nonce, packet + 1 + sizeof(uint16_t), length);
 
-    if (len + 1 + sizeof(uint16_t) != sizeof(packet)) {
-        pthread_mutex_unlock(&conn->mutex);
+    if (len != length + crypto_box_MACBYTES) {
         return -1;
     }
 
-    increment_nonce(conn->sent_nonce);
+    return send_packet_to(c, crypt_connection_id, packet, DATA_PACKET_PLAIN_OFFSET + length);
+}
+
+/* Encrypts and sends a data packet to the peer using the fastest route, like
+ * send_data_packet_nonce() with the next nonce of the connection.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int send_data_packet(Net_Crypto *c, int crypt_connection_id, uint8_t *packet, uint16_t length)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    uint8_t nonce[crypto_box_NONCEBYTES];
+    pthread_mutex_lock(&conn->mutex);
+    take_sent_nonce(conn, nonce);
     pthread_mutex_unlock(&conn->mutex);
 
-    return send_packet_to(c, crypt_connection_id, packet, sizeof(packet));
+    return send_data_packet_nonce(c, crypt_connection_id, nonce, packet, length);
+}
+
+/* Put the plain text of a data packet with buffer_start, num and data in
+ * packet, DATA_PACKET_PLAIN_OFFSET bytes in. packet must have room for
+ * MAX_CRYPTO_PACKET_SIZE bytes.
+ *
+ * return the length of the plain text.
+ */
+static uint16_t fill_data_packet(uint8_t *packet, uint32_t buffer_start, uint32_t num, const uint8_t *data,
+                                 uint16_t length)
+{
+    num = htonl(num);
+    buffer_start = htonl(buffer_start);
+    uint16_t padding_length = (MAX_CRYPTO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
+
+    uint8_t *plain = packet + DATA_PACKET_PLAIN_OFFSET;
+    memcpy(plain, &buffer_start, sizeof(uint32_t));
+    memcpy(plain + sizeof(uint32_t), &num, sizeof(uint32_t));
+    memset(plain + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
+    memcpy(plain + (sizeof(uint32_t) * 2) + padding_length, data, length);
+    return sizeof(uint32_t) + sizeof(uint32_t) + padding_length + length;
 }
 
 /* Creates and sends a data packet with buffer_start and num to the peer using the fastest route.
@@ -929,16 +1367,9 @@ static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint3
         return -1;
     }
 
-    num = htonl(num);
-    buffer_start = htonl(buffer_start);
-    uint16_t padding_length = (MAX_CRYPTO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
-    uint8_t packet[sizeof(uint32_t) + sizeof(uint32_t) + padding_length + length];
-    memcpy(packet, &buffer_start, sizeof(uint32_t));
-    memcpy(packet + sizeof(uint32_t), &num, sizeof(uint32_t));
-    memset(packet + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
-    memcpy(packet + (sizeof(uint32_t) * 2) + padding_length, data, length);
-
-    return send_data_packet(c, crypt_connection_id, packet, sizeof(packet));
+    uint8_t packet[MAX_CRYPTO_PACKET_SIZE];
+    uint16_t plain_length = fill_data_packet(packet, buffer_start, num, data, length);
+    return send_data_packet(c, crypt_connection_id, packet, plain_length);
 }
 
 static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
@@ -952,20 +1383,36 @@ static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
     /* If last packet send failed, try to send packet again.
        If sending it fails we won't be able to send the new packet. */
     if (conn->maximum_speed_reached) {
+        /* Copied out, the packet can be acked and freed once the mutex is
+         * released. */
         Packet_Data *dt = NULL;
+        uint16_t length = 0;
+        uint8_t data[MAX_CRYPTO_DATA_SIZE];
+
+        pthread_mutex_lock(&conn->mutex);
         uint32_t packet_num = conn->send_array.buffer_end - 1;
-        int ret = get_data_pointer(&conn->send_array, &dt, packet_num);
+
+        if (get_data_pointer(&conn->send_array, &dt, packet_num) == 1 && !dt->sent_time) {
+            length = dt->length;
+            memcpy(data, dt->data, length);
+        }
+
+        pthread_mutex_unlock(&conn->mutex);
 
         uint8_t send_failed = 0;
 
-        if (ret == 1) {
-            if (!dt->sent_time) {
-                if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
-                                            dt->length) != 0) {
-                    send_failed = 1;
-                } else {
-                    dt->sent_time = current_time_monotonic();
+        if (length != 0) {
+            if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, data,
+                                        length) != 0) {
+                send_failed = 1;
+            } else {
+                pthread_mutex_lock(&conn->mutex);
+
+                if (get_data_pointer(&conn->send_array, &dt, packet_num) == 1) {
+                    set_sent_time(&conn->send_array, dt, current_time_monotonic());
                 }
+
+                pthread_mutex_unlock(&conn->mutex);
             }
         }
 
@@ -979,14 +1426,101 @@ static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
     return 0;
 }
 
-/*  return -1 if data could not be put in packet queue.
- *  return positive packet number if data was put into the queue.
+/* Send the lossless packet just added to the send array of conn with
+ * packet_num, unless the last send failed and congestion_control is 0: it is
+ * then sent when the peer requests it.
  */
-static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
-                                    uint8_t congestion_control)
+static void send_added_packet(Net_Crypto *c, Crypto_Connection *conn, int crypt_connection_id, uint32_t packet_num,
+                              const uint8_t *data, uint16_t length, uint8_t congestion_control)
 {
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
-        return -1;
+    if (!congestion_control && conn->maximum_speed_reached) {
+        return;
+    }
+
+    if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, data, length) == 0) {
+        Packet_Data *dt = NULL;
+
+        pthread_mutex_lock(&conn->mutex);
+
+        if (get_data_pointer(&conn->send_array, &dt, packet_num) == 1) {
+            set_sent_time(&conn->send_array, dt, current_time_monotonic());
+        }
+
+        pthread_mutex_unlock(&conn->mutex);
+    } else {
+        conn->maximum_speed_reached = 1;
+        LOGGER_ERROR(c->log, "send_data_packet failed\n");
+    }
+}
+
+/* Move the lossless packets waiting in the coalesced packet of conn to the end
+ * of its send array, as a plain lossless packet if there is only one, copying
+ * it to dt for send_coalesced_packet(). conn->mutex must be held.
+ *
+ * return -1 on failure.
+ * return 0 if none are waiting.
+ * return 1 with its packet number in packet_num on success.
+ */
+static int add_coalesced_packet(Net_Crypto *c, Crypto_Connection *conn, Packet_Data *dt, uint32_t *packet_num)
+{
+    Packet_Data *coalesced = conn->coalesce_packet;
+
+    if (coalesced == NULL) {
+        return 0;
+    }
+
+    dt->sent_time = 0;
+    dt->resent = 0;
+
+    if (conn->coalesce_num == 1) {
+        dt->length = coalesced->length - (1 + sizeof(uint16_t));
+        memcpy(dt->data, coalesced->data + 1 + sizeof(uint16_t), dt->length);
+    } else {
+        dt->length = coalesced->length;
+        memcpy(dt->data, coalesced->data, dt->length);
+    }
+
+    int64_t num = add_data_end_of_buffer(c->packet_pool, &conn->send_array, dt);
+
+    if (num == -1) {
+        return -1;
+    }
+
+    conn->coalesce_packet = NULL;
+    conn->coalesce_num = 0;
+    ++conn->total_packets_sent;
+    packet_pool_free(c->packet_pool, coalesced);
+    *packet_num = num;
+    return 1;
+}
+
+/* Send the packet added with packet_num by add_coalesced_packet().
+ */
+static void send_coalesced_packet(Net_Crypto *c, Crypto_Connection *conn, int crypt_connection_id,
+                                  uint32_t packet_num, const Packet_Data *dt)
+{
+    /* The packets went through congestion control when they were written. */
+    send_added_packet(c, conn, crypt_connection_id, packet_num, dt->data, dt->length, 0);
+
+    if (conn->packets_left > 0) {
+        --conn->packets_left;
+    }
+
+    if (conn->packets_left_requested > 0) {
+        --conn->packets_left_requested;
+    }
+
+    conn->packets_sent++;
+}
+
+/*  return -1 if data could not be put in packet queue.
+ *  return positive packet number if data was put into the queue.
+ */
+static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                                    uint8_t congestion_control)
+{
+    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
+        return -1;
     }
 
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
@@ -1003,33 +1537,136 @@ static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, cons
         return -1;
     }
 
-    Packet_Data dt;
+    Packet_Data dt, coalesced;
+    uint32_t coalesced_num;
     dt.sent_time = 0;
     dt.length = length;
+    dt.resent = 0;
     memcpy(dt.data, data, length);
+
+    /* Packets that aren't coalesced go after the ones that are waiting, added
+     * under the same lock so that the number given for those stays theirs. */
     pthread_mutex_lock(&conn->mutex);
-    int64_t packet_num = add_data_end_of_buffer(&conn->send_array, &dt);
+    int coalesced_ret = add_coalesced_packet(c, conn, &coalesced, &coalesced_num);
+    int64_t packet_num = -1;
+
+    if (coalesced_ret != -1) {
+        packet_num = add_data_end_of_buffer(c->packet_pool, &conn->send_array, &dt);
+    }
+
+    if (packet_num != -1) {
+        ++conn->total_packets_sent;
+    }
+
     pthread_mutex_unlock(&conn->mutex);
 
+    if (coalesced_ret == 1) {
+        send_coalesced_packet(c, conn, crypt_connection_id, coalesced_num, &coalesced);
+    }
+
     if (packet_num == -1) {
         return -1;
     }
 
-    if (!congestion_control && conn->maximum_speed_reached) {
-        return packet_num;
+    send_added_packet(c, conn, crypt_connection_id, packet_num, data, length, congestion_control);
+    return packet_num;
+}
+
+/* Send the lossless packets waiting in the coalesced packet of the
+ * connection, as a plain lossless packet if there is only one.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int flush_coalesced_packets(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
     }
 
-    if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, data, length) == 0) {
-        Packet_Data *dt1 = NULL;
+    pthread_mutex_lock(&conn->mutex);
+    _Bool coalescing = conn->coalesce_packet != NULL;
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (!coalescing) {
+        return 0;
+    }
+
+    /* If last packet send failed, try to send packet again.
+       If sending it fails we won't be able to send the new packet. */
+    reset_max_speed_reached(c, crypt_connection_id);
 
-        if (get_data_pointer(&conn->send_array, &dt1, packet_num) == 1) {
-            dt1->sent_time = current_time_monotonic();
+    Packet_Data dt;
+    uint32_t packet_num;
+    pthread_mutex_lock(&conn->mutex);
+    int ret = add_coalesced_packet(c, conn, &dt, &packet_num);
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (ret == 1) {
+        send_coalesced_packet(c, conn, crypt_connection_id, packet_num, &dt);
+    }
+
+    return ret == -1 ? -1 : 0;
+}
+
+/* Add a lossless packet to the coalesced packet of the connection if it is
+ * held back, like Nagle's algorithm does with small packets while others wait
+ * for an ack. If it doesn't fit, the packets already in it are moved to the
+ * send array first and copied to flushed for send_coalesced_packet(), else
+ * flushed->length is set to 0.
+ *
+ * Deciding and adding under one lock keeps packets written meanwhile from
+ * taking the number returned.
+ *
+ * return -2 if it isn't held back.
+ * return -1 on failure.
+ * return packet number it will be sent with on success.
+ */
+static int64_t coalesce_lossless_packet(Net_Crypto *c, Crypto_Connection *conn, const uint8_t *data, uint16_t length,
+                                        Packet_Data *flushed, uint32_t *flushed_num)
+{
+    flushed->length = 0;
+    pthread_mutex_lock(&conn->mutex);
+
+    if (conn->coalesce_packet == NULL && conn->send_array.num_stored == 0) {
+        pthread_mutex_unlock(&conn->mutex);
+        return -2;
+    }
+
+    if (conn->coalesce_packet != NULL
+            && conn->coalesce_packet->length + sizeof(uint16_t) + length > MAX_CRYPTO_DATA_SIZE
+            && add_coalesced_packet(c, conn, flushed, flushed_num) == -1) {
+        flushed->length = 0;
+        pthread_mutex_unlock(&conn->mutex);
+        return -1;
+    }
+
+    if (conn->coalesce_packet == NULL) {
+        Packet_Data *coalesced = packet_pool_alloc(c->packet_pool);
+
+        if (coalesced == NULL) {
+            pthread_mutex_unlock(&conn->mutex);
+            return -1;
         }
-    } else {
-        conn->maximum_speed_reached = 1;
-        LOGGER_ERROR(c->log, "send_data_packet failed\n");
+
+        coalesced->data[0] = PACKET_ID_COALESCED;
+        coalesced->length = 1;
+        conn->coalesce_packet = coalesced;
+        conn->coalesce_time = current_time_monotonic();
     }
 
+    Packet_Data *coalesced = conn->coalesce_packet;
+    uint16_t net_length = htons(length);
+    memcpy(coalesced->data + coalesced->length, &net_length, sizeof(uint16_t));
+    memcpy(coalesced->data + coalesced->length + sizeof(uint16_t), data, length);
+    coalesced->length += sizeof(uint16_t) + length;
+    ++conn->coalesce_num;
+
+    /* Nothing else is added to the send array before the coalesced packet. */
+    int64_t packet_num = conn->send_array.buffer_end;
+    pthread_mutex_unlock(&conn->mutex);
     return packet_num;
 }
 
@@ -1100,8 +1737,27 @@ static int send_request_packet(Net_Crypto *c, int crypt_connection_id)
         return -1;
     }
 
+    /* Keep telling peers our version until they show they know it. Old
+     * peers never will so only try MAX_NUM_SENDPACKET_TRIES times unless they
+     * told us theirs. */
+    if (!conn->version_acked && (conn->peer_version != 0 || conn->version_packets_sent < MAX_NUM_SENDPACKET_TRIES)) {
+        uint8_t version_packet[2] = {PACKET_ID_VERSION, CRYPTO_PROTOCOL_VERSION};
+
+        if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end,
+                                    version_packet, sizeof(version_packet)) == 0
+                && conn->version_packets_sent < UINT8_MAX) {
+            ++conn->version_packets_sent;
+        }
+    }
+
     uint8_t data[MAX_CRYPTO_DATA_SIZE];
-    int len = generate_request_packet(data, sizeof(data), &conn->recv_array);
+    int len;
+
+    if (conn->peer_version >= 1) {
+        len = generate_sack_packet(data, sizeof(data), &conn->recv_array);
+    } else {
+        len = generate_request_packet(data, sizeof(data), &conn->recv_array);
+    }
 
     if (len == -1) {
         return -1;
@@ -1112,6 +1768,9 @@ static int send_request_packet(Net_Crypto *c, int crypt_connection_id)
 }
 
 /* Send up to max num previously requested data packets.
+ *
+ * Only called by the net_crypto thread, the only one freeing packets of the
+ * send array, so they stay valid after the mutex is released.
  *
  * return -1 on failure.
  * return number of packets sent on success.
@@ -1129,12 +1788,17 @@ static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32
     }
 
     uint64_t temp_time = current_time_monotonic();
+    pthread_mutex_lock(&conn->mutex);
     uint32_t i, num_sent = 0, array_size = num_packets_array(&conn->send_array);
+    uint32_t buffer_start = conn->send_array.buffer_start;
+    pthread_mutex_unlock(&conn->mutex);
 
     for (i = 0; i < array_size; ++i) {
         Packet_Data *dt;
-        uint32_t packet_num = (i + conn->send_array.buffer_start);
+        uint32_t packet_num = (i + buffer_start);
+        pthread_mutex_lock(&conn->mutex);
         int ret = get_data_pointer(&conn->send_array, &dt, packet_num);
+        pthread_mutex_unlock(&conn->mutex);
 
         if (ret == -1) {
             return -1;
@@ -1150,7 +1814,9 @@ static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32
 
         if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
                                     dt->length) == 0) {
-            dt->sent_time = temp_time;
+            pthread_mutex_lock(&conn->mutex);
+            set_sent_time(&conn->send_array, dt, temp_time);
+            pthread_mutex_unlock(&conn->mutex);
             ++num_sent;
         }
 
@@ -1313,6 +1979,473 @@ static void connection_kill(Net_Crypto *c, int crypt_connection_id, void *userda
     crypto_kill(c, crypt_connection_id);
 }
 
+/** START: Congestion control **/
+
+/* The dT for the average packet receiving rate calculations.
+   Also used as the */
+#define PACKET_COUNTER_AVERAGE_INTERVAL 50
+
+/* Timeout for increasing speed after congestion event (in ms). */
+#define CONGESTION_EVENT_TIMEOUT 1000
+
+/* If the send queue is SEND_QUEUE_RATIO times larger than the
+ * calculated link speed the packet send speed will be reduced
+ * by a value depending on this number.
+ */
+#define SEND_QUEUE_RATIO 2.0
+
+/* A congestion controller sets conn->packet_send_rate,
+ * conn->packet_send_rate_requested and conn->congestion_window.
+ *
+ * on_ack is called when the peer acks num_acked packets or when a packet
+ * gives an rtt sample (0 if none), on_loss when num_lost packets the peer
+ * requested are sent again and on_tick every PACKET_COUNTER_AVERAGE_INTERVAL
+ * ms with the number of packets sent and resent since the last tick.
+ * on_ack and on_loss may be NULL.
+ */
+typedef struct {
+    void (*on_ack)(Crypto_Connection *conn, uint32_t num_acked, uint64_t rtt_sample, uint64_t temp_time);
+    void (*on_loss)(Crypto_Connection *conn, uint32_t num_lost, uint64_t temp_time);
+    void (*on_tick)(Net_Crypto *c, int crypt_connection_id, uint32_t packets_sent, uint32_t packets_resent,
+                    uint64_t temp_time);
+} Congestion_Control;
+
+/* The classic congestion controller.
+ *
+ * Calculate a new value of conn->packet_send_rate based on how many packets
+ * were sent, resent and left in the send queue in the last
+ * CONGESTION_QUEUE_ARRAY_SIZE dT.
+ */
+static void classic_on_tick(Net_Crypto *c, int crypt_connection_id, uint32_t packets_sent, uint32_t packets_resent,
+                            uint64_t temp_time)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return;
+    }
+
+    unsigned int pos = conn->last_sendqueue_counter % CONGESTION_QUEUE_ARRAY_SIZE;
+    conn->last_sendqueue_size[pos] = num_packets_array(&conn->send_array);
+    ++conn->last_sendqueue_counter;
+
+    unsigned int j;
+    long signed int sum = 0;
+    sum = (long signed int)conn->last_sendqueue_size[(pos) % CONGESTION_QUEUE_ARRAY_SIZE] -
+          (long signed int)conn->last_sendqueue_size[(pos - (CONGESTION_QUEUE_ARRAY_SIZE - 1)) % CONGESTION_QUEUE_ARRAY_SIZE];
+
+    unsigned int n_p_pos = conn->last_sendqueue_counter % CONGESTION_LAST_SENT_ARRAY_SIZE;
+    conn->last_num_packets_sent[n_p_pos] = packets_sent;
+    conn->last_num_packets_resent[n_p_pos] = packets_resent;
+
+    _Bool direct_connected = 0;
+    crypto_connection_status(c, crypt_connection_id, &direct_connected, NULL);
+
+    if (direct_connected && conn->last_tcp_sent + CONGESTION_EVENT_TIMEOUT > temp_time) {
+        /* When switching from TCP to UDP, don't change the packet send rate for CONGESTION_EVENT_TIMEOUT ms. */
+    } else {
+        long signed int total_sent = 0, total_resent = 0;
+
+        //TODO use real delay
+        unsigned int delay = (unsigned int)((conn->rtt_time / PACKET_COUNTER_AVERAGE_INTERVAL) + 0.5);
+        unsigned int packets_set_rem_array = (CONGESTION_LAST_SENT_ARRAY_SIZE - CONGESTION_QUEUE_ARRAY_SIZE);
+
+        if (delay > packets_set_rem_array) {
+            delay = packets_set_rem_array;
+        }
+
+        for (j = 0; j < CONGESTION_QUEUE_ARRAY_SIZE; ++j) {
+            unsigned int ind = (j + (packets_set_rem_array  - delay) + n_p_pos) % CONGESTION_LAST_SENT_ARRAY_SIZE;
+            total_sent += conn->last_num_packets_sent[ind];
+            total_resent += conn->last_num_packets_resent[ind];
+        }
+
+        if (sum > 0) {
+            total_sent -= sum;
+        } else {
+            if (total_resent > -sum) {
+                total_resent = -sum;
+            }
+        }
+
+        /* if queue is too big only allow resending packets. */
+        uint32_t npackets = num_packets_array(&conn->send_array);
+        double min_speed = 1000.0 * (((double)(total_sent)) / ((double)(CONGESTION_QUEUE_ARRAY_SIZE) *
+                                     PACKET_COUNTER_AVERAGE_INTERVAL));
+
+        double min_speed_request = 1000.0 * (((double)(total_sent + total_resent)) / ((double)(
+                CONGESTION_QUEUE_ARRAY_SIZE) * PACKET_COUNTER_AVERAGE_INTERVAL));
+
+        if (min_speed < CRYPTO_PACKET_MIN_RATE) {
+            min_speed = CRYPTO_PACKET_MIN_RATE;
+        }
+
+        double send_array_ratio = (((double)npackets) / min_speed);
+
+        //TODO: Improve formula?
+        if (send_array_ratio > SEND_QUEUE_RATIO && CRYPTO_MIN_QUEUE_LENGTH < npackets) {
+            conn->packet_send_rate = min_speed * (1.0 / (send_array_ratio / SEND_QUEUE_RATIO));
+        } else if (conn->last_congestion_event + CONGESTION_EVENT_TIMEOUT < temp_time) {
+            conn->packet_send_rate = min_speed * 1.2;
+        } else {
+            conn->packet_send_rate = min_speed * 0.9;
+        }
+
+        conn->packet_send_rate_requested = min_speed_request * 1.2;
+
+        if (conn->packet_send_rate < CRYPTO_PACKET_MIN_RATE) {
+            conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
+        }
+
+        if (conn->packet_send_rate_requested < conn->packet_send_rate) {
+            conn->packet_send_rate_requested = conn->packet_send_rate;
+        }
+    }
+}
+
+#define CONGESTION_BBR_STARTUP   0
+#define CONGESTION_BBR_DRAIN     1
+#define CONGESTION_BBR_PROBE_BW  2
+#define CONGESTION_BBR_PROBE_RTT 3
+
+/* Gain on the bottleneck bandwidth while looking for it, 2/ln(2). */
+#define CONGESTION_BBR_STARTUP_GAIN 2.885
+
+/* The send window is this many times the bandwidth delay product. */
+#define CONGESTION_BBR_CWND_GAIN 2.0
+
+/* Smallest send window, also used while measuring the rtt with a short
+ * queue. Messenger keeps a quarter of CRYPTO_MIN_QUEUE_LENGTH free for its own
+ * packets, so a smaller window would stop file transfers from ever sending
+ * enough to measure the bandwidth. */
+#define CONGESTION_BBR_MIN_CWND (CRYPTO_MIN_QUEUE_LENGTH / 2)
+
+/* Time added to the rtt in the send window as the peer only acks packets
+ * in its request packets, which it sends at most every
+ * PACKET_COUNTER_AVERAGE_INTERVAL ms. */
+#define CONGESTION_BBR_ACK_DELAY (2 * PACKET_COUNTER_AVERAGE_INTERVAL)
+
+/* Shortest time in ms of a round and so of a phase of the gain cycle, long
+ * enough for a whole delivery rate to be measured at the gain of a phase. */
+#define CONGESTION_BBR_MIN_ROUND_TIME (2 * CONGESTION_BBR_RATE_INTERVAL * PACKET_COUNTER_AVERAGE_INTERVAL)
+
+/* The min rtt is measured again after this many ms, for this many ms. */
+#define CONGESTION_BBR_MIN_RTT_TIMEOUT 10000
+#define CONGESTION_BBR_PROBE_RTT_TIME 200
+
+/* Don't probe for more bandwidth after a round that lost more than this
+ * ratio of packets. */
+#define CONGESTION_BBR_LOSS_THRESHOLD 0.02
+
+#define CONGESTION_BBR_CYCLE_LENGTH 8
+
+static const double bbr_pacing_gains[CONGESTION_BBR_CYCLE_LENGTH] = {1.25, 0.75, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0};
+
+static void bbr_on_ack(Crypto_Connection *conn, uint32_t num_acked, uint64_t rtt_sample, uint64_t temp_time)
+{
+    Congestion_BBR *bbr = &conn->bbr;
+    bbr->delivered[bbr->delivered_counter % CONGESTION_BBR_RATE_INTERVAL] += num_acked;
+    bbr->cycle_delivered += num_acked;
+
+    if (rtt_sample != 0 && (bbr->min_rtt == 0 || rtt_sample < bbr->min_rtt)) {
+        bbr->min_rtt = rtt_sample;
+        bbr->min_rtt_time = temp_time;
+    }
+}
+
+static void bbr_on_loss(Crypto_Connection *conn, uint32_t num_lost, uint64_t temp_time)
+{
+    conn->bbr.cycle_lost += num_lost;
+}
+
+/* Start a new dT.
+ *
+ * return the delivery rate in packets per second of the last
+ * CONGESTION_BBR_RATE_INTERVAL dT.
+ */
+static double bbr_delivery_rate(Congestion_BBR *bbr, uint64_t temp_time)
+{
+    uint32_t i, delivered = 0;
+
+    for (i = 0; i < CONGESTION_BBR_RATE_INTERVAL; ++i) {
+        delivered += bbr->delivered[i];
+    }
+
+    /* The oldest dT is replaced by the new one. */
+    uint32_t pos = (bbr->delivered_counter + 1) % CONGESTION_BBR_RATE_INTERVAL;
+    uint64_t rate_start = bbr->delivered_time[pos];
+    ++bbr->delivered_counter;
+    bbr->delivered[pos] = 0;
+    bbr->delivered_time[pos] = temp_time;
+
+    if (rate_start == 0 || rate_start >= temp_time) {
+        return 0;
+    }
+
+    return 1000.0 * delivered / (temp_time - rate_start);
+}
+
+static void bbr_enter_probe_bw(Congestion_BBR *bbr, uint64_t temp_time)
+{
+    bbr->mode = CONGESTION_BBR_PROBE_BW;
+    /* Start anywhere but in the phase that drains the probe. */
+    bbr->cycle_index = random_int() % (CONGESTION_BBR_CYCLE_LENGTH - 1);
+
+    if (bbr->cycle_index != 0) {
+        ++bbr->cycle_index;
+    }
+
+    bbr->cycle_start = temp_time;
+    bbr->cycle_delivered = bbr->cycle_lost = 0;
+}
+
+/* The BBR congestion controller.
+ *
+ * Send at the highest rate packets were recently delivered at, the
+ * bottleneck bandwidth, times a gain that probes for more bandwidth and then
+ * drains the queue that made every 8 rounds. Keep at most a few bandwidth
+ * delay products in flight. Unlike the classic controller random losses
+ * don't slow it down, which is what keeps long fat links full.
+ */
+static void bbr_on_tick(Net_Crypto *c, int crypt_connection_id, uint32_t packets_sent, uint32_t packets_resent,
+                        uint64_t temp_time)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return;
+    }
+
+    Congestion_BBR *bbr = &conn->bbr;
+    double delivery_rate = bbr_delivery_rate(bbr, temp_time);
+
+    uint64_t rtt = bbr->min_rtt ? bbr->min_rtt : conn->rtt_time;
+    uint64_t round_time = rtt;
+
+    if (round_time < CONGESTION_BBR_MIN_ROUND_TIME) {
+        round_time = CONGESTION_BBR_MIN_ROUND_TIME;
+    }
+
+    _Bool new_round = bbr->round_start + round_time <= temp_time;
+
+    if (new_round) {
+        bbr->round_start = temp_time;
+        ++bbr->round_counter;
+        bbr->round_bw[bbr->round_counter % CONGESTION_BBR_BW_ROUNDS] = 0;
+    }
+
+    if (delivery_rate > bbr->round_bw[bbr->round_counter % CONGESTION_BBR_BW_ROUNDS]) {
+        bbr->round_bw[bbr->round_counter % CONGESTION_BBR_BW_ROUNDS] = delivery_rate;
+    }
+
+    uint32_t j;
+    bbr->max_bw = 0;
+
+    for (j = 0; j < CONGESTION_BBR_BW_ROUNDS; ++j) {
+        if (bbr->round_bw[j] > bbr->max_bw) {
+            bbr->max_bw = bbr->round_bw[j];
+        }
+    }
+
+    double bw = bbr->max_bw;
+
+    if (bw < CRYPTO_PACKET_MIN_RATE) {
+        bw = CRYPTO_PACKET_MIN_RATE;
+    }
+
+    double bdp = bw * (double)(rtt + CONGESTION_BBR_ACK_DELAY) / 1000.0;
+    uint32_t npackets = conn->send_array.num_stored;
+
+    /* Only rounds in which all we were allowed to send was sent tell
+     * whether the bandwidth stopped growing. */
+    if (bbr->mode == CONGESTION_BBR_STARTUP && new_round && conn->packets_left == 0) {
+        if (bbr->max_bw >= bbr->full_bw * 1.25) {
+            bbr->full_bw = bbr->max_bw;
+            bbr->full_bw_count = 0;
+        } else if (++bbr->full_bw_count >= 3) {
+            bbr->mode = CONGESTION_BBR_DRAIN;
+        }
+    }
+
+    if (bbr->mode == CONGESTION_BBR_DRAIN && npackets <= bdp) {
+        bbr_enter_probe_bw(bbr, temp_time);
+    }
+
+    if (bbr->mode == CONGESTION_BBR_PROBE_BW && bbr->cycle_start + round_time <= temp_time) {
+        bbr->cycle_index = (bbr->cycle_index + 1) % CONGESTION_BBR_CYCLE_LENGTH;
+
+        if (bbr->cycle_index == 0 && bbr->cycle_lost > bbr->cycle_delivered * CONGESTION_BBR_LOSS_THRESHOLD) {
+            bbr->cycle_index = 2;
+        }
+
+        bbr->cycle_start = temp_time;
+        bbr->cycle_delivered = bbr->cycle_lost = 0;
+    }
+
+    if (bbr->mode != CONGESTION_BBR_PROBE_RTT && bbr->min_rtt != 0
+            && bbr->min_rtt_time + CONGESTION_BBR_MIN_RTT_TIMEOUT < temp_time) {
+        /* Take the min rtt again from the samples while the queue is empty. */
+        bbr->mode = CONGESTION_BBR_PROBE_RTT;
+        bbr->min_rtt = 0;
+        bbr->probe_rtt_done = temp_time + CONGESTION_BBR_PROBE_RTT_TIME + rtt;
+    }
+
+    if (bbr->mode == CONGESTION_BBR_PROBE_RTT && bbr->probe_rtt_done <= temp_time) {
+        bbr->min_rtt_time = temp_time;
+
+        if (bbr->full_bw_count >= 3) {
+            bbr_enter_probe_bw(bbr, temp_time);
+        } else {
+            bbr->mode = CONGESTION_BBR_STARTUP;
+        }
+    }
+
+    double pacing_gain = 1.0, cwnd_gain = CONGESTION_BBR_CWND_GAIN;
+
+    switch (bbr->mode) {
+        case CONGESTION_BBR_STARTUP:
+            pacing_gain = cwnd_gain = CONGESTION_BBR_STARTUP_GAIN;
+            break;
+
+        case CONGESTION_BBR_DRAIN:
+            pacing_gain = 1.0 / CONGESTION_BBR_STARTUP_GAIN;
+            cwnd_gain = CONGESTION_BBR_STARTUP_GAIN;
+            break;
+
+        case CONGESTION_BBR_PROBE_BW:
+            pacing_gain = bbr_pacing_gains[bbr->cycle_index];
+            break;
+    }
+
+    conn->packet_send_rate = bw * pacing_gain;
+
+    if (conn->packet_send_rate < CRYPTO_PACKET_MIN_RATE) {
+        conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
+    }
+
+    conn->packet_send_rate_requested = conn->packet_send_rate;
+
+    double cwnd = bdp * cwnd_gain;
+
+    if (bbr->mode == CONGESTION_BBR_PROBE_RTT || cwnd < CONGESTION_BBR_MIN_CWND) {
+        cwnd = CONGESTION_BBR_MIN_CWND;
+    }
+
+    if (cwnd > CRYPTO_PACKET_BUFFER_SIZE) {
+        cwnd = CRYPTO_PACKET_BUFFER_SIZE;
+    }
+
+    conn->congestion_window = cwnd;
+}
+
+static const Congestion_Control congestion_controllers[CRYPTO_CONGESTION_NUM] = {
+    {NULL, NULL, &classic_on_tick},
+    {&bbr_on_ack, &bbr_on_loss, &bbr_on_tick},
+};
+
+/* Set the congestion controller (CRYPTO_CONGESTION_*) of the connections
+ * made from now on.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int net_crypto_congestion_control(Net_Crypto *c, uint8_t congestion_controller)
+{
+    if (congestion_controller >= CRYPTO_CONGESTION_NUM) {
+        return -1;
+    }
+
+    c->congestion_controller = congestion_controller;
+    return 0;
+}
+
+/** END: Congestion control **/
+
+/* Update the smoothed rtt and the retransmission timeout of conn with
+ * rtt_sample, as in RFC 6298.
+ */
+static void update_rto(Crypto_Connection *conn, uint64_t rtt_sample)
+{
+    if (conn->srtt == 0) {
+        conn->srtt = rtt_sample;
+        conn->rttvar = rtt_sample / 2;
+    } else {
+        uint64_t diff = conn->srtt > rtt_sample ? conn->srtt - rtt_sample : rtt_sample - conn->srtt;
+        conn->rttvar = (3 * conn->rttvar + diff) / 4;
+        conn->srtt = (7 * conn->srtt + rtt_sample) / 8;
+    }
+
+    conn->rto = conn->srtt + 4 * conn->rttvar;
+
+    if (conn->rto < CRYPTO_MIN_RTO) {
+        conn->rto = CRYPTO_MIN_RTO;
+    }
+
+    if (conn->rto > CRYPTO_MAX_RTO) {
+        conn->rto = CRYPTO_MAX_RTO;
+    }
+}
+
+/* Pass a lossless packet to the data callback of the connection, or the
+ * packets in it if it is a PACKET_ID_COALESCED packet.
+ *
+ * return -1 if the connection was killed in the callback.
+ * return 0 otherwise.
+ */
+static int handle_lossless_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                                  void *userdata)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    if (data[0] != PACKET_ID_COALESCED) {
+        if (conn->connection_data_callback) {
+            conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id, data,
+                                           length, userdata);
+        }
+
+        /* conn might get killed in callback. */
+        return get_crypto_connection(c, crypt_connection_id) ? 0 : -1;
+    }
+
+    uint16_t offset = 1;
+
+    while (offset + sizeof(uint16_t) <= length) {
+        uint16_t packet_length;
+        memcpy(&packet_length, data + offset, sizeof(uint16_t));
+        packet_length = ntohs(packet_length);
+        offset += sizeof(uint16_t);
+
+        if (packet_length == 0 || packet_length > length - offset) {
+            break;
+        }
+
+        const uint8_t *packet = data + offset;
+        offset += packet_length;
+
+        if (packet[0] < CRYPTO_RESERVED_PACKETS || packet[0] >= PACKET_ID_LOSSY_RANGE_START) {
+            continue;
+        }
+
+        if (conn->connection_data_callback) {
+            conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id, packet,
+                                           packet_length, userdata);
+        }
+
+        /* conn might get killed in callback. */
+        conn = get_crypto_connection(c, crypt_connection_id);
+
+        if (conn == 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 /* Handle a received data packet.
  *
  * return -1 on failure.
@@ -1345,19 +2478,31 @@ static int handle_data_packet_helper(Net_Crypto *c, int crypt_connection_id, con
     num = ntohl(num);
 
     uint64_t rtt_calc_time = 0;
+    _Bool rtt_ambiguous = 0;
+    uint32_t num_acked = 0;
+
+    pthread_mutex_lock(&conn->mutex);
 
     if (buffer_start != conn->send_array.buffer_start) {
         Packet_Data *packet_time;
 
         if (get_data_pointer(&conn->send_array, &packet_time, conn->send_array.buffer_start) == 1) {
             rtt_calc_time = packet_time->sent_time;
+            rtt_ambiguous = packet_time->resent;
         }
 
-        if (clear_buffer_until(&conn->send_array, buffer_start) != 0) {
+        num_acked = conn->send_array.num_stored;
+
+        if (clear_buffer_until(c->packet_pool, &conn->send_array, buffer_start) != 0) {
+            pthread_mutex_unlock(&conn->mutex);
             return -1;
         }
+
+        num_acked -= conn->send_array.num_stored;
     }
 
+    pthread_mutex_unlock(&conn->mutex);
+
     uint8_t *real_data = data + (sizeof(uint32_t) * 2);
     uint16_t real_length = len - (sizeof(uint32_t) * 2);
 
@@ -1385,7 +2530,7 @@ static int handle_data_packet_helper(Net_Crypto *c, int crypt_connection_id, con
         }
     }
 
-    if (real_data[0] == PACKET_ID_REQUEST) {
+    if (real_data[0] == PACKET_ID_REQUEST || real_data[0] == PACKET_ID_SACK) {
         uint64_t rtt_time;
 
         if (udp) {
@@ -1394,7 +2539,36 @@ static int handle_data_packet_helper(Net_Crypto *c, int crypt_connection_id, con
             rtt_time = DEFAULT_TCP_PING_CONNECTION;
         }
 
-        int requested = handle_request_packet(&conn->send_array, real_data, real_length, &rtt_calc_time, rtt_time);
+        pthread_mutex_lock(&conn->mutex);
+        uint32_t num_stored = conn->send_array.num_stored;
+        int requested;
+
+        if (real_data[0] == PACKET_ID_REQUEST) {
+            requested = handle_request_packet(c->packet_pool, &conn->send_array, real_data, real_length, &rtt_calc_time,
+                                              rtt_time);
+        } else {
+            /* Packets at the end of the window have too few acked after
+             * them to ever reach the threshold, send them again once they
+             * are a quarter of an rtt late. */
+            uint64_t reorder_time = rtt_time;
+
+            if (udp && conn->srtt != 0) {
+                reorder_time = conn->srtt + conn->srtt / 4;
+            }
+
+            uint64_t sack_send_time = 0;
+            requested = handle_sack_packet(c->packet_pool, &conn->send_array, real_data, real_length, &sack_send_time,
+                                           rtt_time, reorder_time);
+            conn->version_acked = 1;
+
+            if (sack_send_time > rtt_calc_time) {
+                rtt_calc_time = sack_send_time;
+                rtt_ambiguous = 0;
+            }
+        }
+
+        num_acked += num_stored - conn->send_array.num_stored;
+        pthread_mutex_unlock(&conn->mutex);
 
         if (requested == -1) {
             return -1;
@@ -1403,39 +2577,61 @@ static int handle_data_packet_helper(Net_Crypto *c, int crypt_connection_id, con
         // else { /* TODO? */ }
 
         set_buffer_end(&conn->recv_array, num);
-    } else if (real_data[0] >= CRYPTO_RESERVED_PACKETS && real_data[0] < PACKET_ID_LOSSY_RANGE_START) {
+    } else if (real_data[0] == PACKET_ID_VERSION) {
+        if (real_length < 2) {
+            return -1;
+        }
+
+        conn->peer_version = real_data[1];
+        set_buffer_end(&conn->recv_array, num);
+    } else if ((real_data[0] >= CRYPTO_RESERVED_PACKETS && real_data[0] < PACKET_ID_LOSSY_RANGE_START)
+               || real_data[0] == PACKET_ID_COALESCED) {
         Packet_Data dt;
+        dt.sent_time = 0;
         dt.length = real_length;
+        dt.resent = 0;
         memcpy(dt.data, real_data, real_length);
 
-        if (add_data_to_buffer(&conn->recv_array, num, &dt) != 0) {
+        pthread_mutex_lock(&conn->mutex);
+
+        if (add_data_to_buffer(c->packet_pool, &conn->recv_array, num, &dt) != 0) {
+            pthread_mutex_unlock(&conn->mutex);
             return -1;
         }
 
+        ++conn->total_packets_received;
+        pthread_mutex_unlock(&conn->mutex);
+
         while (1) {
             pthread_mutex_lock(&conn->mutex);
-            int ret = read_data_beg_buffer(&conn->recv_array, &dt);
+            int ret = read_data_beg_buffer(c->packet_pool, &conn->recv_array, &dt);
             pthread_mutex_unlock(&conn->mutex);
 
             if (ret == -1) {
                 break;
             }
 
-            if (conn->connection_data_callback) {
-                conn->connection_data_callback(conn->connection_data_callback_object, conn->connection_data_callback_id, dt.data,
-                                               dt.length, userdata);
+            if (handle_lossless_packet(c, crypt_connection_id, dt.data, dt.length, userdata) == -1) {
+                return -1;
             }
 
-            /* conn might get killed in callback. */
             conn = get_crypto_connection(c, crypt_connection_id);
-
-            if (conn == 0) {
-                return -1;
-            }
         }
 
         /* Packet counter. */
         ++conn->packet_counter;
+
+        /* Packets are missing, tell peers that understand SACK packets right
+         * away so they don't wait for the next request packet to send them
+         * again. */
+        uint64_t temp_time = current_time_monotonic();
+
+        if (conn->peer_version >= 1 && conn->recv_array.buffer_start != conn->recv_array.buffer_end
+                && conn->last_request_packet_sent + CRYPTO_SACK_INTERVAL <= temp_time) {
+            if (send_request_packet(c, crypt_connection_id) == 0) {
+                conn->last_request_packet_sent = temp_time;
+            }
+        }
     } else if (real_data[0] >= PACKET_ID_LOSSY_RANGE_START &&
                real_data[0] < (PACKET_ID_LOSSY_RANGE_START + PACKET_ID_LOSSY_RANGE_SIZE)) {
 
@@ -1449,14 +2645,29 @@ static int handle_data_packet_helper(Net_Crypto *c, int crypt_connection_id, con
         return -1;
     }
 
-    if (rtt_calc_time != 0) {
-        uint64_t rtt_time = current_time_monotonic() - rtt_calc_time;
+    uint64_t temp_time = current_time_monotonic();
+    uint64_t rtt_sample = 0;
+
+    if (rtt_calc_time != 0 && rtt_calc_time <= temp_time) {
+        rtt_sample = temp_time - rtt_calc_time;
 
-        if (rtt_time < conn->rtt_time) {
-            conn->rtt_time = rtt_time;
+        if (rtt_sample < conn->rtt_time) {
+            conn->rtt_time = rtt_sample;
         }
     }
 
+    if (rtt_ambiguous) {
+        rtt_sample = 0;
+    }
+
+    if (rtt_sample != 0) {
+        update_rto(conn, rtt_sample);
+    }
+
+    if ((num_acked != 0 || rtt_sample != 0) && congestion_controllers[conn->congestion_controller].on_ack) {
+        congestion_controllers[conn->congestion_controller].on_ack(conn, num_acked, rtt_sample, temp_time);
+    }
+
     return 0;
 }
 
@@ -1577,6 +2788,50 @@ static int realloc_cryptoconnection(Net_Crypto *c, uint32_t num)
 }
 
 
+/* Let the calling thread use the connections array without holding
+ * connections_mutex, waiting while another thread is changing it.
+ */
+static void use_connections(Net_Crypto *c)
+{
+    while (1) {
+        __atomic_add_fetch(&c->connection_use_counter, 1, __ATOMIC_SEQ_CST);
+
+        if (!__atomic_load_n(&c->connections_resizing, __ATOMIC_SEQ_CST)) {
+            return;
+        }
+
+        __atomic_sub_fetch(&c->connection_use_counter, 1, __ATOMIC_SEQ_CST);
+
+        while (__atomic_load_n(&c->connections_resizing, __ATOMIC_SEQ_CST)) {
+            /* Spin, the connections array is being changed. */
+        }
+    }
+}
+
+static void release_connections(Net_Crypto *c)
+{
+    __atomic_sub_fetch(&c->connection_use_counter, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Lock the connections array to change it, waiting for the threads using it
+ * without the lock to be done.
+ */
+static void lock_connections(Net_Crypto *c)
+{
+    pthread_mutex_lock(&c->connections_mutex);
+    __atomic_store_n(&c->connections_resizing, 1, __ATOMIC_SEQ_CST);
+
+    while (__atomic_load_n(&c->connection_use_counter, __ATOMIC_SEQ_CST)) {
+        /* Spin, lossy packets are being sent. */
+    }
+}
+
+static void unlock_connections(Net_Crypto *c)
+{
+    __atomic_store_n(&c->connections_resizing, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&c->connections_mutex);
+}
+
 /* Create a new empty crypto connection.
  *
  * return -1 on failure.
@@ -1592,30 +2847,30 @@ static int create_crypto_connection(Net_Crypto *c)
         }
     }
 
-    while (1) { /* TODO: is this really the best way to do this? */
-        pthread_mutex_lock(&c->connections_mutex);
-
-        if (!c->connection_use_counter) {
-            break;
-        }
-
-        pthread_mutex_unlock(&c->connections_mutex);
-    }
+    lock_connections(c);
 
     int id = -1;
 
     if (realloc_cryptoconnection(c, c->crypto_connections_length + 1) == 0) {
         id = c->crypto_connections_length;
-        ++c->crypto_connections_length;
         memset(&(c->crypto_connections[id]), 0, sizeof(Crypto_Connection));
+        c->crypto_connections[id].lossy_queue = new_send_queue(CRYPTO_SEND_QUEUE_SIZE);
+
+        if (c->crypto_connections[id].lossy_queue == NULL) {
+            unlock_connections(c);
+            return -1;
+        }
 
         if (pthread_mutex_init(&c->crypto_connections[id].mutex, NULL) != 0) {
-            pthread_mutex_unlock(&c->connections_mutex);
+            kill_send_queue(c->crypto_connections[id].lossy_queue);
+            unlock_connections(c);
             return -1;
         }
+
+        ++c->crypto_connections_length;
     }
 
-    pthread_mutex_unlock(&c->connections_mutex);
+    unlock_connections(c);
     return id;
 }
 
@@ -1632,14 +2887,18 @@ static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
 
     uint32_t i;
 
-    /* Keep mutex, only destroy it when connection is realloced out. */
+    /* Keep mutex and lossy queue, only destroy them when connection is realloced out. */
     pthread_mutex_t mutex = c->crypto_connections[crypt_connection_id].mutex;
+    Send_Queue *lossy_queue = c->crypto_connections[crypt_connection_id].lossy_queue;
     sodium_memzero(&(c->crypto_connections[crypt_connection_id]), sizeof(Crypto_Connection));
     c->crypto_connections[crypt_connection_id].mutex = mutex;
+    c->crypto_connections[crypt_connection_id].lossy_queue = lossy_queue;
+    send_queue_clear(lossy_queue);
 
     for (i = c->crypto_connections_length; i != 0; --i) {
         if (c->crypto_connections[i - 1].status == CRYPTO_CONN_NO_CONNECTION) {
             pthread_mutex_destroy(&c->crypto_connections[i - 1].mutex);
+            kill_send_queue(c->crypto_connections[i - 1].lossy_queue);
         } else {
             break;
         }
@@ -1660,17 +2919,7 @@ static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
  */
 static int getcryptconnection_id(const Net_Crypto *c, const uint8_t *public_key)
 {
-    uint32_t i;
-
-    for (i = 0; i < c->crypto_connections_length; ++i) {
-        if (c->crypto_connections[i].status != CRYPTO_CONN_NO_CONNECTION) {
-            if (public_key_cmp(public_key, c->crypto_connections[i].public_key) == 0) {
-                return i;
-            }
-        }
-    }
-
-    return -1;
+    return key_index_find(&c->public_key_index, public_key_hash(c, public_key), &public_key_match, c, public_key);
 }
 
 /* Add a source to the crypto connection.
@@ -1836,6 +3085,14 @@ int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
     conn->packet_send_rate_requested = CRYPTO_PACKET_MIN_RATE;
     conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
     conn->rtt_time = DEFAULT_PING_CONNECTION;
+    conn->congestion_controller = c->congestion_controller;
+    conn->coalesce = c->coalesce;
+
+    if (key_index_add(&c->public_key_index, public_key_hash(c, conn->public_key), crypt_connection_id) != 0) {
+        crypto_kill(c, crypt_connection_id);
+        return -1;
+    }
+
     crypto_connection_add_source(c, crypt_connection_id, n_c->source);
     return crypt_connection_id;
 }
@@ -1883,6 +3140,8 @@ int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const u
     conn->packet_send_rate_requested = CRYPTO_PACKET_MIN_RATE;
     conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
     conn->rtt_time = DEFAULT_PING_CONNECTION;
+    conn->congestion_controller = c->congestion_controller;
+    conn->coalesce = c->coalesce;
     memcpy(conn->dht_public_key, dht_public_key, crypto_box_PUBLICKEYBYTES);
 
     conn->cookie_request_number = random_64b();
@@ -1898,6 +3157,11 @@ int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const u
         return -1;
     }
 
+    if (key_index_add(&c->public_key_index, public_key_hash(c, conn->public_key), crypt_connection_id) != 0) {
+        crypto_kill(c, crypt_connection_id);
+        return -1;
+    }
+
     return crypt_connection_id;
 }
 
@@ -1977,6 +3241,12 @@ static int tcp_oob_callback(void *object, const uint8_t *public_key, unsigned in
 
     Net_Crypto *c = object;
 
+    if ((data[0] == NET_PACKET_COOKIE_REQUEST || data[0] == NET_PACKET_CRYPTO_HS)
+            && !handshake_source_allowed(c, public_key_hash(c, public_key))) {
+        ++c->handshake_stats.rate_limited;
+        return -1;
+    }
+
     if (data[0] == NET_PACKET_COOKIE_REQUEST) {
         return tcp_oob_handle_cookie_request(c, tcp_connections_number, public_key, data, length);
     }
@@ -2215,7 +3485,7 @@ int nc_dht_pk_callback(Net_Crypto *c, int crypt_connection_id, void (*function)(
  */
 static int crypto_id_ip_port(const Net_Crypto *c, IP_Port ip_port)
 {
-    return bs_list_find(&c->ip_port_list, (uint8_t *)&ip_port);
+    return key_index_find(&c->ip_port_index, ip_port_hash(c, &ip_port), &ip_port_match, c, &ip_port);
 }
 
 #define CRYPTO_MIN_PACKET_SIZE (1 + sizeof(uint16_t) + crypto_box_MACBYTES)
@@ -2242,7 +3512,7 @@ static int udp_handle_packet(void *object, IP_Port source, const uint8_t *packet
             return 1;
         }
 
-        if (handle_new_connection_handshake(c, source, packet, length, userdata) != 0) {
+        if (queue_handshake_request(c, source, packet, length) != 0) {
             return 1;
         }
 
@@ -2271,30 +3541,42 @@ static int udp_handle_packet(void *object, IP_Port source, const uint8_t *packet
     return 0;
 }
 
-/* The dT for the average packet receiving rate calculations.
-   Also used as the */
-#define PACKET_COUNTER_AVERAGE_INTERVAL 50
+/* What send_lossy_cryptpacket() sends the packets in a lossy_queue with. */
+typedef struct {
+    Net_Crypto *c;
+    int crypt_connection_id;
+} Lossy_Sender;
+
+/* Takes conn->mutex once, only to read the packet numbers and take a nonce. */
+static void send_queued_lossy_packet(void *object, const uint8_t *data, uint16_t length)
+{
+    const Lossy_Sender *sender = object;
+    Crypto_Connection *conn = get_crypto_connection(sender->c, sender->crypt_connection_id);
+    uint8_t nonce[crypto_box_NONCEBYTES];
+
+    pthread_mutex_lock(&conn->mutex);
+    uint32_t buffer_start = conn->recv_array.buffer_start;
+    uint32_t buffer_end = conn->send_array.buffer_end;
+    take_sent_nonce(conn, nonce);
+    pthread_mutex_unlock(&conn->mutex);
+
+    uint8_t packet[MAX_CRYPTO_PACKET_SIZE];
+    uint16_t plain_length = fill_data_packet(packet, buffer_start, buffer_end, data, length);
+    send_data_packet_nonce(sender->c, sender->crypt_connection_id, nonce, packet, plain_length);
+}
 
 /* Ratio of recv queue size / recv packet rate (in seconds) times
  * the number of ms between request packets to send at that ratio
  */
 #define REQUEST_PACKETS_COMPARE_CONSTANT (0.125 * 100.0)
 
-/* Timeout for increasing speed after congestion event (in ms). */
-#define CONGESTION_EVENT_TIMEOUT 1000
-
-/* If the send queue is SEND_QUEUE_RATIO times larger than the
- * calculated link speed the packet send speed will be reduced
- * by a value depending on this number.
- */
-#define SEND_QUEUE_RATIO 2.0
-
 static void send_crypto_packets(Net_Crypto *c)
 {
     uint32_t i;
     uint64_t temp_time = current_time_monotonic();
     double total_send_rate = 0;
     uint32_t peak_request_packet_interval = ~0;
+    uint32_t coalesce_sleep_time = ~0;
 
     for (i = 0; i < c->crypto_connections_length; ++i) {
         Crypto_Connection *conn = get_crypto_connection(c, i);
@@ -2307,6 +3589,9 @@ static void send_crypto_packets(Net_Crypto *c)
             send_temp_packet(c, i);
         }
 
+        Lossy_Sender sender = {c, i};
+        send_queue_send_left(conn->lossy_queue, &send_queued_lossy_packet, &sender);
+
         if ((conn->status == CRYPTO_CONN_NOT_CONFIRMED || conn->status == CRYPTO_CONN_ESTABLISHED)
                 && ((CRYPTO_SEND_PACKET_INTERVAL) + conn->last_request_packet_sent) < temp_time) {
             if (send_request_packet(c, i) == 0) {
@@ -2314,6 +3599,12 @@ static void send_crypto_packets(Net_Crypto *c)
             }
         }
 
+        /* Give back the memory of packet arrays that emptied out. */
+        pthread_mutex_lock(&conn->mutex);
+        packets_array_shrink(&conn->send_array);
+        packets_array_shrink(&conn->recv_array);
+        pthread_mutex_unlock(&conn->mutex);
+
         if (conn->status == CRYPTO_CONN_ESTABLISHED) {
             if (conn->packet_recv_rate > CRYPTO_PACKET_MIN_RATE) {
                 double request_packet_interval = (REQUEST_PACKETS_COMPARE_CONSTANT / (((double)num_packets_array(
@@ -2359,86 +3650,8 @@ static void send_crypto_packets(Net_Crypto *c)
                 uint32_t packets_resent = conn->packets_resent;
                 conn->packets_resent = 0;
 
-                /* conjestion control
-                    calculate a new value of conn->packet_send_rate based on some data
-                 */
-
-                unsigned int pos = conn->last_sendqueue_counter % CONGESTION_QUEUE_ARRAY_SIZE;
-                conn->last_sendqueue_size[pos] = num_packets_array(&conn->send_array);
-                ++conn->last_sendqueue_counter;
-
-                unsigned int j;
-                long signed int sum = 0;
-                sum = (long signed int)conn->last_sendqueue_size[(pos) % CONGESTION_QUEUE_ARRAY_SIZE] -
-                      (long signed int)conn->last_sendqueue_size[(pos - (CONGESTION_QUEUE_ARRAY_SIZE - 1)) % CONGESTION_QUEUE_ARRAY_SIZE];
-
-                unsigned int n_p_pos = conn->last_sendqueue_counter % CONGESTION_LAST_SENT_ARRAY_SIZE;
-                conn->last_num_packets_sent[n_p_pos] = packets_sent;
-                conn->last_num_packets_resent[n_p_pos] = packets_resent;
-
-                _Bool direct_connected = 0;
-                crypto_connection_status(c, i, &direct_connected, NULL);
-
-                if (direct_connected && conn->last_tcp_sent + CONGESTION_EVENT_TIMEOUT > temp_time) {
-                    /* When switching from TCP to UDP, don't change the packet send rate for CONGESTION_EVENT_TIMEOUT ms. */
-                } else {
-                    long signed int total_sent = 0, total_resent = 0;
-
-                    //TODO use real delay
-                    unsigned int delay = (unsigned int)((conn->rtt_time / PACKET_COUNTER_AVERAGE_INTERVAL) + 0.5);
-                    unsigned int packets_set_rem_array = (CONGESTION_LAST_SENT_ARRAY_SIZE - CONGESTION_QUEUE_ARRAY_SIZE);
-
-                    if (delay > packets_set_rem_array) {
-                        delay = packets_set_rem_array;
-                    }
-
-                    for (j = 0; j < CONGESTION_QUEUE_ARRAY_SIZE; ++j) {
-                        unsigned int ind = (j + (packets_set_rem_array  - delay) + n_p_pos) % CONGESTION_LAST_SENT_ARRAY_SIZE;
-                        total_sent += conn->last_num_packets_sent[ind];
-                        total_resent += conn->last_num_packets_resent[ind];
-                    }
-
-                    if (sum > 0) {
-                        total_sent -= sum;
-                    } else {
-                        if (total_resent > -sum) {
-                            total_resent = -sum;
-                        }
-                    }
-
-                    /* if queue is too big only allow resending packets. */
-                    uint32_t npackets = num_packets_array(&conn->send_array);
-                    double min_speed = 1000.0 * (((double)(total_sent)) / ((double)(CONGESTION_QUEUE_ARRAY_SIZE) *
-                                                 PACKET_COUNTER_AVERAGE_INTERVAL));
-
-                    double min_speed_request = 1000.0 * (((double)(total_sent + total_resent)) / ((double)(
-                            CONGESTION_QUEUE_ARRAY_SIZE) * PACKET_COUNTER_AVERAGE_INTERVAL));
-
-                    if (min_speed < CRYPTO_PACKET_MIN_RATE) {
-                        min_speed = CRYPTO_PACKET_MIN_RATE;
-                    }
-
-                    double send_array_ratio = (((double)npackets) / min_speed);
-
-                    //TODO: Improve formula?
-                    if (send_array_ratio > SEND_QUEUE_RATIO && CRYPTO_MIN_QUEUE_LENGTH < npackets) {
-                        conn->packet_send_rate = min_speed * (1.0 / (send_array_ratio / SEND_QUEUE_RATIO));
-                    } else if (conn->last_congestion_event + CONGESTION_EVENT_TIMEOUT < temp_time) {
-                        conn->packet_send_rate = min_speed * 1.2;
-                    } else {
-                        conn->packet_send_rate = min_speed * 0.9;
-                    }
-
-                    conn->packet_send_rate_requested = min_speed_request * 1.2;
-
-                    if (conn->packet_send_rate < CRYPTO_PACKET_MIN_RATE) {
-                        conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
-                    }
-
-                    if (conn->packet_send_rate_requested < conn->packet_send_rate) {
-                        conn->packet_send_rate_requested = conn->packet_send_rate;
-                    }
-                }
+                const Congestion_Control *controller = &congestion_controllers[conn->congestion_controller];
+                controller->on_tick(c, i, packets_sent, packets_resent, temp_time);
             }
 
             if (conn->last_packets_left_set == 0 || conn->last_packets_left_requested_set == 0) {
@@ -2481,11 +3694,62 @@ static void send_crypto_packets(Net_Crypto *c)
                 }
             }
 
+            if (conn->congestion_window != 0) {
+                uint32_t npackets = conn->send_array.num_stored;
+                uint32_t window_left = conn->congestion_window > npackets ? conn->congestion_window - npackets : 0;
+
+                if (conn->packets_left > window_left) {
+                    conn->packets_left = window_left;
+                }
+            }
+
+            pthread_mutex_lock(&conn->mutex);
+            _Bool coalescing = conn->coalesce_packet != NULL;
+            _Bool waiting_ack = conn->send_array.num_stored != 0;
+            uint64_t coalesce_time = conn->coalesce_time;
+            pthread_mutex_unlock(&conn->mutex);
+
+            if (coalescing) {
+                if (!waiting_ack || coalesce_time + CRYPTO_COALESCE_DELAY <= temp_time) {
+                    flush_coalesced_packets(c, i);
+                } else if (coalesce_time + CRYPTO_COALESCE_DELAY - temp_time < coalesce_sleep_time) {
+                    coalesce_sleep_time = coalesce_time + CRYPTO_COALESCE_DELAY - temp_time;
+                }
+            }
+
+            /* Peers that send SACK packets ack quickly enough for per packet
+             * retransmission timers, only used on direct UDP as the TCP
+             * relays never lose packets. */
+            uint64_t current_time = unix_time();
+
+            if (conn->version_acked && conn->rto != 0
+                    && ((UDP_DIRECT_TIMEOUT + conn->direct_lastrecv_timev4) > current_time
+                        || (UDP_DIRECT_TIMEOUT + conn->direct_lastrecv_timev6) > current_time)) {
+                pthread_mutex_lock(&conn->mutex);
+                uint32_t timed_out = retransmit_timed_out_packets(&conn->send_array, conn->rto, temp_time);
+                pthread_mutex_unlock(&conn->mutex);
+
+                if (timed_out != 0) {
+                    conn->rto *= 2;
+
+                    if (conn->rto > CRYPTO_MAX_RTO) {
+                        conn->rto = CRYPTO_MAX_RTO;
+                    }
+                }
+            }
+
             int ret = send_requested_packets(c, i, conn->packets_left_requested);
 
+            if (ret > 0 && congestion_controllers[conn->congestion_controller].on_loss) {
+                congestion_controllers[conn->congestion_controller].on_loss(conn, ret, temp_time);
+            }
+
             if (ret != -1) {
                 conn->packets_left_requested -= ret;
                 conn->packets_resent += ret;
+                pthread_mutex_lock(&conn->mutex);
+                conn->total_packets_resent += ret;
+                pthread_mutex_unlock(&conn->mutex);
 
                 if ((unsigned int)ret < conn->packets_left) {
                     conn->packets_left -= ret;
@@ -2521,6 +3785,11 @@ static void send_crypto_packets(Net_Crypto *c)
     if (c->current_sleep_time > sleep_time) {
         c->current_sleep_time = sleep_time;
     }
+
+    /* Wake up in time to send coalesced packets. */
+    if (c->current_sleep_time > coalesce_sleep_time) {
+        c->current_sleep_time = coalesce_sleep_time;
+    }
 }
 
 /* Return 1 if max speed was reached for this connection (no more data can be physically through the pipe).
@@ -2551,6 +3820,13 @@ uint32_t crypto_num_free_sendqueue_slots(const Net_Crypto *c, int crypt_connecti
     return max_packets;
 }
 
+/* Set whether the connections made from now on coalesce lossless packets.
+ */
+void net_crypto_coalesce_packets(Net_Crypto *c, _Bool coalesce)
+{
+    c->coalesce = coalesce;
+}
+
 /* Sends a lossless cryptopacket.
  *
  * return -1 if data could not be put in packet queue.
@@ -2587,6 +3863,24 @@ int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
         return -1;
     }
 
+    if (conn->coalesce && conn->peer_version >= 2 && length <= CRYPTO_COALESCE_MAX_LENGTH) {
+        /* If the last packet send failed, try to send it again before any
+         * coalesced packet. */
+        reset_max_speed_reached(c, crypt_connection_id);
+
+        Packet_Data flushed;
+        uint32_t flushed_num;
+        int64_t ret = coalesce_lossless_packet(c, conn, data, length, &flushed, &flushed_num);
+
+        if (flushed.length != 0) {
+            send_coalesced_packet(c, conn, crypt_connection_id, flushed_num, &flushed);
+        }
+
+        if (ret != -2) {
+            return ret;
+        }
+    }
+
     int64_t ret = send_lossless_packet(c, crypt_connection_id, data, length, congestion_control);
 
     if (ret == -1) {
@@ -2631,6 +3925,10 @@ int cryptpacket_received(Net_Crypto *c, int crypt_connection_id, uint32_t packet
  * return 0 on success.
  *
  * Sends a lossy cryptopacket. (first byte must in the PACKET_ID_LOSSY_RANGE_*)
+ *
+ * Any number of threads can send lossy packets on a connection at the same
+ * time, they go through its lossy_queue: if another thread is sending one the
+ * packet is left to it and this returns right away.
  */
 int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
 {
@@ -2646,25 +3944,18 @@ int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
         return -1;
     }
 
-    pthread_mutex_lock(&c->connections_mutex);
-    ++c->connection_use_counter;
-    pthread_mutex_unlock(&c->connections_mutex);
+    use_connections(c);
 
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
     int ret = -1;
 
     if (conn) {
-        pthread_mutex_lock(&conn->mutex);
-        uint32_t buffer_start = conn->recv_array.buffer_start;
-        uint32_t buffer_end = conn->send_array.buffer_end;
-        pthread_mutex_unlock(&conn->mutex);
-        ret = send_data_packet_helper(c, crypt_connection_id, buffer_start, buffer_end, data, length);
+        Lossy_Sender sender = {c, crypt_connection_id};
+        ret = send_queue_add(conn->lossy_queue, data, length, &send_queued_lossy_packet, &sender);
     }
 
-    pthread_mutex_lock(&c->connections_mutex);
-    --c->connection_use_counter;
-    pthread_mutex_unlock(&c->connections_mutex);
+    release_connections(c);
 
     return ret;
 }
@@ -2676,15 +3967,7 @@ int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
  */
 int crypto_kill(Net_Crypto *c, int crypt_connection_id)
 {
-    while (1) { /* TODO: is this really the best way to do this? */
-        pthread_mutex_lock(&c->connections_mutex);
-
-        if (!c->connection_use_counter) {
-            break;
-        }
-
-        pthread_mutex_unlock(&c->connections_mutex);
-    }
+    lock_connections(c);
 
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
@@ -2699,15 +3982,21 @@ int crypto_kill(Net_Crypto *c, int crypt_connection_id)
         kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
         pthread_mutex_unlock(&c->tcp_mutex);
 
-        bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv4, crypt_connection_id);
-        bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv6, crypt_connection_id);
+        key_index_remove(&c->ip_port_index, ip_port_hash(c, &conn->ip_portv4), crypt_connection_id);
+        key_index_remove(&c->ip_port_index, ip_port_hash(c, &conn->ip_portv6), crypt_connection_id);
+        key_index_remove(&c->public_key_index, public_key_hash(c, conn->public_key), crypt_connection_id);
         clear_temp_packet(c, crypt_connection_id);
-        clear_buffer(&conn->send_array);
-        clear_buffer(&conn->recv_array);
+
+        if (conn->coalesce_packet != NULL) {
+            packet_pool_free(c->packet_pool, conn->coalesce_packet);
+        }
+
+        clear_buffer(c->packet_pool, &conn->send_array);
+        clear_buffer(c->packet_pool, &conn->recv_array);
         ret = wipe_crypto_connection(c, crypt_connection_id);
     }
 
-    pthread_mutex_unlock(&c->connections_mutex);
+    unlock_connections(c);
 
     return ret;
 }
@@ -2747,6 +4036,51 @@ unsigned int crypto_connection_status(const Net_Crypto *c, int crypt_connection_
     return conn->status;
 }
 
+/* Fill stats with the current transport statistics of the connection.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int crypto_connection_stats(const Net_Crypto *c, int crypt_connection_id, Crypto_Connection_Stats *stats)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0) {
+        return -1;
+    }
+
+    crypto_connection_status(c, crypt_connection_id, &stats->direct_connected, &stats->online_tcp_relays);
+
+    /* The counters and queues are updated by the threads writing packets too. */
+    pthread_mutex_lock(&conn->mutex);
+
+    if (conn->srtt != 0) {
+        stats->rtt = conn->srtt;
+    } else {
+        stats->rtt = conn->rtt_time;
+    }
+
+    stats->rto = conn->rto;
+    stats->packet_send_rate = conn->packet_send_rate;
+    stats->packet_recv_rate = conn->packet_recv_rate;
+    stats->packets_sent = conn->total_packets_sent;
+    stats->packets_resent = conn->total_packets_resent;
+    stats->packets_received = conn->total_packets_received;
+    stats->send_queue_size = num_packets_array(&conn->send_array);
+    stats->recv_queue_size = conn->recv_array.num_stored;
+    stats->lossy_queue_size = send_queue_size(conn->lossy_queue);
+    uint64_t last_congestion_event = conn->last_congestion_event;
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (last_congestion_event == 0) {
+        stats->time_since_congestion = UINT64_MAX;
+    } else {
+        stats->time_since_congestion = current_time_monotonic() - last_congestion_event;
+    }
+
+    return 0;
+}
+
 void new_keys(Net_Crypto *c)
 {
     crypto_box_keypair(c->self_public_key, c->self_secret_key);
@@ -2808,6 +4142,19 @@ Net_Crypto *new_net_crypto(Logger *log, DHT *dht, TCP_Proxy_Info *proxy_info)
         return NULL;
     }
 
+    temp->packet_pool = new_packet_pool(sizeof(Packet_Data));
+    temp->handshake_queue = calloc(CRYPTO_HANDSHAKE_QUEUE_SIZE, sizeof(Handshake_Request));
+
+    if (temp->packet_pool == NULL || temp->handshake_queue == NULL) {
+        kill_packet_pool(temp->packet_pool);
+        free(temp->handshake_queue);
+        pthread_mutex_destroy(&temp->tcp_mutex);
+        pthread_mutex_destroy(&temp->connections_mutex);
+        kill_tcp_connections(temp->tcp_c);
+        free(temp);
+        return NULL;
+    }
+
     temp->dht = dht;
 
     new_keys(temp);
@@ -2820,7 +4167,7 @@ Net_Crypto *new_net_crypto(Logger *log, DHT *dht, TCP_Proxy_Info *proxy_info)
     networking_registerhandler(dht->net, NET_PACKET_CRYPTO_HS, &udp_handle_packet, temp);
     networking_registerhandler(dht->net, NET_PACKET_CRYPTO_DATA, &udp_handle_packet, temp);
 
-    bs_list_init(&temp->ip_port_list, sizeof(IP_Port), 8);
+    temp->index_seed = random_64b();
 
     return temp;
 }
@@ -2867,6 +4214,61 @@ uint32_t crypto_run_interval(const Net_Crypto *c)
     return c->current_sleep_time;
 }
 
+uint32_t crypto_get_socks(const Net_Crypto *c, sock_t *socks, uint32_t max_socks)
+{
+    if (max_socks == 0) {
+        return 0;
+    }
+
+    if (socks) {
+        socks[0] = c->dht->net->sock;
+        socks += 1;
+    }
+
+    return 1 + tcp_connections_get_socks(c->tcp_c, socks, max_socks - 1);
+}
+
+/* Handle the queued UDP cookie requests and handshakes, as many as
+ * CRYPTO_HANDSHAKE_WORK_RATE allows.
+ */
+static void do_handshake_queue(Net_Crypto *c, void *userdata)
+{
+    uint64_t now = current_time_monotonic() * 1000;
+
+    while (c->handshake_queue_length != 0) {
+        if (!take_token(&c->handshake_work_time, now, HANDSHAKE_WORK_INTERVAL, CRYPTO_HANDSHAKE_QUEUE_SIZE)) {
+            /* Come back when there is work we can do. */
+            uint32_t sleep_time = (c->handshake_work_time + HANDSHAKE_WORK_INTERVAL
+                                   - CRYPTO_HANDSHAKE_QUEUE_SIZE * HANDSHAKE_WORK_INTERVAL - now) / 1000 + 1;
+
+            if (c->current_sleep_time > sleep_time) {
+                c->current_sleep_time = sleep_time;
+            }
+
+            break;
+        }
+
+        Handshake_Request *request = &c->handshake_queue[c->handshake_queue_start];
+        c->handshake_queue_start = (c->handshake_queue_start + 1) % CRYPTO_HANDSHAKE_QUEUE_SIZE;
+        --c->handshake_queue_length;
+        ++c->handshake_stats.handled;
+
+        if (request->data[0] == NET_PACKET_COOKIE_REQUEST) {
+            send_udp_cookie_response(c, request->source, request->data, request->length);
+            continue;
+        }
+
+        /* A connection to the source may have been made since it was queued. */
+        int crypt_connection_id = crypto_id_ip_port(c, request->source);
+
+        if (crypt_connection_id != -1) {
+            handle_packet_connection(c, crypt_connection_id, request->data, request->length, 1, userdata);
+        } else {
+            handle_new_connection_handshake(c, request->source, request->data, request->length, userdata);
+        }
+    }
+}
+
 /* Main loop. */
 void do_net_crypto(Net_Crypto *c, void *userdata)
 {
@@ -2874,6 +4276,7 @@ void do_net_crypto(Net_Crypto *c, void *userdata)
     kill_timedout(c, userdata);
     do_tcp(c, userdata);
     send_crypto_packets(c);
+    do_handshake_queue(c, userdata);
 }
 
 void kill_net_crypto(Net_Crypto *c)
@@ -2888,7 +4291,10 @@ void kill_net_crypto(Net_Crypto *c)
     pthread_mutex_destroy(&c->connections_mutex);
 
     kill_tcp_connections(c->tcp_c);
-    bs_list_free(&c->ip_port_list);
+    kill_packet_pool(c->packet_pool);
+    free(c->handshake_queue);
+    key_index_free(&c->public_key_index);
+    key_index_free(&c->ip_port_index);
     networking_registerhandler(c->dht->net, NET_PACKET_COOKIE_REQUEST, NULL, NULL);
     networking_registerhandler(c->dht->net, NET_PACKET_COOKIE_RESPONSE, NULL, NULL);
     networking_registerhandler(c->dht->net, NET_PACKET_CRYPTO_HS, NULL, NULL);
@@ -28,7 +28,10 @@
 #include "DHT.h"
 #include "LAN_discovery.h"
 #include "TCP_connection.h"
+#include "key_index.h"
 #include "logger.h"
+#include "packet_pool.h"
+#include "send_queue.h"
 
 #define CRYPTO_CONN_NO_CONNECTION 0
 #define CRYPTO_CONN_COOKIE_REQUESTING 1 //send cookie request packets
@@ -39,6 +42,10 @@
 /* Maximum size of receiving and sending packet buffers. */
 #define CRYPTO_PACKET_BUFFER_SIZE 32768 /* Must be a power of 2 */
 
+/* Packet buffers are allocated with this size when the first packet is put in
+ * them, doubled when they fill up and halved again when mostly empty. */
+#define CRYPTO_MIN_PACKET_BUFFER_SIZE 16 /* Must be a power of 2 */
+
 /* Minimum packet rate per second. */
 #define CRYPTO_PACKET_MIN_RATE 4.0
 
@@ -66,6 +73,50 @@
 #define PACKET_ID_PADDING 0 /* Denotes padding */
 #define PACKET_ID_REQUEST 1 /* Used to request unreceived packets */
 #define PACKET_ID_KILL    2 /* Used to kill connection */
+#define PACKET_ID_VERSION 3 /* Used to tell the other our CRYPTO_PROTOCOL_VERSION */
+#define PACKET_ID_SACK    4 /* Used instead of request packets with peers of version 1 or later */
+#define PACKET_ID_COALESCED 5 /* Several lossless packets, each after its length as a 2 byte big endian number */
+
+/* Version of the data packet protocol we speak, sent to the peer in
+ * PACKET_ID_VERSION packets along with the first request packets of a
+ * connection. Peers that don't send one are version 0.
+ *
+ * 0: missing packets are asked for with PACKET_ID_REQUEST packets.
+ * 1: PACKET_ID_SACK packets with a bitmap of the received packets are sent
+ *    to peers of version 1 or later, as soon as packets go missing.
+ * 2: PACKET_ID_COALESCED packets are unpacked, so peers can coalesce the
+ *    lossless packets they send us.
+ */
+#define CRYPTO_PROTOCOL_VERSION 2
+
+/* A packet the peer is missing is sent again once it acked this many packets
+ * sent after it. */
+#define CRYPTO_FAST_RETRANSMIT_THRESHOLD 3
+
+/* Bounds of the retransmission timeout in ms. */
+#define CRYPTO_MIN_RTO 200
+#define CRYPTO_MAX_RTO 3000
+
+/* Min interval in ms between SACK packets sent because packets went missing. */
+#define CRYPTO_SACK_INTERVAL 10
+
+/* Lossless packets up to this long are coalesced on connections that do it,
+ * waiting at most CRYPTO_COALESCE_DELAY ms for others to go with. */
+#define CRYPTO_COALESCE_MAX_LENGTH 256
+#define CRYPTO_COALESCE_DELAY 10
+
+/* Lossy packets any thread can have waiting to be sent on a connection. */
+#define CRYPTO_SEND_QUEUE_SIZE 256
+
+/* Cookie requests and handshakes from sources we have no connection with are
+ * let through at most CRYPTO_HANDSHAKE_RATE per second per source, in bursts
+ * of up to CRYPTO_HANDSHAKE_BURST. UDP ones are then queued, at most
+ * CRYPTO_HANDSHAKE_QUEUE_SIZE of them, and handled by do_net_crypto() at most
+ * CRYPTO_HANDSHAKE_WORK_RATE per second in total. */
+#define CRYPTO_HANDSHAKE_RATE 4
+#define CRYPTO_HANDSHAKE_BURST 8
+#define CRYPTO_HANDSHAKE_QUEUE_SIZE 64
+#define CRYPTO_HANDSHAKE_WORK_RATE 1000
 
 /* Packet ids 0 to CRYPTO_RESERVED_PACKETS - 1 are reserved for use by net_crypto. */
 #define CRYPTO_RESERVED_PACKETS 16
@@ -84,6 +135,17 @@
 #define CONGESTION_QUEUE_ARRAY_SIZE 12
 #define CONGESTION_LAST_SENT_ARRAY_SIZE (CONGESTION_QUEUE_ARRAY_SIZE * 2)
 
+/* Congestion controllers a connection can use, see net_crypto_congestion_control(). */
+#define CRYPTO_CONGESTION_CLASSIC 0 /* Send queue size based, the default. */
+#define CRYPTO_CONGESTION_BBR     1 /* Bottleneck bandwidth and round trip time based. */
+#define CRYPTO_CONGESTION_NUM     2
+
+/* A delivery rate is measured over this many dT by the BBR controller, as
+   the peer only acks packets in its request packets. The bottleneck bandwidth
+   is the highest one in the last CONGESTION_BBR_BW_ROUNDS round trips. */
+#define CONGESTION_BBR_RATE_INTERVAL 4
+#define CONGESTION_BBR_BW_ROUNDS 10
+
 /* Default connection ping in ms. */
 #define DEFAULT_PING_CONNECTION 1000
 #define DEFAULT_TCP_PING_CONNECTION 500
@@ -91,15 +153,39 @@
 typedef struct {
     uint64_t sent_time;
     uint16_t length;
+    uint8_t resent; /* 1 if the peer requested it again, which makes its rtt ambiguous. */
     uint8_t data[MAX_CRYPTO_DATA_SIZE];
 } Packet_Data;
 
 typedef struct {
-    Packet_Data *buffer[CRYPTO_PACKET_BUFFER_SIZE];
+    Packet_Data **buffer; /* capacity slots, NULL when capacity is 0 */
+    uint32_t  capacity; /* 0 or a power of 2 up to CRYPTO_PACKET_BUFFER_SIZE */
     uint32_t  buffer_start;
     uint32_t  buffer_end; /* packet numbers in array: {buffer_start, buffer_end) */
+    uint32_t  num_stored; /* packets in array, fewer than in the range when some are missing or acked */
+    uint64_t  oldest_sent_time; /* no more than the sent_time of any sent packet in array, 0 if none are */
 } Packets_Array;
 
+/* State of the BBR congestion controller of a connection. */
+typedef struct {
+    uint8_t mode; /* startup, drain, probe bandwidth or probe rtt */
+    uint32_t delivered[CONGESTION_BBR_RATE_INTERVAL]; /* Packets acked in each dT. */
+    uint64_t delivered_time[CONGESTION_BBR_RATE_INTERVAL]; /* Time each dT started. */
+    uint32_t delivered_counter;
+    double round_bw[CONGESTION_BBR_BW_ROUNDS]; /* Highest delivery rate of each round in packets per second. */
+    uint32_t round_counter;
+    uint64_t round_start;
+    double max_bw; /* Highest of round_bw. */
+    double full_bw; /* Bandwidth startup last grew to. */
+    uint8_t full_bw_count; /* Rounds since startup last grew the bandwidth. */
+    uint64_t min_rtt; /* Lowest rtt since min_rtt_time, 0 if none. */
+    uint64_t min_rtt_time;
+    uint64_t probe_rtt_done;
+    uint8_t cycle_index; /* Phase of the gain cycle of probe bandwidth mode. */
+    uint64_t cycle_start;
+    uint32_t cycle_delivered, cycle_lost;
+} Congestion_BBR;
+
 typedef struct {
     uint8_t public_key[crypto_box_PUBLICKEYBYTES]; /* The real public key of the peer. */
     uint8_t recv_nonce[crypto_box_NONCEBYTES]; /* Nonce of received packets. */
@@ -128,6 +214,9 @@ typedef struct {
 
     uint64_t last_tcp_sent; /* Time the last TCP packet was sent. */
 
+    /* Lossless packets can be sent from any thread, so send_array is only
+     * touched with mutex held: adding to it can grow its buffer and the
+     * net_crypto thread frees acked packets and shrinks it. */
     Packets_Array send_array;
     Packets_Array recv_array;
 
@@ -167,18 +256,58 @@ typedef struct {
     uint64_t last_congestion_event;
     uint64_t rtt_time;
 
+    uint64_t srtt, rttvar; /* Smoothed rtt and its variation in ms, 0 before the first sample. */
+    uint64_t rto; /* Time in ms after which a packet not acked by a peer that sends SACK packets is sent again. */
+
+    /* Lossless packets since the connection was made, see crypto_connection_stats(). */
+    uint64_t total_packets_sent, total_packets_resent, total_packets_received;
+
+    uint8_t peer_version; /* CRYPTO_PROTOCOL_VERSION of the peer, 0 until it sends one. */
+    _Bool version_acked; /* The peer sent a SACK packet, so it knows our version. */
+    uint8_t version_packets_sent;
+
+    uint8_t congestion_controller; /* CRYPTO_CONGESTION_* */
+    uint32_t congestion_window; /* Max packets not acked yet to send new ones, 0 for no limit. */
+    Congestion_BBR bbr;
+
+    /* Small lossless packets waiting to be sent together, as a
+     * PACKET_ID_COALESCED packet, see net_crypto_coalesce_packets(). The
+     * packet is taken from the packet pool when the first of them is written.
+     * Only touched with mutex held. */
+    _Bool coalesce;
+    Packet_Data *coalesce_packet; /* NULL if none are waiting. */
+    uint16_t coalesce_num;
+    uint64_t coalesce_time; /* When the first of them was written. */
+
     /* TCP_connection connection_number */
     unsigned int connection_number_tcp;
 
     uint8_t maximum_speed_reached;
 
     pthread_mutex_t mutex;
+    Send_Queue *lossy_queue; /* Kept, like mutex, until the connection is realloced out. */
 
     void (*dht_pk_callback)(void *data, int32_t number, const uint8_t *dht_public_key, void *userdata);
     void *dht_pk_callback_object;
     uint32_t dht_pk_callback_number;
 } Crypto_Connection;
 
+typedef struct {
+    uint64_t rtt; /* Round trip time in ms. */
+    uint64_t rto; /* Retransmission timeout in ms, 0 before the first rtt sample. */
+    double packet_send_rate; /* Packets per second. */
+    double packet_recv_rate;
+    uint64_t packets_sent; /* New lossless packets sent. */
+    uint64_t packets_resent;
+    uint64_t packets_received; /* New lossless packets received. */
+    uint32_t send_queue_size; /* Lossless packets not acked yet. */
+    uint32_t recv_queue_size; /* Lossless packets waiting for the ones before them. */
+    uint32_t lossy_queue_size;
+    uint64_t time_since_congestion; /* In ms, UINT64_MAX if there was none. */
+    _Bool direct_connected;
+    unsigned int online_tcp_relays;
+} Crypto_Connection_Stats;
+
 typedef struct {
     IP_Port source;
     uint8_t public_key[crypto_box_PUBLICKEYBYTES]; /* The real public key of the peer. */
@@ -189,6 +318,16 @@ typedef struct {
     uint8_t cookie_length;
 } New_Connection;
 
+typedef struct Handshake_Request Handshake_Request;
+
+typedef struct {
+    uint64_t queued; /* UDP cookie requests and handshakes queued */
+    uint64_t handled; /* taken out of the queue and handled */
+    uint64_t rate_limited; /* dropped by the per source limit */
+    uint64_t dropped; /* dropped because the queue was full */
+    uint64_t invalid; /* handshakes dropped because their cookie was not ours */
+} Crypto_Handshake_Stats;
+
 typedef struct {
     Logger *log;
 
@@ -198,8 +337,12 @@ typedef struct {
     Crypto_Connection *crypto_connections;
     pthread_mutex_t tcp_mutex;
 
+    /* Threads sending lossy packets only bump connection_use_counter, the
+       ones changing the connections array hold connections_mutex and set
+       connections_resizing while waiting for it to get to 0. */
     pthread_mutex_t connections_mutex;
     unsigned int connection_use_counter;
+    _Bool connections_resizing;
 
     uint32_t crypto_connections_length; /* Length of connections array. */
 
@@ -216,7 +359,34 @@ typedef struct {
     /* The current optimal sleep time */
     uint32_t current_sleep_time;
 
-    BS_LIST ip_port_list;
+    /* Where the Packet_Data in the send and recv arrays of all connections
+     * come from. */
+    Packet_Pool *packet_pool;
+
+    /* Connections by real public key and by the ip_ports in their ip_portv4
+     * and ip_portv6. */
+    /* From the real public key and the ip_ports of connections to their
+     * crypt_connection_id. */
+    Key_Index public_key_index;
+    Key_Index ip_port_index;
+    uint64_t index_seed;
+
+    /* CRYPTO_CONGESTION_* given to new connections. */
+    uint8_t congestion_controller;
+
+    /* Whether new connections coalesce small lossless packets. */
+    _Bool coalesce;
+
+    /* Token buckets of the sources of cookie requests and handshakes. */
+    Key_Index_Sketch handshake_sketch;
+
+    /* Ring of CRYPTO_HANDSHAKE_QUEUE_SIZE UDP cookie requests and handshakes
+     * waiting to be handled, and the token bucket limiting that. */
+    Handshake_Request *handshake_queue;
+    uint32_t handshake_queue_start, handshake_queue_length;
+    uint64_t handshake_work_time;
+
+    Crypto_Handshake_Stats handshake_stats;
 } Net_Crypto;
 
 
@@ -313,6 +483,27 @@ uint32_t crypto_num_free_sendqueue_slots(const Net_Crypto *c, int crypt_connecti
  */
 _Bool max_speed_reached(Net_Crypto *c, int crypt_connection_id);
 
+/* Set the congestion controller (CRYPTO_CONGESTION_*) of the connections
+ * made from now on.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int net_crypto_congestion_control(Net_Crypto *c, uint8_t congestion_controller);
+
+/* Set whether the connections made from now on coalesce lossless packets.
+ *
+ * Lossless packets of at most CRYPTO_COALESCE_MAX_LENGTH bytes written while
+ * others are waiting for an ack are then held back for up to
+ * CRYPTO_COALESCE_DELAY ms and sent together in one packet, if the peer
+ * can unpack them. Coalesced packets share one packet number.
+ */
+void net_crypto_coalesce_packets(Net_Crypto *c, _Bool coalesce);
+
+/* Copy the counters of the cookie requests and handshakes from sources we
+ * have no connection with into stats. */
+void net_crypto_get_handshake_stats(const Net_Crypto *c, Crypto_Handshake_Stats *stats);
+
 /* Sends a lossless cryptopacket.
  *
  * return -1 if data could not be put in packet queue.
@@ -392,6 +583,13 @@ int crypto_kill(Net_Crypto *c, int crypt_connection_id);
 unsigned int crypto_connection_status(const Net_Crypto *c, int crypt_connection_id, _Bool *direct_connected,
                                       unsigned int *online_tcp_relays);
 
+/* Fill stats with the current transport statistics of the connection.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int crypto_connection_stats(const Net_Crypto *c, int crypt_connection_id, Crypto_Connection_Stats *stats);
+
 /* Generate our public and private keys.
  *  Only call this function the first time the program starts.
  */
@@ -416,6 +614,15 @@ Net_Crypto *new_net_crypto(Logger *log, DHT *dht, TCP_Proxy_Info *proxy_info);
  */
 uint32_t crypto_run_interval(const Net_Crypto *c);
 
+/* Put the sockets do_net_crypto() and networking_poll() read from (the DHT's
+ * UDP socket and the TCP relay connections) in socks.
+ *
+ * If socks is NULL they are only counted.
+ *
+ * return the number of sockets put in socks (at most max_socks).
+ */
+uint32_t crypto_get_socks(const Net_Crypto *c, sock_t *socks, uint32_t max_socks);
+
 /* Main loop. */
 void do_net_crypto(Net_Crypto *c, void *userdata);
 
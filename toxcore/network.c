@@ -25,6 +25,11 @@
 #define _WIN32_WINNT  0x501
 #endif
 
+/* recvmmsg() is a GNU extension. */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -33,6 +38,8 @@
 
 #if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
 #endif
 
 #ifdef __APPLE__
@@ -43,6 +50,28 @@
 #include "network.h"
 #include "util.h"
 
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define USE_RECVMMSG
+#define USE_SENDMMSG
+#endif
+
+#ifdef USE_SENDMMSG
+#include <netinet/udp.h>
+
+#ifdef UDP_SEGMENT
+#define USE_UDP_GSO
+#endif
+
+/* Kernel limits for a single UDP GSO send. */
+#define MAX_GSO_SEGMENTS 64
+#define MAX_GSO_SIZE 65000
+
+typedef union {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+} Gso_Control;
+#endif
+
 #if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
 
 static const char *inet_ntop(sa_family_t family, void *addr, char *buf, size_t bufsize)
@@ -183,6 +212,21 @@ int set_socket_reuseaddr(sock_t sock)
     return (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)&set, sizeof(set)) == 0);
 }
 
+/* Enable SO_REUSEPORT on socket.
+ *
+ * return 1 on success
+ * return 0 on failure
+ */
+int set_socket_reuseport(sock_t sock)
+{
+#ifdef SO_REUSEPORT
+    int set = 1;
+    return (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void *)&set, sizeof(set)) == 0);
+#else
+    return 0;
+#endif
+}
+
 /* Set socket to dual (IPv4 + IPv6 socket)
  *
  * return 1 on success
@@ -297,28 +341,24 @@ static void loglogdata(Logger *log, const char *message, const uint8_t *buffer,
 }
 
 
-/* Basic network functions:
- * Function to send packet(data) of length length to ip_port.
+/* Fill addr with the socket address to send to ip_port from net's socket.
+ *
+ * return size of the address on success.
+ * return 0 if ip_port can't be reached from this socket.
  */
-int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+static size_t ip_port_to_sockaddr(const Networking_Core *net, IP_Port ip_port, struct sockaddr_storage *addr)
 {
-    if (net->family == 0) { /* Socket not initialized */
-        return -1;
-    }
-
     /* socket AF_INET, but target IP NOT: can't send */
     if ((net->family == AF_INET) && (ip_port.ip.family != AF_INET)) {
-        return -1;
+        return 0;
     }
 
-    struct sockaddr_storage addr;
-
     size_t addrsize = 0;
 
     if (ip_port.ip.family == AF_INET) {
         if (net->family == AF_INET6) {
             /* must convert to IPV4-in-IPV6 address */
-            struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+            struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
 
             addrsize = sizeof(struct sockaddr_in6);
             addr6->sin6_family = AF_INET6;
@@ -337,7 +377,7 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
             addr6->sin6_flowinfo = 0;
             addr6->sin6_scope_id = 0;
         } else {
-            struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
+            struct sockaddr_in *addr4 = (struct sockaddr_in *)addr;
 
             addrsize = sizeof(struct sockaddr_in);
             addr4->sin_family = AF_INET;
@@ -345,7 +385,7 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
             addr4->sin_port = ip_port.port;
         }
     } else if (ip_port.ip.family == AF_INET6) {
-        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)addr;
 
         addrsize = sizeof(struct sockaddr_in6);
         addr6->sin6_family = AF_INET6;
@@ -354,11 +394,349 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
 
         addr6->sin6_flowinfo = 0;
         addr6->sin6_scope_id = 0;
-    } else {
-        /* unknown address type*/
+    }
+
+    /* unknown address type gives 0 */
+    return addrsize;
+}
+
+struct Send_Queue {
+    pthread_mutex_t mutex;
+
+    uint16_t size;
+    uint16_t count;
+
+    uint8_t (*data)[MAX_UDP_PACKET_SIZE];
+    uint16_t *length;
+    IP_Port *ip_port;
+    struct sockaddr_storage *addrs;
+    size_t *addrsize;
+
+#ifdef USE_SENDMMSG
+    /* Set to 0 if the kernel turns out not to support sendmmsg() or UDP GSO. */
+    uint8_t use_sendmmsg;
+    uint8_t use_gso;
+
+    struct mmsghdr *msgs;
+    struct iovec *iovecs;
+    Gso_Control *control;
+#endif
+};
+
+static void kill_send_queue(Send_Queue *queue)
+{
+    if (!queue) {
+        return;
+    }
+
+    pthread_mutex_destroy(&queue->mutex);
+    free(queue->data);
+    free(queue->length);
+    free(queue->ip_port);
+    free(queue->addrs);
+    free(queue->addrsize);
+#ifdef USE_SENDMMSG
+    free(queue->msgs);
+    free(queue->iovecs);
+    free(queue->control);
+#endif
+    free(queue);
+}
+
+static Send_Queue *new_send_queue(sock_t sock, uint16_t size)
+{
+    Send_Queue *queue = calloc(1, sizeof(Send_Queue));
+
+    if (!queue) {
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&queue->mutex, NULL) != 0) {
+        free(queue);
+        return NULL;
+    }
+
+    queue->size = size;
+    queue->data = malloc(size * sizeof(*queue->data));
+    queue->length = calloc(size, sizeof(uint16_t));
+    queue->ip_port = calloc(size, sizeof(IP_Port));
+    queue->addrs = calloc(size, sizeof(struct sockaddr_storage));
+    queue->addrsize = calloc(size, sizeof(size_t));
+
+    if (!queue->data || !queue->length || !queue->ip_port || !queue->addrs || !queue->addrsize) {
+        kill_send_queue(queue);
+        return NULL;
+    }
+
+#ifdef USE_SENDMMSG
+    queue->use_sendmmsg = 1;
+    queue->msgs = calloc(size, sizeof(struct mmsghdr));
+    queue->iovecs = calloc(size, sizeof(struct iovec));
+    queue->control = calloc(size, sizeof(Gso_Control));
+
+    if (!queue->msgs || !queue->iovecs || !queue->control) {
+        kill_send_queue(queue);
+        return NULL;
+    }
+
+#ifdef USE_UDP_GSO
+    /* Kernels without UDP GSO don't know the option. */
+    int gso_size = 0;
+    socklen_t optlen = sizeof(gso_size);
+    queue->use_gso = getsockopt(sock, IPPROTO_UDP, UDP_SEGMENT, &gso_size, &optlen) == 0;
+#endif
+
+#endif
+    return queue;
+}
+
+/* Account for one flush of count datagrams with num_syscalls syscalls. */
+static void send_stats_add_flush(Net_Send_Stats *stats, uint16_t count, uint16_t num_syscalls)
+{
+    stats->packets += count;
+    stats->syscalls += num_syscalls;
+    ++stats->flushes;
+    stats->last_flush_packets = count;
+    stats->last_flush_syscalls = num_syscalls;
+}
+
+static void send_queued_packet(Networking_Core *net, const Send_Queue *queue, uint16_t i)
+{
+    int res = sendto(net->sock, (const char *) queue->data[i], queue->length[i], 0,
+                     (const struct sockaddr *)&queue->addrs[i], queue->addrsize[i]);
+    loglogdata(net->log, "O=>", queue->data[i], queue->length[i], queue->ip_port[i], res);
+}
+
+#ifdef USE_SENDMMSG
+/* Can datagram j be sent as another GSO segment of the message starting at datagram i? */
+static bool gso_can_append(const Send_Queue *queue, uint16_t i, uint16_t j)
+{
+    if (j - i >= MAX_GSO_SEGMENTS || queue->length[j - 1] != queue->length[i] || queue->length[j] > queue->length[i]) {
+        return 0;
+    }
+
+    if ((uint32_t)(j - i + 1) * queue->length[i] > MAX_GSO_SIZE) {
+        return 0;
+    }
+
+    return queue->addrsize[i] == queue->addrsize[j] && memcmp(&queue->addrs[i], &queue->addrs[j], queue->addrsize[i]) == 0;
+}
+
+/* Flush the queue with sendmmsg(), coalescing runs of datagrams to the same
+ * destination into single GSO messages where possible.
+ *
+ * return number of syscalls made.
+ * return -1 if sendmmsg() is not supported, nothing was sent in that case.
+ */
+static int flush_send_queue_mmsg(Networking_Core *net, Send_Queue *queue)
+{
+    uint16_t num_msgs = 0;
+    uint16_t i = 0;
+
+    while (i < queue->count) {
+        uint16_t j = i + 1;
+
+        if (queue->use_gso) {
+            while (j < queue->count && gso_can_append(queue, i, j)) {
+                ++j;
+            }
+        }
+
+        struct msghdr *hdr = &queue->msgs[num_msgs].msg_hdr;
+        memset(hdr, 0, sizeof(struct msghdr));
+        hdr->msg_name = &queue->addrs[i];
+        hdr->msg_namelen = queue->addrsize[i];
+        hdr->msg_iov = &queue->iovecs[i];
+        hdr->msg_iovlen = j - i;
+
+        uint16_t k;
+
+        for (k = i; k < j; ++k) {
+            queue->iovecs[k].iov_base = queue->data[k];
+            queue->iovecs[k].iov_len = queue->length[k];
+        }
+
+#ifdef USE_UDP_GSO
+
+        if (j - i > 1) {
+            hdr->msg_control = queue->control[num_msgs].buf;
+            hdr->msg_controllen = sizeof(queue->control[num_msgs].buf);
+
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+            cmsg->cmsg_level = IPPROTO_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t gso_size = queue->length[i];
+            memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+        }
+
+#endif
+        ++num_msgs;
+        i = j;
+    }
+
+    int num_syscalls = 0;
+    uint16_t sent = 0;
+
+    while (sent < num_msgs) {
+        int res = sendmmsg(net->sock, &queue->msgs[sent], num_msgs - sent, 0);
+        ++num_syscalls;
+
+        if (res < 0 && errno == ENOSYS && sent == 0) {
+            return -1;
+        }
+
+        uint16_t msgs_done = res > 0 ? res : 1;
+        uint16_t m, k;
+
+        for (m = sent; m < sent + msgs_done; ++m) {
+            const struct msghdr *hdr = &queue->msgs[m].msg_hdr;
+            uint16_t first = hdr->msg_iov - queue->iovecs;
+
+            if (res < 0 && hdr->msg_iovlen > 1 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+                /* The kernel or the NIC refused the GSO message: resend its datagrams one by one. */
+                LOGGER_WARNING(net->log, "UDP GSO send failed (%u, %s), disabling it", errno, strerror(errno));
+                queue->use_gso = 0;
+
+                for (k = first; k < first + hdr->msg_iovlen; ++k) {
+                    send_queued_packet(net, queue, k);
+                    ++num_syscalls;
+                }
+
+                continue;
+            }
+
+            for (k = first; k < first + hdr->msg_iovlen; ++k) {
+                loglogdata(net->log, "O=>", queue->data[k], queue->length[k], queue->ip_port[k],
+                           res < 0 ? -1 : queue->length[k]);
+            }
+        }
+
+        /* sendmmsg() only fails if the first message failed; skip it and carry on. */
+        sent += msgs_done;
+    }
+
+    return num_syscalls;
+}
+#endif
+
+/* Send everything in net's transmit queue. Queue mutex must be held. */
+static void flush_send_queue(Networking_Core *net)
+{
+    Send_Queue *queue = net->send_queue;
+
+    if (queue->count == 0) {
+        return;
+    }
+
+    int num_syscalls = -1;
+
+#ifdef USE_SENDMMSG
+
+    if (queue->use_sendmmsg) {
+        num_syscalls = flush_send_queue_mmsg(net, queue);
+
+        if (num_syscalls == -1) {
+            LOGGER_WARNING(net->log, "sendmmsg() not supported, falling back to sendto()");
+            queue->use_sendmmsg = 0;
+        }
+    }
+
+#endif
+
+    if (num_syscalls == -1) {
+        uint16_t i;
+
+        for (i = 0; i < queue->count; ++i) {
+            send_queued_packet(net, queue, i);
+        }
+
+        num_syscalls = queue->count;
+    }
+
+    send_stats_add_flush(&net->send_stats, queue->count, num_syscalls);
+    queue->count = 0;
+}
+
+void networking_flush(Networking_Core *net)
+{
+    Send_Queue *queue = net->send_queue;
+
+    if (!queue) {
+        return;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    flush_send_queue(net);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+int networking_set_send_batch(Networking_Core *net, uint16_t batch_size)
+{
+    if (batch_size > MAX_SEND_BATCH_SIZE) {
+        return -1;
+    }
+
+    Send_Queue *queue = NULL;
+
+    if (batch_size > 1) {
+        queue = new_send_queue(net->sock, batch_size);
+
+        if (!queue) {
+            return -1;
+        }
+    }
+
+    networking_flush(net);
+    kill_send_queue(net->send_queue);
+    net->send_queue = queue;
+    return 0;
+}
+
+/* Basic network functions:
+ * Function to send packet(data) of length length to ip_port.
+ */
+int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    if (net->family == 0) { /* Socket not initialized */
+        return -1;
+    }
+
+    struct sockaddr_storage addr;
+
+    size_t addrsize = ip_port_to_sockaddr(net, ip_port, &addr);
+
+    if (addrsize == 0) {
         return -1;
     }
 
+    Send_Queue *queue = net->send_queue;
+
+    if (queue) {
+        pthread_mutex_lock(&queue->mutex);
+
+        if (length <= MAX_UDP_PACKET_SIZE) {
+            uint16_t i = queue->count;
+            memcpy(queue->data[i], data, length);
+            queue->length[i] = length;
+            queue->ip_port[i] = ip_port;
+            memcpy(&queue->addrs[i], &addr, addrsize);
+            queue->addrsize[i] = addrsize;
+            ++queue->count;
+
+            if (queue->count == queue->size) {
+                flush_send_queue(net);
+            }
+
+            pthread_mutex_unlock(&queue->mutex);
+            return length;
+        }
+
+        /* Too big to queue: keep ordering by sending what is queued first. */
+        flush_send_queue(net);
+        pthread_mutex_unlock(&queue->mutex);
+    }
+
     int res = sendto(net->sock, (const char *) data, length, 0, (struct sockaddr *)&addr, addrsize);
 
     loglogdata(net->log, "O=>", data, length, ip_port, res);
@@ -366,6 +744,36 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
     return res;
 }
 
+/* Convert the sender address of a received datagram into an IP_Port.
+ *
+ * return 0 on success.
+ * return -1 if the address family is unknown.
+ */
+static int ip_port_from_sockaddr(const struct sockaddr_storage *addr, IP_Port *ip_port)
+{
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *addr_in = (const struct sockaddr_in *)addr;
+
+        ip_port->ip.family = addr_in->sin_family;
+        ip_port->ip.ip4.in_addr = addr_in->sin_addr;
+        ip_port->port = addr_in->sin_port;
+    } else if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *addr_in6 = (const struct sockaddr_in6 *)addr;
+        ip_port->ip.family = addr_in6->sin6_family;
+        ip_port->ip.ip6.in6_addr = addr_in6->sin6_addr;
+        ip_port->port = addr_in6->sin6_port;
+
+        if (IPV6_IPV4_IN_V6(ip_port->ip.ip6)) {
+            ip_port->ip.family = AF_INET;
+            ip_port->ip.ip4.uint32 = ip_port->ip.ip6.uint32[3];
+        }
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
 /* Function to receive data
  *  ip and port of sender is put into ip_port.
  *  Packet data is put into data.
@@ -394,37 +802,461 @@ static int receivepacket(Logger *log, sock_t sock, IP_Port *ip_port, uint8_t *da
 
     *length = (uint32_t)fail_or_len;
 
-    if (addr.ss_family == AF_INET) {
-        struct sockaddr_in *addr_in = (struct sockaddr_in *)&addr;
+    if (ip_port_from_sockaddr(&addr, ip_port) == -1) {
+        return -1;
+    }
 
-        ip_port->ip.family = addr_in->sin_family;
-        ip_port->ip.ip4.in_addr = addr_in->sin_addr;
-        ip_port->port = addr_in->sin_port;
-    } else if (addr.ss_family == AF_INET6) {
-        struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)&addr;
-        ip_port->ip.family = addr_in6->sin6_family;
-        ip_port->ip.ip6.in6_addr = addr_in6->sin6_addr;
-        ip_port->port = addr_in6->sin6_port;
+    loglogdata(log, "=>O", data, MAX_UDP_PACKET_SIZE, *ip_port, *length);
 
-        if (IPV6_IPV4_IN_V6(ip_port->ip.ip6)) {
-            ip_port->ip.family = AF_INET;
-            ip_port->ip.ip4.uint32 = ip_port->ip.ip6.uint32[3];
+    return 0;
+}
+
+struct Recv_Batch {
+    uint16_t size;
+
+    uint8_t (*data)[MAX_UDP_PACKET_SIZE];
+    uint32_t *length;
+    IP_Port *ip_port;
+
+#ifdef USE_RECVMMSG
+    /* Set to 0 if the kernel turns out not to support recvmmsg(). */
+    uint8_t use_recvmmsg;
+
+    struct mmsghdr *msgs;
+    struct iovec *iovecs;
+    struct sockaddr_storage *addrs;
+#endif
+};
+
+static void kill_recv_batch(Recv_Batch *batch)
+{
+    if (!batch) {
+        return;
+    }
+
+    free(batch->data);
+    free(batch->length);
+    free(batch->ip_port);
+#ifdef USE_RECVMMSG
+    free(batch->msgs);
+    free(batch->iovecs);
+    free(batch->addrs);
+#endif
+    free(batch);
+}
+
+static Recv_Batch *new_recv_batch(uint16_t size)
+{
+    Recv_Batch *batch = calloc(1, sizeof(Recv_Batch));
+
+    if (!batch) {
+        return NULL;
+    }
+
+    batch->size = size;
+    batch->data = malloc(size * sizeof(*batch->data));
+    batch->length = calloc(size, sizeof(uint32_t));
+    batch->ip_port = calloc(size, sizeof(IP_Port));
+
+    if (!batch->data || !batch->length || !batch->ip_port) {
+        kill_recv_batch(batch);
+        return NULL;
+    }
+
+#ifdef USE_RECVMMSG
+    batch->use_recvmmsg = 1;
+    batch->msgs = calloc(size, sizeof(struct mmsghdr));
+    batch->iovecs = calloc(size, sizeof(struct iovec));
+    batch->addrs = calloc(size, sizeof(struct sockaddr_storage));
+
+    if (!batch->msgs || !batch->iovecs || !batch->addrs) {
+        kill_recv_batch(batch);
+        return NULL;
+    }
+
+    uint16_t i;
+
+    for (i = 0; i < size; ++i) {
+        batch->iovecs[i].iov_base = batch->data[i];
+        batch->iovecs[i].iov_len = MAX_UDP_PACKET_SIZE;
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovecs[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+    }
+
+#endif
+    return batch;
+}
+
+#ifdef USE_RECVMMSG
+/* Fill the receive ring with a single recvmmsg() call.
+ *
+ * return number of datagrams received.
+ * return -1 if recvmmsg() is not supported by the kernel.
+ */
+static int fill_recv_batch_mmsg(Logger *log, sock_t sock, Recv_Batch *batch)
+{
+    uint16_t i;
+
+    for (i = 0; i < batch->size; ++i) {
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        batch->msgs[i].msg_hdr.msg_flags = 0;
+    }
+
+    int res = recvmmsg(sock, batch->msgs, batch->size, 0, NULL);
+
+    if (res < 0) {
+        if (errno == ENOSYS) {
+            return -1;
+        }
+
+        if (errno != EWOULDBLOCK) {
+            LOGGER_ERROR(log, "Unexpected error reading from socket: %u, %s\n", errno, strerror(errno));
+        }
+
+        return 0;
+    }
+
+    uint16_t count = 0;
+    int j;
+
+    for (j = 0; j < res; ++j) {
+        IP_Port *ip_port = &batch->ip_port[count];
+        memset(ip_port, 0, sizeof(IP_Port));
+
+        if (ip_port_from_sockaddr(&batch->addrs[j], ip_port) == -1) {
+            continue;
+        }
+
+        batch->length[count] = batch->msgs[j].msg_len;
+
+        /* Keep the ring compact if a datagram from an unknown family was skipped. */
+        if (count != j) {
+            memcpy(batch->data[count], batch->data[j], batch->length[count]);
+        }
+
+        loglogdata(log, "=>O", batch->data[count], MAX_UDP_PACKET_SIZE, *ip_port, batch->length[count]);
+        ++count;
+    }
+
+    return count;
+}
+#endif
+
+/* Fill the receive ring with as many datagrams as are waiting, up to its size.
+ *
+ * return number of datagrams received.
+ */
+static uint16_t fill_recv_batch(Logger *log, sock_t sock, Recv_Batch *batch)
+{
+#ifdef USE_RECVMMSG
+
+    if (batch->use_recvmmsg) {
+        int res = fill_recv_batch_mmsg(log, sock, batch);
+
+        if (res != -1) {
+            return res;
+        }
+
+        LOGGER_WARNING(log, "recvmmsg() not supported, falling back to recvfrom()");
+        batch->use_recvmmsg = 0;
+    }
+
+#endif
+
+    uint16_t count = 0;
+
+    while (count < batch->size
+            && receivepacket(log, sock, &batch->ip_port[count], batch->data[count], &batch->length[count]) != -1) {
+        ++count;
+    }
+
+    return count;
+}
+
+/* Jobs each crypto worker can hold before networking_poll() has to wait for them. */
+#define CRYPTO_WORKER_QUEUE_SIZE 128
+
+typedef struct {
+    packet_decrypt_callback decrypt;
+    packet_decrypted_callback decrypted;
+    void *object;
+
+    IP_Port ip_port;
+    uint16_t length;
+    int plain_length;
+    uint8_t data[MAX_UDP_PACKET_SIZE];
+    uint8_t plain[MAX_UDP_PACKET_SIZE];
+} Crypto_Job;
+
+typedef struct {
+    pthread_t thread;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond; /* signalled when a job is queued or the pool stops */
+    pthread_cond_t done_cond; /* signalled when the last queued job is done */
+
+    /* Jobs [num_done, num_queued) are the worker's, the rest belong to the
+     * thread calling networking_poll(). */
+    Crypto_Job *jobs;
+    uint16_t num_queued;
+    uint16_t num_done;
+    uint8_t stop;
+} Crypto_Worker;
+
+struct Crypto_Pool {
+    Crypto_Worker *workers;
+    uint16_t num_workers;
+    uint16_t num_started;
+};
+
+static void *crypto_worker_thread(void *arg)
+{
+    Crypto_Worker *worker = arg;
+
+    pthread_mutex_lock(&worker->mutex);
+
+    while (!worker->stop) {
+        if (worker->num_done == worker->num_queued) {
+            pthread_cond_wait(&worker->work_cond, &worker->mutex);
+            continue;
+        }
+
+        Crypto_Job *job = &worker->jobs[worker->num_done];
+        pthread_mutex_unlock(&worker->mutex);
+
+        job->plain_length = job->decrypt(job->object, job->ip_port, job->data, job->length, job->plain);
+
+        pthread_mutex_lock(&worker->mutex);
+        ++worker->num_done;
+
+        if (worker->num_done == worker->num_queued) {
+            pthread_cond_signal(&worker->done_cond);
         }
+    }
+
+    pthread_mutex_unlock(&worker->mutex);
+    return NULL;
+}
+
+static void kill_crypto_pool(Crypto_Pool *pool)
+{
+    if (!pool) {
+        return;
+    }
+
+    uint16_t i;
+
+    for (i = 0; i < pool->num_started; ++i) {
+        Crypto_Worker *worker = &pool->workers[i];
+
+        pthread_mutex_lock(&worker->mutex);
+        worker->stop = 1;
+        pthread_cond_signal(&worker->work_cond);
+        pthread_mutex_unlock(&worker->mutex);
+
+        pthread_join(worker->thread, NULL);
+        pthread_cond_destroy(&worker->work_cond);
+        pthread_cond_destroy(&worker->done_cond);
+        pthread_mutex_destroy(&worker->mutex);
+        free(worker->jobs);
+    }
+
+    free(pool->workers);
+    free(pool);
+}
+
+static Crypto_Pool *new_crypto_pool(uint16_t num_workers)
+{
+    Crypto_Pool *pool = calloc(1, sizeof(Crypto_Pool));
+
+    if (!pool) {
+        return NULL;
+    }
+
+    pool->workers = calloc(num_workers, sizeof(Crypto_Worker));
+
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->num_workers = num_workers;
+
+    for (pool->num_started = 0; pool->num_started < num_workers; ++pool->num_started) {
+        Crypto_Worker *worker = &pool->workers[pool->num_started];
+        worker->jobs = malloc(CRYPTO_WORKER_QUEUE_SIZE * sizeof(Crypto_Job));
+
+        if (!worker->jobs) {
+            break;
+        }
+
+        if (pthread_mutex_init(&worker->mutex, NULL) != 0) {
+            free(worker->jobs);
+            break;
+        }
+
+        if (pthread_cond_init(&worker->work_cond, NULL) != 0) {
+            pthread_mutex_destroy(&worker->mutex);
+            free(worker->jobs);
+            break;
+        }
+
+        if (pthread_cond_init(&worker->done_cond, NULL) != 0) {
+            pthread_cond_destroy(&worker->work_cond);
+            pthread_mutex_destroy(&worker->mutex);
+            free(worker->jobs);
+            break;
+        }
+
+        if (pthread_create(&worker->thread, NULL, &crypto_worker_thread, worker) != 0) {
+            pthread_cond_destroy(&worker->done_cond);
+            pthread_cond_destroy(&worker->work_cond);
+            pthread_mutex_destroy(&worker->mutex);
+            free(worker->jobs);
+            break;
+        }
+    }
+
+    if (pool->num_started != num_workers) {
+        kill_crypto_pool(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+/* Wait for every worker to finish its jobs, then run their handlers in the
+ * order the packets were queued.
+ */
+static void crypto_pool_finish(Crypto_Pool *pool, void *userdata)
+{
+    uint16_t i, j;
+
+    for (i = 0; i < pool->num_workers; ++i) {
+        Crypto_Worker *worker = &pool->workers[i];
+
+        pthread_mutex_lock(&worker->mutex);
+
+        while (worker->num_done != worker->num_queued) {
+            pthread_cond_wait(&worker->done_cond, &worker->mutex);
+        }
+
+        pthread_mutex_unlock(&worker->mutex);
+    }
+
+    for (i = 0; i < pool->num_workers; ++i) {
+        Crypto_Worker *worker = &pool->workers[i];
+
+        for (j = 0; j < worker->num_queued; ++j) {
+            const Crypto_Job *job = &worker->jobs[j];
+
+            if (job->plain_length != -1) {
+                job->decrypted(job->object, job->ip_port, job->data, job->length, job->plain, job->plain_length, userdata);
+            }
+        }
+
+        pthread_mutex_lock(&worker->mutex);
+        worker->num_queued = 0;
+        worker->num_done = 0;
+        pthread_mutex_unlock(&worker->mutex);
+    }
+}
+
+static uint32_t ip_port_hash(const IP_Port *ip_port)
+{
+    uint32_t hash = ip_port->port;
+
+    if (ip_port->ip.family == AF_INET6) {
+        hash ^= ip_port->ip.ip6.uint32[0] ^ ip_port->ip.ip6.uint32[1] ^ ip_port->ip.ip6.uint32[2] ^ ip_port->ip.ip6.uint32[3];
     } else {
-        return -1;
+        hash ^= ip_port->ip.ip4.uint32;
     }
 
-    loglogdata(log, "=>O", data, MAX_UDP_PACKET_SIZE, *ip_port, *length);
+    hash *= 0x9E3779B1;
+    return hash ^ (hash >> 16);
+}
 
-    return 0;
+static void crypto_pool_queue(Crypto_Pool *pool, const Packet_Handles *handle, IP_Port ip_port, const uint8_t *data,
+                              uint16_t length, void *userdata)
+{
+    Crypto_Worker *worker = &pool->workers[ip_port_hash(&ip_port) % pool->num_workers];
+
+    if (worker->num_queued == CRYPTO_WORKER_QUEUE_SIZE) {
+        crypto_pool_finish(pool, userdata);
+    }
+
+    /* Not the worker's until num_queued says so. */
+    Crypto_Job *job = &worker->jobs[worker->num_queued];
+    job->decrypt = handle->decrypt;
+    job->decrypted = handle->decrypted;
+    job->object = handle->object;
+    job->ip_port = ip_port;
+    job->length = length;
+    memcpy(job->data, data, length);
+
+    pthread_mutex_lock(&worker->mutex);
+    ++worker->num_queued;
+    pthread_cond_signal(&worker->work_cond);
+    pthread_mutex_unlock(&worker->mutex);
 }
 
 void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_callback cb, void *object)
 {
     net->packethandlers[byte].function = cb;
+    net->packethandlers[byte].decrypt = NULL;
+    net->packethandlers[byte].decrypted = NULL;
     net->packethandlers[byte].object = object;
 }
 
+void networking_registerhandler_decrypt(Networking_Core *net, uint8_t byte, packet_decrypt_callback decrypt,
+                                        packet_decrypted_callback cb, void *object)
+{
+    net->packethandlers[byte].function = NULL;
+    net->packethandlers[byte].decrypt = decrypt;
+    net->packethandlers[byte].decrypted = cb;
+    net->packethandlers[byte].object = object;
+}
+
+static void dispatch(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint32_t length, void *userdata,
+                     Crypto_Pool *pool)
+{
+    if (length < 1) {
+        return;
+    }
+
+    const Packet_Handles *handle = &net->packethandlers[data[0]];
+
+    if (handle->decrypt && handle->decrypted) {
+        if (pool) {
+            crypto_pool_queue(pool, handle, ip_port, data, length, userdata);
+            return;
+        }
+
+        uint8_t plain[MAX_UDP_PACKET_SIZE];
+        int plain_length = handle->decrypt(handle->object, ip_port, data, length, plain);
+
+        if (plain_length != -1) {
+            handle->decrypted(handle->object, ip_port, data, length, plain, plain_length, userdata);
+        }
+
+        return;
+    }
+
+    if (!handle->function) {
+        LOGGER_WARNING(net->log, "[%02u] -- Packet has no handler", data[0]);
+        return;
+    }
+
+    handle->function(handle->object, ip_port, data, length, userdata);
+}
+
+void networking_dispatch(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint32_t length,
+                         void *userdata)
+{
+    dispatch(net, ip_port, data, length, userdata, NULL);
+}
+
 void networking_poll(Networking_Core *net, void *userdata)
 {
     if (net->family == 0) { /* Socket not initialized */
@@ -433,22 +1265,168 @@ void networking_poll(Networking_Core *net, void *userdata)
 
     unix_time_update();
 
-    IP_Port ip_port;
-    uint8_t data[MAX_UDP_PACKET_SIZE];
-    uint32_t length;
+    /* Whatever was queued since the last poll goes out before we handle replies. */
+    networking_flush(net);
 
-    while (receivepacket(net->log, net->sock, &ip_port, data, &length) != -1) {
-        if (length < 1) {
-            continue;
+    if (net->recv_batch) {
+        Recv_Batch *batch = net->recv_batch;
+        uint16_t count;
+
+        do {
+            count = fill_recv_batch(net->log, net->sock, batch);
+
+            uint16_t i;
+
+            for (i = 0; i < count; ++i) {
+                dispatch(net, batch->ip_port[i], batch->data[i], batch->length[i], userdata, net->crypto_pool);
+            }
+        } while (count == batch->size);
+    } else {
+        IP_Port ip_port;
+        uint8_t data[MAX_UDP_PACKET_SIZE];
+        uint32_t length;
+
+        while (receivepacket(net->log, net->sock, &ip_port, data, &length) != -1) {
+            dispatch(net, ip_port, data, length, userdata, net->crypto_pool);
         }
+    }
 
-        if (!(net->packethandlers[data[0]].function)) {
-            LOGGER_WARNING(net->log, "[%02u] -- Packet has no handler", data[0]);
-            continue;
+    if (net->crypto_pool) {
+        crypto_pool_finish(net->crypto_pool, userdata);
+    }
+
+    /* Send the replies generated by the handlers. */
+    networking_flush(net);
+}
+
+int networking_wait(Networking_Core *net, const sock_t *socks, uint32_t num_socks, uint32_t timeout_ms)
+{
+    if (net == NULL) {
+        return networking_wait_fds(NULL, NULL, socks, num_socks, timeout_ms);
+    }
+
+    return networking_wait_fds(&net->wait_fds, &net->size_wait_fds, socks, num_socks, timeout_ms);
+}
+
+int networking_wait_fds(struct pollfd **wait_fds, uint32_t *size_fds, const sock_t *socks, uint32_t num_socks,
+                        uint32_t timeout_ms)
+{
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    uint32_t i;
+
+    for (i = 0; i < num_socks && i < FD_SETSIZE; ++i) {
+        FD_SET(socks[i], &readfds);
+    }
+
+    struct timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+    if (num_socks == 0) {
+        Sleep(timeout_ms);
+        return 0;
+    }
+
+    int ret = select(0, &readfds, NULL, NULL, &timeout);
+#else
+    struct pollfd stack_fds[MAX_STACK_WAIT_SOCKETS];
+    struct pollfd *fds = stack_fds;
+    struct pollfd *allocated = NULL;
+
+    if (wait_fds) {
+        if (num_socks > *size_fds) {
+            struct pollfd *temp = realloc(*wait_fds, num_socks * sizeof(struct pollfd));
+
+            if (temp == NULL) {
+                return -1;
+            }
+
+            *wait_fds = temp;
+            *size_fds = num_socks;
+        }
+
+        if (*wait_fds) {
+            fds = *wait_fds;
+        }
+    } else if (num_socks > MAX_STACK_WAIT_SOCKETS) {
+        allocated = malloc(num_socks * sizeof(struct pollfd));
+
+        if (allocated == NULL) {
+            return -1;
         }
 
-        net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length, userdata);
+        fds = allocated;
     }
+
+    uint32_t i;
+
+    for (i = 0; i < num_socks; ++i) {
+        fds[i].fd = socks[i];
+        fds[i].events = POLLIN;
+    }
+
+    int ret = poll(fds, num_socks, timeout_ms > INT_MAX ? INT_MAX : timeout_ms);
+    free(allocated);
+
+    if (ret == -1 && errno == EINTR) {
+        return 0;
+    }
+
+#endif
+
+    if (ret < 0) {
+        return -1;
+    }
+
+    return ret > 0;
+}
+
+int networking_set_recv_batch(Networking_Core *net, uint16_t batch_size)
+{
+    if (batch_size > MAX_RECV_BATCH_SIZE) {
+        return -1;
+    }
+
+    if (batch_size <= 1) {
+        kill_recv_batch(net->recv_batch);
+        net->recv_batch = NULL;
+        return 0;
+    }
+
+    Recv_Batch *batch = new_recv_batch(batch_size);
+
+    if (!batch) {
+        return -1;
+    }
+
+    kill_recv_batch(net->recv_batch);
+    net->recv_batch = batch;
+    return 0;
+}
+
+int networking_set_crypto_workers(Networking_Core *net, uint16_t num_workers)
+{
+    if (num_workers > MAX_CRYPTO_WORKERS) {
+        return -1;
+    }
+
+    if (num_workers == 0) {
+        kill_crypto_pool(net->crypto_pool);
+        net->crypto_pool = NULL;
+        return 0;
+    }
+
+    Crypto_Pool *pool = new_crypto_pool(num_workers);
+
+    if (!pool) {
+        return -1;
+    }
+
+    kill_crypto_pool(net->crypto_pool);
+    net->crypto_pool = pool;
+    return 0;
 }
 
 #ifndef VANILLA_NACL
@@ -516,7 +1494,33 @@ Networking_Core *new_networking(Logger *log, IP ip, uint16_t port)
  *
  * If error is non NULL it is set to 0 if no issues, 1 if socket related error, 2 if other.
  */
+static Networking_Core *new_networking_internal(Logger *log, IP ip, uint16_t port_from, uint16_t port_to,
+        uint8_t reuseport, unsigned int *error);
+
 Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint16_t port_to, unsigned int *error)
+{
+    return new_networking_internal(log, ip, port_from, port_to, 0, error);
+}
+
+/* Initialize networking on a socket with SO_REUSEPORT set.
+ * Bind to ip and exactly port, which may be shared with other sockets
+ * created by this function.
+ */
+Networking_Core *new_networking_reuseport(Logger *log, IP ip, uint16_t port, unsigned int *error)
+{
+    if (port == 0) {
+        if (error) {
+            *error = 2;
+        }
+
+        return NULL;
+    }
+
+    return new_networking_internal(log, ip, port, port, 1, error);
+}
+
+static Networking_Core *new_networking_internal(Logger *log, IP ip, uint16_t port_from, uint16_t port_to,
+        uint8_t reuseport, unsigned int *error)
 {
     /* If both from and to are 0, use default port range
      * If one is 0 and the other is non-0, use the non-0 value as only port
@@ -611,6 +1615,17 @@ Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint1
         return NULL;
     }
 
+    if (reuseport && !set_socket_reuseport(temp->sock)) {
+        LOGGER_ERROR(log, "Failed to set SO_REUSEPORT: %u, %s", errno, strerror(errno));
+        kill_networking(temp);
+
+        if (error) {
+            *error = 1;
+        }
+
+        return NULL;
+    }
+
     /* Bind our socket to port PORT and the given IP address (usually 0.0.0.0 or ::) */
     uint16_t *portptr = NULL;
     struct sockaddr_storage addr;
@@ -730,9 +1745,14 @@ void kill_networking(Networking_Core *net)
     }
 
     if (net->family != 0) { /* Socket not initialized */
+        networking_flush(net);
         kill_sock(net->sock);
     }
 
+    kill_crypto_pool(net->crypto_pool);
+    kill_send_queue(net->send_queue);
+    kill_recv_batch(net->recv_batch);
+    free(net->wait_fds);
     free(net);
 }
 
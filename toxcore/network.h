@@ -301,11 +301,57 @@ int addr_resolve_or_parse_ip(const char *address, IP *to, IP *extra);
 typedef int (*packet_handler_callback)(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len,
                                        void *userdata);
 
+/* First half of a handler registered with networking_registerhandler_decrypt():
+ * check and decrypt the packet into plain (of MAX_UDP_PACKET_SIZE bytes).
+ *
+ * With crypto workers enabled this runs on a worker thread, so it may only use
+ * the packet, plain and whatever of object is safe to use from several threads
+ * at once (e.g. long term keys and a Shared_Keys cache).
+ *
+ * return length of plain on success (0 if there was nothing to decrypt).
+ * return -1 if the packet should be dropped.
+ */
+typedef int (*packet_decrypt_callback)(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len,
+                                       uint8_t *plain);
+
+/* Second half: handle the packet with what the decrypt callback put in plain.
+ * Always runs on the thread calling networking_poll().
+ */
+typedef int (*packet_decrypted_callback)(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len,
+                                         const uint8_t *plain, uint16_t plain_len, void *userdata);
+
 typedef struct {
     packet_handler_callback function;
+    packet_decrypt_callback decrypt;
+    packet_decrypted_callback decrypted;
     void *object;
 } Packet_Handles;
 
+/* Largest number of datagrams networking_poll() pulls from the socket at once
+ * when batched receive is enabled. */
+#define MAX_RECV_BATCH_SIZE 64
+
+/* Largest number of datagrams the transmit queue holds before it is flushed. */
+#define MAX_SEND_BATCH_SIZE 256
+
+/* Largest number of crypto worker threads. */
+#define MAX_CRYPTO_WORKERS 64
+
+typedef struct Recv_Batch Recv_Batch;
+typedef struct Send_Queue Send_Queue;
+typedef struct Crypto_Pool Crypto_Pool;
+
+/* Transmit queue counters. Syscalls saved are packets - syscalls. */
+typedef struct {
+    uint64_t packets;   /* Datagrams sent through the queue. */
+    uint64_t syscalls;  /* Send syscalls it took to flush them. */
+    uint64_t flushes;   /* Non-empty flushes, at the end of a tick or on a full queue. */
+
+    /* Same as above for the most recent flush only. */
+    uint16_t last_flush_packets;
+    uint16_t last_flush_syscalls;
+} Net_Send_Stats;
+
 typedef struct {
     Logger *log;
     Packet_Handles packethandlers[256];
@@ -314,6 +360,20 @@ typedef struct {
     uint16_t port;
     /* Our UDP socket. */
     sock_t sock;
+
+    /* Preallocated receive ring, NULL if batched receive is disabled. */
+    Recv_Batch *recv_batch;
+
+    /* Transmit queue, NULL if sendpacket() sends immediately. */
+    Send_Queue *send_queue;
+    Net_Send_Stats send_stats;
+
+    /* Threads running decrypt callbacks, NULL if they run inline. */
+    Crypto_Pool *crypto_pool;
+
+    /* Reused by networking_wait(), grown as needed. */
+    struct pollfd *wait_fds;
+    uint32_t size_wait_fds;
 } Networking_Core;
 
 /* Run this before creating sockets.
@@ -355,6 +415,13 @@ int set_socket_nosigpipe(sock_t sock);
  */
 int set_socket_reuseaddr(sock_t sock);
 
+/* Enable SO_REUSEPORT on socket.
+ *
+ * return 1 on success
+ * return 0 on failure (or if the platform doesn't have SO_REUSEPORT)
+ */
+int set_socket_reuseport(sock_t sock);
+
 /* Set socket to dual (IPv4 + IPv6 socket)
  *
  * return 1 on success
@@ -367,15 +434,107 @@ uint64_t current_time_monotonic(void);
 
 /* Basic network functions: */
 
-/* Function to send packet(data) of length length to ip_port. */
+/* Function to send packet(data) of length length to ip_port.
+ *
+ * If the transmit queue is enabled the packet is only queued and length is
+ * returned; it goes out on the next networking_flush().
+ */
 int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length);
 
+/* Enable or disable the transmit queue.
+ *
+ * With the queue enabled sendpacket() gathers up to batch_size datagrams,
+ * which are then sent with as few syscalls as possible: sendmmsg() where
+ * available, with runs of same sized datagrams to one destination coalesced
+ * into a single UDP GSO send where the kernel supports it.
+ * The queue is flushed when it is full, at the start and end of
+ * networking_poll() and by networking_flush().
+ * A batch_size of 0 or 1 disables the queue.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int networking_set_send_batch(Networking_Core *net, uint16_t batch_size);
+
+/* Send everything in the transmit queue now.
+ * Call this at the end of every iteration of the main loop.
+ */
+void networking_flush(Networking_Core *net);
+
 /* Function to call when packet beginning with byte is received. */
 void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_callback cb, void *object);
 
+/* Same as above for packets that need to be decrypted before they can be
+ * handled: decrypt(object, ...) checks and decrypts the packet, then cb(object, ...)
+ * handles it, see packet_decrypt_callback. Without crypto workers both run
+ * right after each other.
+ */
+void networking_registerhandler_decrypt(Networking_Core *net, uint8_t byte, packet_decrypt_callback decrypt,
+                                        packet_decrypted_callback cb, void *object);
+
 /* Call this several times a second. */
 void networking_poll(Networking_Core *net, void *userdata);
 
+/* Block until one of socks (e.g. net->sock plus whatever else the caller's
+ * loop runs) is readable or timeout_ms milliseconds have passed. This is
+ * meant to replace sleeping for a fixed time between iterations of a main
+ * loop, with timeout_ms taken from the run_interval functions of the modules
+ * it runs.
+ *
+ * The poll array is kept in net between calls. net may be NULL, the array is
+ * then on the stack for up to MAX_STACK_WAIT_SOCKETS sockets and allocated
+ * per call past that.
+ *
+ * return 1 if a socket is readable.
+ * return 0 on timeout (or if interrupted by a signal).
+ * return -1 on failure.
+ */
+#define MAX_STACK_WAIT_SOCKETS 16
+
+int networking_wait(Networking_Core *net, const sock_t *socks, uint32_t num_socks, uint32_t timeout_ms);
+
+/* Same as networking_wait() for loops without a Networking_Core (e.g. the
+ * threads of a TCP server): the poll array is kept in *fds, *size_fds entries
+ * long, and grown as needed. Free *fds with free() when done.
+ */
+int networking_wait_fds(struct pollfd **fds, uint32_t *size_fds, const sock_t *socks, uint32_t num_socks,
+                        uint32_t timeout_ms);
+
+/* Hand a packet received elsewhere (e.g. on another socket) to the handler
+ * registered for its first byte, as if networking_poll() had received it.
+ * Decrypt callbacks of packets handed in this way always run inline.
+ */
+void networking_dispatch(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint32_t length,
+                         void *userdata);
+
+/* Enable or disable batched receive.
+ *
+ * With batching enabled networking_poll() pulls up to batch_size datagrams per
+ * syscall (recvmmsg() where the platform has it, one recvfrom() per slot
+ * otherwise) into a preallocated ring of buffers and then dispatches them.
+ * A batch_size of 0 or 1 disables batching.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int networking_set_recv_batch(Networking_Core *net, uint16_t batch_size);
+
+/* Enable or disable crypto workers.
+ *
+ * With num_workers threads running, networking_poll() hands every received
+ * packet that has a decrypt callback to one of them, picked by the packet's
+ * source so that packets from one peer are decrypted and then handled in the
+ * order they arrived. Before networking_poll() returns it waits for the
+ * workers and runs the handlers of everything they decrypted, which means
+ * these packets are handled after the ones without a decrypt callback
+ * received in the same poll.
+ * A num_workers of 0 disables the workers.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int networking_set_crypto_workers(Networking_Core *net, uint16_t num_workers);
+
 /* Initialize networking.
  * bind to ip and port.
  * ip must be in network order EX: 127.0.0.1 = (7F000001).
@@ -389,6 +548,13 @@ void networking_poll(Networking_Core *net, void *userdata);
 Networking_Core *new_networking(Logger *log, IP ip, uint16_t port);
 Networking_Core *new_networking_ex(Logger *log, IP ip, uint16_t port_from, uint16_t port_to, unsigned int *error);
 
+/* Same as above, but binds exactly port with SO_REUSEPORT set, so that several
+ * sockets (e.g. one per worker thread) can share it. The kernel then spreads
+ * incoming datagrams over them by source address.
+ * Every socket sharing the port must be created with this function.
+ */
+Networking_Core *new_networking_reuseport(Logger *log, IP ip, uint16_t port, unsigned int *error);
+
 /* Function to cleanup networking stuff (doesn't do much right now). */
 void kill_networking(Networking_Core *net);
 
@@ -166,6 +166,42 @@ int onion_path_to_nodes(Node_format *nodes, unsigned int num_nodes, const Onion_
     return 0;
 }
 
+/* Put the part of an onion packet for data of length to dest that the first
+ * node decrypts (the second node's ip_port and public key followed by what it
+ * decrypts) in layers, which must be SIZE_IPPORT + SEND_BASE * 2 + length big.
+ * Each layer is built where it ends up and encrypted in place.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int create_onion_layers(uint8_t *layers, const Onion_Path *path, IP_Port dest, const uint8_t *nonce,
+                               const uint8_t *data, uint16_t length)
+{
+    uint8_t *layer2 = layers + SIZE_IPPORT + crypto_box_PUBLICKEYBYTES;
+    uint8_t *layer3 = layer2 + crypto_box_MACBYTES + SIZE_IPPORT + crypto_box_PUBLICKEYBYTES;
+
+    ipport_pack(layer3 + crypto_box_MACBYTES, &dest);
+    memcpy(layer3 + crypto_box_MACBYTES + SIZE_IPPORT, data, length);
+
+    int len = encrypt_data_symmetric_inplace(path->shared_key3, nonce, layer3, SIZE_IPPORT + length);
+
+    if (len != SIZE_IPPORT + length + crypto_box_MACBYTES) {
+        return -1;
+    }
+
+    ipport_pack(layer2 + crypto_box_MACBYTES, &path->ip_port3);
+    memcpy(layer2 + crypto_box_MACBYTES + SIZE_IPPORT, path->public_key3, crypto_box_PUBLICKEYBYTES);
+    len = encrypt_data_symmetric_inplace(path->shared_key2, nonce, layer2, SIZE_IPPORT + SEND_BASE + length);
+
+    if (len != SIZE_IPPORT + SEND_BASE + length + crypto_box_MACBYTES) {
+        return -1;
+    }
+
+    ipport_pack(layers, &path->ip_port2);
+    memcpy(layers + SIZE_IPPORT, path->public_key2, crypto_box_PUBLICKEYBYTES);
+    return 0;
+}
+
 /* Create a onion packet.
  *
  * Use Onion_Path path to create packet for data of length to dest.
@@ -182,32 +218,12 @@ int create_onion_packet(uint8_t *packet, uint16_t max_packet_length, const Onion
         return -1;
     }
 
-    uint8_t step1[SIZE_IPPORT + length];
-
-    ipport_pack(step1, &dest);
-    memcpy(step1 + SIZE_IPPORT, data, length);
-
     uint8_t nonce[crypto_box_NONCEBYTES];
     random_nonce(nonce);
 
-    uint8_t step2[SIZE_IPPORT + SEND_BASE + length];
-    ipport_pack(step2, &path->ip_port3);
-    memcpy(step2 + SIZE_IPPORT, path->public_key3, crypto_box_PUBLICKEYBYTES);
-
-    int len = encrypt_data_symmetric(path->shared_key3, nonce, step1, sizeof(step1),
-                                     step2 + SIZE_IPPORT + crypto_box_PUBLICKEYBYTES);
-
-    if (len != SIZE_IPPORT + length + crypto_box_MACBYTES) {
-        return -1;
-    }
+    uint8_t *layer1 = packet + 1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES;
 
-    uint8_t step3[SIZE_IPPORT + SEND_BASE * 2 + length];
-    ipport_pack(step3, &path->ip_port2);
-    memcpy(step3 + SIZE_IPPORT, path->public_key2, crypto_box_PUBLICKEYBYTES);
-    len = encrypt_data_symmetric(path->shared_key2, nonce, step2, sizeof(step2),
-                                 step3 + SIZE_IPPORT + crypto_box_PUBLICKEYBYTES);
-
-    if (len != SIZE_IPPORT + SEND_BASE + length + crypto_box_MACBYTES) {
+    if (create_onion_layers(layer1 + crypto_box_MACBYTES, path, dest, nonce, data, length) == -1) {
         return -1;
     }
 
@@ -215,8 +231,7 @@ int create_onion_packet(uint8_t *packet, uint16_t max_packet_length, const Onion
     memcpy(packet + 1, nonce, crypto_box_NONCEBYTES);
     memcpy(packet + 1 + crypto_box_NONCEBYTES, path->public_key1, crypto_box_PUBLICKEYBYTES);
 
-    len = encrypt_data_symmetric(path->shared_key1, nonce, step3, sizeof(step3),
-                                 packet + 1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES);
+    int len = encrypt_data_symmetric_inplace(path->shared_key1, nonce, layer1, SIZE_IPPORT + SEND_BASE * 2 + length);
 
     if (len != SIZE_IPPORT + SEND_BASE * 2 + length + crypto_box_MACBYTES) {
         return -1;
@@ -241,37 +256,16 @@ int create_onion_packet_tcp(uint8_t *packet, uint16_t max_packet_length, const O
         return -1;
     }
 
-    uint8_t step1[SIZE_IPPORT + length];
-
-    ipport_pack(step1, &dest);
-    memcpy(step1 + SIZE_IPPORT, data, length);
-
     uint8_t nonce[crypto_box_NONCEBYTES];
     random_nonce(nonce);
 
-    uint8_t step2[SIZE_IPPORT + SEND_BASE + length];
-    ipport_pack(step2, &path->ip_port3);
-    memcpy(step2 + SIZE_IPPORT, path->public_key3, crypto_box_PUBLICKEYBYTES);
-
-    int len = encrypt_data_symmetric(path->shared_key3, nonce, step1, sizeof(step1),
-                                     step2 + SIZE_IPPORT + crypto_box_PUBLICKEYBYTES);
-
-    if (len != SIZE_IPPORT + length + crypto_box_MACBYTES) {
-        return -1;
-    }
-
-    ipport_pack(packet + crypto_box_NONCEBYTES, &path->ip_port2);
-    memcpy(packet + crypto_box_NONCEBYTES + SIZE_IPPORT, path->public_key2, crypto_box_PUBLICKEYBYTES);
-    len = encrypt_data_symmetric(path->shared_key2, nonce, step2, sizeof(step2),
-                                 packet + crypto_box_NONCEBYTES + SIZE_IPPORT + crypto_box_PUBLICKEYBYTES);
-
-    if (len != SIZE_IPPORT + SEND_BASE + length + crypto_box_MACBYTES) {
+    if (create_onion_layers(packet + crypto_box_NONCEBYTES, path, dest, nonce, data, length) == -1) {
         return -1;
     }
 
     memcpy(packet, nonce, crypto_box_NONCEBYTES);
 
-    return crypto_box_NONCEBYTES + SIZE_IPPORT + crypto_box_PUBLICKEYBYTES + len;
+    return crypto_box_NONCEBYTES + SIZE_IPPORT + SEND_BASE * 2 + length;
 }
 
 /* Create and send a onion packet.
@@ -322,30 +316,37 @@ int send_onion_response(Networking_Core *net, IP_Port dest, const uint8_t *data,
     return 0;
 }
 
-static int handle_send_initial(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+static int decrypt_send_initial(void *object, IP_Port source, const uint8_t *packet, uint16_t length, uint8_t *plain)
 {
-    Onion *onion = object;
+    const Onion *onion = object;
 
     if (length > ONION_MAX_PACKET_SIZE) {
-        return 1;
+        return -1;
     }
 
     if (length <= 1 + SEND_1) {
-        return 1;
+        return -1;
     }
 
-    change_symmetric_key(onion);
-
-    uint8_t plain[ONION_MAX_PACKET_SIZE];
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
-    get_shared_key(&onion->shared_keys_1, shared_key, onion->dht->self_secret_key, packet + 1 + crypto_box_NONCEBYTES);
+    get_shared_key(onion->shared_keys_1, shared_key, onion->dht->self_secret_key, packet + 1 + crypto_box_NONCEBYTES);
     int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES,
                                      length - (1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES), plain);
 
     if (len != length - (1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + crypto_box_MACBYTES)) {
-        return 1;
+        return -1;
     }
 
+    return len;
+}
+
+static int handle_send_initial(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
+                               const uint8_t *plain, uint16_t len, void *userdata)
+{
+    Onion *onion = object;
+
+    change_symmetric_key(onion);
+
     return onion_send_1(onion, plain, len, source, packet + 1);
 }
 
@@ -391,30 +392,38 @@ int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port
     return 0;
 }
 
-static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+static int decrypt_send_1(void *object, IP_Port source, const uint8_t *packet, uint16_t length, uint8_t *plain)
 {
-    Onion *onion = object;
+    const Onion *onion = object;
 
     if (length > ONION_MAX_PACKET_SIZE) {
-        return 1;
+        return -1;
     }
 
     if (length <= 1 + SEND_2) {
-        return 1;
+        return -1;
     }
 
-    change_symmetric_key(onion);
-
-    uint8_t plain[ONION_MAX_PACKET_SIZE];
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
-    get_shared_key(&onion->shared_keys_2, shared_key, onion->dht->self_secret_key, packet + 1 + crypto_box_NONCEBYTES);
+    get_shared_key(onion->shared_keys_2, shared_key, onion->dht->self_secret_key, packet + 1 + crypto_box_NONCEBYTES);
     int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES,
                                      length - (1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + RETURN_1), plain);
 
     if (len != length - (1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + RETURN_1 + crypto_box_MACBYTES)) {
-        return 1;
+        return -1;
     }
 
+    return len;
+}
+
+static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, uint16_t length, const uint8_t *plain,
+                         uint16_t plain_length, void *userdata)
+{
+    Onion *onion = object;
+    int len = plain_length;
+
+    change_symmetric_key(onion);
+
     IP_Port send_to;
 
     if (ipport_unpack(&send_to, plain, len, 0) == -1) {
@@ -447,30 +456,38 @@ static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, ui
     return 0;
 }
 
-static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+static int decrypt_send_2(void *object, IP_Port source, const uint8_t *packet, uint16_t length, uint8_t *plain)
 {
-    Onion *onion = object;
+    const Onion *onion = object;
 
     if (length > ONION_MAX_PACKET_SIZE) {
-        return 1;
+        return -1;
     }
 
     if (length <= 1 + SEND_3) {
-        return 1;
+        return -1;
     }
 
-    change_symmetric_key(onion);
-
-    uint8_t plain[ONION_MAX_PACKET_SIZE];
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
-    get_shared_key(&onion->shared_keys_3, shared_key, onion->dht->self_secret_key, packet + 1 + crypto_box_NONCEBYTES);
+    get_shared_key(onion->shared_keys_3, shared_key, onion->dht->self_secret_key, packet + 1 + crypto_box_NONCEBYTES);
     int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES,
                                      length - (1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + RETURN_2), plain);
 
     if (len != length - (1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + RETURN_2 + crypto_box_MACBYTES)) {
-        return 1;
+        return -1;
     }
 
+    return len;
+}
+
+static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, uint16_t length, const uint8_t *plain,
+                         uint16_t plain_length, void *userdata)
+{
+    Onion *onion = object;
+    int len = plain_length;
+
+    change_symmetric_key(onion);
+
     IP_Port send_to;
 
     if (ipport_unpack(&send_to, plain, len, 0) == -1) {
@@ -647,10 +664,22 @@ Onion *new_onion(DHT *dht)
     onion->net = dht->net;
     new_symmetric_key(onion->secret_symmetric_key);
     onion->timestamp = unix_time();
+    onion->shared_keys_1 = new_shared_keys(SHARED_KEYS_DEFAULT_SIZE);
+    onion->shared_keys_2 = new_shared_keys(SHARED_KEYS_DEFAULT_SIZE);
+    onion->shared_keys_3 = new_shared_keys(SHARED_KEYS_DEFAULT_SIZE);
+
+    if (onion->shared_keys_1 == NULL || onion->shared_keys_2 == NULL || onion->shared_keys_3 == NULL) {
+        kill_shared_keys(onion->shared_keys_1);
+        kill_shared_keys(onion->shared_keys_2);
+        kill_shared_keys(onion->shared_keys_3);
+        free(onion);
+        return NULL;
+    }
 
-    networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_INITIAL, &handle_send_initial, onion);
-    networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_1, &handle_send_1, onion);
-    networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_2, &handle_send_2, onion);
+    networking_registerhandler_decrypt(onion->net, NET_PACKET_ONION_SEND_INITIAL, &decrypt_send_initial,
+                                       &handle_send_initial, onion);
+    networking_registerhandler_decrypt(onion->net, NET_PACKET_ONION_SEND_1, &decrypt_send_1, &handle_send_1, onion);
+    networking_registerhandler_decrypt(onion->net, NET_PACKET_ONION_SEND_2, &decrypt_send_2, &handle_send_2, onion);
 
     networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_3, &handle_recv_3, onion);
     networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_2, &handle_recv_2, onion);
@@ -659,6 +688,28 @@ Onion *new_onion(DHT *dht)
     return onion;
 }
 
+int onion_set_shared_keys_size(Onion *onion, uint32_t size)
+{
+    Shared_Keys *shared_keys_1 = new_shared_keys(size);
+    Shared_Keys *shared_keys_2 = new_shared_keys(size);
+    Shared_Keys *shared_keys_3 = new_shared_keys(size);
+
+    if (shared_keys_1 == NULL || shared_keys_2 == NULL || shared_keys_3 == NULL) {
+        kill_shared_keys(shared_keys_1);
+        kill_shared_keys(shared_keys_2);
+        kill_shared_keys(shared_keys_3);
+        return -1;
+    }
+
+    kill_shared_keys(onion->shared_keys_1);
+    kill_shared_keys(onion->shared_keys_2);
+    kill_shared_keys(onion->shared_keys_3);
+    onion->shared_keys_1 = shared_keys_1;
+    onion->shared_keys_2 = shared_keys_2;
+    onion->shared_keys_3 = shared_keys_3;
+    return 0;
+}
+
 void kill_onion(Onion *onion)
 {
     if (onion == NULL) {
@@ -673,5 +724,8 @@ void kill_onion(Onion *onion)
     networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_2, NULL, NULL);
     networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_1, NULL, NULL);
 
+    kill_shared_keys(onion->shared_keys_1);
+    kill_shared_keys(onion->shared_keys_2);
+    kill_shared_keys(onion->shared_keys_3);
     free(onion);
 }
@@ -31,9 +31,9 @@ typedef struct {
     uint8_t secret_symmetric_key[crypto_box_KEYBYTES];
     uint64_t timestamp;
 
-    Shared_Keys shared_keys_1;
-    Shared_Keys shared_keys_2;
-    Shared_Keys shared_keys_3;
+    Shared_Keys *shared_keys_1;
+    Shared_Keys *shared_keys_2;
+    Shared_Keys *shared_keys_3;
 
     int (*recv_1_function)(void *, IP_Port, const uint8_t *, uint16_t);
     void *callback_object;
@@ -160,5 +160,12 @@ Onion *new_onion(DHT *dht);
 
 void kill_onion(Onion *onion);
 
+/* Same as DHT_set_shared_keys_size() for the caches of the three onion layers.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int onion_set_shared_keys_size(Onion *onion, uint32_t size);
+
 
 #endif
@@ -316,7 +316,7 @@ static int handle_announce_request(void *object, IP_Port source, const uint8_t *
 
     const uint8_t *packet_public_key = packet + 1 + crypto_box_NONCEBYTES;
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
-    get_shared_key(&onion_a->shared_keys_recv, shared_key, onion_a->dht->self_secret_key, packet_public_key);
+    get_shared_key(onion_a->shared_keys_recv, shared_key, onion_a->dht->self_secret_key, packet_public_key);
 
     uint8_t plain[ONION_PING_ID_SIZE + crypto_box_PUBLICKEYBYTES + crypto_box_PUBLICKEYBYTES +
                   ONION_ANNOUNCE_SENDBACK_DATA_LENGTH];
@@ -450,6 +450,12 @@ Onion_Announce *new_onion_announce(DHT *dht)
     onion_a->dht = dht;
     onion_a->net = dht->net;
     new_symmetric_key(onion_a->secret_bytes);
+    onion_a->shared_keys_recv = new_shared_keys(SHARED_KEYS_DEFAULT_SIZE);
+
+    if (onion_a->shared_keys_recv == NULL) {
+        free(onion_a);
+        return NULL;
+    }
 
     networking_registerhandler(onion_a->net, NET_PACKET_ANNOUNCE_REQUEST, &handle_announce_request, onion_a);
     networking_registerhandler(onion_a->net, NET_PACKET_ONION_DATA_REQUEST, &handle_data_request, onion_a);
@@ -457,6 +463,19 @@ Onion_Announce *new_onion_announce(DHT *dht)
     return onion_a;
 }
 
+int onion_announce_set_shared_keys_size(Onion_Announce *onion_a, uint32_t size)
+{
+    Shared_Keys *shared_keys_recv = new_shared_keys(size);
+
+    if (shared_keys_recv == NULL) {
+        return -1;
+    }
+
+    kill_shared_keys(onion_a->shared_keys_recv);
+    onion_a->shared_keys_recv = shared_keys_recv;
+    return 0;
+}
+
 void kill_onion_announce(Onion_Announce *onion_a)
 {
     if (onion_a == NULL) {
@@ -465,5 +484,6 @@ void kill_onion_announce(Onion_Announce *onion_a)
 
     networking_registerhandler(onion_a->net, NET_PACKET_ANNOUNCE_REQUEST, NULL, NULL);
     networking_registerhandler(onion_a->net, NET_PACKET_ONION_DATA_REQUEST, NULL, NULL);
+    kill_shared_keys(onion_a->shared_keys_recv);
     free(onion_a);
 }
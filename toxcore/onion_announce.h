@@ -60,7 +60,7 @@ typedef struct {
     /* This is crypto_box_KEYBYTES long just so we can use new_symmetric_key() to fill it */
     uint8_t secret_bytes[crypto_box_KEYBYTES];
 
-    Shared_Keys shared_keys_recv;
+    Shared_Keys *shared_keys_recv;
 } Onion_Announce;
 
 /* Create an onion announce request packet in packet of max_packet_length (recommended size ONION_ANNOUNCE_REQUEST_SIZE).
@@ -135,5 +135,12 @@ Onion_Announce *new_onion_announce(DHT *dht);
 
 void kill_onion_announce(Onion_Announce *onion_a);
 
+/* Same as DHT_set_shared_keys_size() for the cache of announce requests.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int onion_announce_set_shared_keys_size(Onion_Announce *onion_a, uint32_t size);
+
 
 #endif
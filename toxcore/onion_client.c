@@ -33,6 +33,8 @@
 #define ANNOUNCE_ARRAY_SIZE 256
 #define ANNOUNCE_TIMEOUT 10
 
+static void friend_updated(Onion_Client *onion_c, uint32_t friend_num);
+
 /* Add a node to the path_nodes bootstrap array.
  *
  * return -1 on failure
@@ -574,6 +576,11 @@ static int client_add_to_list(Onion_Client *onion_c, uint32_t num, const uint8_t
     }
 
     list_nodes[index].path_used = set_path_timeouts(onion_c, num, path_num);
+
+    if (num != 0) {
+        friend_updated(onion_c, num - 1);
+    }
+
     return 0;
 }
 
@@ -1136,6 +1143,7 @@ int onion_addfriend(Onion_Client *onion_c, const uint8_t *public_key)
     onion_c->friends_list[index].status = 1;
     memcpy(onion_c->friends_list[index].real_public_key, public_key, crypto_box_PUBLICKEYBYTES);
     crypto_box_keypair(onion_c->friends_list[index].temp_public_key, onion_c->friends_list[index].temp_secret_key);
+    friend_updated(onion_c, index);
     return index;
 }
 
@@ -1309,6 +1317,7 @@ int onion_set_friend_online(Onion_Client *onion_c, int friend_num, uint8_t is_on
     if (!is_online) {
         onion_c->friends_list[friend_num].last_noreplay = 0;
         onion_c->friends_list[friend_num].run_count = 0;
+        friend_updated(onion_c, friend_num);
     }
 
     return 0;
@@ -1345,6 +1354,63 @@ static void populate_path_nodes_tcp(Onion_Client *onion_c)
 
 #define RUN_COUNT_FRIEND_ANNOUNCE_BEGINNING 17
 
+/* The first time do_friend() has something to do for the friend.
+ *
+ * return 0 if never (the friend is online).
+ */
+static uint64_t friend_next_run(const Onion_Friend *friend)
+{
+    if (friend->status == 0 || friend->is_online) {
+        return 0;
+    }
+
+    unsigned int interval = ANNOUNCE_FRIEND;
+
+    if (friend->run_count < RUN_COUNT_FRIEND_ANNOUNCE_BEGINNING) {
+        interval = ANNOUNCE_FRIEND_BEGINNING;
+    }
+
+    uint64_t next_run = MIN(friend->last_dht_pk_onion_sent + ONION_DHTPK_SEND_INTERVAL,
+                            friend->last_dht_pk_dht_sent + DHT_DHTPK_SEND_INTERVAL);
+    unsigned int i, count = 0;
+
+    for (i = 0; i < MAX_ONION_CLIENTS; ++i) {
+        const Onion_Node *node = &friend->clients_list[i];
+
+        if (is_timeout(node->timestamp, FRIEND_ONION_NODE_TIMEOUT)) {
+            continue;
+        }
+
+        ++count;
+        next_run = MIN(next_run, node->timestamp + FRIEND_ONION_NODE_TIMEOUT);
+        next_run = MIN(next_run, node->last_pinged == 0 ? unix_time() : node->last_pinged + interval);
+    }
+
+    /* Announce requests to random path nodes every run until the list is full. */
+    if (count != MAX_ONION_CLIENTS) {
+        return unix_time();
+    }
+
+    return next_run;
+}
+
+/* Call when the friend's node list or status changed. */
+static void friend_updated(Onion_Client *onion_c, uint32_t friend_num)
+{
+    Onion_Friend *friend = &onion_c->friends_list[friend_num];
+    uint64_t deadline = friend_next_run(friend);
+
+    if (deadline == 0 || (friend->next_run != 0 && friend->next_run <= deadline)) {
+        return;
+    }
+
+    uint64_t added = timer_wheel_add(onion_c->friend_timers, deadline, friend_num);
+
+    if (added != 0) {
+        friend->next_run = added;
+    }
+}
+
 static void do_friend(Onion_Client *onion_c, uint16_t friendnum)
 {
     if (friendnum >= onion_c->num_friends) {
@@ -1422,6 +1488,18 @@ static void do_friend(Onion_Client *onion_c, uint16_t friendnum)
             }
         }
     }
+
+    friend_updated(onion_c, friendnum);
+}
+
+static void friend_timer_fired(void *object, uint32_t id, uint64_t deadline)
+{
+    Onion_Client *onion_c = object;
+
+    if (id < onion_c->num_friends && onion_c->friends_list[id].next_run == deadline) {
+        onion_c->friends_list[id].next_run = 0;
+        do_friend(onion_c, id);
+    }
 }
 
 
@@ -1553,8 +1631,6 @@ unsigned int onion_connection_status(const Onion_Client *onion_c)
 
 void do_onion_client(Onion_Client *onion_c)
 {
-    unsigned int i;
-
     if (onion_c->last_run == unix_time()) {
         return;
     }
@@ -1586,9 +1662,7 @@ void do_onion_client(Onion_Client *onion_c)
                              || get_random_tcp_onion_conn_number(onion_c->c->tcp_c) == -1; /* Check if connected to any TCP relays. */
 
     if (onion_connection_status(onion_c)) {
-        for (i = 0; i < onion_c->num_friends; ++i) {
-            do_friend(onion_c, i);
-        }
+        timer_wheel_run(onion_c->friend_timers, unix_time(), &friend_timer_fired, onion_c);
     }
 
     if (onion_c->last_run == 0) {
@@ -1598,6 +1672,11 @@ void do_onion_client(Onion_Client *onion_c)
     onion_c->last_run = unix_time();
 }
 
+uint32_t onion_client_run_interval(const Onion_Client *onion_c)
+{
+    return timeout_remaining_ms(onion_c->last_run, 1);
+}
+
 Onion_Client *new_onion_client(Net_Crypto *c)
 {
     if (c == NULL) {
@@ -1615,6 +1694,14 @@ Onion_Client *new_onion_client(Net_Crypto *c)
         return NULL;
     }
 
+    onion_c->friend_timers = timer_wheel_new(unix_time());
+
+    if (onion_c->friend_timers == NULL) {
+        ping_array_free_all(&onion_c->announce_ping_array);
+        free(onion_c);
+        return NULL;
+    }
+
     onion_c->dht = c->dht;
     onion_c->net = c->dht->net;
     onion_c->c = c;
@@ -1636,6 +1723,7 @@ void kill_onion_client(Onion_Client *onion_c)
     }
 
     ping_array_free_all(&onion_c->announce_ping_array);
+    timer_wheel_kill(onion_c->friend_timers);
     realloc_onion_friends(onion_c, 0);
     networking_registerhandler(onion_c->net, NET_PACKET_ANNOUNCE_RESPONSE, NULL, NULL);
     networking_registerhandler(onion_c->net, NET_PACKET_ONION_DATA_RESPONSE, NULL, NULL);
@@ -119,6 +119,9 @@ typedef struct {
     uint32_t dht_pk_callback_number;
 
     uint32_t run_count;
+
+    /* Deadline of the friend's pending timer in friend_timers, 0 if none. */
+    uint64_t next_run;
 } Onion_Friend;
 
 typedef int (*oniondata_handler_callback)(void *object, const uint8_t *source_pubkey, const uint8_t *data,
@@ -131,6 +134,9 @@ typedef struct {
     Onion_Friend    *friends_list;
     uint16_t       num_friends;
 
+    /* do_onion_client() only looks at offline friends whose timer fired. */
+    Timer_Wheel    *friend_timers;
+
     Onion_Node clients_announce_list[MAX_ONION_CLIENTS_ANNOUNCE];
 
     Onion_Client_Paths onion_paths_self;
@@ -276,6 +282,9 @@ void oniondata_registerhandler(Onion_Client *onion_c, uint8_t byte, oniondata_ha
 
 void do_onion_client(Onion_Client *onion_c);
 
+/* return the time in ms before do_onion_client() has work to do again (at most 1000). */
+uint32_t onion_client_run_interval(const Onion_Client *onion_c);
+
 Onion_Client *new_onion_client(Net_Crypto *c);
 
 void kill_onion_client(Onion_Client *onion_c);
@@ -0,0 +1,348 @@
+/* packet_pool.c
+ *
+ * Slab allocator for fixed size packet buffers.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "packet_pool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32) && !defined(__WIN32__) && !defined (WIN32)
+#include <sys/mman.h>
+#endif
+
+#define PACKET_POOL_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/* A slab holds at least this many items, whatever their size. */
+#define PACKET_POOL_MIN_ITEMS 8
+
+/* Every item starts with a pointer to its slab, padded to keep the item
+ * itself 16 byte aligned. Free items hold the next free item after it. */
+#define ITEM_HEADER_SIZE 16
+
+#define ROUND_UP(x, n) (((x) + (n) - 1) / (n) * (n))
+
+typedef struct Packet_Slab Packet_Slab;
+
+struct Packet_Slab {
+    Packet_Slab *prev, *next; /* all slabs */
+    Packet_Slab *free_prev, *free_next; /* slabs with free items, empty ones last */
+    uint8_t *free_items;
+    uint32_t used;
+    uint32_t num_items;
+    size_t size;
+    _Bool hugepages;
+};
+
+struct Packet_Pool {
+    pthread_mutex_t mutex;
+    uint32_t item_stride;
+    size_t slab_size;
+    _Bool use_hugepages;
+
+    Packet_Slab *slabs;
+    Packet_Slab *free_head, *free_tail;
+    uint32_t empty_slabs;
+
+    Packet_Pool_Stats stats;
+};
+
+Packet_Pool *new_packet_pool(uint32_t item_size)
+{
+    if (item_size == 0) {
+        return NULL;
+    }
+
+    Packet_Pool *pool = calloc(1, sizeof(Packet_Pool));
+
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->item_stride = ROUND_UP(ITEM_HEADER_SIZE + item_size, ITEM_HEADER_SIZE);
+    pool->slab_size = ROUND_UP(sizeof(Packet_Slab), 64) + (size_t)pool->item_stride * PACKET_POOL_MIN_ITEMS;
+
+    if (pool->slab_size < PACKET_POOL_SLAB_SIZE) {
+        pool->slab_size = PACKET_POOL_SLAB_SIZE;
+    }
+
+    return pool;
+}
+
+static void free_slab(Packet_Slab *slab)
+{
+#ifdef MAP_HUGETLB
+
+    if (slab->hugepages) {
+        munmap(slab, slab->size);
+        return;
+    }
+
+#endif
+    free(slab);
+}
+
+void kill_packet_pool(Packet_Pool *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+
+    while (pool->slabs) {
+        Packet_Slab *slab = pool->slabs;
+        pool->slabs = slab->next;
+        free_slab(slab);
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+void packet_pool_use_hugepages(Packet_Pool *pool, _Bool enabled)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->use_hugepages = enabled;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static void unlink_free_slab(Packet_Pool *pool, Packet_Slab *slab)
+{
+    if (slab->free_prev) {
+        slab->free_prev->free_next = slab->free_next;
+    } else {
+        pool->free_head = slab->free_next;
+    }
+
+    if (slab->free_next) {
+        slab->free_next->free_prev = slab->free_prev;
+    } else {
+        pool->free_tail = slab->free_prev;
+    }
+
+    slab->free_prev = NULL;
+    slab->free_next = NULL;
+}
+
+static void push_free_slab(Packet_Pool *pool, Packet_Slab *slab, _Bool tail)
+{
+    if (tail) {
+        slab->free_prev = pool->free_tail;
+        slab->free_next = NULL;
+
+        if (pool->free_tail) {
+            pool->free_tail->free_next = slab;
+        } else {
+            pool->free_head = slab;
+        }
+
+        pool->free_tail = slab;
+    } else {
+        slab->free_prev = NULL;
+        slab->free_next = pool->free_head;
+
+        if (pool->free_head) {
+            pool->free_head->free_prev = slab;
+        } else {
+            pool->free_tail = slab;
+        }
+
+        pool->free_head = slab;
+    }
+}
+
+static Packet_Slab *new_slab(Packet_Pool *pool)
+{
+    Packet_Slab *slab = NULL;
+    size_t size = pool->slab_size;
+    _Bool hugepages = 0;
+
+#ifdef MAP_HUGETLB
+
+    if (pool->use_hugepages && size <= PACKET_POOL_HUGEPAGE_SIZE) {
+        void *memory = mmap(NULL, PACKET_POOL_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if (memory != MAP_FAILED) {
+            slab = memory;
+            size = PACKET_POOL_HUGEPAGE_SIZE;
+            hugepages = 1;
+        }
+    }
+
+#endif
+
+    if (slab == NULL) {
+        slab = malloc(size);
+
+        if (slab == NULL) {
+            return NULL;
+        }
+    }
+
+    memset(slab, 0, sizeof(Packet_Slab));
+    slab->size = size;
+    slab->hugepages = hugepages;
+
+    size_t items_offset = ROUND_UP(sizeof(Packet_Slab), 64);
+    slab->num_items = (size - items_offset) / pool->item_stride;
+
+    /* Chain the items so the first one is handed out first. */
+    uint8_t *items = (uint8_t *)slab + items_offset;
+    uint32_t i = slab->num_items;
+
+    while (i--) {
+        uint8_t *item = items + (size_t)i * pool->item_stride;
+        memcpy(item, &slab, sizeof(Packet_Slab *));
+        memcpy(item + ITEM_HEADER_SIZE, &slab->free_items, sizeof(uint8_t *));
+        slab->free_items = item;
+    }
+
+    slab->next = pool->slabs;
+
+    if (pool->slabs) {
+        pool->slabs->prev = slab;
+    }
+
+    pool->slabs = slab;
+    push_free_slab(pool, slab, 1);
+    ++pool->empty_slabs;
+
+    ++pool->stats.slabs;
+    pool->stats.hugepage_slabs += hugepages;
+    pool->stats.items_free += slab->num_items;
+    ++pool->stats.slab_allocations;
+    return slab;
+}
+
+void *packet_pool_alloc(Packet_Pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+
+    Packet_Slab *slab = pool->free_head;
+
+    if (slab == NULL) {
+        slab = new_slab(pool);
+
+        if (slab == NULL) {
+            pthread_mutex_unlock(&pool->mutex);
+            return NULL;
+        }
+    }
+
+    uint8_t *item = slab->free_items;
+    memcpy(&slab->free_items, item + ITEM_HEADER_SIZE, sizeof(uint8_t *));
+
+    if (slab->used == 0) {
+        --pool->empty_slabs;
+    }
+
+    ++slab->used;
+
+    if (slab->free_items == NULL) {
+        unlink_free_slab(pool, slab);
+    }
+
+    ++pool->stats.allocations;
+    --pool->stats.items_free;
+    ++pool->stats.items_used;
+
+    if (pool->stats.items_used > pool->stats.items_peak) {
+        pool->stats.items_peak = pool->stats.items_used;
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    return item + ITEM_HEADER_SIZE;
+}
+
+void packet_pool_free(Packet_Pool *pool, void *data)
+{
+    if (data == NULL) {
+        return;
+    }
+
+    uint8_t *item = (uint8_t *)data - ITEM_HEADER_SIZE;
+    Packet_Slab *slab;
+    memcpy(&slab, item, sizeof(Packet_Slab *));
+
+    pthread_mutex_lock(&pool->mutex);
+
+    _Bool was_full = slab->free_items == NULL;
+    memcpy(item + ITEM_HEADER_SIZE, &slab->free_items, sizeof(uint8_t *));
+    slab->free_items = item;
+    --slab->used;
+
+    --pool->stats.items_used;
+    ++pool->stats.items_free;
+
+    if (slab->used == 0) {
+        if (pool->empty_slabs != 0) {
+            /* Keep only one empty slab around. */
+            if (!was_full) {
+                unlink_free_slab(pool, slab);
+            }
+
+            if (slab->prev) {
+                slab->prev->next = slab->next;
+            } else {
+                pool->slabs = slab->next;
+            }
+
+            if (slab->next) {
+                slab->next->prev = slab->prev;
+            }
+
+            --pool->stats.slabs;
+            pool->stats.hugepage_slabs -= slab->hugepages;
+            pool->stats.items_free -= slab->num_items;
+            free_slab(slab);
+        } else {
+            /* Empty slabs are used last. */
+            if (!was_full) {
+                unlink_free_slab(pool, slab);
+            }
+
+            push_free_slab(pool, slab, 1);
+            ++pool->empty_slabs;
+        }
+    } else if (was_full) {
+        push_free_slab(pool, slab, 0);
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void packet_pool_get_stats(Packet_Pool *pool, Packet_Pool_Stats *stats)
+{
+    pthread_mutex_lock(&pool->mutex);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->mutex);
+}
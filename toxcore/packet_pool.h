@@ -0,0 +1,70 @@
+/* packet_pool.h
+ *
+ * Slab allocator for fixed size packet buffers.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+#include <stdint.h>
+
+/* Items are carved out of slabs of this size (or huge pages, see
+ * packet_pool_use_hugepages()). A slab that is completely free is given back
+ * to the system unless it is the only free one left.
+ */
+#define PACKET_POOL_SLAB_SIZE (128 * 1024)
+
+typedef struct Packet_Pool Packet_Pool;
+
+typedef struct {
+    uint32_t slabs; /* slabs currently taken from the system */
+    uint32_t hugepage_slabs; /* how many of them are huge pages */
+    uint32_t items_used;
+    uint32_t items_free; /* free items in the slabs we have */
+    uint32_t items_peak; /* highest items_used so far */
+    uint64_t allocations; /* successful packet_pool_alloc() calls */
+    uint64_t slab_allocations; /* times a new slab had to be taken from the system */
+} Packet_Pool_Stats;
+
+/* Create a pool of items of item_size bytes.
+ *
+ * return NULL on failure.
+ */
+Packet_Pool *new_packet_pool(uint32_t item_size);
+
+/* Free the pool and all of its slabs, including items still in use. */
+void kill_packet_pool(Packet_Pool *pool);
+
+/* Try to back new slabs with huge pages if enabled is 1.
+ * Falls back to normal memory where they are not available.
+ */
+void packet_pool_use_hugepages(Packet_Pool *pool, _Bool enabled);
+
+/* return a new item, not zeroed.
+ * return NULL on failure.
+ */
+void *packet_pool_alloc(Packet_Pool *pool);
+
+/* Give item back to the pool it was allocated from. */
+void packet_pool_free(Packet_Pool *pool, void *item);
+
+void packet_pool_get_stats(Packet_Pool *pool, Packet_Pool_Stats *stats);
+
+#endif
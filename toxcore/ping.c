@@ -103,13 +103,13 @@ int send_ping_request(PING *ping, IP_Port ipp, const uint8_t *public_key)
     return sendpacket(ping->dht->net, ipp, pk, sizeof(pk));
 }
 
-static int send_ping_response(PING *ping, IP_Port ipp, const uint8_t *public_key, uint64_t ping_id,
-                              uint8_t *shared_encryption_key)
+static int send_ping_response(const DHT *dht, Networking_Core *net, IP_Port ipp, const uint8_t *public_key,
+                              uint64_t ping_id, uint8_t *shared_encryption_key)
 {
     uint8_t   pk[DHT_PING_SIZE];
     int       rc;
 
-    if (id_equal(public_key, ping->dht->self_public_key)) {
+    if (id_equal(public_key, dht->self_public_key)) {
         return 1;
     }
 
@@ -118,7 +118,7 @@ static int send_ping_response(PING *ping, IP_Port ipp, const uint8_t *public_key
     memcpy(ping_plain + 1, &ping_id, sizeof(ping_id));
 
     pk[0] = NET_PACKET_PING_RESPONSE;
-    id_copy(pk + 1, ping->dht->self_public_key);     // Our pubkey
+    id_copy(pk + 1, dht->self_public_key);     // Our pubkey
     new_nonce(pk + 1 + crypto_box_PUBLICKEYBYTES); // Generate new nonce
 
     // Encrypt ping_id using recipient privkey
@@ -131,29 +131,27 @@ static int send_ping_response(PING *ping, IP_Port ipp, const uint8_t *public_key
         return 1;
     }
 
-    return sendpacket(ping->dht->net, ipp, pk, sizeof(pk));
+    return sendpacket(net, ipp, pk, sizeof(pk));
 }
 
-static int handle_ping_request(void *_dht, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+int ping_answer_request(const DHT *dht, Networking_Core *net, Shared_Keys *shared_keys, IP_Port source,
+                        const uint8_t *packet, uint16_t length)
 {
-    DHT       *dht = _dht;
     int        rc;
 
     if (length != DHT_PING_SIZE) {
-        return 1;
+        return -1;
     }
 
-    PING *ping = dht->ping;
-
-    if (id_equal(packet + 1, ping->dht->self_public_key)) {
-        return 1;
+    if (id_equal(packet + 1, dht->self_public_key)) {
+        return -1;
     }
 
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
 
     uint8_t ping_plain[PING_PLAIN_SIZE];
     // Decrypt ping_id
-    DHT_get_shared_key_recv(dht, shared_key, packet + 1);
+    get_shared_key(shared_keys, shared_key, dht->self_secret_key, packet + 1);
     rc = decrypt_data_symmetric(shared_key,
                                 packet + 1 + crypto_box_PUBLICKEYBYTES,
                                 packet + 1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES,
@@ -161,18 +159,30 @@ static int handle_ping_request(void *_dht, IP_Port source, const uint8_t *packet
                                 ping_plain );
 
     if (rc != sizeof(ping_plain)) {
-        return 1;
+        return -1;
     }
 
     if (ping_plain[0] != NET_PACKET_PING_REQUEST) {
-        return 1;
+        return -1;
     }
 
     uint64_t   ping_id;
     memcpy(&ping_id, ping_plain + 1, sizeof(ping_id));
     // Send response
-    send_ping_response(ping, source, packet + 1, ping_id, shared_key);
-    add_to_ping(ping, packet + 1, source);
+    send_ping_response(dht, net, source, packet + 1, ping_id, shared_key);
+
+    return 0;
+}
+
+static int handle_ping_request(void *_dht, IP_Port source, const uint8_t *packet, uint16_t length, void *userdata)
+{
+    DHT       *dht = _dht;
+
+    if (ping_answer_request(dht, dht->net, dht->shared_keys_recv, source, packet, length) == -1) {
+        return 1;
+    }
+
+    add_to_ping(dht->ping, packet + 1, source);
 
     return 0;
 }
@@ -284,7 +294,8 @@ int add_to_ping(PING *ping, const uint8_t *public_key, IP_Port ip_port)
         return -1;
     }
 
-    if (in_list(ping->dht->close_clientlist, LCLIENT_LIST, public_key, ip_port)) {
+    if (in_list(&ping->dht->close_clientlist[close_list_bucket(ping->dht, public_key)], LCLIENT_NODES, public_key,
+                ip_port)) {
         return -1;
     }
 
@@ -49,4 +49,16 @@ void kill_ping(PING *ping);
 
 int send_ping_request(PING *ping, IP_Port ipp, const uint8_t *public_key);
 
+/* Answer a ping request from source, getting the shared key from shared_keys
+ * and sending the response from net.
+ *
+ * Like DHT_answer_getnodes() this only reads dht, so it can run on another
+ * thread; the caller passes the sender on to add_to_ping() on the DHT's thread.
+ *
+ *  return 0 if the request was valid and answered.
+ *  return -1 if it was invalid.
+ */
+int ping_answer_request(const DHT *dht, Networking_Core *net, Shared_Keys *shared_keys, IP_Port source,
+                        const uint8_t *packet, uint16_t length);
+
 #endif /* __PING_H__ */
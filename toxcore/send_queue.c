@@ -0,0 +1,156 @@
+/* send_queue.c
+ *
+ * Lock-free multi producer, single consumer queue of packets to send.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "send_queue.h"
+
+#include "mailbox.h"
+
+#include <sched.h>
+#include <stdlib.h>
+
+/* The packets wait in a Mailbox, the thread sending them is the one taking
+ * them out of it.
+ *
+ * pending counts the packets added and not yet sent. The thread that raises
+ * it from 0 sends packets until it is back to 0, every other one returns
+ * right after adding its packet. So that it doesn't keep sending for ever
+ * when the others add packets as fast as it sends them, it stops after
+ * max_size packets and sets left, the next thread adding a packet or calling
+ * send_queue_send_left() takes over. Uses the GCC/clang __atomic builtins.
+ */
+struct Send_Queue {
+    Mailbox *mailbox;
+    uint32_t pending;
+    uint32_t max_size;
+    uint8_t left;
+};
+
+Send_Queue *new_send_queue(uint32_t max_size)
+{
+    Send_Queue *queue = calloc(1, sizeof(Send_Queue));
+
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    queue->mailbox = new_mailbox(max_size);
+
+    if (queue->mailbox == NULL) {
+        free(queue);
+        return NULL;
+    }
+
+    queue->max_size = max_size;
+    return queue;
+}
+
+void kill_send_queue(Send_Queue *queue)
+{
+    if (queue == NULL) {
+        return;
+    }
+
+    kill_mailbox(queue->mailbox);
+    free(queue);
+}
+
+void send_queue_clear(Send_Queue *queue)
+{
+    mailbox_clear(queue->mailbox);
+    queue->pending = 0;
+    queue->left = 0;
+}
+
+/* Send packets until none are pending, or max_size of them.
+ * Must only be called by the thread that raised pending from 0 or took left.
+ */
+static void send_pending(Send_Queue *queue, send_queue_cb *function, void *object)
+{
+    uint32_t sent = 0, total = 0;
+
+    while (1) {
+        if (mailbox_take_with(queue->mailbox, function, object) == 0) {
+            ++sent;
+
+            if (++total < queue->max_size) {
+                continue;
+            }
+        } else if (sent == 0) {
+            /* A packet is pending but the thread adding it hasn't linked it
+             * in yet. It is just about to, unless it got preempted right
+             * before: let it run. */
+            sched_yield();
+            continue;
+        }
+
+        if (__atomic_sub_fetch(&queue->pending, sent, __ATOMIC_ACQ_REL) == 0) {
+            return;
+        }
+
+        sent = 0;
+
+        if (total >= queue->max_size) {
+            __atomic_store_n(&queue->left, 1, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
+
+void send_queue_send_left(Send_Queue *queue, send_queue_cb *function, void *object)
+{
+    if (__atomic_load_n(&queue->left, __ATOMIC_RELAXED) && __atomic_exchange_n(&queue->left, 0, __ATOMIC_ACQUIRE)) {
+        send_pending(queue, function, object);
+    }
+}
+
+int send_queue_add(Send_Queue *queue, const uint8_t *data, uint16_t length, send_queue_cb *function, void *object)
+{
+    Mailbox_Item *item = mailbox_reserve(queue->mailbox, data, length, 0);
+
+    if (item == NULL) {
+        return -1;
+    }
+
+    /* Counted once it is sure to be added, as the thread sending can only
+     * stop when pending is 0, and before it is linked in so that it can't be
+     * sent uncounted. */
+    _Bool send = __atomic_fetch_add(&queue->pending, 1, __ATOMIC_ACQ_REL) == 0;
+    mailbox_commit(queue->mailbox, item);
+
+    if (send) {
+        send_pending(queue, function, object);
+    } else {
+        send_queue_send_left(queue, function, object);
+    }
+
+    return 0;
+}
+
+uint32_t send_queue_size(const Send_Queue *queue)
+{
+    return mailbox_size(queue->mailbox);
+}
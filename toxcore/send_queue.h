@@ -0,0 +1,73 @@
+/* send_queue.h
+ *
+ * Lock-free multi producer, single consumer queue of packets to send.
+ *
+ *  Copyright (C) 2016 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef SEND_QUEUE_H
+#define SEND_QUEUE_H
+
+#include <stdint.h>
+
+/* Any number of threads can add packets to a Send_Queue at the same time
+ * without ever waiting on each other. The packets are sent one at a time in
+ * the order each thread added them: a thread adding a packet while no other
+ * one is sending sends it and every packet added until the queue is empty
+ * again (or at most max_size of them), the others return right after adding
+ * theirs.
+ */
+typedef struct Send_Queue Send_Queue;
+
+typedef void send_queue_cb(void *object, const uint8_t *data, uint16_t length);
+
+/* Create a queue holding at most max_size packets.
+ *
+ * return NULL on failure.
+ */
+Send_Queue *new_send_queue(uint32_t max_size);
+
+/* Free the queue and the packets still in it.
+ * No other thread may be using it.
+ */
+void kill_send_queue(Send_Queue *queue);
+
+/* Drop the packets in the queue.
+ * No other thread may be using it.
+ */
+void send_queue_clear(Send_Queue *queue);
+
+/* Add a copy of data to the queue. Safe to call from any thread.
+ *
+ * If no other thread is sending the packets in the queue, send them by
+ * calling function with object until it is empty.
+ *
+ * return -1 if the queue is full or out of memory.
+ * return 0 on success.
+ */
+int send_queue_add(Send_Queue *queue, const uint8_t *data, uint16_t length, send_queue_cb *function, void *object);
+
+/* Send the packets a thread stopped sending after max_size of them, if no
+ * other thread added one since. Safe to call from any thread.
+ */
+void send_queue_send_left(Send_Queue *queue, send_queue_cb *function, void *object);
+
+/* return number of packets in the queue. */
+uint32_t send_queue_size(const Send_Queue *queue);
+
+#endif
@@ -34,6 +34,9 @@
 #define TOX_DEFINED
 typedef struct Messenger Tox;
 
+#define TOX_CONNECTION_STATS_DEFINED
+typedef Crypto_Connection_Stats Tox_Connection_Stats;
+
 #include "tox.h"
 
 #define SET_ERROR_PARAMETER(param, x) {if(param) {*param = x;}}
@@ -134,6 +137,9 @@ ACCESSORS(uint16_t, , end_port)
 ACCESSORS(uint16_t, , tcp_port)
 ACCESSORS(TOX_SAVEDATA_TYPE, savedata_, type)
 ACCESSORS(size_t, savedata_, length)
+ACCESSORS(TOX_CONGESTION_CONTROL, , congestion_control)
+ACCESSORS(bool, , coalescing_enabled)
+ACCESSORS(bool, , hugepages_enabled)
 
 const uint8_t *tox_options_get_savedata_data(const struct Tox_Options *options)
 {
@@ -154,6 +160,7 @@ void tox_options_default(struct Tox_Options *options)
         options->ipv6_enabled = 1;
         options->udp_enabled = 1;
         options->proxy_type = TOX_PROXY_TYPE_NONE;
+        options->congestion_control = TOX_CONGESTION_CONTROL_CLASSIC;
     }
 }
 
@@ -218,6 +225,8 @@ Tox *tox_new(const struct Tox_Options *options, TOX_ERR_NEW *error)
         m_options.port_range[0] = options->start_port;
         m_options.port_range[1] = options->end_port;
         m_options.tcp_server_port = options->tcp_port;
+        m_options.coalesce_packets = options->coalescing_enabled;
+        m_options.hugepages = options->hugepages_enabled;
 
         switch (options->proxy_type) {
             case TOX_PROXY_TYPE_HTTP:
@@ -237,6 +246,16 @@ Tox *tox_new(const struct Tox_Options *options, TOX_ERR_NEW *error)
                 return NULL;
         }
 
+        switch (options->congestion_control) {
+            case TOX_CONGESTION_CONTROL_BBR:
+                m_options.congestion_controller = CRYPTO_CONGESTION_BBR;
+                break;
+
+            default:
+                m_options.congestion_controller = CRYPTO_CONGESTION_CLASSIC;
+                break;
+        }
+
         if (m_options.proxy_info.proxy_type != TCP_PROXY_NONE) {
             if (options->proxy_port == 0) {
                 SET_ERROR_PARAMETER(error, TOX_ERR_NEW_PROXY_BAD_PORT);
@@ -473,6 +492,34 @@ uint32_t tox_iteration_interval(const Tox *tox)
     return messenger_run_interval(m);
 }
 
+size_t tox_get_fds_size(const Tox *tox)
+{
+    const Messenger *m = tox;
+    return messenger_get_socks(m, NULL, UINT32_MAX);
+}
+
+void tox_get_fds(const Tox *tox, int32_t *fds)
+{
+    if (!fds) {
+        return;
+    }
+
+    const Messenger *m = tox;
+    uint32_t num = messenger_get_socks(m, NULL, UINT32_MAX);
+
+    if (num == 0) {
+        return;
+    }
+
+    sock_t socks[num];
+    uint32_t i;
+    num = messenger_get_socks(m, socks, num);
+
+    for (i = 0; i < num; ++i) {
+        fds[i] = socks[i];
+    }
+}
+
 void tox_iterate(Tox *tox, void *user_data)
 {
     Messenger *m = tox;
@@ -877,6 +924,82 @@ void tox_callback_friend_connection_status(Tox *tox, tox_friend_connection_statu
     m_callback_connectionstatus(m, callback, user_data);
 }
 
+#define STATS_ACCESSOR(type, name, field) \
+type tox_connection_stats_get_##name(const Tox_Connection_Stats *connection_stats) \
+{ \
+    return connection_stats->field; \
+}
+
+STATS_ACCESSOR(uint64_t, rtt, rtt)
+STATS_ACCESSOR(uint64_t, rto, rto)
+STATS_ACCESSOR(uint32_t, send_rate, packet_send_rate)
+STATS_ACCESSOR(uint32_t, recv_rate, packet_recv_rate)
+STATS_ACCESSOR(uint64_t, packets_sent, packets_sent)
+STATS_ACCESSOR(uint64_t, packets_resent, packets_resent)
+STATS_ACCESSOR(uint64_t, packets_received, packets_received)
+STATS_ACCESSOR(uint32_t, send_queue_size, send_queue_size)
+STATS_ACCESSOR(uint32_t, recv_queue_size, recv_queue_size)
+STATS_ACCESSOR(uint32_t, lossy_queue_size, lossy_queue_size)
+STATS_ACCESSOR(uint64_t, time_since_congestion, time_since_congestion)
+STATS_ACCESSOR(uint32_t, tcp_relays, online_tcp_relays)
+
+TOX_CONNECTION tox_connection_stats_get_connection(const Tox_Connection_Stats *connection_stats)
+{
+    if (connection_stats->direct_connected) {
+        return TOX_CONNECTION_UDP;
+    }
+
+    if (connection_stats->online_tcp_relays) {
+        return TOX_CONNECTION_TCP;
+    }
+
+    return TOX_CONNECTION_NONE;
+}
+
+Tox_Connection_Stats *tox_connection_stats_new(TOX_ERR_CONNECTION_STATS_NEW *error)
+{
+    Tox_Connection_Stats *connection_stats = calloc(sizeof(Tox_Connection_Stats), 1);
+
+    if (connection_stats) {
+        connection_stats->time_since_congestion = UINT64_MAX;
+        SET_ERROR_PARAMETER(error, TOX_ERR_CONNECTION_STATS_NEW_OK);
+        return connection_stats;
+    }
+
+    SET_ERROR_PARAMETER(error, TOX_ERR_CONNECTION_STATS_NEW_MALLOC);
+    return NULL;
+}
+
+void tox_connection_stats_free(Tox_Connection_Stats *connection_stats)
+{
+    free(connection_stats);
+}
+
+bool tox_friend_get_connection_stats(const Tox *tox, uint32_t friend_number, Tox_Connection_Stats *stats,
+                                     TOX_ERR_FRIEND_QUERY *error)
+{
+    if (!stats) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_NULL);
+        return 0;
+    }
+
+    const Messenger *m = tox;
+
+    if (m_get_friend_connection_stats(m, friend_number, stats) == -1) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_FRIEND_NOT_FOUND);
+        return 0;
+    }
+
+    SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_QUERY_OK);
+    return 1;
+}
+
+void tox_callback_friend_connection_stats(Tox *tox, tox_friend_connection_stats_cb *callback, void *user_data)
+{
+    Messenger *m = tox;
+    m_callback_connection_stats(m, callback, user_data);
+}
+
 bool tox_friend_get_typing(const Tox *tox, uint32_t friend_number, TOX_ERR_FRIEND_QUERY *error)
 {
     const Messenger *m = tox;
@@ -418,6 +418,25 @@ typedef enum TOX_SAVEDATA_TYPE {
 } TOX_SAVEDATA_TYPE;
 
 
+/**
+ * Congestion controller used to pace the data sent to friends.
+ */
+typedef enum TOX_CONGESTION_CONTROL {
+
+    /**
+     * Based on the size of the send queue.
+     */
+    TOX_CONGESTION_CONTROL_CLASSIC,
+
+    /**
+     * Based on the bottleneck bandwidth and round trip time of the path (BBR).
+     * Only changes how fast we send, so friends don't need to support it.
+     */
+    TOX_CONGESTION_CONTROL_BBR,
+
+} TOX_CONGESTION_CONTROL;
+
+
 /**
  * This struct contains all the startup options for Tox. You can either
  * allocate this object yourself, and pass it to tox_options_default, or call tox_options_new to get
@@ -540,6 +559,30 @@ struct Tox_Options {
      */
     size_t savedata_length;
 
+
+    /**
+     * The congestion controller of the connections to friends.
+     */
+    TOX_CONGESTION_CONTROL congestion_control;
+
+
+    /**
+     * Send small lossless packets (messages, file control) written while
+     * others wait to be acknowledged together in one packet, waiting up to
+     * 10 ms for more of them. Fewer packets are sent at the cost of some
+     * latency. Only done with friends whose client can unpack them.
+     */
+    bool coalescing_enabled;
+
+
+    /**
+     * Try to back the buffers of packets waiting to be sent or delivered
+     * with huge pages, which take fewer TLB entries with many busy
+     * connections. Falls back to normal memory where the system has no huge
+     * pages to give.
+     */
+    bool hugepages_enabled;
+
 };
 
 
@@ -587,6 +630,18 @@ size_t tox_options_get_savedata_length(const struct Tox_Options *options);
 
 void tox_options_set_savedata_length(struct Tox_Options *options, size_t length);
 
+TOX_CONGESTION_CONTROL tox_options_get_congestion_control(const struct Tox_Options *options);
+
+void tox_options_set_congestion_control(struct Tox_Options *options, TOX_CONGESTION_CONTROL congestion_control);
+
+bool tox_options_get_coalescing_enabled(const struct Tox_Options *options);
+
+void tox_options_set_coalescing_enabled(struct Tox_Options *options, bool coalescing_enabled);
+
+bool tox_options_get_hugepages_enabled(const struct Tox_Options *options);
+
+void tox_options_set_hugepages_enabled(struct Tox_Options *options, bool hugepages_enabled);
+
 /**
  * Initialises a Tox_Options object with the default options.
  *
@@ -944,6 +999,28 @@ uint32_t tox_iteration_interval(const Tox *tox);
  */
 void tox_iterate(Tox *tox, void *user_data);
 
+/**
+ * Return the number of sockets tox_iterate() reads from.
+ *
+ * This function can be used to determine how much memory to allocate for
+ * tox_get_fds. The number changes as TCP connections come and go, so call it again
+ * after every tox_iterate().
+ */
+size_t tox_get_fds_size(const Tox *tox);
+
+/**
+ * Copy the sockets (file descriptors) tox_iterate() reads from into an array.
+ *
+ * Instead of sleeping for tox_iteration_interval() milliseconds between calls
+ * to tox_iterate(), a client can block on these sockets (e.g. with poll(),
+ * select() or epoll) for up to that time, and call tox_iterate() as soon as one
+ * of them is readable.
+ *
+ * @param fds A memory region with enough space to hold tox_get_fds_size elements. If
+ *   this parameter is NULL, this function has no effect.
+ */
+void tox_get_fds(const Tox *tox, int32_t *fds);
+
 
 /*******************************************************************************
  *
@@ -1557,6 +1634,160 @@ typedef void tox_friend_typing_cb(Tox *tox, uint32_t friend_number, bool is_typi
 void tox_callback_friend_typing(Tox *tox, tox_friend_typing_cb *callback);
 
 
+/*******************************************************************************
+ *
+ * :: Friend connection statistics
+ *
+ ******************************************************************************/
+
+
+
+/**
+ * Transport statistics of the connection to a friend, for diagnosing slow or
+ * unreliable connections. Filled by tox_friend_get_connection_stats or passed
+ * to the `friend_connection_stats` callback, and read with the
+ * accessor functions below.
+ */
+#ifndef TOX_CONNECTION_STATS_DEFINED
+#define TOX_CONNECTION_STATS_DEFINED
+typedef struct Tox_Connection_Stats Tox_Connection_Stats;
+#endif /* TOX_CONNECTION_STATS_DEFINED */
+
+/**
+ * The smoothed round trip time to the friend in milliseconds.
+ */
+uint64_t tox_connection_stats_get_rtt(const Tox_Connection_Stats *connection_stats);
+
+/**
+ * The time in milliseconds after which a packet not acknowledged by the
+ * friend is sent again, 0 before the first round trip time measurement.
+ */
+uint64_t tox_connection_stats_get_rto(const Tox_Connection_Stats *connection_stats);
+
+/**
+ * The number of packets per second the connection is allowed to send.
+ */
+uint32_t tox_connection_stats_get_send_rate(const Tox_Connection_Stats *connection_stats);
+
+/**
+ * The number of packets per second received from the friend.
+ */
+uint32_t tox_connection_stats_get_recv_rate(const Tox_Connection_Stats *connection_stats);
+
+/**
+ * The number of lossless packets sent to the friend, not counting the
+ * packets sent again.
+ */
+uint64_t tox_connection_stats_get_packets_sent(const Tox_Connection_Stats *connection_stats);
+
+/**
+ * The number of lossless packets sent again because they were lost.
+ */
+uint64_t tox_connection_stats_get_packets_resent(const Tox_Connection_Stats *connection_stats);
+
+/**
+ * The number of lossless packets received from the friend.
+ */
+uint64_t tox_connection_stats_get_packets_received(const Tox_Connection_Stats *connection_stats);
+
+/**
+ * The number of lossless packets sent but not acknowledged by the friend yet.
+ */
+uint32_t tox_connection_stats_get_send_queue_size(const Tox_Connection_Stats *connection_stats);
+
+/**
+ * The number of lossless packets received that wait for an earlier lost
+ * packet to be delivered.
+ */
+uint32_t tox_connection_stats_get_recv_queue_size(const Tox_Connection_Stats *connection_stats);
+
+/**
+ * The number of lossy packets waiting to be sent.
+ */
+uint32_t tox_connection_stats_get_lossy_queue_size(const Tox_Connection_Stats *connection_stats);
+
+/**
+ * The time in milliseconds since the connection last had to slow down
+ * because packets were lost, UINT64_MAX if it never had to.
+ */
+uint64_t tox_connection_stats_get_time_since_congestion(const Tox_Connection_Stats *connection_stats);
+
+/**
+ * Whether packets go directly to the friend over UDP or through TCP relays.
+ * TOX_CONNECTION_NONE if the friend is offline.
+ */
+TOX_CONNECTION tox_connection_stats_get_connection(const Tox_Connection_Stats *connection_stats);
+
+/**
+ * The number of TCP relays the friend can be reached through.
+ */
+uint32_t tox_connection_stats_get_tcp_relays(const Tox_Connection_Stats *connection_stats);
+
+typedef enum TOX_ERR_CONNECTION_STATS_NEW {
+
+    /**
+     * The function returned successfully.
+     */
+    TOX_ERR_CONNECTION_STATS_NEW_OK,
+
+    /**
+     * The function failed to allocate enough memory for the stats struct.
+     */
+    TOX_ERR_CONNECTION_STATS_NEW_MALLOC,
+
+} TOX_ERR_CONNECTION_STATS_NEW;
+
+
+/**
+ * Allocates a new Tox_Connection_Stats object to pass to tox_friend_get_connection_stats.
+ *
+ * Objects returned from this function must be freed using the tox_connection_stats_free
+ * function.
+ *
+ * @return A new Tox_Connection_Stats object or NULL on failure.
+ */
+Tox_Connection_Stats *tox_connection_stats_new(TOX_ERR_CONNECTION_STATS_NEW *error);
+
+/**
+ * Releases all resources associated with a stats object.
+ *
+ * Passing a pointer that was not returned by tox_connection_stats_new results in
+ * undefined behaviour.
+ */
+void tox_connection_stats_free(Tox_Connection_Stats *connection_stats);
+
+/**
+ * Fill stats with the current transport statistics of the connection to a
+ * friend. All of them are 0 if the friend is offline.
+ *
+ * @param friend_number The friend number for which to query the statistics.
+ * @param stats An object returned by tox_connection_stats_new.
+ *
+ * @return true on success.
+ */
+bool tox_friend_get_connection_stats(const Tox *tox, uint32_t friend_number, Tox_Connection_Stats *stats,
+                                     TOX_ERR_FRIEND_QUERY *error);
+
+/**
+ * @param friend_number The friend number of the friend the statistics are
+ *   for.
+ * @param stats The result of calling tox_friend_get_connection_stats on the passed
+ *   friend_number. Only valid during the callback.
+ */
+typedef void tox_friend_connection_stats_cb(Tox *tox, uint32_t friend_number, const Tox_Connection_Stats *stats,
+        void *user_data);
+
+
+/**
+ * Set the callback for the `friend_connection_stats` event. Pass NULL to unset.
+ *
+ * This event is triggered about once per second for each online friend, so
+ * clients can keep track of the connections without polling them. Nothing is
+ * gathered while no callback is set.
+ */
+void tox_callback_friend_connection_stats(Tox *tox, tox_friend_connection_stats_cb *callback, void *user_data);
+
+
 /*******************************************************************************
  *
  * :: Sending private messages
@@ -34,22 +34,39 @@
 #include "util.h"
 
 
-/* don't call into system billions of times for no reason */
+/* don't call into system billions of times for no reason
+ *
+ * Worker threads (receive workers, TCP relay shards) update these too, so
+ * they are only accessed atomically. */
 static uint64_t unix_time_value;
 static uint64_t unix_base_time_value;
 
 void unix_time_update(void)
 {
-    if (unix_base_time_value == 0) {
-        unix_base_time_value = ((uint64_t)time(NULL) - (current_time_monotonic() / 1000ULL));
+    uint64_t base = __atomic_load_n(&unix_base_time_value, __ATOMIC_ACQUIRE);
+
+    if (base == 0) {
+        uint64_t new_base = (uint64_t)time(NULL) - (current_time_monotonic() / 1000ULL);
+
+        /* The first thread to get here sets it, the others use that. */
+        if (__atomic_compare_exchange_n(&unix_base_time_value, &base, new_base, 0, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE)) {
+            base = new_base;
+        }
     }
 
-    unix_time_value = (current_time_monotonic() / 1000ULL) + unix_base_time_value;
+    uint64_t now = (current_time_monotonic() / 1000ULL) + base;
+    uint64_t old = __atomic_load_n(&unix_time_value, __ATOMIC_RELAXED);
+
+    /* A thread that read the clock before another one stored a later time
+     * must not move it back. */
+    while (old < now && !__atomic_compare_exchange_n(&unix_time_value, &old, now, 1, __ATOMIC_RELAXED,
+            __ATOMIC_RELAXED));
 }
 
 uint64_t unix_time(void)
 {
-    return unix_time_value;
+    return __atomic_load_n(&unix_time_value, __ATOMIC_RELAXED);
 }
 
 int is_timeout(uint64_t timestamp, uint64_t timeout)
@@ -57,6 +74,38 @@ int is_timeout(uint64_t timestamp, uint64_t timeout)
     return timestamp + timeout <= unix_time();
 }
 
+uint64_t timeout_remaining_ms(uint64_t timestamp, uint64_t timeout)
+{
+    uint64_t base = __atomic_load_n(&unix_base_time_value, __ATOMIC_ACQUIRE);
+
+    if (base == 0) {
+        return 0;
+    }
+
+    /* unix_time() reaches timestamp + timeout once the monotonic clock
+     * reaches this many milliseconds. */
+    uint64_t deadline = (timestamp + timeout - base) * 1000ULL;
+    uint64_t now = current_time_monotonic();
+
+    if (timestamp + timeout <= base || deadline <= now) {
+        return 0;
+    }
+
+    return deadline - now;
+}
+
+bool take_token(uint64_t *full_time, uint64_t now, uint64_t interval, uint32_t burst)
+{
+    uint64_t time = *full_time < now ? now : *full_time;
+
+    if (time + interval > now + burst * interval) {
+        return 0;
+    }
+
+    *full_time = time + interval;
+    return 1;
+}
+
 
 /* id functions */
 bool id_equal(const uint8_t *dest, const uint8_t *src)
@@ -284,3 +333,230 @@ uint16_t rb_data(const RingBuffer *b, void **dest)
 
     return i;
 }
+
+
+/* Timer wheel: level L has TIMER_WHEEL_SLOTS slots of TIMER_WHEEL_SLOTS^L ticks each.
+ * A timer goes on the lowest level whose current slot block its deadline
+ * falls in, and moves down a level each time the wheel enters its slot.
+ * Timers further away than the top level covers wait in a separate list. */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+typedef struct {
+    uint64_t deadline;
+    uint32_t id;
+} Timer;
+
+typedef struct {
+    Timer *timers;
+    uint32_t length;
+    uint32_t capacity;
+} Timer_Slot;
+
+struct Timer_Wheel {
+    /* All ticks before next have been run. */
+    uint64_t next;
+    uint32_t count[TIMER_WHEEL_LEVELS];
+    uint32_t num_timers;
+    Timer_Slot slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    Timer_Slot far;
+};
+
+Timer_Wheel *timer_wheel_new(uint64_t start)
+{
+    Timer_Wheel *wheel = calloc(1, sizeof(Timer_Wheel));
+
+    if (wheel == NULL) {
+        return NULL;
+    }
+
+    wheel->next = start;
+    return wheel;
+}
+
+void timer_wheel_kill(Timer_Wheel *wheel)
+{
+    if (wheel == NULL) {
+        return;
+    }
+
+    unsigned int i, j;
+
+    for (i = 0; i < TIMER_WHEEL_LEVELS; ++i) {
+        for (j = 0; j < TIMER_WHEEL_SLOTS; ++j) {
+            free(wheel->slots[i][j].timers);
+        }
+    }
+
+    free(wheel->far.timers);
+    free(wheel);
+}
+
+static int timer_slot_append(Timer_Slot *slot, uint64_t deadline, uint32_t id)
+{
+    if (slot->length == slot->capacity) {
+        uint32_t capacity = slot->capacity ? slot->capacity * 2 : 4;
+        Timer *timers = realloc(slot->timers, capacity * sizeof(Timer));
+
+        if (timers == NULL) {
+            return -1;
+        }
+
+        slot->timers = timers;
+        slot->capacity = capacity;
+    }
+
+    slot->timers[slot->length].deadline = deadline;
+    slot->timers[slot->length].id = id;
+    ++slot->length;
+    return 0;
+}
+
+static int timer_wheel_insert(Timer_Wheel *wheel, uint64_t deadline, uint32_t id)
+{
+    unsigned int level = 0;
+
+    while (level < TIMER_WHEEL_LEVELS
+            && (deadline >> (TIMER_WHEEL_BITS * (level + 1))) != (wheel->next >> (TIMER_WHEEL_BITS * (level + 1)))) {
+        ++level;
+    }
+
+    if (level == TIMER_WHEEL_LEVELS) {
+        if (timer_slot_append(&wheel->far, deadline, id) == -1) {
+            return -1;
+        }
+    } else {
+        Timer_Slot *slot = &wheel->slots[level][(deadline >> (TIMER_WHEEL_BITS * level)) % TIMER_WHEEL_SLOTS];
+
+        if (timer_slot_append(slot, deadline, id) == -1) {
+            return -1;
+        }
+
+        ++wheel->count[level];
+    }
+
+    ++wheel->num_timers;
+    return 0;
+}
+
+uint64_t timer_wheel_add(Timer_Wheel *wheel, uint64_t deadline, uint32_t id)
+{
+    if (deadline < wheel->next) {
+        deadline = wheel->next;
+    }
+
+    if (timer_wheel_insert(wheel, deadline, id) == -1) {
+        return 0;
+    }
+
+    return deadline;
+}
+
+/* Insert the timers of a slot taken out of the wheel again, relative to the
+ * current tick. If that fails for lack of memory the timer fires early rather
+ * than getting lost. */
+static void timer_wheel_reinsert(Timer_Wheel *wheel, Timer_Slot *slot, timer_wheel_cb *callback, void *object)
+{
+    uint32_t i;
+
+    for (i = 0; i < slot->length; ++i) {
+        if (timer_wheel_insert(wheel, slot->timers[i].deadline, slot->timers[i].id) == -1) {
+            callback(object, slot->timers[i].id, slot->timers[i].deadline);
+        }
+    }
+}
+
+/* Take all timers out of a slot, leaving it empty. */
+static Timer_Slot timer_wheel_detach(Timer_Wheel *wheel, Timer_Slot *wheel_slot)
+{
+    Timer_Slot slot = *wheel_slot;
+    wheel_slot->timers = NULL;
+    wheel_slot->length = 0;
+    wheel_slot->capacity = 0;
+    wheel->num_timers -= slot.length;
+    return slot;
+}
+
+/* Give a detached slot's memory back if nothing was added to it since. */
+static void timer_wheel_reattach(Timer_Slot *wheel_slot, Timer_Slot *slot)
+{
+    if (wheel_slot->timers == NULL) {
+        slot->length = 0;
+        *wheel_slot = *slot;
+    } else {
+        free(slot->timers);
+    }
+}
+
+void timer_wheel_run(Timer_Wheel *wheel, uint64_t now, timer_wheel_cb *callback, void *object)
+{
+    while (wheel->next <= now) {
+        uint64_t tick = wheel->next;
+
+        if (wheel->num_timers == 0) {
+            wheel->next = now + 1;
+            return;
+        }
+
+        /* Entering a new slot on a higher level: move its timers down,
+         * starting at the top so they can cascade all the way. */
+        unsigned int level;
+        uint64_t top_mask = ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+
+        if ((tick & top_mask) == 0 && wheel->far.length != 0) {
+            Timer_Slot slot = timer_wheel_detach(wheel, &wheel->far);
+            timer_wheel_reinsert(wheel, &slot, callback, object);
+            timer_wheel_reattach(&wheel->far, &slot);
+        }
+
+        for (level = TIMER_WHEEL_LEVELS - 1; level > 0; --level) {
+            uint64_t mask = ((uint64_t)1 << (TIMER_WHEEL_BITS * level)) - 1;
+
+            if ((tick & mask) != 0 || wheel->count[level] == 0) {
+                continue;
+            }
+
+            Timer_Slot *wheel_slot = &wheel->slots[level][(tick >> (TIMER_WHEEL_BITS * level)) % TIMER_WHEEL_SLOTS];
+            wheel->count[level] -= wheel_slot->length;
+            Timer_Slot slot = timer_wheel_detach(wheel, wheel_slot);
+            timer_wheel_reinsert(wheel, &slot, callback, object);
+            timer_wheel_reattach(wheel_slot, &slot);
+        }
+
+        /* Nothing on the lower levels: skip to where the lowest non empty
+         * level (or the far list) moves timers down next. */
+        for (level = 0; level < TIMER_WHEEL_LEVELS && wheel->count[level] == 0; ++level);
+
+        if (level != 0) {
+            uint64_t mask = ((uint64_t)1 << (TIMER_WHEEL_BITS * level)) - 1;
+            uint64_t next_block = (tick | mask) + 1;
+            wheel->next = next_block <= now ? next_block : now + 1;
+            continue;
+        }
+
+        Timer_Slot *wheel_slot = &wheel->slots[0][tick % TIMER_WHEEL_SLOTS];
+        wheel->next = tick + 1;
+
+        if (wheel_slot->length == 0) {
+            continue;
+        }
+
+        /* Detached first, timers added by the callback for tick + TIMER_WHEEL_SLOTS
+         * may go in the same slot. */
+        wheel->count[0] -= wheel_slot->length;
+        Timer_Slot slot = timer_wheel_detach(wheel, wheel_slot);
+        uint32_t i;
+
+        for (i = 0; i < slot.length; ++i) {
+            callback(object, slot.timers[i].id, slot.timers[i].deadline);
+        }
+
+        timer_wheel_reattach(wheel_slot, &slot);
+    }
+}
+
+uint32_t timer_wheel_count(const Timer_Wheel *wheel)
+{
+    return wheel->num_timers;
+}
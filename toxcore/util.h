@@ -36,6 +36,18 @@ void unix_time_update(void);
 uint64_t unix_time(void);
 int is_timeout(uint64_t timestamp, uint64_t timeout);
 
+/* return the number of milliseconds before is_timeout(timestamp, timeout)
+ * becomes true (0 if it already is). */
+uint64_t timeout_remaining_ms(uint64_t timestamp, uint64_t timeout);
+
+/* Take a packet from the token bucket that ends up full at *full_time (in us),
+ * and holds at most burst packets of one per interval us.
+ *
+ * return 0 if it is empty.
+ * return 1 if a packet was taken.
+ */
+bool take_token(uint64_t *full_time, uint64_t now, uint64_t interval, uint32_t burst);
+
 
 /* id functions */
 bool id_equal(const uint8_t *dest, const uint8_t *src);
@@ -69,4 +81,43 @@ void rb_kill(RingBuffer *b);
 uint16_t rb_size(const RingBuffer *b);
 uint16_t rb_data(const RingBuffer *b, void **dest);
 
+/* Hierarchical timer wheel
+ *
+ * Timers are (deadline, id) pairs in ticks of whatever unit the caller uses
+ * (unix_time() seconds for the DHT). Adding a timer and firing it are O(1), so
+ * code that has to do something for a few out of many entries can keep one
+ * timer per entry instead of scanning all of them on every tick.
+ *
+ * There is no way to remove a timer. Callers keep the deadline they are
+ * waiting for next to each entry and ignore fired timers that no longer match
+ * it (the entry was rescheduled or deleted in the meantime).
+ */
+typedef struct Timer_Wheel Timer_Wheel;
+
+typedef void timer_wheel_cb(void *object, uint32_t id, uint64_t deadline);
+
+/* Create a timer wheel whose first call to timer_wheel_run() will fire timers
+ * with a deadline of start or earlier.
+ *
+ * return NULL on failure.
+ */
+Timer_Wheel *timer_wheel_new(uint64_t start);
+void timer_wheel_kill(Timer_Wheel *wheel);
+
+/* Add a timer firing id at deadline. Deadlines that have already been run
+ * are moved to the next tick that will be.
+ *
+ * return the deadline the timer will fire at on success.
+ * return 0 on failure.
+ */
+uint64_t timer_wheel_add(Timer_Wheel *wheel, uint64_t deadline, uint32_t id);
+
+/* Call callback(object, id, deadline) for every timer with a deadline of now
+ * or earlier, in deadline order. The callback may add new timers.
+ */
+void timer_wheel_run(Timer_Wheel *wheel, uint64_t now, timer_wheel_cb *callback, void *object);
+
+/* return the number of timers that have not fired yet. */
+uint32_t timer_wheel_count(const Timer_Wheel *wheel);
+
 #endif /* __UTIL_H__ */